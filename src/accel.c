@@ -0,0 +1,136 @@
+#include "accel.h"
+
+// Worlds with at most this many spheres are tested without any structure
+#define AUTO_MAX_BRUTE_SPHERES		16
+// Worlds with at least this many spheres use the compressed tree over the binary one
+#define AUTO_MIN_QBVH_SPHERES		4096
+// Largest ratio between the biggest sphere and a typical sphere before a tree is used instead of a grid
+#define AUTO_MAX_SIZE_RATIO			16.f
+// Largest average number of grid cells a sphere can cover before a tree is used instead
+#define AUTO_MAX_CELLS_PER_SPHERE	8.f
+// Smallest fraction of non-empty cells for a dense grid, below it the spheres are clustered
+#define AUTO_MIN_OCCUPANCY			0.25f
+
+// Accelerator registry
+static u32 g_accel_count = 0;
+static const accel_t *g_accels[MAX_ACCELS];
+
+void accel_register(const accel_t *accel)
+{
+	// Replace an accelerator with the same name
+	for (u32 i = 0; i < g_accel_count; i++)
+	{
+		if (strcmp(g_accels[i]->name, accel->name) == 0)
+		{
+			g_accels[i] = accel;
+			return;
+		}
+	}
+	assert(g_accel_count < MAX_ACCELS);
+	g_accels[g_accel_count++] = accel;
+};
+void accel_register_defaults()
+{
+	accel_register(&accel_brute);
+	accel_register(&accel_bvh);
+	accel_register(&accel_qbvh);
+	accel_register(&accel_grid);
+	accel_register(&accel_paged);
+	accel_register(&accel_lod);
+};
+u32 accel_count()
+{
+	return g_accel_count;
+};
+const accel_t* accel_get(u32 index)
+{
+	assert(index < g_accel_count);
+	return g_accels[index];
+};
+const accel_t* accel_find(const char *name)
+{
+	for (u32 i = 0; i < g_accel_count; i++)
+	{
+		if (strcmp(g_accels[i]->name, name) == 0)
+			return g_accels[i];
+	}
+	return NULL;
+};
+
+const accel_t* accel_auto(const world_t *world, accel_params_t *params)
+{
+	const u32 count = world->sphere_count;
+	// A structure isn't worth it for a handful of spheres
+	if (count <= AUTO_MAX_BRUTE_SPHERES)
+		return &accel_brute;
+	const accel_t *tree = (count >= AUTO_MIN_QBVH_SPHERES) ? &accel_qbvh : &accel_bvh;
+
+	// Compare the biggest sphere against the typical one, through the geometric mean of the sizes
+	// NOTE: A few huge spheres (like a ground plane) cover every cell of a grid, which it handles badly
+	f32 max_size = 0.f;
+	f32 log_size = 0.f;
+	for (u32 i = 0; i < count; i++)
+	{
+		const f32 size = max(world->spheres[i].radius, 1e-6f);
+		max_size = max(max_size, size);
+		log_size += f32_log2(size);
+	}
+	if (max_size > AUTO_MAX_SIZE_RATIO*exp2f(log_size / (f32) count))
+		return tree;
+
+	// Lay out a grid with about one cell per sphere over the sphere bounds
+	aabb_t bounds = aabb_empty();
+	for (u32 i = 0; i < count; i++)
+		bounds = aabb_combine(bounds, world->spheres[i].aabb);
+	const v3 extent = v3_sub(bounds.max, bounds.min);
+	const f32 cell_size = max(f32_pow((extent.x*extent.y*extent.z) / (f32) count, 1.f/3.f), 1e-6f);
+	u32 res[3];
+	for (u32 i = 0; i < 3; i++)
+		res[i] = (u32) clamp((i32) f32_ceil(extent.v[i] / cell_size), 1, 1024);
+	const u32 cell_count = res[0]*res[1]*res[2];
+
+	// Count the cells each sphere covers, and the cells sphere centers are in
+	f32 covered = 0.f;
+	u8 *occupied = malloc(cell_count);
+	assert(occupied != NULL);
+	memset(occupied, 0, cell_count);
+	for (u32 i = 0; i < count; i++)
+	{
+		const sphere_t *sphere = world->spheres + i;
+		f32 cells = 1.f;
+		u32 cell[3];
+		for (u32 j = 0; j < 3; j++)
+		{
+			cells *= f32_floor((sphere->aabb.max.v[j] - sphere->aabb.min.v[j]) / cell_size) + 1.f;
+			const i32 c = (i32) ((sphere->center.v[j] - bounds.min.v[j]) / cell_size);
+			cell[j] = (u32) clamp(c, 0, (i32) res[j] - 1);
+		}
+		covered += min(cells, (f32) cell_count);
+		occupied[(cell[2]*res[1] + cell[1])*res[0] + cell[0]] = 1;
+	}
+	u32 occupied_count = 0;
+	for (u32 i = 0; i < cell_count; i++)
+		occupied_count += occupied[i];
+	free(occupied);
+
+	// Spheres too big for the cells, trees adapt to them
+	if ((covered / (f32) count) > AUTO_MAX_CELLS_PER_SPHERE)
+		return tree;
+	// Spheres clustered in a small part of the bounds, only store the cells around them
+	if (((f32) occupied_count / (f32) cell_count) < AUTO_MIN_OCCUPANCY)
+	{
+		params->grid.mode = GRID_HASHED;
+		return &accel_grid;
+	}
+	// Evenly spread spheres of similar sizes, the best case for a dense grid
+	params->grid.mode = GRID_DENSE;
+	return &accel_grid;
+};
+
+void world_build_accel(world_t *world, const accel_t *accel, const accel_params_t *params)
+{
+	const f64 start = time_now();
+	world->accel = accel;
+	accel->build(world, params);
+	world->accel_build_time = (time_now() - start);
+};
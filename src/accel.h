@@ -0,0 +1,87 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "world.h"
+
+// Maximum number of accelerators that can be registered
+#define MAX_ACCELS	16
+
+// Acceleration structure construction parameters
+typedef struct
+{
+	// Parameters for tree based accelerators
+	bvh_params_t bvh;
+	// Parameters for grid based accelerators
+	grid_params_t grid;
+	// File to load a cached tree from or store it to, NULL to always build
+	const char *cache_file;
+	// Parameters for out-of-core accelerators
+	page_params_t page;
+	// Parameters for level of detail accelerators
+	lod_params_t lod;
+} accel_params_t;
+
+// Acceleration structure statistics
+typedef struct
+{
+	// Time the last build took, in seconds
+	f64 build_time;
+	// Memory used by the structure, in bytes
+	size_t memory;
+	// Number of tree nodes or grid slots
+	u32 node_count;
+	// Number of primitive references
+	u32 index_count;
+	// SAH cost of trees, 0 for anything else
+	f32 cost;
+} accel_stats_t;
+
+// Acceleration structure interface, over the sphere list of a world
+// NOTE: Instances always use their own two-level BVH, no matter which accelerator the world uses
+typedef struct accel_s
+{
+	// Name the accelerator is selected by
+	const char *name;
+	const char *description;
+	// Build the structure, replacing the current one
+	void (*build)(world_t *world, const accel_params_t *params);
+	// Update the structure after the spheres moved, NULL if it has to be rebuilt instead
+	void (*refit)(world_t *world);
+	// Find the closest sphere hit closer than hit->t, returns false if there is none
+	bool (*hit)(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray, f32 t_min, f32 t_max, hit_t *hit);
+	// Check if a ray hits any sphere between t_min and t_max
+	bool (*any_hit)(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray, f32 t_min, f32 t_max);
+	// Get the structure statistics
+	void (*stats)(const world_t *world, accel_stats_t *stats);
+} accel_t;
+
+// Built-in accelerators
+extern const accel_t accel_brute;
+extern const accel_t accel_bvh;
+extern const accel_t accel_qbvh;
+extern const accel_t accel_grid;
+extern const accel_t accel_paged;
+extern const accel_t accel_lod;
+
+// Add an accelerator to the registry, replacing any with the same name
+void accel_register(const accel_t *accel);
+// Add the built-in accelerators to the registry
+void accel_register_defaults();
+// Get the number of registered accelerators, and an accelerator by index
+u32 accel_count();
+const accel_t* accel_get(u32 index);
+// Find a registered accelerator by name, returns NULL if there is none
+// NOTE: "auto" isn't a registered accelerator, use accel_auto for it
+const accel_t* accel_find(const char *name);
+// Pick an accelerator for the spheres of a world, from their count and distribution
+// NOTE: Also sets the parameters the pick depends on, like the grid mode
+const accel_t* accel_auto(const world_t *world, accel_params_t *params);
+
+// Build an accelerator for a world, and select it for raycasts
+void world_build_accel(world_t *world, const accel_t *accel, const accel_params_t *params);
+
+#endif
@@ -0,0 +1,66 @@
+#include "anim.h"
+
+bool anim_open(anim_player_t *player, const animation_t *animation, const world_t *world)
+{
+	memset(player, 0, sizeof(anim_player_t));
+	player->animation = animation;
+	// Store the starting centers, for spheres that don't move
+	// NOTE: Centers are in scene order, the spheres might be in leaf order already
+	player->sphere_count = world->sphere_count;
+	player->centers = malloc(world->sphere_count*sizeof(v3));
+	assert((player->centers != NULL) || (world->sphere_count == 0));
+	for (u32 i = 0; i < world->sphere_count; i++)
+		player->centers[world->sphere_order ? world->sphere_order[i] : i] = world->spheres[i].center;
+	// Open the stream file, if there is one
+	if (animation->stream[0] != '\0')
+	{
+		player->stream = fopen(animation->stream, "rb");
+		if (!player->stream)
+		{
+			anim_close(player);
+			return false;
+		}
+	}
+	return true;
+};
+bool anim_frame(anim_player_t *player, i32 frame, v3 *centers)
+{
+	const animation_t *animation = player->animation;
+	// Read the next frame from the stream
+	if (player->stream)
+	{
+		assert(sizeof(v3) == 3*sizeof(f32));
+		return (fread(centers, sizeof(v3), player->sphere_count, player->stream) == player->sphere_count);
+	}
+	// Get the position of the frame in the animation, [0, 1]
+	const f32 time = (animation->frames > 1) ? ((f32) frame / (f32) (animation->frames - 1)) : 0.f;
+	// Interpolate between the keyframes around the frame time
+	for (u32 i = 0; i < player->sphere_count; i++)
+	{
+		// NOTE: Only the spheres listed one by one in the scene can have keyframes
+		const u32 count = (i < MAX_SPHERES) ? animation->keyframe_count[i] : 0;
+		const v3 *keyframes = (i < MAX_SPHERES) ? animation->keyframes[i] : NULL;
+		if (count == 0)
+		{
+			centers[i] = player->centers[i];
+		} else if (count == 1) {
+			centers[i] = keyframes[0];
+		} else {
+			// Find the keyframe pair, and the position between them
+			const f32 position = time*(f32) (count - 1);
+			const u32 key = min((u32) position, count - 2);
+			const f32 t = (position - (f32) key);
+			// NOTE: v3_lerp returns a*t + b*(1-t)
+			centers[i] = v3_lerp(keyframes[key + 1], keyframes[key], t);
+		}
+	}
+	return true;
+};
+void anim_close(anim_player_t *player)
+{
+	if (player->stream)
+		fclose(player->stream);
+	player->stream = NULL;
+	free(player->centers);
+	player->centers = NULL;
+};
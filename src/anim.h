@@ -0,0 +1,48 @@
+#ifndef ANIM_H
+#define ANIM_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "world.h"
+
+// Maximum number of keyframes a sphere can have
+#define MAX_KEYFRAMES	16
+
+// Animation data, only sphere centers are animated
+typedef struct
+{
+	// Number of frames to render, 0 renders a single still image
+	i32 frames;
+	// Rebuild the BVH once refitting makes its SAH cost this many times worse than after the last build
+	f32 rebuild_threshold;
+	// Binary file to stream the sphere centers from, used instead of the keyframes if set
+	// NOTE: Raw f32 x,y,z centers, one for every sphere in scene order, repeated for every frame
+	char stream[512];
+	// Sphere center keyframes, spread evenly over the animation
+	// NOTE: Spheres without keyframes don't move
+	u32 keyframe_count[MAX_SPHERES];
+	v3  keyframes[MAX_SPHERES][MAX_KEYFRAMES];
+} animation_t;
+
+// Animation playback state
+typedef struct
+{
+	const animation_t *animation;
+	// Open stream file, NULL if keyframes are used
+	FILE *stream;
+	// Number of spheres and their initial centers
+	u32 sphere_count;
+	v3 *centers;
+} anim_player_t;
+
+// Start playing an animation for a world, returns false if the stream file couldn't be opened
+bool anim_open(anim_player_t *player, const animation_t *animation, const world_t *world);
+// Get the sphere centers for a frame, returns false if the stream ended early
+// NOTE: Streamed frames have to be read in order
+bool anim_frame(anim_player_t *player, i32 frame, v3 *centers);
+// Stop playing an animation, closing the stream file and freeing the initial centers
+void anim_close(anim_player_t *player);
+
+#endif
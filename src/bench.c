@@ -0,0 +1,1005 @@
+#include "bench.h"
+
+#include "bvh.h"
+#include "job.h"
+#include "qbvh.h"
+#include "world.h"
+#include "perf.h"
+#include "scene.h"
+#include "accel.h"
+#include "import.h"
+#include "render.h"
+#include "tile.h"
+#include "anim.h"
+
+// Fill a list with the bounds of randomly placed spheres in a unit cube
+// NOTE: The radius shrinks with the count, so the density of the field stays the same
+static aabb_t* random_sphere_bounds(u32 count)
+{
+	aabb_t *bounds = malloc(count*sizeof(aabb_t));
+	assert(bounds != NULL);
+
+	const f32 radius = 0.5f / f32_pow((f32) count, 1.f/3.f);
+	for (u32 i = 0; i < count; i++)
+	{
+		const v3 center = V3(f32_rand(), f32_rand(), f32_rand());
+		const v3 extent = V3(radius, radius, radius);
+		bounds[i].min = v3_sub(center, extent);
+		bounds[i].max = v3_add(center, extent);
+	}
+	return bounds;
+};
+// Fill a list of randomly placed spheres in a unit cube, the same way as the bounds above
+static sphere_t* random_spheres(u32 count)
+{
+	sphere_t *spheres = malloc(count*sizeof(sphere_t));
+	assert(spheres != NULL);
+
+	const f32 radius = 0.5f / f32_pow((f32) count, 1.f/3.f);
+	for (u32 i = 0; i < count; i++)
+	{
+		sphere_t *sphere = spheres + i;
+		memset(sphere, 0, sizeof(sphere_t));
+		sphere->center = V3(f32_rand(), f32_rand(), f32_rand());
+		sphere->radius = radius*(0.5f + f32_rand());
+		sphere->aabb = sphere_aabb(sphere->center, sphere->radius);
+	}
+	return spheres;
+};
+// Fill a list of rays starting anywhere around the unit cube, going in any direction
+static ray_t* random_rays(u32 count)
+{
+	ray_t *rays = malloc(count*sizeof(ray_t));
+	assert(rays != NULL);
+	for (u32 i = 0; i < count; i++)
+	{
+		rays[i].origin = V3(f32_rand()*2.f - 0.5f, f32_rand()*2.f - 0.5f, f32_rand()*2.f - 0.5f);
+		rays[i].direction = v3_unit_rand();
+	}
+	return rays;
+};
+// Build a BVH and print its build time, its speedup over a baseline time and its SAH cost
+static f64 bench_build(const char *name, const aabb_t *bounds, u32 count, const bvh_params_t *params,
+	f64 baseline, f32 *cost)
+{
+	bvh_t bvh;
+	bvh_build(&bvh, bounds, count, params);
+	const f64 time = bvh.build_time;
+	*cost = bvh_cost(&bvh);
+	printf("%10u %-14s %8u %12.4f %12.1f %8.2fx %10.2f\n", count, name, params->worker_count,
+		time, (f64) count / time * 1e-3, (baseline > 0.0) ? (baseline / time) : 1.0, *cost);
+	bvh_free(&bvh);
+	return time;
+};
+
+void bench_bvh_build(u32 max_spheres, u32 max_workers)
+{
+	// The median builder sorts the whole list at every level, so it's only run on the smaller fields
+	const u32 max_median = 1000000;
+	// Largest relative SAH cost difference allowed between the serial and parallel SAH builds
+	const f32 sah_tolerance = 0.01f;
+
+	printf("%10s %-14s %8s %12s %12s %9s %10s\n", "spheres", "builder", "workers", "seconds", "kprims/s", "speedup", "sah cost");
+	for (u32 count = 1000; count <= max_spheres; count *= 10)
+	{
+		aabb_t *bounds = random_sphere_bounds(count);
+		f32 cost;
+		if (count <= max_median)
+		{
+			const bvh_params_t params = { BVH_BUILD_MEDIAN, false, 1 };
+			bench_build("median", bounds, count, &params, 0.0, &cost);
+		}
+		// Speedups are relative to the single worker build of the same builder
+		f64 serial_time = 0.0;
+		for (u32 workers = 1; workers <= max_workers; workers *= 2)
+		{
+			const bvh_params_t params = { BVH_BUILD_LBVH, false, workers };
+			const f64 time = bench_build("lbvh", bounds, count, &params, serial_time, &cost);
+			if (workers == 1)
+				serial_time = time;
+		}
+		{
+			const bvh_params_t params = { BVH_BUILD_LBVH, true, max_workers };
+			bench_build("lbvh+treelets", bounds, count, &params, serial_time, &cost);
+		}
+		// The parallel SAH builds should be as good as the serial one
+		serial_time = 0.0;
+		f32 serial_cost = 0.f;
+		for (u32 workers = 1; workers <= max_workers; workers *= 2)
+		{
+			const bvh_params_t params = { BVH_BUILD_SAH, false, workers };
+			const f64 time = bench_build("sah", bounds, count, &params, serial_time, &cost);
+			if (workers == 1)
+			{
+				serial_time = time;
+				serial_cost = cost;
+			} else if (f32_abs(cost - serial_cost) > sah_tolerance*serial_cost) {
+				printf("WARNING: SAH cost differs from the serial build by more than %.0f%%\n", sah_tolerance*100.f);
+			}
+		}
+		free(bounds);
+	}
+};
+
+// Trace every ray through a tree, returns the time it took
+static f64 trace_rays(lin_alloc_t *temp_alloc, const bvh_t *bvh, const qbvh_t *qbvh, const sphere_t *spheres,
+	const ray_t *rays, u32 ray_count, f32 *t_hit)
+{
+	const f64 start = time_now();
+	for (u32 i = 0; i < ray_count; i++)
+	{
+		hit_t hit;
+		spheres_hit(temp_alloc, bvh, qbvh, spheres, rays[i], 1e-3f, FLT_MAX, &hit);
+		t_hit[i] = hit.t;
+	}
+	return (time_now() - start);
+};
+void bench_qbvh(u32 sphere_count, u32 ray_count)
+{
+	sphere_t *spheres = random_spheres(sphere_count);
+	aabb_t *bounds = malloc(sphere_count*sizeof(aabb_t));
+	assert(bounds != NULL);
+	for (u32 i = 0; i < sphere_count; i++)
+		bounds[i] = spheres[i].aabb;
+	ray_t *rays = random_rays(ray_count);
+	f32 *t_binary = malloc(ray_count*sizeof(f32));
+	f32 *t_compressed = malloc(ray_count*sizeof(f32));
+	assert((t_binary != NULL) && (t_compressed != NULL));
+	// Scratch memory for the traversal query lists
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	printf("%u spheres, %u rays\n", sphere_count, ray_count);
+	printf("%-8s %-10s %10s %12s %12s %10s %8s %8s\n", "builder", "tree", "nodes", "node bytes", "total bytes", "Mrays/s", "hits", "missed");
+
+	const struct { const char *name; bvh_builder_t builder; } builders[] =
+	{
+		{ "lbvh", BVH_BUILD_LBVH },
+		{ "sah",  BVH_BUILD_SAH },
+	};
+	for (u32 b = 0; b < static_len(builders); b++)
+	{
+		const bvh_params_t params = { builders[b].builder, false, 1 };
+		bvh_t bvh;
+		bvh_build(&bvh, bounds, sphere_count, &params);
+		qbvh_t qbvh;
+		qbvh_build(&qbvh, &bvh);
+
+		const f64 binary_time = trace_rays(&temp_alloc, &bvh, NULL, spheres, rays, ray_count, t_binary);
+		const f64 compressed_time = trace_rays(&temp_alloc, &bvh, &qbvh, spheres, rays, ray_count, t_compressed);
+		// Conservative bounds can only add work, the closest hit has to be exactly the same
+		u32 hits = 0, missed = 0;
+		for (u32 i = 0; i < ray_count; i++)
+		{
+			hits += (t_binary[i] < INFINITY);
+			missed += (t_compressed[i] != t_binary[i]);
+		}
+
+		const size_t binary_nodes = bvh.node_count*sizeof(bvh_node_t);
+		const size_t compressed_nodes = qbvh.node_count*sizeof(qbvh_node_t);
+		printf("%-8s %-10s %10u %12zu %12zu %10.3f %8u %8s\n", builders[b].name, "binary",
+			bvh.node_count, binary_nodes, binary_nodes + bvh.index_count*sizeof(u32),
+			(f64) ray_count / binary_time * 1e-6, hits, "-");
+		printf("%-8s %-10s %10u %12zu %12zu %10.3f %8u %8u\n", builders[b].name, "compressed",
+			qbvh.node_count, compressed_nodes, compressed_nodes + qbvh.index_count*sizeof(u32),
+			(f64) ray_count / compressed_time * 1e-6, hits - missed, missed);
+		if (missed > 0)
+			printf("ERROR: The compressed tree missed %u hits\n", missed);
+
+		qbvh_free(&qbvh);
+		bvh_free(&bvh);
+	}
+	free(temp_alloc.memory);
+	free(t_compressed);
+	free(t_binary);
+	free(rays);
+	free(bounds);
+	free(spheres);
+};
+
+// Trace rays through a tree with the cache counters running, and print a row of the layout report
+static void bench_layout_row(perf_t *perf, lin_alloc_t *temp_alloc, const char *layout, const char *tree,
+	const bvh_t *bvh, const qbvh_t *qbvh, const sphere_t *spheres, const ray_t *rays, u32 ray_count, f32 *t_hit)
+{
+	u64 counters[PERF_COUNTER_COUNT];
+	perf_begin(perf);
+	const f64 time = trace_rays(temp_alloc, bvh, qbvh, spheres, rays, ray_count, t_hit);
+	perf_end(perf, counters);
+
+	printf("%-10s %-10s %10.3f", layout, tree, (f64) ray_count / time * 1e-6);
+	// Miss rates of each cache level, if it's counters are available
+	const perf_counter_t accesses[] = { PERF_L1D_ACCESS, PERF_LLC_ACCESS };
+	for (u32 i = 0; i < static_len(accesses); i++)
+	{
+		const u64 access = counters[accesses[i]];
+		const u64 miss = counters[accesses[i] + 1];
+		if (access > 0)
+			printf(" %10.2f%% %12.2f", (f64) miss / (f64) access * 100.0, (f64) miss / (f64) ray_count);
+		else
+			printf(" %11s %12s", "-", "-");
+	}
+	printf("\n");
+};
+void bench_layout(u32 sphere_count, u32 ray_count)
+{
+	sphere_t *spheres = random_spheres(sphere_count);
+	aabb_t *bounds = malloc(sphere_count*sizeof(aabb_t));
+	assert(bounds != NULL);
+	for (u32 i = 0; i < sphere_count; i++)
+		bounds[i] = spheres[i].aabb;
+	ray_t *rays = random_rays(ray_count);
+	f32 *t_before = malloc(ray_count*sizeof(f32));
+	f32 *t_after = malloc(ray_count*sizeof(f32));
+	assert((t_before != NULL) && (t_after != NULL));
+
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	perf_t perf;
+	if (!perf_open(&perf))
+		printf("Cache counters unavailable (perf_event_open failed), only throughput is reported\n");
+
+	const bvh_params_t params = { BVH_BUILD_SAH, false, 1 };
+	bvh_t bvh;
+	bvh_build(&bvh, bounds, sphere_count, &params);
+	qbvh_t qbvh;
+	qbvh_build(&qbvh, &bvh);
+
+	printf("%u spheres, %u rays\n", sphere_count, ray_count);
+	printf("%-10s %-10s %10s %11s %12s %11s %12s\n", "layout", "tree", "Mrays/s", "L1D miss", "L1D miss/ray", "LLC miss", "LLC miss/ray");
+	// Build order, the spheres are scattered randomly in memory
+	bench_layout_row(&perf, &temp_alloc, "original", "binary", &bvh, NULL, spheres, rays, ray_count, t_before);
+	bench_layout_row(&perf, &temp_alloc, "original", "compressed", &bvh, &qbvh, spheres, rays, ray_count, t_after);
+	// Leaf ordered spheres, and the compressed nodes in van Emde Boas order
+	u32 *order = malloc(sphere_count*sizeof(u32));
+	assert(order != NULL);
+	for (u32 i = 0; i < sphere_count; i++)
+		order[i] = i;
+	spheres_reorder(spheres, &bvh, &qbvh, order);
+	qbvh_reorder(&qbvh);
+	bench_layout_row(&perf, &temp_alloc, "reordered", "binary", &bvh, NULL, spheres, rays, ray_count, t_before);
+	bench_layout_row(&perf, &temp_alloc, "reordered", "compressed", &bvh, &qbvh, spheres, rays, ray_count, t_after);
+	// Reordering only moves memory around, every ray has to hit the same thing
+	u32 mismatched = 0;
+	for (u32 i = 0; i < ray_count; i++)
+		mismatched += (t_before[i] != t_after[i]);
+	if (mismatched > 0)
+		printf("ERROR: %u rays hit something different after reordering\n", mismatched);
+	// The first frame of an animation has to leave the reordered spheres where a still image has them,
+	// except for the first scene sphere, which gets moved by it's keyframe
+	world_t *world = calloc(1, sizeof(world_t));
+	animation_t *animation = calloc(1, sizeof(animation_t));
+	v3 *centers = malloc(sphere_count*sizeof(v3));
+	v3 *still = malloc(sphere_count*sizeof(v3));
+	assert((world != NULL) && (animation != NULL) && (centers != NULL) && (still != NULL));
+	world->sphere_count = sphere_count;
+	world->spheres = spheres;
+	world->sphere_order = order;
+	animation->frames = 1;
+	animation->keyframe_count[0] = 1;
+	animation->keyframes[0][0] = V3(2.f, 2.f, 2.f);
+	for (u32 i = 0; i < sphere_count; i++)
+		still[i] = (order[i] == 0) ? animation->keyframes[0][0] : spheres[i].center;
+	anim_player_t player;
+	anim_open(&player, animation, world);
+	anim_frame(&player, 0, centers);
+	world_move_spheres(world, centers);
+	anim_close(&player);
+	u32 moved = 0;
+	for (u32 i = 0; i < sphere_count; i++)
+		moved += (memcmp(&spheres[i].center, still + i, sizeof(v3)) != 0);
+	if (moved > 0)
+		printf("ERROR: %u reordered spheres aren't where they should be in the first animation frame\n", moved);
+	free(still);
+	free(centers);
+	free(animation);
+	free(world);
+	free(order);
+
+	perf_close(&perf);
+	qbvh_free(&qbvh);
+	bvh_free(&bvh);
+	free(temp_alloc.memory);
+	free(t_after);
+	free(t_before);
+	free(rays);
+	free(bounds);
+	free(spheres);
+};
+
+// Check every ray for any hit closer than t_max, returns the time it took
+static f64 trace_any_rays(lin_alloc_t *temp_alloc, const bvh_t *bvh, const sphere_t *spheres,
+	const ray_t *rays, u32 ray_count, f32 t_max, bool *hit)
+{
+	const f64 start = time_now();
+	for (u32 i = 0; i < ray_count; i++)
+		hit[i] = spheres_any_hit(temp_alloc, bvh, spheres, rays[i], 1e-3f, t_max);
+	return (time_now() - start);
+};
+void bench_traversal(u32 sphere_count, u32 ray_count)
+{
+	sphere_t *spheres = random_spheres(sphere_count);
+	aabb_t *bounds = malloc(sphere_count*sizeof(aabb_t));
+	assert(bounds != NULL);
+	for (u32 i = 0; i < sphere_count; i++)
+		bounds[i] = spheres[i].aabb;
+	ray_t *rays = random_rays(ray_count);
+	f32 *t_stack = malloc(ray_count*sizeof(f32));
+	f32 *t_stackless = malloc(ray_count*sizeof(f32));
+	bool *any_stack = malloc(ray_count*sizeof(bool));
+	bool *any_stackless = malloc(ray_count*sizeof(bool));
+	assert((t_stack != NULL) && (t_stackless != NULL) && (any_stack != NULL) && (any_stackless != NULL));
+
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	// Any hit rays are short, like shadow rays towards a nearby light
+	const f32 any_t_max = 0.25f;
+
+	printf("%u spheres, %u rays\n", sphere_count, ray_count);
+	printf("%-8s %-12s %-10s %10s %10s %10s\n", "builder", "query", "traversal", "Mrays/s", "hits", "mismatched");
+
+	const struct { const char *name; bvh_builder_t builder; } builders[] =
+	{
+		{ "lbvh", BVH_BUILD_LBVH },
+		{ "sah",  BVH_BUILD_SAH },
+	};
+	for (u32 b = 0; b < static_len(builders); b++)
+	{
+		const bvh_params_t params = { builders[b].builder, false, 1 };
+		bvh_t bvh;
+		bvh_build(&bvh, bounds, sphere_count, &params);
+		// Without skip links first, then with them
+		const f64 closest_stack = trace_rays(&temp_alloc, &bvh, NULL, spheres, rays, ray_count, t_stack);
+		const f64 any_stack_time = trace_any_rays(&temp_alloc, &bvh, spheres, rays, ray_count, any_t_max, any_stack);
+		bvh_link(&bvh);
+		const f64 closest_stackless = trace_rays(&temp_alloc, &bvh, NULL, spheres, rays, ray_count, t_stackless);
+		const f64 any_stackless_time = trace_any_rays(&temp_alloc, &bvh, spheres, rays, ray_count, any_t_max, any_stackless);
+		// Both traversals visit the same leaves, so the results have to match exactly
+		u32 closest_hits = 0, closest_mismatched = 0;
+		u32 any_hits = 0, any_mismatched = 0;
+		for (u32 i = 0; i < ray_count; i++)
+		{
+			closest_hits += (t_stack[i] < INFINITY);
+			closest_mismatched += (t_stack[i] != t_stackless[i]);
+			any_hits += any_stack[i];
+			any_mismatched += (any_stack[i] != any_stackless[i]);
+		}
+		const char *name = builders[b].name;
+		printf("%-8s %-12s %-10s %10.3f %10u %10s\n", name, "closest-hit", "stack", (f64) ray_count / closest_stack * 1e-6, closest_hits, "-");
+		printf("%-8s %-12s %-10s %10.3f %10u %10u\n", name, "closest-hit", "stackless", (f64) ray_count / closest_stackless * 1e-6, closest_hits, closest_mismatched);
+		printf("%-8s %-12s %-10s %10.3f %10u %10s\n", name, "any-hit", "stack", (f64) ray_count / any_stack_time * 1e-6, any_hits, "-");
+		printf("%-8s %-12s %-10s %10.3f %10u %10u\n", name, "any-hit", "stackless", (f64) ray_count / any_stackless_time * 1e-6, any_hits, any_mismatched);
+		if ((closest_mismatched > 0) || (any_mismatched > 0))
+			printf("ERROR: Stackless traversal results differ from stack traversal\n");
+		bvh_free(&bvh);
+	}
+	free(temp_alloc.memory);
+	free(any_stackless);
+	free(any_stack);
+	free(t_stackless);
+	free(t_stack);
+	free(rays);
+	free(bounds);
+	free(spheres);
+};
+
+// Fill a list of spheres packed into a few small clusters inside the unit cube, with empty space between them
+static sphere_t* clustered_spheres(u32 count, u32 cluster_count)
+{
+	sphere_t *spheres = malloc(count*sizeof(sphere_t));
+	assert(spheres != NULL);
+
+	v3 clusters[64];
+	assert(cluster_count <= static_len(clusters));
+	for (u32 i = 0; i < cluster_count; i++)
+		clusters[i] = V3(0.1f + 0.8f*f32_rand(), 0.1f + 0.8f*f32_rand(), 0.1f + 0.8f*f32_rand());
+	// Same radius as the uniform field, so the clusters are much denser
+	const f32 radius = 0.5f / f32_pow((f32) count, 1.f/3.f);
+	const f32 spread = 0.03f;
+	for (u32 i = 0; i < count; i++)
+	{
+		// NOTE: The sum of a few uniform numbers is close enough to a normal distribution
+		v3 offset;
+		for (u32 j = 0; j < 3; j++)
+			offset.v[j] = (f32_rand() + f32_rand() + f32_rand() - 1.5f)*spread;
+
+		sphere_t *sphere = spheres + i;
+		memset(sphere, 0, sizeof(sphere_t));
+		sphere->center = v3_add(clusters[i % cluster_count], offset);
+		sphere->radius = radius*(0.5f + f32_rand());
+		sphere->aabb = sphere_aabb(sphere->center, sphere->radius);
+	}
+	return spheres;
+};
+// Trace every ray through a grid, returns the time it took
+static f64 trace_grid_rays(lin_alloc_t *temp_alloc, const grid_t *grid, const sphere_t *spheres,
+	const ray_t *rays, u32 ray_count, f32 *t_hit)
+{
+	const f64 start = time_now();
+	for (u32 i = 0; i < ray_count; i++)
+	{
+		hit_t hit;
+		spheres_hit_grid(temp_alloc, grid, spheres, rays[i], 1e-3f, FLT_MAX, &hit);
+		t_hit[i] = hit.t;
+	}
+	return (time_now() - start);
+};
+void bench_grid(u32 sphere_count, u32 ray_count)
+{
+	ray_t *rays = random_rays(ray_count);
+	f32 *t_reference = malloc(ray_count*sizeof(f32));
+	f32 *t_hit = malloc(ray_count*sizeof(f32));
+	aabb_t *bounds = malloc(sphere_count*sizeof(aabb_t));
+	assert((t_reference != NULL) && (t_hit != NULL) && (bounds != NULL));
+
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	printf("%u spheres, %u rays\n", sphere_count, ray_count);
+	printf("%-10s %-12s %12s %12s %10s %10s %10s\n", "field", "structure", "build s", "memory KB", "Mrays/s", "hits", "mismatched");
+	for (u32 field = 0; field < 2; field++)
+	{
+		const char *field_name = (field == 0) ? "uniform" : "clustered";
+		sphere_t *spheres = (field == 0) ? random_spheres(sphere_count) : clustered_spheres(sphere_count, 32);
+		for (u32 i = 0; i < sphere_count; i++)
+			bounds[i] = spheres[i].aabb;
+
+		// The SAH tree is the reference every other structure is checked against
+		const struct { const char *name; bvh_builder_t builder; } builders[] =
+		{
+			{ "sah",  BVH_BUILD_SAH },
+			{ "lbvh", BVH_BUILD_LBVH },
+		};
+		for (u32 b = 0; b < static_len(builders); b++)
+		{
+			const bvh_params_t params = { builders[b].builder, false, 1 };
+			bvh_t bvh;
+			bvh_build(&bvh, bounds, sphere_count, &params);
+			const f64 time = trace_rays(&temp_alloc, &bvh, NULL, spheres, rays, ray_count, (b == 0) ? t_reference : t_hit);
+			u32 hits = 0, mismatched = 0;
+			for (u32 i = 0; i < ray_count; i++)
+			{
+				hits += (t_reference[i] < INFINITY);
+				mismatched += (b > 0) && (t_hit[i] != t_reference[i]);
+			}
+			const size_t size = bvh.node_count*sizeof(bvh_node_t) + bvh.index_count*sizeof(u32);
+			printf("%-10s %-12s %12.4f %12zu %10.3f %10u %10u\n", field_name, builders[b].name,
+				bvh.build_time, size / 1024, (f64) ray_count / time * 1e-6, hits, mismatched);
+			bvh_free(&bvh);
+		}
+		const struct { const char *name; grid_mode_t mode; } grids[] =
+		{
+			{ "dense grid",  GRID_DENSE },
+			{ "hashed grid", GRID_HASHED },
+		};
+		for (u32 g = 0; g < static_len(grids); g++)
+		{
+			const grid_params_t params = { grids[g].mode, 0.f };
+			grid_t grid;
+			grid_build(&grid, bounds, sphere_count, &params);
+			const f64 time = trace_grid_rays(&temp_alloc, &grid, spheres, rays, ray_count, t_hit);
+			// A grid finds the same closest sphere as a tree, so the distances have to match exactly
+			u32 hits = 0, mismatched = 0;
+			for (u32 i = 0; i < ray_count; i++)
+			{
+				hits += (t_hit[i] < INFINITY);
+				mismatched += (t_hit[i] != t_reference[i]);
+			}
+			printf("%-10s %-12s %12.4f %12zu %10.3f %10u %10u\n", field_name, grids[g].name,
+				grid.build_time, grid_size(&grid) / 1024, (f64) ray_count / time * 1e-6, hits, mismatched);
+			if (mismatched > 0)
+				printf("ERROR: Grid traversal results differ from the BVH\n");
+			grid_free(&grid);
+		}
+		free(spheres);
+	}
+	free(temp_alloc.memory);
+	free(bounds);
+	free(t_hit);
+	free(t_reference);
+	free(rays);
+};
+
+// Trace camera rays through one accelerator of a world, returns the time the closest hit and any hit queries took
+static void trace_accel_rays(lin_alloc_t *temp_alloc, const world_t *world, const ray_t *rays, u32 ray_count,
+	f32 *t_hit, bool *any_hit, f64 *closest_time, f64 *any_time)
+{
+	f64 start = time_now();
+	for (u32 i = 0; i < ray_count; i++)
+	{
+		hit_t hit;
+		world_hit(temp_alloc, world, rays[i], 1e-3f, FLT_MAX, &hit);
+		t_hit[i] = hit.t;
+	}
+	*closest_time = (time_now() - start);
+
+	start = time_now();
+	for (u32 i = 0; i < ray_count; i++)
+		any_hit[i] = world_any_hit(temp_alloc, world, rays[i], 1e-3f, FLT_MAX);
+	*any_time = (time_now() - start);
+};
+void bench_accel(const char *scene_file, u32 ray_count)
+{
+	scene_t *scene = scene_load(scene_file);
+	if (!scene)
+	{
+		printf("Failed to load scene \"%s\"\n", scene_file);
+		return;
+	}
+	// NOTE: The spheres of a scene that reuses its page file were never loaded, there's nothing to compare against
+	if (scene->page.reuse)
+	{
+		printf("Scene spheres are only in the page file \"%s\", remove it to bench the scene\n", scene->page.file);
+		world_free(&scene->world);
+		free(scene);
+		return;
+	}
+	world_t *world = &scene->world;
+	scene->bvh.worker_count = 1;
+	if (world->instance_count > 0)
+		world_build_instances(world, &scene->bvh);
+
+	// Camera rays through random points of the image
+	ray_t *rays = malloc(ray_count*sizeof(ray_t));
+	f32 *t_reference = malloc(ray_count*sizeof(f32));
+	f32 *t_hit = malloc(ray_count*sizeof(f32));
+	bool *any_hit = malloc(ray_count*sizeof(bool));
+	assert((rays != NULL) && (t_reference != NULL) && (t_hit != NULL) && (any_hit != NULL));
+	for (u32 i = 0; i < ray_count; i++)
+		rays[i] = camera_ray(&scene->camera, f32_rand(), f32_rand());
+
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	printf("%u spheres, %u instances, %u rays\n", world->sphere_count, world->instance_count, ray_count);
+	printf("%-12s %12s %12s %10s %10s %10s %10s %10s\n",
+		"accel", "build s", "memory KB", "sah cost", "closest", "any", "hits", "mismatched");
+	// Every registered accelerator, then the automatic pick
+	// NOTE: The first accelerator is the reference the others are checked against
+	const u32 count = accel_count();
+	for (u32 a = 0; a <= count; a++)
+	{
+		accel_params_t params = { scene->bvh, scene->grid, NULL };
+		// Paged accelerators keep the spheres, the other accelerators still need them
+		params.page = scene->page;
+		params.page.keep_spheres = true;
+		params.lod = scene->lod;
+		if (params.page.file[0] == '\0')
+			snprintf(params.page.file, sizeof(params.page.file), "%s.pages", scene_file);
+		const accel_t *accel = (a < count) ? accel_get(a) : accel_auto(world, &params);
+		world_build_accel(world, accel, &params);
+		accel_stats_t stats;
+		accel->stats(world, &stats);
+
+		f64 closest_time, any_time;
+		trace_accel_rays(&temp_alloc, world, rays, ray_count, (a == 0) ? t_reference : t_hit, any_hit, &closest_time, &any_time);
+		// The closest hit has to be the same sphere, and any hit has to agree with it
+		u32 hits = 0, mismatched = 0;
+		for (u32 i = 0; i < ray_count; i++)
+		{
+			const f32 t = (a == 0) ? t_reference[i] : t_hit[i];
+			hits += (t < INFINITY);
+			mismatched += (t != t_reference[i]) || (any_hit[i] != (t < INFINITY));
+		}
+		char name[64];
+		snprintf(name, sizeof(name), (a < count) ? "%s" : "auto (%s)", accel->name);
+		printf("%-12s %12.6f %12zu %10.2f %10.3f %10.3f %10u %10u\n", name, stats.build_time, stats.memory / 1024, stats.cost,
+			(f64) ray_count / closest_time * 1e-6, (f64) ray_count / any_time * 1e-6, hits, mismatched);
+		if (mismatched > 0)
+			printf("ERROR: Accelerator results differ from the reference\n");
+	}
+	printf("(closest and any are in Mrays/s)\n");
+	// Remove the page file the paged accelerator wrote
+	char page_file[512];
+	snprintf(page_file, sizeof(page_file), "%s.pages", scene_file);
+	remove((scene->page.file[0] != '\0') ? scene->page.file : page_file);
+
+	free(temp_alloc.memory);
+	free(any_hit);
+	free(t_hit);
+	free(t_reference);
+	free(rays);
+	world_free(world);
+	free(scene);
+};
+
+void bench_lazy(u32 sphere_count, u32 ray_count)
+{
+	sphere_t *spheres = random_spheres(sphere_count);
+	aabb_t *bounds = malloc(sphere_count*sizeof(aabb_t));
+	ray_t *rays = malloc(ray_count*sizeof(ray_t));
+	f32 *t_reference = malloc(ray_count*sizeof(f32));
+	f32 *t_hit = malloc(ray_count*sizeof(f32));
+	assert((bounds != NULL) && (rays != NULL) && (t_reference != NULL) && (t_hit != NULL));
+	for (u32 i = 0; i < sphere_count; i++)
+		bounds[i] = spheres[i].aabb;
+	// Rays from a camera in front of the cube, looking at a small part of one face
+	// NOTE: Most of the field is never reached, which is the case lazy building is for
+	const v3 eye = V3(0.5f, 0.5f, -1.f);
+	for (u32 i = 0; i < ray_count; i++)
+	{
+		const v3 target = V3(0.4f + 0.2f*f32_rand(), 0.4f + 0.2f*f32_rand(), 0.f);
+		rays[i].origin = eye;
+		rays[i].direction = v3_norm(v3_sub(target, eye));
+	}
+
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	printf("%u spheres, %u rays\n", sphere_count, ray_count);
+	printf("%-6s %12s %14s %12s %10s %10s %10s %10s\n",
+		"tree", "build s", "first hit s", "trace s", "subtrees", "built", "spheres %", "mismatched");
+	for (u32 lazy = 0; lazy < 2; lazy++)
+	{
+		bvh_params_t params = { BVH_BUILD_SAH, false, 1 };
+		params.lazy = (lazy != 0);
+		// Time from the start of the build until the first ray has its result
+		const f64 start = time_now();
+		bvh_t bvh;
+		bvh_build(&bvh, bounds, sphere_count, &params);
+		hit_t hit;
+		spheres_hit(&temp_alloc, &bvh, NULL, spheres, rays[0], 1e-3f, FLT_MAX, &hit);
+		const f64 first_hit = (time_now() - start);
+		const f64 time = trace_rays(&temp_alloc, &bvh, NULL, spheres, rays, ray_count, lazy ? t_hit : t_reference);
+
+		u32 mismatched = 0;
+		for (u32 i = 0; lazy && (i < ray_count); i++)
+			mismatched += (t_hit[i] != t_reference[i]);
+		if (lazy)
+		{
+			bvh_lazy_stats_t stats;
+			bvh_lazy_stats(&bvh, &stats);
+			printf("%-6s %12.4f %14.4f %12.4f %10u %10u %10.1f %10u\n", "lazy",
+				bvh.build_time, first_hit, time, stats.subtree_count, stats.built_subtrees,
+				100.0*(f64) stats.built_primitives / (f64) stats.primitive_count, mismatched);
+			if (mismatched > 0)
+				printf("ERROR: Lazy tree results differ from the full tree\n");
+		} else {
+			printf("%-6s %12.4f %14.4f %12.4f %10s %10s %10.1f %10u\n", "full",
+				bvh.build_time, first_hit, time, "-", "-", 100.0, mismatched);
+		}
+		bvh_free(&bvh);
+	}
+	free(temp_alloc.memory);
+	free(t_hit);
+	free(t_reference);
+	free(rays);
+	free(bounds);
+	free(spheres);
+};
+
+void bench_import(u32 particle_count, const char *file_prefix)
+{
+	char binary_name[512], csv_name[512];
+	snprintf(binary_name, sizeof(binary_name), "%s.bin", file_prefix);
+	snprintf(csv_name, sizeof(csv_name), "%s.csv", file_prefix);
+
+	// Write the same random particles in both formats
+	// NOTE: 9 significant digits are enough for every f32 to survive the round trip through text
+	FILE *binary = fopen(binary_name, "wb");
+	FILE *csv = fopen(csv_name, "wb");
+	if (!binary || !csv)
+	{
+		printf("Failed to create the particle files\n");
+		if (binary) fclose(binary);
+		if (csv) fclose(csv);
+		return;
+	}
+	fprintf(csv, "x,y,z,radius,material\n");
+	for (u32 i = 0; i < particle_count; i++)
+	{
+		import_particle_t particle;
+		particle.x = f32_rand()*200.f - 100.f;
+		particle.y = f32_rand()*200.f - 100.f;
+		particle.z = f32_rand()*200.f - 100.f;
+		particle.radius = 0.01f + f32_rand()*0.1f;
+		particle.material = u32_rand(0, 3);
+		fwrite(&particle, sizeof(particle), 1, binary);
+		fprintf(csv, "%.9g,%.9g,%.9g,%.9g,%u\n", particle.x, particle.y, particle.z, particle.radius, particle.material);
+	}
+	fclose(binary);
+	fclose(csv);
+
+	import_params_t params;
+	import_params_init(&params);
+	const u32 max_workers = params.worker_count;
+	params.material_count = 4;
+	for (u32 i = 0; i < params.material_count; i++)
+	{
+		params.materials[i].type = MATERIAL_LAMBERTIAN;
+		params.materials[i].albedo = V3(0.2f*(f32) i, 0.5f, 0.5f);
+	}
+
+	// The binary import is the reference every other import is checked against
+	world_t reference;
+	memset(&reference, 0, sizeof(world_t));
+	printf("%u particles\n", particle_count);
+	printf("%-8s %8s %10s %12s %10s %10s %10s\n", "format", "workers", "MB", "seconds", "MB/s", "particles", "mismatched");
+	for (u32 format = 0; format < 2; format++)
+	{
+		// One worker, then the default number of workers
+		for (u32 w = 0; w < 2; w++)
+		{
+			const u32 workers = (w == 0) ? 1 : max_workers;
+			world_t world;
+			memset(&world, 0, sizeof(world_t));
+			params.format = (format == 0) ? IMPORT_BINARY : IMPORT_CSV;
+			params.worker_count = workers;
+			import_stats_t stats;
+			if (!import_particles(&world, (format == 0) ? binary_name : csv_name, &params, &stats))
+			{
+				printf("Failed to import the particle file\n");
+				world_free(&world);
+				continue;
+			}
+			u32 mismatched = 0;
+			if (reference.sphere_count == 0)
+			{
+				reference = world;
+			} else {
+				mismatched += (world.sphere_count != reference.sphere_count);
+				for (u32 i = 0; i < min(world.sphere_count, reference.sphere_count); i++)
+					mismatched += (memcmp(world.spheres + i, reference.spheres + i, sizeof(sphere_t)) != 0);
+			}
+			const f64 megabytes = (f64) stats.bytes / (1024.0*1024.0);
+			printf("%-8s %8u %10.1f %12.4f %10.1f %10u %10u\n", (format == 0) ? "binary" : "csv", workers,
+				megabytes, stats.time, megabytes / stats.time, stats.count, mismatched);
+			if (mismatched > 0)
+				printf("ERROR: Imported particles differ from the binary import\n");
+			if (world.spheres != reference.spheres)
+				world_free(&world);
+		}
+	}
+	world_free(&reference);
+	remove(binary_name);
+	remove(csv_name);
+};
+
+// Render a whole scene on the calling thread, returns the time it took
+static f64 bench_render(lin_alloc_t *temp_alloc, const scene_t *scene, i32 samples, framebuffer_t *framebuffer)
+{
+	const rect_t area = { 0, 0, framebuffer->width, framebuffer->height };
+	const f64 start = time_now();
+	render(temp_alloc, &scene->world, &scene->camera, samples, scene->bounces, framebuffer, area);
+	return (time_now() - start);
+};
+// Get the root mean square difference between two renders
+static f64 image_rmse(const framebuffer_t *a, const framebuffer_t *b)
+{
+	f64 sum = 0.0;
+	const u32 count = a->width*a->height;
+	for (u32 i = 0; i < count; i++)
+	{
+		// NOTE: Clamped like the resolved image, so a few bright outliers don't dominate the error
+		for (u32 j = 0; j < 3; j++)
+			sum += f32_square(f32_saturate(a->pixels[i].v[j]) - f32_saturate(b->pixels[i].v[j]));
+	}
+	return sqrt(sum / (f64) (count*3));
+};
+// Get the memory rays touched in the last render: the nodes they visited, the spheres of visited leaves and the proxies they tested
+static size_t lod_touched_bytes(const world_t *world)
+{
+	const bvh_t *bvh = &world->bvh;
+	const lod_t *lod = &world->lod;
+	size_t bytes = 0;
+	for (u32 i = 0; i < bvh->node_count; i++)
+	{
+		if (!lod->touched[i])
+			continue;
+		const bvh_node_t *node = bvh->nodes + i;
+		bytes += sizeof(bvh_node_t);
+		if (node->count > 0)
+			bytes += node->count*(sizeof(sphere_t) + sizeof(u32));
+		else if (lod->threshold > 0.f)
+			bytes += sizeof(lod_proxy_t);
+	}
+	return bytes;
+};
+void bench_lod(const char *scene_file, i32 samples)
+{
+	scene_t *scene = scene_load(scene_file);
+	if (!scene)
+	{
+		printf("Failed to load scene \"%s\"\n", scene_file);
+		return;
+	}
+	// NOTE: The spheres of a scene that reuses its page file were never loaded, there's nothing to compare against
+	if (scene->page.reuse)
+	{
+		printf("Scene spheres are only in the page file \"%s\", remove it to bench the scene\n", scene->page.file);
+		world_free(&scene->world);
+		free(scene);
+		return;
+	}
+	world_t *world = &scene->world;
+	scene->bvh.worker_count = 1;
+	if (world->instance_count > 0)
+		world_build_instances(world, &scene->bvh);
+
+	framebuffer_t reference, noise, framebuffer;
+	framebuffer_alloc(&reference, scene->w, scene->h);
+	framebuffer_alloc(&noise, scene->w, scene->h);
+	framebuffer_alloc(&framebuffer, scene->w, scene->h);
+
+	const size_t temp_size = kilobytes(16);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, temp_size, malloc(temp_size));
+	assert(temp_alloc.memory != NULL);
+
+	// Build the tree and proxies once, only the threshold changes between renders
+	accel_params_t params = { scene->bvh, scene->grid, NULL };
+	params.lod = scene->lod;
+	world_build_accel(world, &accel_lod, &params);
+	accel_stats_t stats;
+	accel_lod.stats(world, &stats);
+	lod_t *lod = &world->lod;
+	const size_t proxy_bytes = lod->proxy_count*sizeof(lod_proxy_t);
+	lod->touched = malloc(max(lod->proxy_count, 1));
+	assert(lod->touched != NULL);
+
+	printf("%u spheres, %dx%d pixels, %d samples, %d bounces\n", world->sphere_count, scene->w, scene->h, samples, scene->bounces);
+	printf("%u proxies (%zu KB) on top of a %zu KB tree, built in %f seconds\n",
+		lod->proxy_count, proxy_bytes / 1024, (stats.memory - proxy_bytes) / 1024, lod->build_time);
+	printf("%-10s %10s %10s %12s %12s %10s %10s\n",
+		"threshold", "render s", "speedup", "touched KB", "touched %", "rmse", "psnr db");
+	// Full traversal through the same code with proxies turned off, for the reference image and the memory it touches
+	const f32 threshold = lod->threshold;
+	lod->threshold = 0.f;
+	memset(lod->touched, 0, lod->proxy_count);
+	bench_render(&temp_alloc, scene, samples, &reference);
+	const size_t full_bytes = lod_touched_bytes(world);
+	// The plain BVH accelerator over the same tree is the baseline time
+	// NOTE: It's a second full render, so the difference to the reference is the noise any render has
+	world->accel = &accel_bvh;
+	const f64 full_time = bench_render(&temp_alloc, scene, samples, &noise);
+	world->accel = &accel_lod;
+	const f64 noise_floor = image_rmse(&reference, &noise);
+	printf("%-10s %10.3f %10.2f %12zu %12.1f %10.5f %10.2f\n", "bvh",
+		full_time, 1.0, full_bytes / 1024, 100.0, noise_floor, -20.0*log10(max(noise_floor, 1e-9)));
+	// The scene threshold, and multiples of it
+	const f32 scales[] = { 0.25f, 0.5f, 1.f, 2.f, 4.f };
+	for (u32 i = 0; i < static_len(scales); i++)
+	{
+		lod->threshold = threshold*scales[i];
+		memset(lod->touched, 0, lod->proxy_count);
+		const f64 time = bench_render(&temp_alloc, scene, samples, &framebuffer);
+		const size_t bytes = lod_touched_bytes(world);
+		const f64 rmse = image_rmse(&reference, &framebuffer);
+		printf("%-10.3f %10.3f %10.2f %12zu %12.1f %10.5f %10.2f\n", lod->threshold,
+			time, full_time / time, bytes / 1024, 100.0*(f64) bytes / (f64) max(full_bytes, 1),
+			rmse, -20.0*log10(max(rmse, 1e-9)));
+	}
+	printf("(rmse is against a full render, the bvh row is the noise between two full renders)\n");
+
+	free(temp_alloc.memory);
+	framebuffer_free(&framebuffer);
+	framebuffer_free(&noise);
+	framebuffer_free(&reference);
+	world_free(world);
+	free(scene);
+};
+
+// Width of the strips the sharing benchmark splits the frame into, 60 bytes so every edge between strips is inside a cache line
+#define BENCH_STRIP_WIDTH	5
+#define BENCH_STRIP_HEIGHT	64
+// Strips the sharing benchmark gives each worker
+#define BENCH_STRIPS_PER_WORKER	16
+
+typedef struct
+{
+	v3 *pixels;
+	u32 width;
+	u32 strip_count;
+	u32 passes;
+	// Sum into an aligned, padded buffer of the worker's own and add it to the frame once a strip is done
+	bool local;
+} sharing_job_t;
+
+// Add a made up sample to every pixel of a worker's strips once per pass, workers take every worker_count'th strip
+// NOTE: So the neighbours of every strip are being summed at the same time, by other workers
+static void sharing_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	const sharing_job_t *job = (const sharing_job_t*) data;
+	// Rows of the local buffer are padded to whole cache lines the same way as the tile sums
+	const u32 stride = (BENCH_STRIP_WIDTH + TILE_ROW_PIXELS - 1) / TILE_ROW_PIXELS * TILE_ROW_PIXELS;
+	v3 *local = aligned_alloc(CACHE_LINE_SIZE, stride*BENCH_STRIP_HEIGHT*sizeof(v3));
+	assert(local != NULL);
+	for (u32 strip = worker_index; strip < job->strip_count; strip += worker_count)
+	{
+		v3 *pixels = job->pixels + strip*BENCH_STRIP_WIDTH;
+		if (job->local)
+		{
+			memset(local, 0, stride*BENCH_STRIP_HEIGHT*sizeof(v3));
+			for (u32 pass = 0; pass < job->passes; pass++)
+			{
+				for (u32 j = 0; j < BENCH_STRIP_HEIGHT; j++)
+				{
+					for (u32 i = 0; i < BENCH_STRIP_WIDTH; i++)
+					{
+						const f32 sample = (f32) ((pass + i + j) & 7);
+						local[j*stride + i] = v3_add(local[j*stride + i], V3(sample, sample, sample));
+					}
+				}
+			}
+			// Flush the strip to the frame once
+			for (u32 j = 0; j < BENCH_STRIP_HEIGHT; j++)
+			{
+				for (u32 i = 0; i < BENCH_STRIP_WIDTH; i++)
+					pixels[j*job->width + i] = v3_add(pixels[j*job->width + i], local[j*stride + i]);
+			}
+		} else {
+			for (u32 pass = 0; pass < job->passes; pass++)
+			{
+				for (u32 j = 0; j < BENCH_STRIP_HEIGHT; j++)
+				{
+					for (u32 i = 0; i < BENCH_STRIP_WIDTH; i++)
+					{
+						const f32 sample = (f32) ((pass + i + j) & 7);
+						pixels[j*job->width + i] = v3_add(pixels[j*job->width + i], V3(sample, sample, sample));
+					}
+				}
+			}
+		}
+	}
+	free(local);
+};
+void bench_sharing(u32 worker_count, u32 passes)
+{
+	worker_count = clamp(worker_count, 1, MAX_WORKERS);
+	const u32 strip_count = worker_count*BENCH_STRIPS_PER_WORKER;
+	const u32 width = strip_count*BENCH_STRIP_WIDTH;
+	const size_t pixel_count = (size_t) width*BENCH_STRIP_HEIGHT;
+	v3 *shared = malloc(pixel_count*sizeof(v3));
+	v3 *local = malloc(pixel_count*sizeof(v3));
+	assert((shared != NULL) && (local != NULL));
+
+	const f64 updates = (f64) pixel_count*(f64) passes;
+	printf("%ux%u frame, %u pixel wide strips, %u passes\n", width, BENCH_STRIP_HEIGHT, BENCH_STRIP_WIDTH, passes);
+	printf("%-8s %8s %12s %14s %10s\n", "sums", "workers", "seconds", "Mupdates/s", "mismatched");
+	// One worker, then all of them, summing straight into the frame and into local buffers
+	for (u32 w = 0; w < 2; w++)
+	{
+		const u32 workers = (w == 0) ? 1 : worker_count;
+		if ((w > 0) && (workers == 1))
+			break;
+		for (u32 mode = 0; mode < 2; mode++)
+		{
+			sharing_job_t job;
+			job.pixels = (mode == 0) ? shared : local;
+			job.width = width;
+			job.strip_count = strip_count;
+			job.passes = passes;
+			job.local = (mode == 1);
+			memset(job.pixels, 0, pixel_count*sizeof(v3));
+			const f64 start = time_now();
+			jobs_run(workers, sharing_proc, &job);
+			const f64 seconds = (time_now() - start);
+			// Both add the same samples in the same order, so the frames have to match exactly
+			u32 mismatched = 0;
+			if (mode == 1)
+			{
+				for (size_t i = 0; i < pixel_count; i++)
+					mismatched += (memcmp(shared + i, local + i, sizeof(v3)) != 0);
+			}
+			printf("%-8s %8u %12.4f %14.1f %10u\n", (mode == 0) ? "shared" : "local", workers,
+				seconds, updates / (seconds*1e6), mismatched);
+			if (mismatched > 0)
+				printf("ERROR: Local sums differ from the shared frame\n");
+		}
+	}
+	free(shared);
+	free(local);
+};
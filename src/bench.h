@@ -0,0 +1,37 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "core.h"
+#include "util.h"
+
+// Time the BVH builders on random sphere fields of increasing size, with an increasing number of workers
+void bench_bvh_build(u32 max_spheres, u32 max_workers);
+// Check the compressed BVH against the binary one on a random sphere field, and compare their size and ray throughput
+// NOTE: Any hit the compressed tree misses is reported as an error
+void bench_qbvh(u32 sphere_count, u32 ray_count);
+// Compare the cache behaviour and ray throughput of the trees before and after reordering them for locality
+// NOTE: Cache miss rates come from the hardware counters, which aren't available everywhere
+void bench_layout(u32 sphere_count, u32 ray_count);
+// Compare stack and stackless (skip link) traversal, for closest hit and any hit queries
+void bench_traversal(u32 sphere_count, u32 ray_count);
+// Compare dense and hashed grids against BVHs on uniform and clustered sphere fields: build time, memory and ray throughput
+// NOTE: Any grid hit that differs from the SAH tree is reported as an error
+void bench_grid(u32 sphere_count, u32 ray_count);
+// Compare a lazily built BVH against a fully built one, on rays that only reach a small part of a random sphere field
+// NOTE: Any hit that differs from the full tree is reported as an error
+void bench_lazy(u32 sphere_count, u32 ray_count);
+// Write a random particle snapshot as binary and CSV files, and time importing them with one and several workers
+// NOTE: Any particle that differs from the binary import is reported as an error, the files are removed afterwards
+void bench_import(u32 particle_count, const char *file_prefix);
+// Compare every registered accelerator, and the automatic pick, on the spheres of a scene
+// NOTE: Camera rays are traced through random points of the image, results are checked against the first accelerator
+void bench_accel(const char *scene_file, u32 ray_count);
+// Render a scene with level of detail proxies at several thresholds, and compare time, touched memory and image error against full traversal
+// NOTE: Renders on the calling thread, a second full render gives the noise floor the error has to be read against
+void bench_lod(const char *scene_file, i32 samples);
+// Compare workers summing samples straight into neighbouring strips of a shared frame against summing into local buffers,
+// the way tiles do, and flushing them once
+// NOTE: Strip edges are inside cache lines, so the shared frame shows the cost of workers writing to the same lines
+void bench_sharing(u32 worker_count, u32 passes);
+
+#endif
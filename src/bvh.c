@@ -0,0 +1,381 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bvh.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Cache file identifier, "PTBV"
+#define BVH_FILE_MAGIC		0x56425450
+// Bump whenever the node layout or the build algorithm changes
+#define BVH_FILE_VERSION	1
+// Alignment of the arrays inside a cache file
+#define BVH_FILE_ALIGN		64
+
+// Cache file header, followed by the node and index arrays
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	// Hash of the primitives and build parameters the tree was built from
+	u64 hash;
+	// Time the original build took
+	f64 build_time;
+	// Array sizes
+	u32 node_count;
+	u32 index_count;
+	// Array offsets, relative to the start of the file
+	u64 node_offset;
+	u64 index_offset;
+} bvh_file_header_t;
+
+// Primitive reference used while building
+typedef struct
+{
+	aabb_t aabb;
+	u32 index;
+} bvh_prim_t;
+
+static int bvh_compare_x(const void *a, const void *b)
+{
+	const bvh_prim_t *prim_a = (const bvh_prim_t*) a;
+	const bvh_prim_t *prim_b = (const bvh_prim_t*) b;
+	return ((prim_a->aabb.min.x - prim_b->aabb.min.x) < 0.f) ? -1 : 1;
+};
+static int bvh_compare_y(const void *a, const void *b)
+{
+	const bvh_prim_t *prim_a = (const bvh_prim_t*) a;
+	const bvh_prim_t *prim_b = (const bvh_prim_t*) b;
+	return ((prim_a->aabb.min.y - prim_b->aabb.min.y) < 0.f) ? -1 : 1;
+};
+static int bvh_compare_z(const void *a, const void *b)
+{
+	const bvh_prim_t *prim_a = (const bvh_prim_t*) a;
+	const bvh_prim_t *prim_b = (const bvh_prim_t*) b;
+	return ((prim_a->aabb.min.z - prim_b->aabb.min.z) < 0.f) ? -1 : 1;
+};
+// Build a BVH recursively, based on a range of primitives, returns the index of the new node
+static u32 build_node(bvh_t *bvh, bvh_prim_t *prims, u32 first, u32 count)
+{
+	if (count > 2)
+	{
+		// Sort primitives along a random axis
+		const u32 axis = u32_rand(0, 2);
+		switch (axis)
+		{
+			case 0: qsort(prims + first, count, sizeof(bvh_prim_t), bvh_compare_x); break;
+			case 1: qsort(prims + first, count, sizeof(bvh_prim_t), bvh_compare_y); break;
+			case 2: qsort(prims + first, count, sizeof(bvh_prim_t), bvh_compare_z); break;
+		}
+	}
+
+	// Allocate a new BVH node
+	const u32 index = bvh->node_count++;
+	bvh_node_t *node = bvh->nodes + index;
+	// If theres only one primitive left, it's a leaf
+	if (count == 1)
+	{
+		node->aabb = prims[first].aabb;
+		node->offset = first;
+		node->count = 1;
+	} else {
+		// Otherwise divide the list in half, create BVH trees for both sides
+		// NOTE: Two primitives split into two leaves
+		const u32 half = (count / 2);
+
+		build_node(bvh, prims, first, half);
+		const u32 r = build_node(bvh, prims, first + half, count - half);
+		// NOTE: The node array can't move during the build, so the pointer is still valid
+		node->offset = (r - index);
+		node->count = 0;
+		node->aabb = aabb_combine(bvh->nodes[index + 1].aabb, bvh->nodes[r].aabb);
+	}
+	return index;
+};
+static void bvh_build_median(bvh_t *bvh, const aabb_t *bounds, u32 count)
+{
+	if (count > 0)
+	{
+		// Allocate a primitive reference list for the build routine to modify
+		bvh_prim_t *prims = malloc(count*sizeof(bvh_prim_t));
+		assert(prims != NULL);
+		for (u32 i = 0; i < count; i++)
+		{
+			prims[i].aabb = bounds[i];
+			prims[i].index = i;
+		}
+		// A binary tree with one primitive per leaf has at most 2n-1 nodes
+		bvh->nodes = malloc((2*count - 1)*sizeof(bvh_node_t));
+		bvh->indices = malloc(count*sizeof(u32));
+		assert((bvh->nodes != NULL) && (bvh->indices != NULL));
+		// Build the tree
+		build_node(bvh, prims, 0, count);
+		// Store the final primitive order, leaves reference ranges of it
+		bvh->index_count = count;
+		for (u32 i = 0; i < count; i++)
+			bvh->indices[i] = prims[i].index;
+		// Free the temp primitive list
+		free(prims);
+	}
+};
+void bvh_build(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params)
+{
+	const f64 start = time_now();
+
+	memset(bvh, 0, sizeof(bvh_t));
+	if (params->lazy)
+	{
+		bvh_build_lazy(bvh, bounds, count, params);
+		bvh->build_time = (time_now() - start);
+		return;
+	}
+	switch (params->builder)
+	{
+		case BVH_BUILD_MEDIAN:	bvh_build_median(bvh, bounds, count); break;
+		case BVH_BUILD_LBVH:	bvh_build_lbvh(bvh, bounds, count, params); break;
+		case BVH_BUILD_SAH:		bvh_build_sah(bvh, bounds, count, params); break;
+	}
+	bvh->build_time = (time_now() - start);
+};
+void bvh_link(bvh_t *bvh)
+{
+	free(bvh->skips);
+	bvh->skips = malloc(max(bvh->node_count, 1)*sizeof(u32));
+	assert(bvh->skips != NULL);
+	// Missing the root ends the traversal
+	bvh->skips[0] = bvh->node_count;
+	// Parents always come before their children, so their links are set before they're needed
+	for (u32 i = 0; i < bvh->node_count; i++)
+	{
+		const bvh_node_t *node = bvh->nodes + i;
+		if (node->count == 0)
+		{
+			// Missing the left child moves on to the right child, missing the right child moves on to wherever the parent would
+			bvh->skips[i + 1] = (i + node->offset);
+			bvh->skips[i + node->offset] = bvh->skips[i];
+		}
+	}
+};
+// Refit a node array, walking it backwards
+// NOTE: Children are always stored after their parent, so they're visited first
+static void bvh_refit_nodes(const bvh_t *bvh, bvh_node_t *nodes, u32 node_count, const aabb_t *bounds)
+{
+	for (u32 i = node_count; i-- > 0;)
+	{
+		bvh_node_t *node = nodes + i;
+		if (node->count == 0)
+		{
+			// Branches enclose both children
+			node->aabb = aabb_combine(nodes[i + 1].aabb, nodes[i + node->offset].aabb);
+		} else if (node->count == BVH_DEFERRED) {
+			// Deferred nodes enclose their subtree, or it's primitives if it isn't built yet
+			bvh_subtree_t *subtree = bvh->lazy->subtrees + node->offset;
+			if (subtree->state == BVH_SUBTREE_BUILT)
+			{
+				bvh_refit_nodes(bvh, subtree->nodes, subtree->node_count, bounds);
+				node->aabb = subtree->nodes[0].aabb;
+			} else {
+				node->aabb = aabb_empty();
+				for (u32 j = 0; j < subtree->count; j++)
+					node->aabb = aabb_combine(node->aabb, bounds[bvh->indices[subtree->first + j]]);
+			}
+		} else {
+			// Leaves enclose their primitives
+			const u32 *indices = bvh->indices + node->offset;
+			node->aabb = bounds[indices[0]];
+			for (u32 j = 1; j < node->count; j++)
+				node->aabb = aabb_combine(node->aabb, bounds[indices[j]]);
+		}
+	}
+};
+void bvh_refit(bvh_t *bvh, const aabb_t *bounds)
+{
+	// Subtrees that aren't built yet will be built from the moved primitives
+	// NOTE: Refits happen between frames, so no thread is building a subtree
+	bvh_lazy_t *lazy = bvh->lazy;
+	if (lazy)
+	{
+		memcpy(lazy->bounds, bounds, bvh->index_count*sizeof(aabb_t));
+		for (u32 i = 0; i < bvh->index_count; i++)
+			lazy->centers[i] = aabb_center(bounds[i]);
+	}
+	bvh_refit_nodes(bvh, bvh->nodes, bvh->node_count, bounds);
+};
+void bvh_free(bvh_t *bvh)
+{
+	if (bvh->mapping)
+	{
+		munmap(bvh->mapping, bvh->mapping_size);
+	} else {
+		free(bvh->nodes);
+		free(bvh->indices);
+	}
+	// NOTE: Skip links are always on the heap, even for mapped trees
+	free(bvh->skips);
+	// Free the lazy build state, and every subtree built so far
+	bvh_lazy_t *lazy = bvh->lazy;
+	if (lazy)
+	{
+		for (u32 i = 0; i < lazy->subtree_count; i++)
+			free(lazy->subtrees[i].nodes);
+		free(lazy->subtrees);
+		free(lazy->build);
+		free(lazy->centers);
+		free(lazy->bounds);
+		free(lazy);
+	}
+	memset(bvh, 0, sizeof(bvh_t));
+};
+void bvh_lazy_stats(const bvh_t *bvh, bvh_lazy_stats_t *stats)
+{
+	memset(stats, 0, sizeof(bvh_lazy_stats_t));
+	stats->node_count = bvh->node_count;
+	const bvh_lazy_t *lazy = bvh->lazy;
+	if (!lazy)
+		return;
+
+	stats->subtree_count = lazy->subtree_count;
+	for (u32 i = 0; i < lazy->subtree_count; i++)
+	{
+		const bvh_subtree_t *subtree = lazy->subtrees + i;
+		stats->primitive_count += subtree->count;
+		if (subtree->state == BVH_SUBTREE_BUILT)
+		{
+			stats->built_subtrees++;
+			stats->built_primitives += subtree->count;
+			stats->node_count += subtree->node_count;
+			stats->build_time += subtree->build_time;
+		}
+	}
+};
+
+// Sum the SAH cost of a node array, relative to a root surface area
+static f32 bvh_nodes_cost(const bvh_t *bvh, const bvh_node_t *nodes, u32 node_count, f32 root_area)
+{
+	f32 cost = 0.f;
+	for (u32 i = 0; i < node_count; i++)
+	{
+		const bvh_node_t *node = nodes + i;
+		const f32 probability = aabb_area(node->aabb) / root_area;
+		if (node->count == 0)
+		{
+			cost += BVH_COST_TRAVERSAL*probability;
+		} else if (node->count == BVH_DEFERRED) {
+			// Subtrees that aren't built yet count as a single leaf
+			const bvh_subtree_t *subtree = bvh->lazy->subtrees + node->offset;
+			if (subtree->state == BVH_SUBTREE_BUILT)
+				cost += bvh_nodes_cost(bvh, subtree->nodes, subtree->node_count, root_area);
+			else
+				cost += BVH_COST_INTERSECT*probability*(f32) subtree->count;
+		} else {
+			cost += BVH_COST_INTERSECT*probability*(f32) node->count;
+		}
+	}
+	return cost;
+};
+f32 bvh_cost(const bvh_t *bvh)
+{
+	if (bvh->node_count == 0)
+		return 0.f;
+
+	// Sum the cost of every node, weighted by the probability of a ray hitting it
+	return bvh_nodes_cost(bvh, bvh->nodes, bvh->node_count, aabb_area(bvh->nodes[0].aabb));
+};
+
+u64 bvh_hash(const aabb_t *bounds, u32 count, const bvh_params_t *params)
+{
+	// Build parameters that change the output tree
+	// NOTE: The worker count isn't one of them, parallel builders give the same result for any number of workers
+	const u32 key[] = { BVH_FILE_VERSION, sizeof(bvh_node_t), count, params->builder, params->optimize };
+
+	u64 hash = HASH_SEED;
+	hash = hash_bytes(hash, key, sizeof(key));
+	hash = hash_bytes(hash, bounds, count*sizeof(aabb_t));
+	return hash;
+};
+
+static inline u64 align_offset(u64 offset)
+{
+	return (offset + (BVH_FILE_ALIGN-1)) & ~((u64) BVH_FILE_ALIGN-1);
+};
+bool bvh_save(const bvh_t *bvh, u64 hash, const char *file_name)
+{
+	bvh_file_header_t header = {0};
+	header.magic = BVH_FILE_MAGIC;
+	header.version = BVH_FILE_VERSION;
+	header.hash = hash;
+	header.build_time = bvh->build_time;
+	header.node_count = bvh->node_count;
+	header.index_count = bvh->index_count;
+	header.node_offset = align_offset(sizeof(bvh_file_header_t));
+	header.index_offset = align_offset(header.node_offset + bvh->node_count*sizeof(bvh_node_t));
+
+	// Write to a temporary file first, so that a crash never leaves a half written cache behind
+	char temp_name[512];
+	snprintf(temp_name, sizeof(temp_name), "%s.tmp", file_name);
+
+	FILE *f = fopen(temp_name, "wb");
+	if (!f)
+		return false;
+
+	// Padding between the header and the arrays
+	const u8 padding[BVH_FILE_ALIGN] = {0};
+	const size_t node_padding = header.node_offset - sizeof(header);
+	const size_t index_padding = header.index_offset - (header.node_offset + bvh->node_count*sizeof(bvh_node_t));
+	bool result = true;
+	result &= (fwrite(&header, sizeof(header), 1, f) == 1);
+	result &= (fwrite(padding, 1, node_padding, f) == node_padding);
+	result &= (fwrite(bvh->nodes, sizeof(bvh_node_t), bvh->node_count, f) == bvh->node_count);
+	result &= (fwrite(padding, 1, index_padding, f) == index_padding);
+	result &= (fwrite(bvh->indices, sizeof(u32), bvh->index_count, f) == bvh->index_count);
+	result &= (fclose(f) == 0);
+	// Move the finished file into place
+	if (result)
+		result = (rename(temp_name, file_name) == 0);
+	if (!result)
+		remove(temp_name);
+	return result;
+};
+bool bvh_load(bvh_t *bvh, u64 hash, const char *file_name)
+{
+	const int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	bool result = false;
+	struct stat st;
+	if ((fstat(fd, &st) == 0) && (st.st_size >= sizeof(bvh_file_header_t)))
+	{
+		// NOTE: Mapped copy-on-write, so the tree can still be modified in memory
+		const size_t size = st.st_size;
+		u8 *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			// Validate the header against the file size and expected contents
+			const bvh_file_header_t *header = (const bvh_file_header_t*) mapping;
+			const u64 node_end = header->node_offset + (u64) header->node_count*sizeof(bvh_node_t);
+			const u64 index_end = header->index_offset + (u64) header->index_count*sizeof(u32);
+			if ((header->magic == BVH_FILE_MAGIC) &&
+				(header->version == BVH_FILE_VERSION) &&
+				(header->hash == hash) &&
+				(node_end <= size) && (index_end <= size))
+			{
+				memset(bvh, 0, sizeof(bvh_t));
+				bvh->build_time = header->build_time;
+				bvh->node_count = header->node_count;
+				bvh->nodes = (bvh_node_t*) (mapping + header->node_offset);
+				bvh->index_count = header->index_count;
+				bvh->indices = (u32*) (mapping + header->index_offset);
+				bvh->mapping = mapping;
+				bvh->mapping_size = size;
+				result = true;
+			} else {
+				munmap(mapping, size);
+			}
+		}
+	}
+	close(fd);
+	return result;
+};
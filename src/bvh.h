@@ -0,0 +1,161 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+// Surface area heuristic costs of traversing a node and intersecting a primitive
+#define BVH_COST_TRAVERSAL	1.f
+#define BVH_COST_INTERSECT	1.f
+
+// Leaf count of a deferred node, the offset is the index of it's subtree in the lazy build state
+#define BVH_DEFERRED		0xFFFFFFFF
+
+// BVH construction algorithm
+typedef enum
+{
+	// Recursive median split along a random axis
+	BVH_BUILD_MEDIAN,
+	// Parallel linear BVH, built from sorted morton codes
+	BVH_BUILD_LBVH,
+	// Parallel binned surface area heuristic
+	BVH_BUILD_SAH,
+} bvh_builder_t;
+
+// BVH construction parameters
+typedef struct
+{
+	bvh_builder_t builder;
+	// Restructure small treelets after building to lower the SAH cost (LBVH only)
+	bool optimize;
+	// Number of worker threads parallel builders can use
+	u32 worker_count;
+	// Also compress the tree into a quantized 4-wide one, which is used for traversal
+	// NOTE: Doesn't change the binary tree, so it isn't part of the cache key
+	bool compress;
+	// Reorder the primitives to match the leaf order, and lay the compressed tree out cache-obliviously
+	bool reorder;
+	// Add skip links to the tree, for traversal without a stack
+	bool stackless;
+	// Only build the top of the tree, the subtrees below it are built when a ray first reaches them
+	// NOTE: Always uses the SAH builder, and can't be cached, compressed, reordered or linked
+	bool lazy;
+} bvh_params_t;
+
+// Flattened BVH node
+// NOTE: Nodes are stored depth-first, so the left child of a branch always directly follows it
+typedef struct
+{
+	// Bounding box
+	aabb_t aabb;
+	// Branches: offset from this node to the right child
+	// Leaves: index of the first primitive in the index list
+	u32 offset;
+	// Number of primitives in a leaf, 0 for branches
+	u32 count;
+} bvh_node_t;
+
+// Subtree build state
+typedef enum
+{
+	BVH_SUBTREE_DEFERRED,
+	BVH_SUBTREE_BUILDING,
+	BVH_SUBTREE_BUILT,
+} bvh_subtree_state_t;
+
+// Subtree below a deferred node
+typedef struct
+{
+	// Primitive range, partitioned in place when the subtree is built
+	u32 first;
+	u32 count;
+	// Build state, only ever moves forward
+	volatile u32 state;
+	// Subtree nodes, only valid once the subtree is built
+	// NOTE: Offsets are relative to this array, leaves reference the shared index list
+	u32 node_count;
+	bvh_node_t *nodes;
+	// Time it took to build the subtree, in seconds
+	f64 build_time;
+} bvh_subtree_t;
+
+// Lazy build state, kept with the tree until every subtree could be built
+typedef struct
+{
+	// Copies of the primitive bounds and their centers, subtrees are built from them
+	aabb_t *bounds;
+	v3 *centers;
+	// Subtrees of the deferred nodes
+	u32 subtree_count;
+	bvh_subtree_t *subtrees;
+	// Builder state subtrees are built with
+	void *build;
+} bvh_lazy_t;
+
+// Lazy build statistics
+typedef struct
+{
+	u32 subtree_count;
+	u32 built_subtrees;
+	// Primitives in all subtrees, and in the built ones
+	u32 primitive_count;
+	u32 built_primitives;
+	// Nodes in the top of the tree and in the built subtrees
+	u32 node_count;
+	// Time spent building subtrees, summed over all threads
+	f64 build_time;
+} bvh_lazy_stats_t;
+
+// BVH tree data structure
+typedef struct
+{
+	// Node array, the root is always the first node
+	u32 node_count;
+	bvh_node_t *nodes;
+	// Primitive index list, leaves reference ranges of this list
+	u32 index_count;
+	u32 *indices;
+	// Skip link of every node, the node to visit next when a ray misses it, NULL if the tree isn't linked
+	// NOTE: A skip link equal to the node count ends the traversal
+	u32 *skips;
+	// Time it took to build the tree, in seconds
+	f64 build_time;
+	// Lazy build state, NULL if the whole tree was built up front
+	bvh_lazy_t *lazy;
+	// Memory mapped cache file the arrays live in, NULL if they are heap allocated
+	void  *mapping;
+	size_t mapping_size;
+} bvh_t;
+
+// Build a BVH from a list of primitive bounding boxes
+void bvh_build(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params);
+// Parallel builders, use bvh_build instead
+void bvh_build_lbvh(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params);
+void bvh_build_sah(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params);
+void bvh_build_lazy(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params);
+// Get the nodes of the subtree below a deferred node, building it if no thread has yet
+// NOTE: Safe to call from any number of threads, a thread reaching a subtree another thread is building waits for it
+const bvh_node_t* bvh_subtree(const bvh_t *bvh, u32 subtree);
+// Get how much of a lazily built tree has been built so far
+void bvh_lazy_stats(const bvh_t *bvh, bvh_lazy_stats_t *stats);
+// Compute the skip links of a tree, so it can be traversed without a stack
+// NOTE: Only depends on the tree structure, so refitting doesn't invalidate them
+void bvh_link(bvh_t *bvh);
+// Update the node bounds bottom-up after the primitives moved, the tree structure stays the same
+// NOTE: Refitting is much faster than a rebuild, but the tree quality degrades the further primitives move
+void bvh_refit(bvh_t *bvh, const aabb_t *bounds);
+// Free the BVH node and index arrays, or unmap them if they were loaded from a cache file
+void bvh_free(bvh_t *bvh);
+
+// Get the SAH cost of a BVH, relative to the surface area of the root
+f32 bvh_cost(const bvh_t *bvh);
+
+// Hash the primitive bounds and the build parameters, used as the key for cache files
+u64 bvh_hash(const aabb_t *bounds, u32 count, const bvh_params_t *params);
+// Write a BVH to a cache file, returns false if the file couldn't be written
+bool bvh_save(const bvh_t *bvh, u64 hash, const char *file_name);
+// Memory map a BVH from a cache file, returns false if the file is missing, invalid or was built from different data
+bool bvh_load(bvh_t *bvh, u64 hash, const char *file_name);
+
+#endif
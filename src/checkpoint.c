@@ -0,0 +1,84 @@
+// NOTE: Needed for fsync and fileno
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint.h"
+
+#include <unistd.h>
+
+// Get the number of tiles and pixels of a checkpoint
+static size_t checkpoint_tile_count(const checkpoint_header_t *header)
+{
+	return (size_t) header->tiles_x*(size_t) header->tiles_y;
+};
+static size_t checkpoint_pixel_count(const checkpoint_header_t *header)
+{
+	return (size_t) header->width*(size_t) header->height;
+};
+
+void checkpoint_alloc(checkpoint_t *checkpoint)
+{
+	const size_t tile_count = checkpoint_tile_count(&checkpoint->header);
+	const size_t pixel_count = checkpoint_pixel_count(&checkpoint->header);
+	checkpoint->tiles_done = calloc(max(tile_count, 1), sizeof(u8));
+	checkpoint->pixels = calloc(max(pixel_count, 1), sizeof(v3));
+	checkpoint->counts = calloc(max(pixel_count, 1), sizeof(u32));
+	assert((checkpoint->tiles_done != NULL) && (checkpoint->pixels != NULL) && (checkpoint->counts != NULL));
+};
+void checkpoint_free(checkpoint_t *checkpoint)
+{
+	free(checkpoint->tiles_done);
+	free(checkpoint->pixels);
+	free(checkpoint->counts);
+	memset(checkpoint, 0, sizeof(checkpoint_t));
+};
+
+bool checkpoint_write(const char *file_name, const checkpoint_t *checkpoint)
+{
+	char temp_name[512];
+	snprintf(temp_name, sizeof(temp_name), "%s.tmp", file_name);
+	FILE *file = fopen(temp_name, "wb");
+	if (!file)
+	{
+		printf("Failed to create checkpoint file \"%s\"\n", temp_name);
+		return false;
+	}
+	const checkpoint_header_t *header = &checkpoint->header;
+	fwrite(header, sizeof(checkpoint_header_t), 1, file);
+	fwrite(checkpoint->tiles_done, sizeof(u8), checkpoint_tile_count(header), file);
+	fwrite(checkpoint->pixels, sizeof(v3), checkpoint_pixel_count(header), file);
+	fwrite(checkpoint->counts, sizeof(u32), checkpoint_pixel_count(header), file);
+	// Make sure the data is on disk before the rename, or a crash could leave the new name on a partly written file
+	bool failed = (fflush(file) != 0) || (ferror(file) != 0) || (fsync(fileno(file)) != 0);
+	failed |= (fclose(file) != 0);
+	if (failed || (rename(temp_name, file_name) != 0))
+	{
+		printf("Failed to write checkpoint file \"%s\"\n", file_name);
+		remove(temp_name);
+		return false;
+	}
+	return true;
+};
+bool checkpoint_read(const char *file_name, checkpoint_t *checkpoint)
+{
+	memset(checkpoint, 0, sizeof(checkpoint_t));
+	FILE *file = fopen(file_name, "rb");
+	if (!file)
+		return false;
+	checkpoint_header_t *header = &checkpoint->header;
+	bool result = (fread(header, sizeof(checkpoint_header_t), 1, file) == 1) &&
+		(header->magic == CHECKPOINT_MAGIC) && (header->version == CHECKPOINT_VERSION) &&
+		(header->tiles_x > 0) && (header->tiles_y > 0) && (header->tiles_x <= header->width) && (header->tiles_y <= header->height);
+	if (result)
+	{
+		checkpoint_alloc(checkpoint);
+		const size_t tile_count = checkpoint_tile_count(header);
+		const size_t pixel_count = checkpoint_pixel_count(header);
+		result = (fread(checkpoint->tiles_done, sizeof(u8), tile_count, file) == tile_count) &&
+			(fread(checkpoint->pixels, sizeof(v3), pixel_count, file) == pixel_count) &&
+			(fread(checkpoint->counts, sizeof(u32), pixel_count, file) == pixel_count);
+	}
+	fclose(file);
+	if (!result)
+		checkpoint_free(checkpoint);
+	return result;
+};
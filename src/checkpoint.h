@@ -0,0 +1,50 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+// Checkpoint file identifier and version, the version changes with the layout
+#define CHECKPOINT_MAGIC	0x544b4843
+#define CHECKPOINT_VERSION	1
+
+// Header of a checkpoint file
+// NOTE: Followed by a flag for every tile that was finished, then the pixels and sample count of the whole frame.
+// Pixels of unfinished tiles are 0, with no samples
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	// Hash of the scene file the frame was rendered from
+	u64 scene_hash;
+	// Size of the frame, and the samples of every pixel and the ranges they're split into
+	u32 width, height;
+	i32 samples;
+	u32 range_samples;
+	// Tiles the frame was split into, and the number of them that were finished
+	u32 tiles_x, tiles_y;
+	u32 done_count;
+} checkpoint_header_t;
+
+// Frame in progress, as stored in a checkpoint
+typedef struct
+{
+	checkpoint_header_t header;
+	// Flag for every tile, set if it was finished
+	u8 *tiles_done;
+	// Pixels and sample counts of the frame, row by row
+	v3 *pixels;
+	u32 *counts;
+} checkpoint_t;
+
+// Allocate the tile flags, pixels and counts of a checkpoint from it's header, all cleared
+void checkpoint_alloc(checkpoint_t *checkpoint);
+void checkpoint_free(checkpoint_t *checkpoint);
+// Write a checkpoint file
+// NOTE: Written under a temporary name, flushed to disk and renamed over the last one, so there's always a whole checkpoint
+bool checkpoint_write(const char *file_name, const checkpoint_t *checkpoint);
+// Read a checkpoint file, returns false if it's missing or damaged
+bool checkpoint_read(const char *file_name, checkpoint_t *checkpoint);
+
+#endif
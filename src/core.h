@@ -24,6 +24,7 @@
 #include <math.h>
 
 #include <xmmintrin.h>
+#include <emmintrin.h>
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -70,6 +71,10 @@ typedef double f64;
 #define heap_right(i)	((i << 1) + 2)
 
 #define align_16 __attribute__((aligned(16)))
+#define align_64 __attribute__((aligned(64)))
+// Size of a cache line, the unit cores share memory in
+#define CACHE_LINE_SIZE	64
+#define no_inline __attribute__((noinline))
 #define nearest4(v)	(((v) + 3) & ~0x03)
 
 // TODO: Implement these as intrinsics
@@ -113,5 +118,94 @@ inline u32 atomic_inc(volatile u32 *value)
 	return _InterlockedExchangeAdd(value, 1);
 #endif
 }
+inline u32 atomic_dec(volatile u32 *value)
+{
+#if GCC
+	return __sync_fetch_and_sub(value, 1);
+#elif MSVC
+	return _InterlockedExchangeAdd(value, -1);
+#endif
+}
+// Add to a value, returns the value before the add
+inline u32 atomic_add(volatile u32 *value, u32 amount)
+{
+#if GCC
+	return __sync_fetch_and_add(value, amount);
+#elif MSVC
+	return _InterlockedExchangeAdd(value, amount);
+#endif
+}
+// Set a value if it still has the expected value, returns true if it was set
+inline bool atomic_cas(volatile u32 *value, u32 expected, u32 desired)
+{
+#if GCC
+	return __sync_bool_compare_and_swap(value, expected, desired);
+#elif MSVC
+	return (_InterlockedCompareExchange(value, desired, expected) == expected);
+#endif
+}
+// Read a value, no later memory access can move before the read
+inline u32 atomic_load_acquire(volatile u32 *value)
+{
+#if GCC
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#elif MSVC
+	const u32 result = *value;
+	_ReadWriteBarrier();
+	return result;
+#endif
+}
+// Write a value, no earlier memory access can move after the write
+inline void atomic_store_release(volatile u32 *value, u32 v)
+{
+#if GCC
+	__atomic_store_n(value, v, __ATOMIC_RELEASE);
+#elif MSVC
+	_ReadWriteBarrier();
+	*value = v;
+#endif
+}
+
+// Count leading zeros, undefined for 0
+inline u32 u32_clz(u32 v)
+{
+#if GCC
+	return __builtin_clz(v);
+#elif MSVC
+	unsigned long i;
+	_BitScanReverse(&i, v);
+	return 31 - i;
+#endif
+}
+inline u32 u64_clz(u64 v)
+{
+#if GCC
+	return __builtin_clzll(v);
+#elif MSVC
+	unsigned long i;
+	_BitScanReverse64(&i, v);
+	return 63 - i;
+#endif
+}
+// Count trailing zeros, undefined for 0
+inline u32 u32_ctz(u32 v)
+{
+#if GCC
+	return __builtin_ctz(v);
+#elif MSVC
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return i;
+#endif
+}
+// Count the set bits
+inline u32 u32_popcount(u32 v)
+{
+#if GCC
+	return __builtin_popcount(v);
+#elif MSVC
+	return __popcnt(v);
+#endif
+}
 
 #endif
\ No newline at end of file
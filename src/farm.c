@@ -0,0 +1,562 @@
+// NOTE: Needed for fork, kill and MSG_NOSIGNAL
+#define _GNU_SOURCE
+
+#include "farm.h"
+#include "job.h"
+#include "render.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Time the coordinator waits for messages before checking the lease deadlines, in milliseconds
+#define FARM_POLL_INTERVAL	100
+
+// Messages between the coordinator and the workers
+typedef enum
+{
+	// Worker to coordinator, ready for a lease
+	FARM_MSG_READY,
+	// Coordinator to worker, render a lease
+	FARM_MSG_LEASE,
+	// Worker to coordinator, the sums of a lease follow, and it's ready for the next one
+	FARM_MSG_RESULT,
+	// Coordinator to worker, exit
+	FARM_MSG_QUIT,
+} farm_msg_type_t;
+
+typedef struct
+{
+	u32 type;
+	u32 lease;
+	// Pixels and samples of the lease
+	rect_t area;
+	i32 first_sample, sample_count;
+} farm_msg_t;
+
+// Sample range of a tile, rendered by one worker at a time
+typedef struct
+{
+	u32 tile;
+	u32 range;
+	// Worker the lease was handed to, -1 while it's queued
+	i32 owner;
+	// Time the owner has to return it by
+	f64 deadline;
+	bool done;
+} farm_lease_t;
+
+// Worker process, and the coordinator's end of it's socket
+typedef struct
+{
+	pid_t pid;
+	int fd;
+	bool alive;
+	// Lease being rendered, -1 if there is none
+	// NOTE: Kept after the lease times out, a late result is still used if nobody else finished it first
+	i32 lease;
+	// Waiting for a lease, none were queued when it asked
+	bool waiting;
+} farm_worker_t;
+
+// Sums of a tile, gathered from the results of it's leases
+typedef struct
+{
+	rect_t area;
+	u32 stride;
+	size_t range_size;
+	// Number of leases still missing
+	u32 pending;
+	v3 *sums;
+} farm_tile_t;
+
+// Scene and frame the leases are rendered from
+typedef struct
+{
+	const world_t *world;
+	const camera_t *camera;
+	i32 width, height;
+	i32 bounces;
+} farm_job_t;
+
+// Coordinator state for a frame
+typedef struct
+{
+	farm_job_t job;
+	tile_layout_t layout;
+	f64 lease_timeout;
+	u32 lease_count;
+	farm_lease_t *leases;
+	u32 done_count;
+	// Leases are handed out in order, but taken back ones go first
+	u32 next_lease;
+	u32 requeued_count;
+	u32 *requeued;
+	farm_tile_t *tiles;
+	u32 worker_count;
+	u32 alive_count;
+	farm_worker_t *workers;
+	// Space for results nobody needs anymore
+	v3 *discard;
+	framebuffer_t *framebuffer;
+	farm_stats_t *stats;
+	f64 start;
+} farm_t;
+
+// Send or receive a whole buffer, returns false once the other end is gone
+// NOTE: Sent without SIGPIPE, a dead worker is noticed by the coordinator instead of killing it
+static bool farm_write(int fd, const void *data, size_t size)
+{
+	const u8 *bytes = (const u8*) data;
+	while (size > 0)
+	{
+		const ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+		if ((written < 0) && (errno == EINTR))
+			continue;
+		if (written <= 0)
+			return false;
+		bytes += written;
+		size -= (size_t) written;
+	}
+	return true;
+};
+static bool farm_read(int fd, void *data, size_t size)
+{
+	u8 *bytes = (u8*) data;
+	while (size > 0)
+	{
+		const ssize_t received = recv(fd, bytes, size, 0);
+		if ((received < 0) && (errno == EINTR))
+			continue;
+		if (received <= 0)
+			return false;
+		bytes += received;
+		size -= (size_t) received;
+	}
+	return true;
+};
+// Get the row stride and the size of the sums of an area, rows are padded like tile sums
+static u32 farm_stride(rect_t area)
+{
+	return (u32) (area.w + TILE_ROW_PIXELS - 1) / TILE_ROW_PIXELS * TILE_ROW_PIXELS;
+};
+static size_t farm_sums_size(rect_t area)
+{
+	return max((size_t) farm_stride(area)*(size_t) area.h, TILE_ROW_PIXELS)*sizeof(v3);
+};
+
+// Render the sums of a lease on every thread of the process, returns false if rendering was cancelled
+static bool farm_render_lease(const farm_job_t *job, const farm_msg_t *msg, v3 *sums)
+{
+	memset(sums, 0, farm_sums_size(msg->area));
+	return tile_render_sums(job->world, job->camera,
+		job->width, job->height,
+		msg->first_sample, msg->sample_count,
+		job->bounces,
+		msg->area, sums, farm_stride(msg->area));
+};
+// Worker process loop, render leases until the coordinator says to quit or goes away
+static void farm_worker(int fd, const farm_job_t *job)
+{
+	farm_msg_t msg = {0};
+	msg.type = FARM_MSG_READY;
+	if (!farm_write(fd, &msg, sizeof(msg)))
+		return;
+	v3 *sums = NULL;
+	size_t capacity = 0;
+	while (farm_read(fd, &msg, sizeof(msg)) && (msg.type == FARM_MSG_LEASE))
+	{
+		const size_t size = farm_sums_size(msg.area);
+		if (size > capacity)
+		{
+			free(sums);
+			sums = aligned_alloc(CACHE_LINE_SIZE, size);
+			assert(sums != NULL);
+			capacity = size;
+		}
+		farm_render_lease(job, &msg, sums);
+		msg.type = FARM_MSG_RESULT;
+		if (!farm_write(fd, &msg, sizeof(msg)) || !farm_write(fd, sums, size))
+			break;
+	}
+	free(sums);
+};
+
+// Get the message handing out a lease
+static farm_msg_t farm_lease_msg(const farm_t *farm, u32 index)
+{
+	const farm_lease_t *lease = farm->leases + index;
+	farm_msg_t msg = {0};
+	msg.type = FARM_MSG_LEASE;
+	msg.lease = index;
+	msg.area = farm->tiles[lease->tile].area;
+	msg.first_sample = (i32) (lease->range*farm->layout.range_samples);
+	msg.sample_count = min((i32) farm->layout.range_samples, farm->layout.samples - msg.first_sample);
+	return msg;
+};
+// Take the next lease nobody is working on, returns -1 if there are none
+static i32 farm_next_lease(farm_t *farm)
+{
+	while (farm->requeued_count > 0)
+	{
+		const u32 index = farm->requeued[--farm->requeued_count];
+		if (!farm->leases[index].done && (farm->leases[index].owner < 0))
+			return (i32) index;
+	}
+	while (farm->next_lease < farm->lease_count)
+	{
+		const u32 index = farm->next_lease++;
+		if (!farm->leases[index].done && (farm->leases[index].owner < 0))
+			return (i32) index;
+	}
+	return -1;
+};
+// Put a lease back in the queue, for another worker to take
+static void farm_requeue(farm_t *farm, u32 index)
+{
+	farm->leases[index].owner = -1;
+	farm->requeued[farm->requeued_count++] = index;
+	farm->stats->reassigned++;
+};
+// Stop using a worker, after it died or stopped answering
+static void farm_lose(farm_t *farm, u32 worker_index)
+{
+	farm_worker_t *worker = farm->workers + worker_index;
+	if (!worker->alive)
+		return;
+	// NOTE: Killed in case it's only stuck, so it can be waited for
+	kill(worker->pid, SIGKILL);
+	waitpid(worker->pid, NULL, 0);
+	close(worker->fd);
+	worker->alive = false;
+	farm->alive_count--;
+	farm->stats->lost_workers++;
+	// It's lease goes to someone else, unless it already has
+	if ((worker->lease >= 0) && !farm->leases[worker->lease].done && (farm->leases[worker->lease].owner == (i32) worker_index))
+		farm_requeue(farm, (u32) worker->lease);
+	worker->lease = -1;
+};
+// Hand a worker the next lease, or leave it waiting
+static void farm_assign(farm_t *farm, u32 worker_index)
+{
+	farm_worker_t *worker = farm->workers + worker_index;
+	const i32 index = farm_next_lease(farm);
+	if (index < 0)
+	{
+		worker->waiting = true;
+		return;
+	}
+	farm_lease_t *lease = farm->leases + index;
+	lease->owner = (i32) worker_index;
+	lease->deadline = time_now() + farm->lease_timeout;
+	worker->lease = index;
+	worker->waiting = false;
+	const farm_msg_t msg = farm_lease_msg(farm, (u32) index);
+	if (!farm_write(worker->fd, &msg, sizeof(msg)))
+		farm_lose(farm, worker_index);
+};
+// Get the sums a lease's result goes in, allocating them for the first result of a tile
+static v3* farm_lease_sums(farm_t *farm, const farm_lease_t *lease)
+{
+	farm_tile_t *tile = farm->tiles + lease->tile;
+	if (!tile->sums)
+	{
+		tile->sums = malloc(tile->range_size*farm->layout.range_count*sizeof(v3));
+		assert(tile->sums != NULL);
+	}
+	return tile->sums + lease->range*tile->range_size;
+};
+// Mark a lease as finished, and merge it's tile once all of it's ranges are in
+static void farm_finish(farm_t *farm, u32 index)
+{
+	farm_lease_t *lease = farm->leases + index;
+	farm_tile_t *tile = farm->tiles + lease->tile;
+	lease->done = true;
+	farm->done_count++;
+	if (--tile->pending == 0)
+	{
+		tile_resolve(farm->framebuffer, tile->area, tile->sums, tile->stride, tile->range_size, farm->layout.range_count, farm->layout.samples);
+		free(tile->sums);
+		tile->sums = NULL;
+		if (farm->stats->first_tile_time == 0.0)
+			farm->stats->first_tile_time = time_now();
+	}
+};
+// Read a message from a worker, returns false if the worker is gone
+static bool farm_receive(farm_t *farm, u32 worker_index)
+{
+	farm_worker_t *worker = farm->workers + worker_index;
+	farm_msg_t msg;
+	if (!farm_read(worker->fd, &msg, sizeof(msg)))
+		return false;
+	if (msg.type == FARM_MSG_RESULT)
+	{
+		// Only the lease the worker was given can come back
+		if ((worker->lease < 0) || (msg.lease != (u32) worker->lease))
+			return false;
+		farm_lease_t *lease = farm->leases + msg.lease;
+		const farm_tile_t *tile = farm->tiles + lease->tile;
+		// Results for leases someone else finished first are read and dropped
+		v3 *sums = lease->done ? farm->discard : farm_lease_sums(farm, lease);
+		if (!farm_read(worker->fd, sums, farm_sums_size(tile->area)))
+			return false;
+		worker->lease = -1;
+		if (!lease->done)
+			farm_finish(farm, msg.lease);
+	} else if (msg.type != FARM_MSG_READY) {
+		return false;
+	}
+	farm_assign(farm, worker_index);
+	return true;
+};
+
+// Fork the worker processes, each with it's end of a socket
+static void farm_start(farm_t *farm, const farm_params_t *params)
+{
+	// Spread the workers over the NUMA nodes the coordinator's threads are pinned to
+	const u32 node_count = job_node_count();
+	// NOTE: Anything still buffered would be written again by every worker
+	fflush(stdout);
+	for (u32 i = 0; i < farm->worker_count; i++)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		{
+			printf("Failed to create a socket for worker process %u\n", i);
+			break;
+		}
+		const pid_t pid = fork();
+		if (pid < 0)
+		{
+			printf("Failed to start worker process %u\n", i);
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+		if (pid == 0)
+		{
+			// Keep only this worker's end of the sockets
+			close(fds[0]);
+			for (u32 j = 0; j < i; j++)
+				close(farm->workers[j].fd);
+			// Start a pool of this process's own, on it's share of the CPUs
+			// NOTE: Threads aren't pinned, the node's CPUs could be shared with other workers
+			job_pool_forked();
+			// The coordinator decides when to stop, and kills workers that are still rendering then
+			signal(SIGINT, SIG_IGN);
+			signal(SIGTERM, SIG_IGN);
+			const bool bound = (node_count > 1) && job_bind_node(i % node_count);
+			const u32 sharing = bound ? ((farm->worker_count - (i % node_count) + node_count - 1) / node_count) : farm->worker_count;
+			job_pool_init((params->threads > 0) ? params->threads : max(job_default_thread_count() / sharing, 1), false);
+			farm_worker(fds[1], &farm->job);
+			job_pool_shutdown();
+			close(fds[1]);
+			fflush(stdout);
+			_exit(0);
+		}
+		close(fds[1]);
+		farm_worker_t *worker = farm->workers + i;
+		worker->pid = pid;
+		worker->fd = fds[0];
+		worker->alive = true;
+		worker->lease = -1;
+		worker->waiting = false;
+		farm->alive_count++;
+	}
+};
+// Hand out leases and gather their results, until every lease is done or every worker is lost
+static void farm_coordinate(farm_t *farm)
+{
+	struct pollfd *fds = malloc(farm->worker_count*sizeof(struct pollfd));
+	u32 *fd_workers = malloc(farm->worker_count*sizeof(u32));
+	assert((fds != NULL) && (fd_workers != NULL));
+	while ((farm->done_count < farm->lease_count) && (farm->alive_count > 0) && !render_cancelled())
+	{
+		// Hand out leases taken back from other workers
+		for (u32 i = 0; i < farm->worker_count; i++)
+		{
+			if (farm->workers[i].alive && farm->workers[i].waiting && (farm->requeued_count > 0))
+				farm_assign(farm, i);
+		}
+		// Wait for messages from the workers
+		u32 fd_count = 0;
+		for (u32 i = 0; i < farm->worker_count; i++)
+		{
+			if (!farm->workers[i].alive)
+				continue;
+			fds[fd_count].fd = farm->workers[i].fd;
+			fds[fd_count].events = POLLIN;
+			fds[fd_count].revents = 0;
+			fd_workers[fd_count++] = i;
+		}
+		const int ready = poll(fds, fd_count, FARM_POLL_INTERVAL);
+		if ((ready < 0) && (errno != EINTR))
+		{
+			printf("Failed to wait for the worker processes\n");
+			break;
+		}
+		for (u32 i = 0; (ready > 0) && (i < fd_count); i++)
+		{
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !farm_receive(farm, fd_workers[i]))
+				farm_lose(farm, fd_workers[i]);
+		}
+		// Take back leases that ran past their deadline, the worker keeps going in case it's only slow
+		const f64 now = time_now();
+		for (u32 i = 0; i < farm->worker_count; i++)
+		{
+			const farm_worker_t *worker = farm->workers + i;
+			if (!worker->alive || (worker->lease < 0))
+				continue;
+			const farm_lease_t *lease = farm->leases + worker->lease;
+			if (!lease->done && (lease->owner == (i32) i) && (now > lease->deadline))
+				farm_requeue(farm, (u32) worker->lease);
+		}
+	}
+	free(fd_workers);
+	free(fds);
+};
+// Tell the workers to exit, and wait for them
+// NOTE: Workers still on a lease somebody else finished are killed, they could be stuck
+static void farm_stop(farm_t *farm)
+{
+	for (u32 i = 0; i < farm->worker_count; i++)
+	{
+		farm_worker_t *worker = farm->workers + i;
+		if (!worker->alive)
+			continue;
+		farm_msg_t msg = {0};
+		msg.type = FARM_MSG_QUIT;
+		if ((worker->lease >= 0) || !farm_write(worker->fd, &msg, sizeof(msg)))
+			kill(worker->pid, SIGKILL);
+		close(worker->fd);
+		waitpid(worker->pid, NULL, 0);
+		worker->alive = false;
+	}
+};
+
+void farm_render(
+	const world_t *world,
+	const camera_t *camera,
+	i32 samples, i32 bounces,
+	const tile_params_t *tile_params,
+	const farm_params_t *params,
+	framebuffer_t *framebuffer, farm_stats_t *stats)
+{
+	farm_t farm = {0};
+	farm.start = time_now();
+	farm.framebuffer = framebuffer;
+	farm.stats = stats;
+	memset(stats, 0, sizeof(farm_stats_t));
+	farm.lease_timeout = (params->lease_timeout > 0.0) ? params->lease_timeout : FARM_DEFAULT_LEASE_TIMEOUT;
+	farm.job.world = world;
+	farm.job.camera = camera;
+	farm.job.width = framebuffer->width;
+	farm.job.height = framebuffer->height;
+	farm.job.bounces = bounces;
+
+	// Tiles are sized for every CPU, the workers together use them all
+	tile_layout(tile_params, framebuffer->width, framebuffer->height, samples, job_default_thread_count(), &farm.layout);
+	const tile_layout_t *layout = &farm.layout;
+	farm.tiles = malloc(layout->tile_count*sizeof(farm_tile_t));
+	assert(farm.tiles != NULL);
+	size_t largest = 0;
+	for (u32 i = 0; i < layout->tile_count; i++)
+	{
+		farm_tile_t *tile = farm.tiles + i;
+		tile->area = tile_area(layout, i);
+		tile->stride = farm_stride(tile->area);
+		tile->range_size = (size_t) tile->stride*(size_t) tile->area.h;
+		tile->pending = layout->range_count;
+		tile->sums = NULL;
+		largest = max(largest, farm_sums_size(tile->area));
+	}
+	farm.discard = malloc(largest);
+	assert(farm.discard != NULL);
+	// Leases go out tile by tile, in the tile order
+	farm.lease_count = layout->tile_count*layout->range_count;
+	farm.leases = malloc(farm.lease_count*sizeof(farm_lease_t));
+	farm.requeued = malloc(farm.lease_count*sizeof(u32));
+	u32 *order = malloc(layout->tile_count*sizeof(u32));
+	assert((farm.leases != NULL) && (farm.requeued != NULL) && (order != NULL));
+	tile_sort(layout->tiles_x, layout->tiles_y, tile_params->order, order);
+	for (u32 i = 0; i < farm.lease_count; i++)
+	{
+		farm_lease_t *lease = farm.leases + i;
+		lease->tile = order[i / layout->range_count];
+		lease->range = i % layout->range_count;
+		lease->owner = -1;
+		lease->deadline = 0.0;
+		lease->done = false;
+	}
+	free(order);
+
+	farm.worker_count = clamp(params->process_count, 1, MAX_WORKERS);
+	farm.workers = malloc(farm.worker_count*sizeof(farm_worker_t));
+	assert(farm.workers != NULL);
+	memset(farm.workers, 0, farm.worker_count*sizeof(farm_worker_t));
+	farm_start(&farm, params);
+	stats->process_count = farm.alive_count;
+	stats->lease_count = farm.lease_count;
+	farm_coordinate(&farm);
+	farm_stop(&farm);
+
+	// Render whatever the workers didn't get to here
+	if ((farm.done_count < farm.lease_count) && !render_cancelled())
+	{
+		printf("Lost every worker process, rendering the remaining %u leases here\n", farm.lease_count - farm.done_count);
+		for (u32 i = 0; i < farm.lease_count; i++)
+		{
+			if (farm.leases[i].done)
+				continue;
+			const farm_msg_t msg = farm_lease_msg(&farm, i);
+			if (!farm_render_lease(&farm.job, &msg, farm_lease_sums(&farm, farm.leases + i)))
+				break;
+			farm_finish(&farm, i);
+			stats->local_leases++;
+		}
+	}
+	// Resolve the tiles a cancelled frame didn't finish, every pixel is the average of the ranges it got
+	stats->samples_taken = (u64) framebuffer->width*(u64) framebuffer->height*(u64) layout->samples;
+	if (farm.done_count < farm.lease_count)
+	{
+		stats->cancelled = true;
+		stats->samples_taken = 0;
+		u32 *rows_done = NULL;
+		for (u32 i = 0; i < layout->tile_count; i++)
+		{
+			farm_tile_t *tile = farm.tiles + i;
+			if (tile->pending == 0)
+			{
+				stats->samples_taken += (u64) (tile->area.w*tile->area.h)*(u64) layout->samples;
+				continue;
+			}
+			// Finished leases have every row of their range, the rest have none
+			const size_t row_count = (size_t) tile->area.h*layout->range_count;
+			rows_done = realloc(rows_done, row_count*sizeof(u32));
+			assert(rows_done != NULL);
+			memset(rows_done, 0, row_count*sizeof(u32));
+			for (u32 j = 0; j < farm.lease_count; j++)
+			{
+				const farm_lease_t *lease = farm.leases + j;
+				if ((lease->tile != i) || !lease->done)
+					continue;
+				for (i32 y = 0; y < tile->area.h; y++)
+					rows_done[lease->range*(u32) tile->area.h + (u32) y] = (u32) tile->area.w;
+			}
+			stats->samples_taken += tile_resolve_partial(framebuffer, tile->area, tile->sums, tile->stride, tile->range_size,
+				layout->range_count, layout->range_samples, layout->samples, rows_done);
+		}
+		free(rows_done);
+	}
+	stats->render_time = (time_now() - farm.start);
+	for (u32 i = 0; i < layout->tile_count; i++)
+		free(farm.tiles[i].sums);
+	free(farm.workers);
+	free(farm.leases);
+	free(farm.requeued);
+	free(farm.discard);
+	free(farm.tiles);
+};
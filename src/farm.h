@@ -0,0 +1,61 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "framebuffer.h"
+#include "world.h"
+#include "tile.h"
+
+// Default time a worker process has to return a lease before it's handed to another, in seconds
+#define FARM_DEFAULT_LEASE_TIMEOUT	60.0
+
+// Worker process parameters
+typedef struct
+{
+	// Number of worker processes to fork
+	u32 process_count;
+	// Number of threads in every worker process, 0 splits the CPUs between the processes
+	u32 threads;
+	// Time a worker has to return a lease before it's handed to another, in seconds, 0 uses the default
+	f64 lease_timeout;
+} farm_params_t;
+
+// Worker process statistics for a frame
+typedef struct
+{
+	// Number of worker processes started
+	u32 process_count;
+	// Number of leases the frame was split into, one for every sample range of every tile
+	u32 lease_count;
+	// Number of leases handed to another worker, after theirs died or ran past the timeout
+	u32 reassigned;
+	// Number of worker processes lost while rendering
+	u32 lost_workers;
+	// Number of leases rendered by the coordinator itself, once every worker was lost
+	u32 local_leases;
+	// Time the first tile was finished
+	f64 first_tile_time;
+	// Time the frame took, in seconds
+	f64 render_time;
+	// Set if rendering was cancelled, and the samples the frame got
+	bool cancelled;
+	u64 samples_taken;
+} farm_stats_t;
+
+// Render the frame in worker processes forked from this one, with every sample range of every tile leased to one of them at a time
+// NOTE: Workers get the scene from the fork, so it's loaded once and shared copy on write. Leases are handed out over
+// Unix domain sockets, and handed to another worker when theirs dies or runs past the timeout, the first result back wins.
+// Ranges are merged in order like tile_render does, so the image is the same as rendering in a single process.
+// With pinned threads on several NUMA nodes, the workers are spread over the nodes
+void farm_render(
+	const world_t *world,
+	const camera_t *camera,
+	i32 samples, i32 bounces,
+	const tile_params_t *tile_params,
+	const farm_params_t *params,
+	framebuffer_t *framebuffer, farm_stats_t *stats);
+
+#endif
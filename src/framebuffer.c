@@ -1,12 +1,23 @@
 #include "framebuffer.h"
+#include "job.h"
 
+// Clear the rows of the framebuffer a worker will write
+static void framebuffer_clear_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	framebuffer_t *framebuffer = (framebuffer_t*) data;
+	u32 first, count;
+	job_node_range(framebuffer->height, worker_index, worker_count, &first, &count);
+	memset(framebuffer->pixels + first*framebuffer->width, 0, count*framebuffer->width*sizeof(v3));
+};
 void framebuffer_alloc(framebuffer_t *framebuffer, i32 w, i32 h)
 {
 	framebuffer->width = w;
 	framebuffer->height = h;
 	framebuffer->pixels = malloc(w*h*sizeof(v3));
 	assert(framebuffer->pixels != NULL);
-	memset(framebuffer->pixels, 0, w*h*sizeof(v3));
+	// Clear the framebuffer on every thread, so each band of rows is first touched on the NUMA node of the workers that write it
+	// NOTE: Tiles are handed to workers on the node their rows are on, see tile_render
+	jobs_run(job_thread_count(), framebuffer_clear_proc, framebuffer);
 };
 void framebuffer_free(framebuffer_t *framebuffer)
 {
@@ -22,25 +33,51 @@ static inline u32 srgb(v3 color)
 	const u8 b = (u32)(f32_pow(f32_saturate(color.b), exp) * 255.f + 0.5f) & 0xFF;
 	return (a << 24) | (b << 16) | (g << 8) | (r << 0);
 };
-void framebuffer_resolve(image_t *image, const framebuffer_t *framebuffer)
+// Rows resolved by a single worker at a time
+#define RESOLVE_ROWS	16
+
+// Shared state of the workers resolving a framebuffer
+typedef struct
 {
-	// Get a pointer to the begining of the render area
-	u8 *row = image->pixels;
-	// For each row of the area to render
-	for (u32 j = 0; j < image->height; j++)
+	image_t *image;
+	const framebuffer_t *framebuffer;
+	// Next block of rows to be resolved
+	volatile u32 next_row;
+} resolve_job_t;
+
+static void resolve_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	resolve_job_t *job = (resolve_job_t*) data;
+	image_t *image = job->image;
+	const framebuffer_t *framebuffer = job->framebuffer;
+	// Take blocks of rows until there are none left
+	for (;;)
 	{
-		// Iterate over each pixel
-		u32 *pixel = (u32*) row;
-		for (u32 i = 0; i < image->width; i++)
+		const u32 first = atomic_add(&job->next_row, RESOLVE_ROWS);
+		if (first >= image->height)
+			break;
+		const u32 last = min(first + RESOLVE_ROWS, image->height);
+		// For each row of the block
+		for (u32 j = first; j < last; j++)
 		{
-			// Get the color
-			const v3 color = framebuffer->pixels[j*framebuffer->width + i];
-			// Store the pixel in srgb space
-			*pixel++ = srgb(color);
+			// Iterate over each pixel
+			u32 *pixel = (u32*) (image->pixels + j*image->stride);
+			for (u32 i = 0; i < image->width; i++)
+			{
+				// Get the color
+				const v3 color = framebuffer->pixels[j*framebuffer->width + i];
+				// Store the pixel in srgb space
+				*pixel++ = srgb(color);
+			}
 		}
-		// Iterate to the next row
-		row += image->stride;
-	};
+	}
+};
+void framebuffer_resolve(image_t *image, const framebuffer_t *framebuffer)
+{
+	// Resolve blocks of rows on every thread
+	resolve_job_t job = { image, framebuffer, 0 };
+	const u32 blocks = (image->height + RESOLVE_ROWS - 1) / RESOLVE_ROWS;
+	jobs_run(clamp(blocks, 1, job_thread_count()), resolve_proc, &job);
 };
 
 #if 0
@@ -0,0 +1,240 @@
+#include "gen.h"
+
+// Default spread of clustered fields, relative to the bounds size
+#define GEN_DEFAULT_CLUSTER_SIZE	0.05f
+// Number of random centers tried for each sphere of a Poisson field before giving up
+#define GEN_POISSON_ATTEMPTS		16
+// Empty cell marker for the Poisson field lookup grid
+#define GEN_EMPTY					0xFFFFFFFF
+
+// Seeded random number generator (splitmix64), so generated fields don't depend on anything but their seed
+typedef struct
+{
+	u64 state;
+} gen_rng_t;
+
+static inline u64 gen_rand_u64(gen_rng_t *rng)
+{
+	u64 z = (rng->state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+};
+// rand range [0.f, 1.f)
+static inline f32 gen_rand_f32(gen_rng_t *rng)
+{
+	return (f32) (gen_rand_u64(rng) >> 40) * (1.f / 16777216.f);
+};
+static inline u32 gen_rand_u32(gen_rng_t *rng, u32 count)
+{
+	return (u32) (((gen_rand_u64(rng) >> 32) * (u64) count) >> 32);
+};
+// Random point in a box
+static inline v3 gen_rand_point(gen_rng_t *rng, aabb_t bounds)
+{
+	v3 p;
+	for (u32 i = 0; i < 3; i++)
+		p.v[i] = bounds.min.v[i] + (bounds.max.v[i] - bounds.min.v[i])*gen_rand_f32(rng);
+	return p;
+};
+
+// Get the edge length of cubic cells that split a box into about count cells
+// NOTE: Flat axes are left out, so a flat box is split as a square or a line
+static f32 gen_cell_size(v3 extent, u32 count)
+{
+	f32 volume = 1.f;
+	u32 dimensions = 0;
+	for (u32 i = 0; i < 3; i++)
+	{
+		if (extent.v[i] > 0.f)
+		{
+			volume *= extent.v[i];
+			dimensions++;
+		}
+	}
+	if (dimensions == 0)
+		return 1.f;
+	return f32_pow(volume / (f32) max(count, 1), 1.f / (f32) dimensions);
+};
+
+// Fill in a sphere at a center, with a random radius and material
+static void gen_sphere(gen_rng_t *rng, const gen_params_t *params, f32 total_weight, v3 center, sphere_t *sphere)
+{
+	memset(sphere, 0, sizeof(sphere_t));
+	sphere->center = center;
+	sphere->radius = params->radius_min + (params->radius_max - params->radius_min)*gen_rand_f32(rng);
+	sphere->aabb = sphere_aabb(center, sphere->radius);
+	if (params->material_count == 0)
+	{
+		sphere->material.type = MATERIAL_LAMBERTIAN;
+		sphere->material.albedo = V3(
+			0.1f + 0.8f*gen_rand_f32(rng),
+			0.1f + 0.8f*gen_rand_f32(rng),
+			0.1f + 0.8f*gen_rand_f32(rng));
+		return;
+	}
+	// Pick a material, with a chance proportional to it's weight
+	f32 pick = total_weight*gen_rand_f32(rng);
+	u32 material = 0;
+	while ((material < (params->material_count - 1)) && (pick >= params->weights[material]))
+		pick -= params->weights[material++];
+	sphere->material = params->materials[material];
+};
+
+// Place the centers on a lattice with about one point per sphere, in x, y, z order
+static u32 gen_grid(gen_rng_t *rng, const gen_params_t *params, f32 total_weight, sphere_t *spheres)
+{
+	const v3 extent = v3_sub(params->bounds.max, params->bounds.min);
+	const f32 cell_size = gen_cell_size(extent, params->count);
+	u32 res[3];
+	for (u32 i = 0; i < 3; i++)
+		res[i] = (extent.v[i] > 0.f) ? (u32) max(f32_round(extent.v[i] / cell_size), 1.f) : 1;
+	// Rounding can leave too few points, add a row to the axis with the biggest spacing until they fit
+	while (((u64) res[0]*res[1]*res[2]) < params->count)
+	{
+		u32 axis = 0;
+		for (u32 i = 1; i < 3; i++)
+		{
+			if ((extent.v[i] / (f32) res[i]) > (extent.v[axis] / (f32) res[axis]))
+				axis = i;
+		}
+		res[axis]++;
+	}
+	for (u32 i = 0; i < params->count; i++)
+	{
+		const u32 cell[3] = { i % res[0], (i / res[0]) % res[1], i / (res[0]*res[1]) };
+		v3 center;
+		for (u32 j = 0; j < 3; j++)
+			center.v[j] = params->bounds.min.v[j] + extent.v[j]*(((f32) cell[j] + 0.5f) / (f32) res[j]);
+		gen_sphere(rng, params, total_weight, center, spheres + i);
+	}
+	return params->count;
+};
+// Throw random spheres at the bounds, keeping the ones that don't overlap any sphere already placed
+// NOTE: Placed spheres are found through a grid with cells at least as big as the biggest sphere, so only the 27 cells around a new sphere are checked
+static u32 gen_poisson(gen_rng_t *rng, const gen_params_t *params, f32 total_weight, sphere_t *spheres)
+{
+	const v3 extent = v3_sub(params->bounds.max, params->bounds.min);
+	// Keep at most two cells per sphere, spheres per cell are bounded by how many fit without overlapping
+	const f32 cell_size = max(2.f*params->radius_max, gen_cell_size(extent, 2*params->count));
+	u32 res[3];
+	v3 inv_cell_size;
+	for (u32 i = 0; i < 3; i++)
+	{
+		res[i] = (u32) max(f32_floor(extent.v[i] / cell_size), 1.f);
+		inv_cell_size.v[i] = (extent.v[i] > 0.f) ? ((f32) res[i] / extent.v[i]) : 0.f;
+	}
+	// Each cell holds a linked list of the spheres in it
+	const u64 cell_count = (u64) res[0]*res[1]*res[2];
+	u32 *heads = malloc(cell_count*sizeof(u32));
+	u32 *next = malloc(params->count*sizeof(u32));
+	assert((heads != NULL) && ((next != NULL) || (params->count == 0)));
+	memset(heads, 0xFF, cell_count*sizeof(u32));
+
+	u32 count = 0;
+	const u64 max_attempts = (u64) params->count*GEN_POISSON_ATTEMPTS;
+	for (u64 attempt = 0; (attempt < max_attempts) && (count < params->count); attempt++)
+	{
+		sphere_t sphere;
+		gen_sphere(rng, params, total_weight, gen_rand_point(rng, params->bounds), &sphere);
+		u32 cell[3];
+		for (u32 i = 0; i < 3; i++)
+		{
+			const i32 c = (i32) ((sphere.center.v[i] - params->bounds.min.v[i])*inv_cell_size.v[i]);
+			cell[i] = (u32) clamp(c, 0, (i32) res[i] - 1);
+		}
+		// Check the spheres in the neighbouring cells
+		bool overlap = false;
+		for (u32 z = (cell[2] > 0) ? (cell[2] - 1) : 0; (z <= min(cell[2] + 1, res[2] - 1)) && !overlap; z++)
+			for (u32 y = (cell[1] > 0) ? (cell[1] - 1) : 0; (y <= min(cell[1] + 1, res[1] - 1)) && !overlap; y++)
+				for (u32 x = (cell[0] > 0) ? (cell[0] - 1) : 0; (x <= min(cell[0] + 1, res[0] - 1)) && !overlap; x++)
+				{
+					for (u32 i = heads[((u64) z*res[1] + y)*res[0] + x]; (i != GEN_EMPTY) && !overlap; i = next[i])
+					{
+						const f32 distance = sphere.radius + spheres[i].radius;
+						overlap = (v3_len2(v3_sub(sphere.center, spheres[i].center)) < (distance*distance));
+					}
+				}
+		if (overlap)
+			continue;
+		// Keep the sphere, and add it to it's cell
+		const u64 slot = ((u64) cell[2]*res[1] + cell[1])*res[0] + cell[0];
+		spheres[count] = sphere;
+		next[count] = heads[slot];
+		heads[slot] = count++;
+	}
+	free(next);
+	free(heads);
+	return count;
+};
+// Spread the centers around random cluster centers, roughly normally distributed
+static u32 gen_clustered(gen_rng_t *rng, const gen_params_t *params, f32 total_weight, sphere_t *spheres)
+{
+	const v3 extent = v3_sub(params->bounds.max, params->bounds.min);
+	const f32 cluster_size = (params->cluster_size > 0.f) ? params->cluster_size : GEN_DEFAULT_CLUSTER_SIZE;
+	const f32 spread = cluster_size*max(extent.x, max(extent.y, extent.z));
+
+	const u32 cluster_count = max(params->cluster_count, 1);
+	v3 *clusters = malloc(cluster_count*sizeof(v3));
+	assert(clusters != NULL);
+	for (u32 i = 0; i < cluster_count; i++)
+		clusters[i] = gen_rand_point(rng, params->bounds);
+	for (u32 i = 0; i < params->count; i++)
+	{
+		const v3 cluster = clusters[gen_rand_u32(rng, cluster_count)];
+		v3 center;
+		for (u32 j = 0; j < 3; j++)
+		{
+			// NOTE: The sum of three uniform numbers is close enough to a normal distribution, with a deviation of 0.5
+			const f32 offset = (gen_rand_f32(rng) + gen_rand_f32(rng) + gen_rand_f32(rng) - 1.5f)*2.f*spread;
+			center.v[j] = clamp(cluster.v[j] + offset, params->bounds.min.v[j], params->bounds.max.v[j]);
+		}
+		gen_sphere(rng, params, total_weight, center, spheres + i);
+	}
+	free(clusters);
+	return params->count;
+};
+static u32 gen_random(gen_rng_t *rng, const gen_params_t *params, f32 total_weight, sphere_t *spheres)
+{
+	for (u32 i = 0; i < params->count; i++)
+		gen_sphere(rng, params, total_weight, gen_rand_point(rng, params->bounds), spheres + i);
+	return params->count;
+};
+
+void gen_params_init(gen_params_t *params)
+{
+	memset(params, 0, sizeof(gen_params_t));
+	params->type = GEN_RANDOM;
+	params->bounds.min = V3(-1.f, -1.f, -1.f);
+	params->bounds.max = V3( 1.f,  1.f,  1.f);
+	params->radius_min = 0.01f;
+	params->radius_max = 0.01f;
+	params->cluster_count = 16;
+	params->cluster_size = GEN_DEFAULT_CLUSTER_SIZE;
+	params->seed = 1;
+};
+u32 gen_spheres(world_t *world, const gen_params_t *params)
+{
+	assert(params->radius_min <= params->radius_max);
+	assert(params->material_count <= MAX_GEN_MATERIALS);
+
+	gen_rng_t rng = { params->seed };
+	f32 total_weight = 0.f;
+	for (u32 i = 0; i < params->material_count; i++)
+		total_weight += params->weights[i];
+
+	// Reserve room for every sphere, and write them straight into the world
+	const u32 first = world->sphere_count;
+	sphere_t *spheres = world_add_spheres(world, params->count);
+	u32 count = 0;
+	switch (params->type)
+	{
+		case GEN_RANDOM:    count = gen_random(&rng, params, total_weight, spheres); break;
+		case GEN_GRID:      count = gen_grid(&rng, params, total_weight, spheres); break;
+		case GEN_POISSON:   count = gen_poisson(&rng, params, total_weight, spheres); break;
+		case GEN_CLUSTERED: count = gen_clustered(&rng, params, total_weight, spheres); break;
+	}
+	// Give back the room for spheres that didn't fit
+	world->sphere_count = first + count;
+	return count;
+};
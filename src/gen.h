@@ -0,0 +1,54 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "world.h"
+
+// Maximum number of materials a generator can pick from
+#define MAX_GEN_MATERIALS	8
+
+// Sphere field layout
+typedef enum
+{
+	// Uniformly random centers
+	GEN_RANDOM,
+	// Centers on a regular lattice over the bounds
+	GEN_GRID,
+	// Random centers, with no two spheres overlapping
+	GEN_POISSON,
+	// Centers spread out around a number of random cluster centers
+	GEN_CLUSTERED,
+} gen_type_t;
+
+// Sphere field generator parameters
+typedef struct
+{
+	gen_type_t type;
+	// Number of spheres to generate
+	u32 count;
+	// Box the sphere centers are placed in
+	aabb_t bounds;
+	// Range the sphere radii are picked from
+	f32 radius_min, radius_max;
+	// Clustered fields: number of clusters, and their spread relative to the bounds size
+	u32 cluster_count;
+	f32 cluster_size;
+	// Materials, and the relative weights they're picked with
+	// NOTE: Spheres get random lambertian materials if there are none
+	u32 material_count;
+	material_t materials[MAX_GEN_MATERIALS];
+	f32 weights[MAX_GEN_MATERIALS];
+	// Random seed, the same parameters and seed always generate the same field
+	u64 seed;
+} gen_params_t;
+
+// Set the default generator parameters
+void gen_params_init(gen_params_t *params);
+// Generate a sphere field straight into the sphere array of a world, returns the number of spheres added
+// NOTE: Poisson fields stop early once there's no room left for more spheres
+u32 gen_spheres(world_t *world, const gen_params_t *params);
+
+#endif
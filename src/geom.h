@@ -37,6 +37,10 @@ typedef struct
 {
 	v3 origin;
 	v3 direction;
+	// Ray cone, the footprint width at the origin and how much it grows per unit of t
+	// NOTE: Only used for level of detail, a spread of 0 is an infinitely thin ray
+	f32 width;
+	f32 spread;
 } ray_t;
 
 typedef struct
@@ -170,6 +174,30 @@ inline m44 m44_rotationZ(f32 theta)
 		0.f, 0.f, 0.f, 1.f,
 	}};
 };
+inline m44 m44_rotationX(f32 theta)
+{
+	const f32 c = f32_cos(theta);
+	const f32 s = f32_sin(theta);
+	return (m44)
+	{{
+		1.f, 0.f, 0.f, 0.f,
+		0.f, c,  -s,   0.f,
+		0.f, s,   c,   0.f,
+		0.f, 0.f, 0.f, 1.f,
+	}};
+};
+inline m44 m44_rotationY(f32 theta)
+{
+	const f32 c = f32_cos(theta);
+	const f32 s = f32_sin(theta);
+	return (m44)
+	{{
+		c,   0.f, s,   0.f,
+		0.f, 1.f, 0.f, 0.f,
+		-s,  0.f, c,   0.f,
+		0.f, 0.f, 0.f, 1.f,
+	}};
+};
 inline m44 m44_translation(f32 x, f32 y, f32 z)
 {
 	return (m44)
@@ -250,6 +278,57 @@ inline m44 m44_mul(m44 a, m44 b)
 	};
 	return out;
 };
+// Invert an affine transformation (rotation, scale and translation only)
+inline m44 m44_inverse_affine(m44 m)
+{
+	// Cofactors of the upper 3x3
+	const f32 c00 = m.y1*m.z2 - m.z1*m.y2;
+	const f32 c01 = m.z1*m.x2 - m.x1*m.z2;
+	const f32 c02 = m.x1*m.y2 - m.y1*m.x2;
+	const f32 c10 = m.z0*m.y2 - m.y0*m.z2;
+	const f32 c11 = m.x0*m.z2 - m.z0*m.x2;
+	const f32 c12 = m.y0*m.x2 - m.x0*m.y2;
+	const f32 c20 = m.y0*m.z1 - m.z0*m.y1;
+	const f32 c21 = m.z0*m.x1 - m.x0*m.z1;
+	const f32 c22 = m.x0*m.y1 - m.y0*m.x1;
+	const f32 inv_det = 1.f / (m.x0*c00 + m.y0*c01 + m.z0*c02);
+
+	m44 r;
+	r.x0 = c00*inv_det; r.y0 = c10*inv_det; r.z0 = c20*inv_det; r.w0 = 0.f;
+	r.x1 = c01*inv_det; r.y1 = c11*inv_det; r.z1 = c21*inv_det; r.w1 = 0.f;
+	r.x2 = c02*inv_det; r.y2 = c12*inv_det; r.z2 = c22*inv_det; r.w2 = 0.f;
+	// The inverse translation is the negated translation, moved through the inverse 3x3
+	r.x3 = -(r.x0*m.x3 + r.x1*m.y3 + r.x2*m.z3);
+	r.y3 = -(r.y0*m.x3 + r.y1*m.y3 + r.y2*m.z3);
+	r.z3 = -(r.z0*m.x3 + r.z1*m.y3 + r.z2*m.z3);
+	r.w3 = 1.f;
+	return r;
+};
+// Transform a position, applying the translation
+inline v3 m44_transform_point(m44 m, v3 p)
+{
+	return V3(
+		m.x0*p.x + m.x1*p.y + m.x2*p.z + m.x3,
+		m.y0*p.x + m.y1*p.y + m.y2*p.z + m.y3,
+		m.z0*p.x + m.z1*p.y + m.z2*p.z + m.z3);
+};
+// Transform a direction, ignoring the translation
+inline v3 m44_transform_vector(m44 m, v3 v)
+{
+	return V3(
+		m.x0*v.x + m.x1*v.y + m.x2*v.z,
+		m.y0*v.x + m.y1*v.y + m.y2*v.z,
+		m.z0*v.x + m.z1*v.y + m.z2*v.z);
+};
+// Transform a normal by the inverse transpose, given the inverse of the transformation
+// NOTE: The result isn't normalized
+inline v3 m44_transform_normal(m44 inverse, v3 n)
+{
+	return V3(
+		inverse.x0*n.x + inverse.y0*n.y + inverse.z0*n.z,
+		inverse.x1*n.x + inverse.y1*n.y + inverse.z1*n.z,
+		inverse.x2*n.x + inverse.y2*n.y + inverse.z2*n.z);
+};
 static inline m44 m44_viewport(i32 x, i32 y, i32 w, i32 h)
 {
 	const i32 d = 255;
@@ -267,6 +346,8 @@ inline ray_t ray(v3 origin, v3 direction)
 	ray_t ray;
 	ray.origin = origin;
 	ray.direction = direction;
+	ray.width = 0.f;
+	ray.spread = 0.f;
 	return ray;
 };
 inline v3 ray_point(ray_t ray, f32 t)
@@ -290,6 +371,42 @@ inline bool aabb_hit(aabb_t aabb, ray_t ray, f32 t_min, f32 t_max)
 	}
 	return true;
 };
+inline aabb_t aabb_empty()
+{
+	aabb_t aabb;
+	aabb.min = V3( FLT_MAX,  FLT_MAX,  FLT_MAX);
+	aabb.max = V3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	return aabb;
+};
+inline v3 aabb_center(aabb_t aabb)
+{
+	return v3_scale(v3_add(aabb.min, aabb.max), 0.5f);
+};
+inline f32 aabb_area(aabb_t aabb)
+{
+	const v3 d = v3_sub(aabb.max, aabb.min);
+	return 2.f*(d.x*d.y + d.y*d.z + d.z*d.x);
+};
+inline aabb_t aabb_extend(aabb_t aabb, v3 p)
+{
+	aabb.min = V3(min(aabb.min.x, p.x), min(aabb.min.y, p.y), min(aabb.min.z, p.z));
+	aabb.max = V3(max(aabb.max.x, p.x), max(aabb.max.y, p.y), max(aabb.max.z, p.z));
+	return aabb;
+};
+// Get the bounding box of a transformed bounding box
+inline aabb_t aabb_transform(aabb_t aabb, m44 m)
+{
+	aabb_t result = aabb_empty();
+	for (u32 i = 0; i < 8; i++)
+	{
+		const v3 corner = V3(
+			(i & 1) ? aabb.max.x : aabb.min.x,
+			(i & 2) ? aabb.max.y : aabb.min.y,
+			(i & 4) ? aabb.max.z : aabb.min.z);
+		result = aabb_extend(result, m44_transform_point(m, corner));
+	}
+	return result;
+};
 inline aabb_t aabb_combine(aabb_t a, aabb_t b)
 {
 	aabb_t aabb;
@@ -0,0 +1,213 @@
+#include "grid.h"
+
+// Default cells per primitive for dense grids
+#define GRID_DEFAULT_DENSITY		2.f
+// Default cell size for hashed grids, in average primitive sizes
+#define GRID_DEFAULT_CELL_SCALE		1.f
+// Most cells a hash table can hold, keeping it at most half full of 32 bit slots
+#define GRID_MAX_HASH_CELLS			(1ull << 30)
+
+// Get the range of cells a bounding box overlaps
+static inline void grid_cell_range(const grid_t *grid, aabb_t aabb, u32 lo[3], u32 hi[3])
+{
+	for (u32 i = 0; i < 3; i++)
+	{
+		const f32 min = (aabb.min.v[i] - grid->bounds.min.v[i])*grid->inv_cell_size.v[i];
+		const f32 max = (aabb.max.v[i] - grid->bounds.min.v[i])*grid->inv_cell_size.v[i];
+		lo[i] = (u32) clamp((i32) min, 0, (i32) grid->res[i] - 1);
+		hi[i] = (u32) clamp((i32) max, 0, (i32) grid->res[i] - 1);
+	}
+};
+// Get the number of hash table slots for a number of cells, keeping the table at most half full
+static u32 grid_hash_slots(u64 cell_count)
+{
+	assert(cell_count <= GRID_MAX_HASH_CELLS);
+	u64 slot_count = 1;
+	while (slot_count < 2*cell_count)
+		slot_count <<= 1;
+	return (u32) slot_count;
+};
+// Allocate an empty hash table for a number of cells
+static void grid_hash_alloc(grid_t *grid, u64 cell_count)
+{
+	grid->slot_count = grid_hash_slots(cell_count);
+	grid->keys = malloc(grid->slot_count*sizeof(u64));
+	assert(grid->keys != NULL);
+	memset(grid->keys, 0xFF, grid->slot_count*sizeof(u64));
+};
+// Find the hash table slot of a cell, or the empty slot it would go in
+static u32 grid_probe(const grid_t *grid, u32 x, u32 y, u32 z)
+{
+	const u64 key = grid_key(x, y, z);
+	const u32 mask = (grid->slot_count - 1);
+	u32 slot = (u32) ((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+	while ((grid->keys[slot] != key) && (grid->keys[slot] != GRID_EMPTY_KEY))
+		slot = (slot + 1) & mask;
+	return slot;
+};
+// Move the cells of the hash table over to one sized for a number of cells
+static void grid_hash_resize(grid_t *grid, u64 cell_count)
+{
+	const u32 old_slot_count = grid->slot_count;
+	u64 *old_keys = grid->keys;
+	grid_hash_alloc(grid, cell_count);
+	for (u32 i = 0; i < old_slot_count; i++)
+	{
+		const u64 key = old_keys[i];
+		if (key != GRID_EMPTY_KEY)
+			grid->keys[grid_probe(grid, key & 0x1FFFFF, (key >> 21) & 0x1FFFFF, key >> 42)] = key;
+	}
+	free(old_keys);
+};
+static inline u32 grid_slot(const grid_t *grid, u32 x, u32 y, u32 z)
+{
+	if (grid->mode == GRID_DENSE)
+		return (z*grid->res[1] + y)*grid->res[0] + x;
+	// NOTE: Every cell is already in the table
+	return grid_probe(grid, x, y, z);
+};
+
+// Pick the cell size and resolution of the grid
+static void grid_layout(grid_t *grid, const aabb_t *bounds, u32 count, const grid_params_t *params)
+{
+	// Average primitive size, used to keep flat grids from collapsing
+	f32 average_size = 0.f;
+	for (u32 i = 0; i < count; i++)
+	{
+		const v3 extent = v3_sub(bounds[i].max, bounds[i].min);
+		average_size += max(extent.x, max(extent.y, extent.z));
+	}
+	average_size = max(average_size / (f32) count, 1e-6f);
+
+	const v3 extent = v3_sub(grid->bounds.max, grid->bounds.min);
+	f32 cell_size;
+	u32 max_res;
+	if (grid->mode == GRID_DENSE)
+	{
+		// Cubic cells, sized so that there are about density cells per primitive
+		const f32 density = (params->density > 0.f) ? params->density : GRID_DEFAULT_DENSITY;
+		const f32 volume =
+			max(extent.x, average_size) *
+			max(extent.y, average_size) *
+			max(extent.z, average_size);
+		cell_size = f32_pow(volume / (density*(f32) count), 1.f/3.f);
+		max_res = GRID_MAX_DENSE_RES;
+	} else {
+		// Cells sized after the primitives, no matter how the primitives are spread out
+		const f32 scale = (params->density > 0.f) ? params->density : GRID_DEFAULT_CELL_SCALE;
+		cell_size = average_size*scale;
+		max_res = GRID_MAX_HASHED_RES;
+	}
+	for (u32 i = 0; i < 3; i++)
+	{
+		grid->res[i] = (u32) clamp((i32) f32_ceil(extent.v[i] / cell_size), 1, (i32) max_res);
+		grid->cell_size.v[i] = max(extent.v[i] / (f32) grid->res[i], 1e-6f);
+		grid->inv_cell_size.v[i] = 1.f / grid->cell_size.v[i];
+	}
+};
+void grid_build(grid_t *grid, const aabb_t *bounds, u32 count, const grid_params_t *params)
+{
+	const f64 start = time_now();
+
+	memset(grid, 0, sizeof(grid_t));
+	grid->mode = params->mode;
+	assert(grid->mode != GRID_NONE);
+	if (count == 0)
+		return;
+
+	// Get the bounds of all primitives
+	grid->bounds = aabb_empty();
+	for (u32 i = 0; i < count; i++)
+		grid->bounds = aabb_combine(grid->bounds, bounds[i]);
+	grid_layout(grid, bounds, count, params);
+
+	// Count the cell references
+	u64 reference_count = 0;
+	for (u32 i = 0; i < count; i++)
+	{
+		u32 lo[3], hi[3];
+		grid_cell_range(grid, bounds[i], lo, hi);
+		reference_count += (u64) (hi[0] - lo[0] + 1)*(hi[1] - lo[1] + 1)*(hi[2] - lo[2] + 1);
+	}
+	assert(reference_count < 0xFFFFFFFFull);
+	// Allocate the slots
+	if (grid->mode == GRID_DENSE)
+	{
+		grid->slot_count = grid->res[0]*grid->res[1]*grid->res[2];
+	} else {
+		// Insert every non-empty cell, into a table sized for a cell per primitive that grows as it fills up
+		// NOTE: Cells are sized after the primitives, and neighbours share most of their cells, so there are
+		// usually far fewer cells than references
+		grid_hash_alloc(grid, count);
+		u64 cell_count = 0;
+		for (u32 i = 0; i < count; i++)
+		{
+			u32 lo[3], hi[3];
+			grid_cell_range(grid, bounds[i], lo, hi);
+			for (u32 z = lo[2]; z <= hi[2]; z++)
+				for (u32 y = lo[1]; y <= hi[1]; y++)
+					for (u32 x = lo[0]; x <= hi[0]; x++)
+					{
+						const u32 slot = grid_probe(grid, x, y, z);
+						if (grid->keys[slot] == GRID_EMPTY_KEY)
+						{
+							grid->keys[slot] = grid_key(x, y, z);
+							if ((2*(++cell_count)) > grid->slot_count)
+								grid_hash_resize(grid, 2*cell_count);
+						}
+					}
+		}
+		// Shrink the table if there were fewer cells than primitives
+		if (grid_hash_slots(cell_count) < grid->slot_count)
+			grid_hash_resize(grid, cell_count);
+	}
+	grid->starts = malloc((grid->slot_count + 1)*sizeof(u32));
+	grid->index_count = (u32) reference_count;
+	grid->indices = malloc(grid->index_count*sizeof(u32));
+	assert((grid->starts != NULL) && (grid->indices != NULL));
+	memset(grid->starts, 0, (grid->slot_count + 1)*sizeof(u32));
+
+	// Count the primitives in each slot
+	// NOTE: Counted one slot ahead, so the prefix sum turns the counts into starts
+	for (u32 i = 0; i < count; i++)
+	{
+		u32 lo[3], hi[3];
+		grid_cell_range(grid, bounds[i], lo, hi);
+		for (u32 z = lo[2]; z <= hi[2]; z++)
+			for (u32 y = lo[1]; y <= hi[1]; y++)
+				for (u32 x = lo[0]; x <= hi[0]; x++)
+					grid->starts[grid_slot(grid, x, y, z) + 1]++;
+	}
+	for (u32 i = 0; i < grid->slot_count; i++)
+		grid->starts[i + 1] += grid->starts[i];
+	// Fill the index list, moving each slot start forward as it's filled
+	for (u32 i = 0; i < count; i++)
+	{
+		u32 lo[3], hi[3];
+		grid_cell_range(grid, bounds[i], lo, hi);
+		for (u32 z = lo[2]; z <= hi[2]; z++)
+			for (u32 y = lo[1]; y <= hi[1]; y++)
+				for (u32 x = lo[0]; x <= hi[0]; x++)
+					grid->indices[grid->starts[grid_slot(grid, x, y, z)]++] = i;
+	}
+	// Every start is now the start of the next slot, shift them back
+	for (u32 i = grid->slot_count; i > 0; i--)
+		grid->starts[i] = grid->starts[i - 1];
+	grid->starts[0] = 0;
+
+	grid->build_time = (time_now() - start);
+};
+void grid_free(grid_t *grid)
+{
+	free(grid->keys);
+	free(grid->starts);
+	free(grid->indices);
+	memset(grid, 0, sizeof(grid_t));
+};
+size_t grid_size(const grid_t *grid)
+{
+	size_t size = (grid->slot_count + 1)*sizeof(u32) + grid->index_count*sizeof(u32);
+	if (grid->keys)
+		size += grid->slot_count*sizeof(u64);
+	return size;
+};
@@ -0,0 +1,94 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+// Maximum number of cells along each axis of a dense grid
+#define GRID_MAX_DENSE_RES	1024
+// Maximum number of cells along each axis of a hashed grid, cell coordinates are packed into 21 bits each
+#define GRID_MAX_HASHED_RES	(1 << 21)
+// Hash table key of an unused bucket
+#define GRID_EMPTY_KEY		0xFFFFFFFFFFFFFFFFull
+
+// Grid storage mode
+typedef enum
+{
+	// No grid, use the BVH
+	GRID_NONE,
+	// Every cell is stored, best for primitives spread evenly over the bounds
+	GRID_DENSE,
+	// Only non-empty cells are stored in a hash table, best for clustered primitives
+	GRID_HASHED,
+} grid_mode_t;
+
+// Grid construction parameters
+typedef struct
+{
+	grid_mode_t mode;
+	// Dense grids: average number of cells per primitive, 0 uses the default
+	// Hashed grids: cell size in average primitive sizes, 0 uses the default
+	f32 density;
+} grid_params_t;
+
+// Uniform grid data structure
+// NOTE: Cells reference ranges of the index list through a CSR offset array, a primitive is listed in every cell it overlaps
+typedef struct
+{
+	grid_mode_t mode;
+	// Bounds of all primitives, and the cell layout over them
+	aabb_t bounds;
+	u32 res[3];
+	v3 cell_size;
+	v3 inv_cell_size;
+	// Dense grids: one slot per cell, in x, y, z order
+	// Hashed grids: one slot per hash table bucket, a power of two
+	u32 slot_count;
+	// Cell coordinates stored in each bucket, hashed grids only
+	u64 *keys;
+	// First index of each slot, followed by the end of the last slot
+	u32 *starts;
+	// Primitive index list
+	u32 index_count;
+	u32 *indices;
+	// Time it took to build the grid, in seconds
+	f64 build_time;
+} grid_t;
+
+// Build a grid from a list of primitive bounding boxes
+void grid_build(grid_t *grid, const aabb_t *bounds, u32 count, const grid_params_t *params);
+void grid_free(grid_t *grid);
+// Get the memory used by a grid, in bytes
+size_t grid_size(const grid_t *grid);
+
+// Pack cell coordinates into a hash table key
+static inline u64 grid_key(u32 x, u32 y, u32 z)
+{
+	return (u64) x | ((u64) y << 21) | ((u64) z << 42);
+};
+// Get the range of the index list a cell covers, returns false if the cell is empty
+static inline bool grid_cell(const grid_t *grid, u32 x, u32 y, u32 z, u32 *first, u32 *count)
+{
+	u32 slot;
+	if (grid->mode == GRID_DENSE)
+	{
+		slot = (z*grid->res[1] + y)*grid->res[0] + x;
+	} else {
+		// Linear probing, until the key or an empty bucket is found
+		const u64 key = grid_key(x, y, z);
+		const u32 mask = (grid->slot_count - 1);
+		slot = (u32) ((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+		while (grid->keys[slot] != key)
+		{
+			if (grid->keys[slot] == GRID_EMPTY_KEY)
+				return false;
+			slot = (slot + 1) & mask;
+		}
+	}
+	*first = grid->starts[slot];
+	*count = grid->starts[slot + 1] - grid->starts[slot];
+	return (*count > 0);
+};
+
+#endif
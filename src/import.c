@@ -0,0 +1,350 @@
+// NOTE: madvise isn't part of POSIX, and posix_madvise ignores POSIX_MADV_DONTNEED on Linux
+#define _DEFAULT_SOURCE
+
+#include "import.h"
+#include "job.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Amount of the file converted at once, the pages of a chunk are released once it's done
+#define IMPORT_CHUNK_SIZE		megabytes(64)
+
+// Shared state of the workers converting a chunk
+typedef struct
+{
+	const import_params_t *params;
+	// First sphere the chunk is written to
+	sphere_t *spheres;
+	// Binary files: records of the chunk
+	const import_particle_t *particles;
+	u32 particle_count;
+	// CSV files: line aligned range of the chunk each worker handles, and the sphere it starts writing at
+	const char *starts[MAX_WORKERS + 1];
+	u32 offsets[MAX_WORKERS];
+	// Per worker results, CSV row or parsed sphere counts
+	u32 counts[MAX_WORKERS];
+	u32 bad_rows[MAX_WORKERS];
+	u32 unknown_materials[MAX_WORKERS];
+} import_job_t;
+
+// Fill in the sphere for a particle
+static inline void import_sphere(import_job_t *job, u32 worker_index, v3 center, f32 radius, u32 material, sphere_t *sphere)
+{
+	const import_params_t *params = job->params;
+	sphere->center = center;
+	sphere->radius = radius;
+	sphere->aabb = sphere_aabb(center, radius);
+	if (material < params->material_count)
+	{
+		sphere->material = params->materials[material];
+	} else {
+		memset(&sphere->material, 0, sizeof(material_t));
+		sphere->material.type = MATERIAL_LAMBERTIAN;
+		sphere->material.albedo = V3(0.5f, 0.5f, 0.5f);
+		job->unknown_materials[worker_index]++;
+	}
+};
+
+static void import_binary_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	import_job_t *job = (import_job_t*) data;
+	u32 first, count;
+	job_range(job->particle_count, worker_index, worker_count, &first, &count);
+	for (u32 i = first; i < (first + count); i++)
+	{
+		const import_particle_t *particle = job->particles + i;
+		import_sphere(job, worker_index, V3(particle->x, particle->y, particle->z), particle->radius, particle->material,
+			job->spheres + i);
+	}
+};
+static bool import_binary(world_t *world, const char *mapping, u64 size, const import_params_t *params, u32 worker_count,
+	import_job_t *job, import_stats_t *stats)
+{
+	if ((size % sizeof(import_particle_t)) != 0)
+	{
+		printf("Particle file size isn't a multiple of the %zu byte record size\n", sizeof(import_particle_t));
+		return false;
+	}
+	const u64 count = size / sizeof(import_particle_t);
+	assert(count <= (0xFFFFFFFF - world->sphere_count));
+	// The particle count is known up front, so the spheres are added all at once
+	sphere_t *spheres = world_add_spheres(world, (u32) count);
+	const u32 chunk_count = IMPORT_CHUNK_SIZE / sizeof(import_particle_t);
+	const u64 page_size = (u64) sysconf(_SC_PAGESIZE);
+	u64 released = 0;
+	for (u64 first = 0; first < count; first += chunk_count)
+	{
+		job->spheres = spheres + first;
+		job->particles = ((const import_particle_t*) mapping) + first;
+		job->particle_count = (u32) min(count - first, (u64) chunk_count);
+		jobs_run(worker_count, import_binary_proc, job);
+		// Release the pages of the finished chunk
+		const u64 end = (((first + job->particle_count)*sizeof(import_particle_t)) / page_size)*page_size;
+		if (end > released)
+		{
+			madvise((void*) (mapping + released), end - released, MADV_DONTNEED);
+			released = end;
+		}
+	}
+	stats->count = (u32) count;
+	return true;
+};
+
+// Get the start of the line after the one a character is on
+static inline const char* import_next_line(const char *p, const char *end)
+{
+	const char *newline = memchr(p, '\n', end - p);
+	return newline ? (newline + 1) : end;
+};
+// Skip spaces and tabs
+static inline const char* import_skip_blank(const char *p, const char *end)
+{
+	while ((p < end) && ((*p == ' ') || (*p == '\t')))
+		p++;
+	return p;
+};
+// Check if a line holds a particle, rather than being a header, comment or empty line
+static inline bool import_is_row(const char *p, const char *end)
+{
+	p = import_skip_blank(p, end);
+	return (p < end) && (((*p >= '0') && (*p <= '9')) || (*p == '-') || (*p == '+') || (*p == '.'));
+};
+// Parse a decimal number, returns the character after it, or NULL if there's no number
+// NOTE: Unlike strtof, never reads past the end, which matters since the mapped file isn't null terminated
+static const char* import_parse_f32(const char *p, const char *end, f32 *value)
+{
+	static const f64 powers[] =
+	{
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	p = import_skip_blank(p, end);
+	bool negative = false;
+	if ((p < end) && ((*p == '-') || (*p == '+')))
+		negative = (*p++ == '-');
+	// Gather up to 19 significant digits, and the power of ten they're scaled by
+	u64 mantissa = 0;
+	i32 exponent = 0;
+	u32 digits = 0, significant = 0;
+	for (; (p < end) && (*p >= '0') && (*p <= '9'); p++, digits++)
+	{
+		if (significant < 19)
+		{
+			mantissa = mantissa*10 + (u64) (*p - '0');
+			significant += (mantissa > 0);
+		} else {
+			exponent++;
+		}
+	}
+	if ((p < end) && (*p == '.'))
+	{
+		for (p++; (p < end) && (*p >= '0') && (*p <= '9'); p++, digits++)
+		{
+			if (significant < 19)
+			{
+				mantissa = mantissa*10 + (u64) (*p - '0');
+				significant += (mantissa > 0);
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0)
+		return NULL;
+	if ((p < end) && ((*p == 'e') || (*p == 'E')))
+	{
+		p++;
+		bool exponent_negative = false;
+		if ((p < end) && ((*p == '-') || (*p == '+')))
+			exponent_negative = (*p++ == '-');
+		i32 e = 0;
+		for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+			e = min(e*10 + (*p - '0'), 1000);
+		exponent += exponent_negative ? -e : e;
+	}
+	// NOTE: Powers of ten up to 1e22 are exact doubles, so common inputs round correctly
+	f64 v = (f64) mantissa;
+	if (exponent < 0)
+		v = (exponent >= -22) ? (v / powers[-exponent]) : (v * pow(10.0, exponent));
+	else
+		v = (exponent <= 22) ? (v * powers[exponent]) : (v * pow(10.0, exponent));
+	*value = (f32) (negative ? -v : v);
+	return p;
+};
+// Parse the fields of a row, returns false if it isn't 4 or 5 numbers separated by commas
+static bool import_parse_row(const char *p, const char *end, f32 fields[5])
+{
+	u32 count = 0;
+	while (true)
+	{
+		if (count == 5)
+			return false;
+		p = import_parse_f32(p, end, fields + count++);
+		if (!p)
+			return false;
+		p = import_skip_blank(p, end);
+		if ((p < end) && (*p == ','))
+		{
+			p++;
+			continue;
+		}
+		break;
+	}
+	// Nothing but the line ending can follow the last field
+	if ((p < end) && (*p == '\r'))
+		p++;
+	if ((p < end) && (*p != '\n'))
+		return false;
+	if (count == 4)
+		fields[4] = 0.f;
+	return (count >= 4);
+};
+static void import_count_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	import_job_t *job = (import_job_t*) data;
+	const char *end = job->starts[worker_index + 1];
+	u32 count = 0;
+	for (const char *p = job->starts[worker_index]; p < end; p = import_next_line(p, end))
+		count += import_is_row(p, end);
+	job->counts[worker_index] = count;
+};
+static void import_parse_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	import_job_t *job = (import_job_t*) data;
+	const char *end = job->starts[worker_index + 1];
+	sphere_t *spheres = job->spheres + job->offsets[worker_index];
+	u32 count = 0;
+	for (const char *p = job->starts[worker_index]; p < end; p = import_next_line(p, end))
+	{
+		if (!import_is_row(p, end))
+			continue;
+		f32 fields[5];
+		if (!import_parse_row(p, end, fields))
+		{
+			job->bad_rows[worker_index]++;
+			continue;
+		}
+		import_sphere(job, worker_index, V3(fields[0], fields[1], fields[2]), fields[3], (u32) max(fields[4], 0.f),
+			spheres + count++);
+	}
+	job->counts[worker_index] = count;
+};
+static bool import_csv(world_t *world, const char *mapping, u64 size, const import_params_t *params, u32 worker_count,
+	import_job_t *job, import_stats_t *stats)
+{
+	const char *file_end = mapping + size;
+	const u64 page_size = (u64) sysconf(_SC_PAGESIZE);
+	u64 released = 0;
+	for (const char *chunk = mapping; chunk < file_end; )
+	{
+		// Cut the chunk at a line end, and split it between the workers at line ends too
+		const char *chunk_end = ((u64) (file_end - chunk) > IMPORT_CHUNK_SIZE) ?
+			import_next_line(chunk + IMPORT_CHUNK_SIZE, file_end) : file_end;
+		const u64 chunk_size = (chunk_end - chunk);
+		job->starts[0] = chunk;
+		for (u32 i = 1; i < worker_count; i++)
+		{
+			const u64 offset = (chunk_size*i) / worker_count;
+			const char *start = (offset > 0) ? import_next_line(chunk + offset - 1, chunk_end) : chunk;
+			job->starts[i] = max(start, job->starts[i - 1]);
+		}
+		job->starts[worker_count] = chunk_end;
+
+		// Count the rows first, so every worker knows where its spheres go
+		jobs_run(worker_count, import_count_proc, job);
+		u32 row_count = 0;
+		for (u32 i = 0; i < worker_count; i++)
+		{
+			job->offsets[i] = row_count;
+			row_count += job->counts[i];
+		}
+		// The first chunk gives an estimate of the total row count, reserve room for it all at once
+		if (chunk == mapping)
+			world_reserve_spheres(world, world->sphere_count + (u32) min(((u64) row_count*size) / chunk_size + row_count / 16, 0xFFFFFFFFull - world->sphere_count));
+		const u32 first = world->sphere_count;
+		job->spheres = world_add_spheres(world, row_count);
+		jobs_run(worker_count, import_parse_proc, job);
+
+		// Close the gaps left by rows that couldn't be parsed
+		u32 count = 0;
+		for (u32 i = 0; i < worker_count; i++)
+		{
+			if (count != job->offsets[i])
+				memmove(job->spheres + count, job->spheres + job->offsets[i], job->counts[i]*sizeof(sphere_t));
+			count += job->counts[i];
+		}
+		world->sphere_count = first + count;
+		stats->count += count;
+
+		// Release the pages of the finished chunk
+		const u64 end = ((chunk_end - mapping) / page_size)*page_size;
+		if (end > released)
+		{
+			madvise((void*) (mapping + released), end - released, MADV_DONTNEED);
+			released = end;
+		}
+		chunk = chunk_end;
+	}
+	return true;
+};
+
+void import_params_init(import_params_t *params)
+{
+	memset(params, 0, sizeof(import_params_t));
+	params->format = IMPORT_AUTO;
+	params->worker_count = job_thread_count();
+};
+bool import_particles(world_t *world, const char *file_name, const import_params_t *params, import_stats_t *stats)
+{
+	const f64 start = time_now();
+	memset(stats, 0, sizeof(import_stats_t));
+
+	const int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	stats->bytes = (u64) st.st_size;
+	if (stats->bytes == 0)
+	{
+		close(fd);
+		return true;
+	}
+	// NOTE: Mapped read-only, the pages come straight from the page cache and are dropped again after each chunk
+	const char *mapping = mmap(NULL, stats->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+	madvise((void*) mapping, stats->bytes, MADV_SEQUENTIAL);
+
+	import_format_t format = params->format;
+	if (format == IMPORT_AUTO)
+	{
+		const char *extension = strrchr(file_name, '.');
+		format = (extension && (strcmp(extension, ".csv") == 0)) ? IMPORT_CSV : IMPORT_BINARY;
+	}
+	const u32 worker_count = clamp(params->worker_count, 1, MAX_WORKERS);
+	import_job_t *job = malloc(sizeof(import_job_t));
+	assert(job != NULL);
+	memset(job, 0, sizeof(import_job_t));
+	job->params = params;
+
+	const bool result = (format == IMPORT_CSV) ?
+		import_csv(world, mapping, stats->bytes, params, worker_count, job, stats) :
+		import_binary(world, mapping, stats->bytes, params, worker_count, job, stats);
+	for (u32 i = 0; i < worker_count; i++)
+	{
+		stats->bad_rows += job->bad_rows[i];
+		stats->unknown_materials += job->unknown_materials[i];
+	}
+	free(job);
+	munmap((void*) mapping, stats->bytes);
+	stats->time = (time_now() - start);
+	return result;
+};
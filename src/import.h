@@ -0,0 +1,66 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "world.h"
+
+// Maximum number of materials particle ids can refer to
+#define MAX_IMPORT_MATERIALS	16
+
+// Particle file format
+typedef enum
+{
+	// Pick the format from the file extension, ".csv" is CSV and anything else is binary
+	IMPORT_AUTO,
+	// Packed import_particle_t records
+	IMPORT_BINARY,
+	// Text rows of x, y, z, radius, material id, separated by commas
+	// NOTE: Lines that don't start with a number (headers, comments) are skipped, the material id can be left out
+	IMPORT_CSV,
+} import_format_t;
+
+// Binary particle record, little endian
+typedef struct
+{
+	f32 x, y, z;
+	f32 radius;
+	u32 material;
+} import_particle_t;
+
+// Particle import parameters
+typedef struct
+{
+	import_format_t format;
+	// Number of worker threads used to convert or parse the file
+	u32 worker_count;
+	// Materials the particle material ids index
+	// NOTE: Particles with ids past the end of the list get a grey lambertian material
+	u32 material_count;
+	material_t materials[MAX_IMPORT_MATERIALS];
+} import_params_t;
+
+// Particle import statistics
+typedef struct
+{
+	// Size of the file, in bytes
+	u64 bytes;
+	// Number of particles added to the world
+	u32 count;
+	// Number of CSV rows that couldn't be parsed
+	u32 bad_rows;
+	// Number of particles with a material id that has no material
+	u32 unknown_materials;
+	// Time the import took, in seconds
+	f64 time;
+} import_stats_t;
+
+// Set the default import parameters
+void import_params_init(import_params_t *params);
+// Stream a particle file straight into the sphere array of a world, returns false if the file couldn't be read
+// NOTE: The file is memory mapped and converted in chunks, it's never copied into memory as a whole
+bool import_particles(world_t *world, const char *file_name, const import_params_t *params, import_stats_t *stats);
+
+#endif
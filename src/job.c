@@ -0,0 +1,364 @@
+// NOTE: sched_getaffinity and CPU_COUNT are GNU extensions
+#define _GNU_SOURCE
+
+#include "job.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+// Largest NUMA node number looked for
+#define JOB_MAX_NODES	64
+
+// A job being run on the pool, lives on the stack of the thread that started it
+typedef struct
+{
+	job_proc_t *proc;
+	void *data;
+	u32 worker_count;
+	// Next worker index to be claimed, and a flag for every index that was
+	// NOTE: Threads claim the index matching their own first, so worker i runs on thread i whenever it's free
+	volatile u32 next_worker;
+	volatile u32 claimed[MAX_WORKERS];
+	// Number of threads working on the job, the starting thread included
+	// NOTE: Guarded by the pool lock, the job can't go away until this reaches 0
+	u32 active;
+	// Job number, so threads don't take the same job twice
+	u32 generation;
+} job_t;
+// Persistent worker threads, started once and reused by every job
+typedef struct
+{
+	pthread_mutex_t lock;
+	// Signalled when a job is started or the pool shuts down
+	pthread_cond_t wake;
+	// Signalled when the last thread leaves a job
+	pthread_cond_t done;
+	// Threads in the pool, the thread starting a job is used too and isn't counted here
+	u32 thread_count;
+	pthread_t threads[MAX_WORKERS];
+	// CPU and NUMA node of every thread, the thread starting jobs first
+	// NOTE: Only known when the threads are pinned, they're all on node 0 otherwise
+	bool pinned;
+	u32 node_count;
+	u32 thread_cpus[MAX_WORKERS];
+	u32 thread_nodes[MAX_WORKERS];
+	// Job currently being run, NULL when idle
+	job_t *job;
+	u32 generation;
+	bool quit;
+} job_pool_t;
+
+static job_pool_t job_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static bool job_pool_running = false;
+// Set on threads while they're working on a job, jobs started from inside one run serially
+static _Thread_local bool job_nested = false;
+// Index of the pool thread, 0 for the thread starting jobs and any other thread
+static _Thread_local u32 job_thread = 0;
+// Affinity mask of the process from before the thread starting jobs was pinned
+// NOTE: Children forked from a pinned thread would only get it's one CPU otherwise
+static cpu_set_t job_process_cpus;
+static bool job_process_pinned = false;
+
+// Claim and run worker indices of a job until none are left, starting with the one matching the thread
+static void job_work(job_t *job)
+{
+	if ((job_thread < job->worker_count) && atomic_cas(job->claimed + job_thread, 0, 1))
+		job->proc(job->data, job_thread, job->worker_count);
+	u32 index;
+	while ((index = atomic_inc(&job->next_worker)) < job->worker_count)
+	{
+		if (atomic_cas(job->claimed + index, 0, 1))
+			job->proc(job->data, index, job->worker_count);
+	}
+};
+static void* job_thread_proc(void *data)
+{
+	job_pool_t *pool = &job_pool;
+	job_thread = (u32) (uintptr_t) data;
+	job_nested = true;
+
+	u32 generation = 0;
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		// Sleep until there's a job this thread hasn't worked on yet
+		while (!pool->quit && ((pool->job == NULL) || (pool->job->generation == generation)))
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->quit)
+			break;
+		// Join the job
+		job_t *job = pool->job;
+		generation = job->generation;
+		job->active++;
+		pthread_mutex_unlock(&pool->lock);
+
+		job_work(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--job->active == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+};
+
+// Get the NUMA node of every CPU from sysfs, CPUs of unknown nodes are left on node 0
+// NOTE: Read directly so there's no dependency on libnuma, machines without NUMA have a single node
+static void job_read_nodes(u32 *cpu_nodes, u32 cpu_count)
+{
+	memset(cpu_nodes, 0, cpu_count*sizeof(u32));
+	for (u32 node = 0; node < JOB_MAX_NODES; node++)
+	{
+		char file_name[128];
+		snprintf(file_name, sizeof(file_name), "/sys/devices/system/node/node%u/cpulist", node);
+		FILE *file = fopen(file_name, "r");
+		if (!file)
+			continue;
+		// Comma separated list of CPUs and CPU ranges, like "0-3,8-11"
+		u32 first, last;
+		while (fscanf(file, "%u", &first) == 1)
+		{
+			last = first;
+			i32 c = fgetc(file);
+			if ((c == '-') && (fscanf(file, "%u", &last) == 1))
+				c = fgetc(file);
+			for (u32 cpu = first; (cpu <= last) && (cpu < cpu_count); cpu++)
+				cpu_nodes[cpu] = node;
+			if (c != ',')
+				break;
+		}
+		fclose(file);
+	}
+};
+// Pin a thread to a single CPU
+static bool job_pin(pthread_t thread, u32 cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return (pthread_setaffinity_np(thread, sizeof(set), &set) == 0);
+};
+
+// Get the CPUs the process can run on, the ones it had before pinning if the calling thread was pinned
+static bool job_affinity(cpu_set_t *set)
+{
+	if (job_process_pinned)
+	{
+		*set = job_process_cpus;
+		return true;
+	}
+	CPU_ZERO(set);
+	return (sched_getaffinity(0, sizeof(cpu_set_t), set) == 0);
+};
+// Give the calling thread back the CPUs it had before it was pinned
+static void job_unpin()
+{
+	if (job_process_pinned)
+		sched_setaffinity(0, sizeof(job_process_cpus), &job_process_cpus);
+	job_process_pinned = false;
+};
+
+u32 job_default_thread_count()
+{
+	// Use every CPU the process is allowed to run on
+	cpu_set_t set;
+	if (!job_affinity(&set))
+		return 1;
+	return clamp((u32) CPU_COUNT(&set), 1, MAX_WORKERS);
+};
+void job_pool_init(u32 thread_count, bool pin)
+{
+	job_pool_t *pool = &job_pool;
+	if (job_pool_running)
+		job_pool_shutdown();
+	if (thread_count == 0)
+		thread_count = job_default_thread_count();
+	thread_count = clamp(thread_count, 1, MAX_WORKERS);
+
+	// Give threads the CPUs of the affinity mask in turn, and look up their nodes
+	pool->pinned = false;
+	pool->node_count = 1;
+	memset(pool->thread_cpus, 0, sizeof(pool->thread_cpus));
+	memset(pool->thread_nodes, 0, sizeof(pool->thread_nodes));
+	cpu_set_t set;
+	const bool affinity = job_affinity(&set);
+	job_unpin();
+	if (pin && affinity && (CPU_COUNT(&set) > 0))
+	{
+		static u32 cpu_nodes[CPU_SETSIZE];
+		job_read_nodes(cpu_nodes, CPU_SETSIZE);
+		u32 cpu = 0;
+		for (u32 i = 0; i < thread_count; i++)
+		{
+			// Wrap around when there are more threads than CPUs
+			while (!CPU_ISSET(cpu, &set))
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			pool->thread_cpus[i] = cpu;
+			pool->thread_nodes[i] = cpu_nodes[cpu];
+			pool->node_count = max(pool->node_count, cpu_nodes[cpu] + 1);
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		}
+		// The thread starting jobs is worker 0, so it's pinned too
+		job_process_cpus = set;
+		pool->pinned = job_pin(pthread_self(), pool->thread_cpus[0]);
+		job_process_pinned = pool->pinned;
+		if (!pool->pinned)
+			printf("Failed to pin threads, running unpinned\n");
+	}
+
+	// Start every thread but one, the thread running a job works on it too
+	pool->quit = false;
+	pool->thread_count = 0;
+	for (u32 i = 1; i < thread_count; i++)
+	{
+		if (pthread_create(pool->threads + pool->thread_count, NULL, job_thread_proc, (void*) (uintptr_t) i) != 0)
+		{
+			printf("Failed to start worker thread %u\n", i);
+			break;
+		}
+		if (pool->pinned)
+			job_pin(pool->threads[pool->thread_count], pool->thread_cpus[i]);
+		pool->thread_count++;
+	}
+	if (!pool->pinned)
+	{
+		memset(pool->thread_nodes, 0, sizeof(pool->thread_nodes));
+		pool->node_count = 1;
+	}
+	// The first pool started is stopped at exit, so threads never outlive main
+	static bool registered = false;
+	if (!registered)
+	{
+		atexit(job_pool_shutdown);
+		registered = true;
+	}
+	job_pool_running = true;
+};
+void job_pool_shutdown()
+{
+	job_pool_t *pool = &job_pool;
+	if (!job_pool_running)
+		return;
+	assert(pool->job == NULL);
+	// Wake every thread to quit, and wait for them to exit
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (u32 i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+	pool->thread_count = 0;
+	job_pool_running = false;
+};
+void job_pool_forked()
+{
+	// The pool threads weren't copied, only their state
+	job_pool_t *pool = &job_pool;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->thread_count = 0;
+	pool->job = NULL;
+	pool->quit = false;
+	job_pool_running = false;
+	// A pinned parent would leave the child on a single CPU
+	job_unpin();
+};
+bool job_bind_node(u32 node)
+{
+	// Keep the CPUs of the affinity mask that are on the node
+	cpu_set_t set, node_set;
+	CPU_ZERO(&set);
+	CPU_ZERO(&node_set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return false;
+	static u32 cpu_nodes[CPU_SETSIZE];
+	job_read_nodes(cpu_nodes, CPU_SETSIZE);
+	for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &set) && (cpu_nodes[cpu] == node))
+			CPU_SET(cpu, &node_set);
+	}
+	if (CPU_COUNT(&node_set) == 0)
+		return false;
+	return (sched_setaffinity(0, sizeof(node_set), &node_set) == 0);
+};
+u32 job_thread_count()
+{
+	if (!job_pool_running)
+		job_pool_init(0, false);
+	return job_pool.thread_count + 1;
+};
+u32 job_node_count()
+{
+	if (!job_pool_running)
+		job_pool_init(0, false);
+	return job_pool.node_count;
+};
+u32 job_node(u32 thread_index)
+{
+	return job_pool.thread_nodes[min(thread_index, MAX_WORKERS - 1)];
+};
+u32 job_thread_index()
+{
+	return job_thread;
+};
+void job_node_range(u32 n, u32 worker_index, u32 worker_count, u32 *first, u32 *count)
+{
+	// Order the workers by node, so every node gets one contiguous band of items
+	const u32 node = job_node(worker_index);
+	u32 rank = 0;
+	for (u32 i = 0; i < worker_count; i++)
+	{
+		const u32 other = job_node(i);
+		rank += ((other < node) || ((other == node) && (i < worker_index))) ? 1 : 0;
+	}
+	job_range(n, rank, worker_count, first, count);
+};
+
+void jobs_run(u32 worker_count, job_proc_t *proc, void *data)
+{
+	assert((worker_count > 0) && (worker_count <= MAX_WORKERS));
+	job_pool_t *pool = &job_pool;
+	if (!job_pool_running)
+		job_pool_init(0, false);
+
+	job_t job = {0};
+	job.proc = proc;
+	job.data = data;
+	job.worker_count = worker_count;
+	job.active = 1;
+
+	// Jobs started from inside another one, or with no other threads to help, run serially on this thread
+	// NOTE: Lazy BVH subtrees are built from render workers, the pool is already busy then
+	pthread_mutex_lock(&pool->lock);
+	if (job_nested || (worker_count == 1) || (pool->thread_count == 0) || (pool->job != NULL))
+	{
+		pthread_mutex_unlock(&pool->lock);
+		const bool nested = job_nested;
+		job_nested = true;
+		job_work(&job);
+		job_nested = nested;
+		return;
+	}
+	// Publish the job and wake the pool
+	job.generation = ++pool->generation;
+	pool->job = &job;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	// The calling thread does its share of the work too
+	job_nested = true;
+	job_work(&job);
+	job_nested = false;
+
+	// Wait for the threads still working on the job to leave it
+	pthread_mutex_lock(&pool->lock);
+	job.active--;
+	while (job.active > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->job = NULL;
+	pthread_mutex_unlock(&pool->lock);
+};
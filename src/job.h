@@ -0,0 +1,55 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include "core.h"
+
+// Maximum number of workers a job can run on
+#define MAX_WORKERS	256
+
+// Job procedure, called once on every worker
+// NOTE: The worker index can be used to split the work into worker_count parts
+typedef void job_proc_t(void *data, u32 worker_index, u32 worker_count);
+
+// Start the persistent worker threads jobs run on, 0 uses one thread for every CPU the process can run on
+// NOTE: Started on the first job otherwise, and stopped at exit. Pinned threads get the CPUs of the affinity mask in order,
+// the calling thread the first one
+void job_pool_init(u32 thread_count, bool pin);
+// Wake every worker thread to exit, and wait for them
+void job_pool_shutdown();
+// Forget the pool in a child process after fork, without the threads it's parent started
+// NOTE: Only the thread calling fork is copied, the next job starts a new pool. The thread gets back every CPU
+// of the process if the parent had pinned it
+void job_pool_forked();
+// Restrict the calling thread, and the threads it starts from then on, to the CPUs of a NUMA node
+// NOTE: Returns false if none of the CPUs the process can run on are on the node
+bool job_bind_node(u32 node);
+// Get the number of threads jobs run on, the one starting a job included
+u32 job_thread_count();
+// Get the number of CPUs in the process affinity mask
+// NOTE: The mask from before pinning, pinning the calling thread doesn't make it one CPU
+u32 job_default_thread_count();
+// Get the number of NUMA nodes the threads are on, always 1 unless they're pinned
+u32 job_node_count();
+// Get the NUMA node of a thread, and the index of the calling thread (0 outside the pool)
+u32 job_node(u32 thread_index);
+u32 job_thread_index();
+// Get the [first, first+count) range of n items a worker is responsible for, with the items of every node's workers together
+// NOTE: Workers touching their own items first places them on their node, worker i is thread i unless that thread was busy
+void job_node_range(u32 n, u32 worker_index, u32 worker_count, u32 *first, u32 *count);
+
+// Run a job procedure on a number of workers and wait for all of them to finish
+// NOTE: Worker indices are handed out to the pool threads and the calling thread as they become free,
+// so every index runs once but any number of them can share a thread
+void jobs_run(u32 worker_count, job_proc_t *proc, void *data);
+
+// Get the [first, first+count) range of n items a worker is responsible for
+static inline void job_range(u32 n, u32 worker_index, u32 worker_count, u32 *first, u32 *count)
+{
+	const u32 chunk = (n + worker_count - 1) / worker_count;
+	const u32 begin = min(n, worker_index*chunk);
+	const u32 end = min(n, begin + chunk);
+	*first = begin;
+	*count = (end - begin);
+};
+
+#endif
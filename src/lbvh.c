@@ -0,0 +1,502 @@
+#include "bvh.h"
+#include "job.h"
+
+// Child references with this bit set point to a sorted primitive instead of a node
+#define LBVH_LEAF		0x80000000
+// Number of leaves in a treelet restructured by the optimization pass
+#define TREELET_SIZE	7
+// Primitive counts up to this use 30-bit morton codes, larger ones use 63-bit codes
+#define LBVH_SHORT_KEYS	(1 << 20)
+// Number of subtrees each worker gets during the parallel passes
+#define LBVH_TASKS_PER_WORKER	16
+
+// Intermediate radix tree node
+typedef struct
+{
+	// Bounding box
+	aabb_t aabb;
+	// Child references
+	u32 l, r;
+	// Number of primitives under this node
+	u32 count;
+	// SAH cost of this subtree, only used by the treelet optimization
+	f32 cost;
+} lbvh_node_t;
+
+// Morton code of a primitive center, paired with the primitive index
+typedef struct
+{
+	u64 key;
+	u32 index;
+} lbvh_ref_t;
+
+// Subtree task for the parallel passes
+typedef struct
+{
+	u32 node;
+	u32 position;
+} lbvh_task_t;
+
+// Shared state of an LBVH build
+typedef struct
+{
+	// Input primitives
+	const aabb_t *bounds;
+	u32 count;
+	bool optimize;
+	// Bounds of the primitive centers, reduced per worker
+	aabb_t center_bounds;
+	aabb_t worker_bounds[MAX_WORKERS];
+	// Morton code quantization
+	u32 bits;
+	v3 scale;
+	// Radix sort buffers, current digit shift and per worker digit histograms
+	lbvh_ref_t *refs;
+	lbvh_ref_t *temp;
+	u32 shift;
+	u32 histogram[MAX_WORKERS][256];
+	// Radix tree, the root is always node 0
+	lbvh_node_t *nodes;
+	// Subtrees processed in parallel, any subtree with at most task_size primitives
+	u32 task_size;
+	u32 task_count;
+	lbvh_task_t *tasks;
+	// Next task to be picked up by a worker
+	volatile u32 next_task;
+	// Output tree
+	bvh_t *bvh;
+} lbvh_build_t;
+
+// Spread the lower 21 bits of a value out so that there are two zero bits between each of them
+static inline u64 morton_expand(u64 v)
+{
+	v &= 0x1FFFFF;
+	v = (v | (v << 32)) & 0x001F00000000FFFFull;
+	v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+	v = (v | (v <<  8)) & 0x100F00F00F00F00Full;
+	v = (v | (v <<  4)) & 0x10C30C30C30C30C3ull;
+	v = (v | (v <<  2)) & 0x1249249249249249ull;
+	return v;
+};
+
+static void lbvh_bounds_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+
+	u32 first, count;
+	job_range(build->count, worker_index, worker_count, &first, &count);
+	// Get the bounds of the primitive centers in this worker's range
+	aabb_t bounds = aabb_empty();
+	for (u32 i = first; i < (first + count); i++)
+		bounds = aabb_extend(bounds, aabb_center(build->bounds[i]));
+	build->worker_bounds[worker_index] = bounds;
+};
+static void lbvh_morton_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+
+	u32 first, count;
+	job_range(build->count, worker_index, worker_count, &first, &count);
+	// Quantize the primitive centers to the center bounds, and interleave the bits of each axis
+	const v3 origin = build->center_bounds.min;
+	const f32 limit = (f32) ((1u << build->bits) - 1);
+	for (u32 i = first; i < (first + count); i++)
+	{
+		const v3 p = v3_mul(v3_sub(aabb_center(build->bounds[i]), origin), build->scale);
+		const u64 x = (u64) clamp(p.x, 0.f, limit);
+		const u64 y = (u64) clamp(p.y, 0.f, limit);
+		const u64 z = (u64) clamp(p.z, 0.f, limit);
+
+		build->refs[i].key = (morton_expand(x) << 2) | (morton_expand(y) << 1) | morton_expand(z);
+		build->refs[i].index = i;
+	}
+};
+
+static void lbvh_histogram_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+
+	u32 first, count;
+	job_range(build->count, worker_index, worker_count, &first, &count);
+	// Count the digits in this worker's range
+	u32 *histogram = build->histogram[worker_index];
+	memset(histogram, 0, 256*sizeof(u32));
+	for (u32 i = first; i < (first + count); i++)
+		histogram[(build->refs[i].key >> build->shift) & 0xFF]++;
+};
+static void lbvh_scatter_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+
+	u32 first, count;
+	job_range(build->count, worker_index, worker_count, &first, &count);
+	// Move each reference to its sorted position
+	// NOTE: Each worker owns a disjoint set of output slots per digit, so no synchronization is needed
+	u32 *offsets = build->histogram[worker_index];
+	for (u32 i = first; i < (first + count); i++)
+	{
+		const lbvh_ref_t ref = build->refs[i];
+		build->temp[offsets[(ref.key >> build->shift) & 0xFF]++] = ref;
+	}
+};
+// Stable, parallel LSD radix sort of the morton codes
+static void lbvh_sort(lbvh_build_t *build, u32 worker_count)
+{
+	const u32 key_bits = (3*build->bits);
+	for (build->shift = 0; build->shift < key_bits; build->shift += 8)
+	{
+		jobs_run(worker_count, lbvh_histogram_proc, build);
+		// Turn the histograms into output offsets, ordered by digit first and worker second
+		u32 sum = 0;
+		for (u32 d = 0; d < 256; d++)
+		{
+			for (u32 w = 0; w < worker_count; w++)
+			{
+				const u32 count = build->histogram[w][d];
+				build->histogram[w][d] = sum;
+				sum += count;
+			}
+		}
+		jobs_run(worker_count, lbvh_scatter_proc, build);
+		swap(lbvh_ref_t*, build->refs, build->temp);
+	}
+};
+
+// Length of the common prefix of two sorted keys, -1 if j is out of range
+// NOTE: Duplicate keys are told apart by their indices
+static inline i32 lbvh_delta(const lbvh_build_t *build, i64 i, i64 j)
+{
+	if ((j < 0) || (j >= build->count))
+		return -1;
+	const u64 a = build->refs[i].key;
+	const u64 b = build->refs[j].key;
+	if (a == b)
+		return 64 + u32_clz((u32) i ^ (u32) j);
+	return u64_clz(a ^ b);
+};
+static void lbvh_emit_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+
+	u32 first, count;
+	job_range(build->count - 1, worker_index, worker_count, &first, &count);
+	// Every internal node of a binary radix tree can be found independently of the others
+	// NOTE: See Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees"
+	for (i64 i = first; i < (first + count); i++)
+	{
+		// Find the direction of the node's range
+		const i32 d = (lbvh_delta(build, i, i+1) - lbvh_delta(build, i, i-1)) < 0 ? -1 : 1;
+		// Find an upper bound for the range length
+		const i32 delta_min = lbvh_delta(build, i, i-d);
+		i64 l_max = 2;
+		while (lbvh_delta(build, i, i + l_max*d) > delta_min)
+			l_max *= 2;
+		// Binary search for the other end of the range
+		i64 l = 0;
+		for (i64 t = (l_max / 2); t >= 1; t /= 2)
+		{
+			if (lbvh_delta(build, i, i + (l + t)*d) > delta_min)
+				l += t;
+		}
+		const i64 j = i + l*d;
+		// Binary search for the split position
+		const i32 delta_node = lbvh_delta(build, i, j);
+		i64 s = 0;
+		for (i64 div = 2;; div *= 2)
+		{
+			const i64 t = (l + div - 1) / div;
+			if (lbvh_delta(build, i, i + (s + t)*d) > delta_node)
+				s += t;
+			if (t == 1)
+				break;
+		}
+		const i64 split = i + s*d + min(d, 0);
+		// Store the node, children at the ends of the range are leaves
+		lbvh_node_t *node = build->nodes + i;
+		node->l = (min(i, j) == split)     ? (LBVH_LEAF | (u32) split)     : (u32) split;
+		node->r = (max(i, j) == split + 1) ? (LBVH_LEAF | (u32) (split+1)) : (u32) (split+1);
+		node->count = (u32) (l + 1);
+	}
+};
+
+static inline aabb_t lbvh_child_aabb(const lbvh_build_t *build, u32 child)
+{
+	if (child & LBVH_LEAF)
+		return build->bounds[build->refs[child & ~LBVH_LEAF].index];
+	return build->nodes[child].aabb;
+};
+static inline u32 lbvh_child_count(const lbvh_build_t *build, u32 child)
+{
+	return (child & LBVH_LEAF) ? 1 : build->nodes[child].count;
+};
+static inline f32 lbvh_child_cost(const lbvh_build_t *build, u32 child)
+{
+	if (child & LBVH_LEAF)
+		return BVH_COST_INTERSECT*aabb_area(lbvh_child_aabb(build, child));
+	return build->nodes[child].cost;
+};
+
+// Rebuild a treelet from the optimal partitions, reusing its internal nodes
+static u32 lbvh_treelet_emit(lbvh_build_t *build,
+	const u32 *leaves, const u8 *partitions, u32 set,
+	const u32 *internals, u32 *next)
+{
+	if (u32_popcount(set) == 1)
+		return leaves[u32_ctz(set)];
+
+	const u32 index = internals[(*next)++];
+	const u32 l = lbvh_treelet_emit(build, leaves, partitions, partitions[set], internals, next);
+	const u32 r = lbvh_treelet_emit(build, leaves, partitions, set ^ partitions[set], internals, next);
+
+	lbvh_node_t *node = build->nodes + index;
+	node->l = l;
+	node->r = r;
+	node->aabb = aabb_combine(lbvh_child_aabb(build, l), lbvh_child_aabb(build, r));
+	node->count = lbvh_child_count(build, l) + lbvh_child_count(build, r);
+	node->cost = BVH_COST_TRAVERSAL*aabb_area(node->aabb) + lbvh_child_cost(build, l) + lbvh_child_cost(build, r);
+	return index;
+};
+// Find the topology with the lowest SAH cost for the treelet below a node
+// NOTE: See Karras and Aila, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+static void lbvh_treelet_optimize(lbvh_build_t *build, u32 root)
+{
+	// Grow the treelet by repeatedly expanding the leaf with the largest surface area
+	u32 leaves[TREELET_SIZE];
+	u32 internals[TREELET_SIZE-1];
+	u32 leaf_count = 2;
+	u32 internal_count = 1;
+	leaves[0] = build->nodes[root].l;
+	leaves[1] = build->nodes[root].r;
+	internals[0] = root;
+	while (leaf_count < TREELET_SIZE)
+	{
+		i32 largest = -1;
+		f32 largest_area = -1.f;
+		for (u32 i = 0; i < leaf_count; i++)
+		{
+			if (!(leaves[i] & LBVH_LEAF))
+			{
+				const f32 area = aabb_area(build->nodes[leaves[i]].aabb);
+				if (area > largest_area)
+				{
+					largest = i;
+					largest_area = area;
+				}
+			}
+		}
+		if (largest == -1)
+			break;
+
+		const u32 node = leaves[largest];
+		internals[internal_count++] = node;
+		leaves[largest] = build->nodes[node].l;
+		leaves[leaf_count++] = build->nodes[node].r;
+	}
+	// Two or three leaves have only one possible topology worth considering
+	if (leaf_count < 4)
+		return;
+
+	// Find the optimal cost of every subset of the leaves, smaller subsets first
+	aabb_t bounds[1 << TREELET_SIZE];
+	f32 costs[1 << TREELET_SIZE];
+	u8 partitions[1 << TREELET_SIZE];
+	const u32 full = (1u << leaf_count) - 1;
+	for (u32 set = 1; set <= full; set++)
+	{
+		// The bounds of a set are the bounds of its lowest leaf combined with the rest of the set
+		const u32 lowest = set & (~set + 1);
+		const aabb_t lowest_aabb = lbvh_child_aabb(build, leaves[u32_ctz(lowest)]);
+		bounds[set] = (set == lowest) ? lowest_aabb : aabb_combine(bounds[set ^ lowest], lowest_aabb);
+
+		if (set == lowest)
+		{
+			costs[set] = lbvh_child_cost(build, leaves[u32_ctz(set)]);
+			continue;
+		}
+		// Try every way of splitting the set in two
+		// NOTE: Only partitions containing the lowest bit are visited, the others are mirror images
+		f32 best_cost = FLT_MAX;
+		u8 best_partition = 0;
+		for (u32 p = (set - 1) & set; p != 0; p = (p - 1) & set)
+		{
+			if (!(p & lowest))
+				continue;
+			const f32 cost = costs[p] + costs[set ^ p];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_partition = p;
+			}
+		}
+		costs[set] = BVH_COST_TRAVERSAL*aabb_area(bounds[set]) + best_cost;
+		partitions[set] = best_partition;
+	}
+	// Only restructure the treelet if it's an improvement
+	if (costs[full] < build->nodes[root].cost*0.999f)
+	{
+		u32 next = 0;
+		lbvh_treelet_emit(build, leaves, partitions, full, internals, &next);
+	}
+};
+// Compute the bounds of a subtree bottom up, optimizing its treelets if enabled
+// NOTE: Subtrees with at most 'done' primitives are expected to be up to date already
+static void lbvh_update(lbvh_build_t *build, u32 index, u32 done)
+{
+	lbvh_node_t *node = build->nodes + index;
+	if (!(node->l & LBVH_LEAF) && (build->nodes[node->l].count > done))
+		lbvh_update(build, node->l, done);
+	if (!(node->r & LBVH_LEAF) && (build->nodes[node->r].count > done))
+		lbvh_update(build, node->r, done);
+
+	node->aabb = aabb_combine(lbvh_child_aabb(build, node->l), lbvh_child_aabb(build, node->r));
+	if (build->optimize)
+	{
+		node->cost = BVH_COST_TRAVERSAL*aabb_area(node->aabb) +
+			lbvh_child_cost(build, node->l) + lbvh_child_cost(build, node->r);
+		lbvh_treelet_optimize(build, index);
+	}
+};
+// Write a subtree to the flat node array, depth-first
+// NOTE: If task_size is not 0, smaller subtrees are added to the task list instead
+static void lbvh_flatten(lbvh_build_t *build, u32 child, u32 position, u32 task_size)
+{
+	bvh_node_t *out = build->bvh->nodes + position;
+	if (child & LBVH_LEAF)
+	{
+		const u32 index = (child & ~LBVH_LEAF);
+		out->aabb = build->bounds[build->refs[index].index];
+		out->offset = index;
+		out->count = 1;
+		return;
+	}
+	if (build->nodes[child].count <= task_size)
+	{
+		lbvh_task_t *task = build->tasks + build->task_count++;
+		task->node = child;
+		task->position = position;
+		return;
+	}
+	// A subtree with n primitives always takes up 2n-1 nodes
+	const lbvh_node_t *node = build->nodes + child;
+	const u32 left_size = 2*lbvh_child_count(build, node->l) - 1;
+
+	out->aabb = node->aabb;
+	out->offset = 1 + left_size;
+	out->count = 0;
+	lbvh_flatten(build, node->l, position + 1, task_size);
+	lbvh_flatten(build, node->r, position + 1 + left_size, task_size);
+};
+// Collect the subtrees with at most task_size primitives
+static void lbvh_collect_tasks(lbvh_build_t *build, u32 child)
+{
+	if (child & LBVH_LEAF)
+		return;
+	const lbvh_node_t *node = build->nodes + child;
+	if (node->count <= build->task_size)
+	{
+		lbvh_task_t *task = build->tasks + build->task_count++;
+		task->node = child;
+		task->position = 0;
+		return;
+	}
+	lbvh_collect_tasks(build, node->l);
+	lbvh_collect_tasks(build, node->r);
+};
+static void lbvh_update_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+	// NOTE: Subtrees vary in size, so tasks are handed out one at a time
+	for (u32 i = atomic_inc(&build->next_task); i < build->task_count; i = atomic_inc(&build->next_task))
+		lbvh_update(build, build->tasks[i].node, 0);
+};
+static void lbvh_flatten_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	lbvh_build_t *build = (lbvh_build_t*) data;
+
+	for (u32 i = atomic_inc(&build->next_task); i < build->task_count; i = atomic_inc(&build->next_task))
+		lbvh_flatten(build, build->tasks[i].node, build->tasks[i].position, 0);
+	// Store the sorted primitive order, leaves reference it by position
+	u32 first, count;
+	job_range(build->count, worker_index, worker_count, &first, &count);
+	for (u32 i = first; i < (first + count); i++)
+		build->bvh->indices[i] = build->refs[i].index;
+};
+
+void bvh_build_lbvh(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params)
+{
+	if (count == 0)
+		return;
+
+	const u32 worker_count = clamp(params->worker_count, 1, MAX_WORKERS);
+
+	lbvh_build_t *build = malloc(sizeof(lbvh_build_t));
+	assert(build != NULL);
+	memset(build, 0, sizeof(lbvh_build_t));
+	build->bounds = bounds;
+	build->count = count;
+	build->optimize = params->optimize;
+	build->bvh = bvh;
+	// Allocate the output tree
+	bvh->node_count = (2*count - 1);
+	bvh->nodes = malloc(bvh->node_count*sizeof(bvh_node_t));
+	bvh->index_count = count;
+	bvh->indices = malloc(count*sizeof(u32));
+	// Allocate the build buffers
+	build->refs = malloc(count*sizeof(lbvh_ref_t));
+	build->temp = malloc(count*sizeof(lbvh_ref_t));
+	build->nodes = malloc(max(count - 1, 1)*sizeof(lbvh_node_t));
+	assert((bvh->nodes != NULL) && (bvh->indices != NULL));
+	assert((build->refs != NULL) && (build->temp != NULL) && (build->nodes != NULL));
+
+	// Get the bounds of all the primitive centers
+	jobs_run(worker_count, lbvh_bounds_proc, build);
+	build->center_bounds = build->worker_bounds[0];
+	for (u32 i = 1; i < worker_count; i++)
+		build->center_bounds = aabb_combine(build->center_bounds, build->worker_bounds[i]);
+	// Compute the morton codes, using fewer bits for small scenes so the sort needs fewer passes
+	build->bits = (count <= LBVH_SHORT_KEYS) ? 10 : 21;
+	{
+		const v3 extent = v3_sub(build->center_bounds.max, build->center_bounds.min);
+		const f32 cells = (f32) (1u << build->bits);
+		build->scale.x = (extent.x > 0.f) ? (cells / extent.x) : 0.f;
+		build->scale.y = (extent.y > 0.f) ? (cells / extent.y) : 0.f;
+		build->scale.z = (extent.z > 0.f) ? (cells / extent.z) : 0.f;
+	}
+	jobs_run(worker_count, lbvh_morton_proc, build);
+	// Sort the primitives along the morton curve
+	lbvh_sort(build, worker_count);
+
+	if (count == 1)
+	{
+		// A single primitive is a leaf on its own
+		build->bvh->nodes[0].aabb = bounds[0];
+		build->bvh->nodes[0].offset = 0;
+		build->bvh->nodes[0].count = 1;
+		build->bvh->indices[0] = 0;
+	} else {
+		// Emit the radix tree
+		jobs_run(worker_count, lbvh_emit_proc, build);
+		// Split the tree into subtrees that can be processed independently
+		build->task_size = max(count / (worker_count*LBVH_TASKS_PER_WORKER), 1);
+		// NOTE: Subtrees are disjoint and have at least two primitives each
+		build->tasks = malloc((count/2 + 1)*sizeof(lbvh_task_t));
+		assert(build->tasks != NULL);
+		// Compute the bounds of the subtrees in parallel, then the nodes above them
+		lbvh_collect_tasks(build, 0);
+		build->next_task = 0;
+		jobs_run(worker_count, lbvh_update_proc, build);
+		lbvh_update(build, 0, build->task_size);
+		// Flatten the top of the tree, then the subtrees below it in parallel
+		// NOTE: The treelet optimization may have moved nodes around, so the subtrees are collected again
+		build->task_count = 0;
+		build->next_task = 0;
+		lbvh_flatten(build, 0, 0, build->task_size);
+		jobs_run(worker_count, lbvh_flatten_proc, build);
+		free(build->tasks);
+	}
+	// Free the build buffers
+	free(build->nodes);
+	free(build->temp);
+	free(build->refs);
+	free(build);
+};
@@ -0,0 +1,116 @@
+#include "lod.h"
+
+// Largest coverage of a single part when combining them, fully opaque parts would saturate any node they're in
+#define LOD_MAX_COVERAGE	0.999f
+
+// Proxy shading summed over the parts of a node, weighted by the area each part covers
+typedef struct
+{
+	// Summed optical depth of the parts, times their squared radius
+	f32 depth;
+	// Summed covered area, and the area weighted colors
+	f32 weight;
+	v3 albedo;
+	v3 emittance;
+} lod_sum_t;
+
+// Grow a bounding sphere to enclose another sphere
+static void lod_enclose(lod_proxy_t *proxy, const lod_proxy_t *part)
+{
+	if (proxy->radius < 0.f)
+	{
+		proxy->center = part->center;
+		proxy->radius = part->radius;
+		return;
+	}
+	const v3 offset = v3_sub(part->center, proxy->center);
+	const f32 distance = v3_len(offset);
+	// Already inside
+	if ((distance + part->radius) <= proxy->radius)
+		return;
+	// Swallows the whole sphere so far
+	if ((distance + proxy->radius) <= part->radius)
+	{
+		proxy->center = part->center;
+		proxy->radius = part->radius;
+		return;
+	}
+	// Otherwise the new sphere touches both from the outside
+	const f32 radius = 0.5f*(distance + proxy->radius + part->radius);
+	proxy->center = v3_add(proxy->center, v3_scale(offset, (radius - proxy->radius) / distance));
+	proxy->radius = radius;
+};
+static void lod_sum_add(lod_sum_t *sum, const lod_proxy_t *part)
+{
+	const f32 area = part->radius*part->radius;
+	const f32 coverage = lod_coverage(part);
+	const f32 weight = coverage*area;
+	// NOTE: Optical depth is in base 2, to match exp2f
+	sum->depth -= f32_log2(1.f - min(coverage, LOD_MAX_COVERAGE))*area;
+	sum->weight += weight;
+	sum->albedo = v3_add(sum->albedo, v3_scale(lod_albedo(part), weight));
+	sum->emittance = v3_add(sum->emittance, v3_scale(part->emittance, weight));
+};
+// Resolve the summed parts into the proxy shading, once the bounding sphere is known
+// NOTE: Coverage follows Beer-Lambert, the parts are treated as randomly placed absorbers inside the bounding sphere
+static void lod_sum_resolve(const lod_sum_t *sum, lod_proxy_t *proxy)
+{
+	const f32 inv_weight = (sum->weight > 0.f) ? (1.f / sum->weight) : 0.f;
+	const f32 area = max(proxy->radius*proxy->radius, FLT_MIN);
+	lod_pack(proxy, v3_scale(sum->albedo, inv_weight), 1.f - exp2f(-sum->depth / area));
+	proxy->emittance = v3_scale(sum->emittance, inv_weight);
+};
+
+void lod_build(lod_t *lod, const bvh_t *bvh, const lod_proxy_t *primitives, const lod_params_t *params)
+{
+	assert(bvh->lazy == NULL);
+	const f64 start = time_now();
+
+	memset(lod, 0, sizeof(lod_t));
+	lod->threshold = (params->threshold > 0.f) ? params->threshold : LOD_DEFAULT_THRESHOLD;
+	lod->proxy_count = bvh->node_count;
+	lod->proxies = malloc(max(bvh->node_count, 1)*sizeof(lod_proxy_t));
+	assert(lod->proxies != NULL);
+	// Children are always stored after their parent, so walking backwards builds them first
+	for (u32 i = bvh->node_count; i-- > 0;)
+	{
+		const bvh_node_t *node = bvh->nodes + i;
+		lod_proxy_t *proxy = lod->proxies + i;
+		proxy->radius = -1.f;
+
+		lod_sum_t sum = {0};
+		if (node->count == 0)
+		{
+			// Branches combine both child proxies
+			const lod_proxy_t *left = lod->proxies + (i + 1);
+			const lod_proxy_t *right = lod->proxies + (i + node->offset);
+			lod_enclose(proxy, left);
+			lod_enclose(proxy, right);
+			lod_sum_add(&sum, left);
+			lod_sum_add(&sum, right);
+		} else {
+			// Leaves combine their primitives
+			const u32 *indices = bvh->indices + node->offset;
+			for (u32 j = 0; j < node->count; j++)
+			{
+				lod_enclose(proxy, primitives + indices[j]);
+				lod_sum_add(&sum, primitives + indices[j]);
+			}
+		}
+		// Loose bounding spheres can grow past the node box, the sphere around the box is enough then
+		const f32 box_radius = 0.5f*v3_len(v3_sub(node->aabb.max, node->aabb.min));
+		if (box_radius < proxy->radius)
+		{
+			proxy->center = aabb_center(node->aabb);
+			proxy->radius = box_radius;
+		}
+		lod_sum_resolve(&sum, proxy);
+	}
+	lod->build_time = (time_now() - start);
+};
+void lod_free(lod_t *lod)
+{
+	free(lod->proxies);
+	free(lod->touched);
+	memset(lod, 0, sizeof(lod_t));
+};
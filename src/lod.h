@@ -0,0 +1,74 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "bvh.h"
+
+// Default largest node size a ray stops at, relative to the width of it's cone
+#define LOD_DEFAULT_THRESHOLD	1.f
+
+// Level of detail parameters
+typedef struct
+{
+	// Largest node size a ray stops at instead of descending further, relative to the width of it's cone at the node
+	// NOTE: Camera ray cones are a pixel wide, so this is the fraction of a pixel a node has to shrink to. 0 uses the default
+	f32 threshold;
+} lod_params_t;
+
+// Aggregate stand-in for everything below a BVH node, half a cache line
+typedef struct
+{
+	// Bounding sphere of the primitives
+	v3 center;
+	f32 radius;
+	// Albedo of the primitives averaged by the area they cover, and the fraction of the rays through the bounding sphere expected to hit one
+	// NOTE: Stored as 8-bit fractions in that order, see lod_pack
+	u8 albedo_coverage[4];
+	// Emittance of the primitives averaged by the area they cover
+	v3 emittance;
+} lod_proxy_t;
+
+// Get the albedo and coverage of a proxy
+static inline v3 lod_albedo(const lod_proxy_t *proxy)
+{
+	return V3(
+		(f32) proxy->albedo_coverage[0] * (1.f / 255.f),
+		(f32) proxy->albedo_coverage[1] * (1.f / 255.f),
+		(f32) proxy->albedo_coverage[2] * (1.f / 255.f));
+};
+static inline f32 lod_coverage(const lod_proxy_t *proxy)
+{
+	return (f32) proxy->albedo_coverage[3] * (1.f / 255.f);
+};
+// Set the albedo and coverage of a proxy, clamped to [0, 1]
+static inline void lod_pack(lod_proxy_t *proxy, v3 albedo, f32 coverage)
+{
+	for (u32 i = 0; i < 3; i++)
+		proxy->albedo_coverage[i] = (u8) (f32_saturate(albedo.v[i])*255.f + 0.5f);
+	proxy->albedo_coverage[3] = (u8) (f32_saturate(coverage)*255.f + 0.5f);
+};
+
+// Level of detail proxies, one for every node of a BVH
+// NOTE: Stored apart from the tree, so the tree nodes stay the same size for full traversal
+typedef struct
+{
+	// Threshold rays stop at, 0 always descends to the leaves
+	f32 threshold;
+	u32 proxy_count;
+	lod_proxy_t *proxies;
+	// Marker for every node rays reached, NULL unless they're tracked
+	// NOTE: Only used to measure how much of the tree rays touch, the writes are racy but every one stores the same value
+	u8 *touched;
+	// Time it took to build the proxies, in seconds
+	f64 build_time;
+} lod_t;
+
+// Build the proxy of every node bottom up, from a proxy for each primitive
+// NOTE: Primitive proxies are indexed like the bounds the tree was built from, lazy trees aren't supported
+void lod_build(lod_t *lod, const bvh_t *bvh, const lod_proxy_t *primitives, const lod_params_t *params);
+void lod_free(lod_t *lod);
+
+#endif
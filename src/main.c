@@ -1,7 +1,5 @@
-// Should tile-based rendering be used?
-#define USE_TILES 1
-// Should a BVH be used?
-#define USE_BVH   1
+// NOTE: Needed for sigaction
+#define _POSIX_C_SOURCE 200809L
 
 #include "core.h"
 #include "util.h"
@@ -12,209 +10,778 @@
 #include "framebuffer.h"
 
 #include "render.h"
+#include "bench.h"
+#include "job.h"
+#include "accel.h"
+#include "tile.h"
+#include "farm.h"
+#include "partial.h"
 
-#include <pthread.h>
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
 
-#if USE_TILES
-// Maximum number of tiles that can be rendered
-// NOTE: Arbitrary, just used to keep the tile array length constant 
-#define MAX_TILES			1024
-// Maximum amount of memory that can be allocated from the tile scratch allocator
-#define TILE_MEMORY_SIZE	kilobytes(16)
+// Seconds a cancelled render has to stop and save it's image in, before the process exits without it
+#define DEFAULT_STOP_TIMEOUT 10
 
-// Per-tile rendering data
-typedef struct
+// Output the memory used by instanced geometry, compared to flattening every instance into the world
+static void print_instance_stats(const world_t *world)
 {
-	// Area to render for this tile
-	rect_t area;
-	// Scratch memory allocator for fast, thread-safe allocations
-	lin_alloc_t temp_alloc;
-} render_tile_t;
-// Tile render queue
+	// Unique geometry, stored once per object
+	size_t object_size = 0;
+	size_t object_spheres = 0;
+	for (u32 i = 0; i < world->object_count; i++)
+	{
+		const object_t *object = world->objects + i;
+		object_size += object->sphere_count*sizeof(sphere_t);
+		object_size += object->bvh.node_count*sizeof(bvh_node_t) + object->bvh.index_count*sizeof(u32);
+		object_spheres += object->sphere_count;
+	}
+	// Instances and the top level tree
+	const bvh_t *tlas = &world->instance_bvh;
+	const size_t instance_size = world->instance_count*sizeof(instance_t) +
+		tlas->node_count*sizeof(bvh_node_t) + tlas->index_count*sizeof(u32);
+	// Flattened, every instance would copy it's spheres, and the tree would need ~2 nodes per sphere
+	size_t flat_spheres = 0;
+	for (u32 i = 0; i < world->instance_count; i++)
+		flat_spheres += world->objects[world->instances[i].object].sphere_count;
+	const size_t flat_size = flat_spheres*(sizeof(sphere_t) + 2*sizeof(bvh_node_t) + sizeof(u32));
+
+	printf("%u objects (%zu spheres, %zu KB), %u instances (%zu KB), %zu spheres flattened (~%zu KB)\n",
+		world->object_count, object_spheres, object_size / 1024,
+		world->instance_count, instance_size / 1024,
+		flat_spheres, flat_size / 1024);
+};
+// Command line options
 typedef struct
 {
-	// Input and output pointers
-	scene_t *scene;
-	framebuffer_t *framebuffer;
-	// Total number of tiles to render
-	u32 tile_count;
-	// Tile array
-	render_tile_t tiles[MAX_TILES];
-	// Next tile to be rendered
-	volatile u32 next_tile;
-	// Number of completed tiles
-	volatile u32 completed;
-} render_queue_t;
-
-// Renders a single tile, returns a boolean indicating if work was done
-static bool render_tile(render_queue_t *queue)
+	// Accelerator name, overrides the one in the scene
+	const char *accel;
+	// Render on the calling thread only, without tiles
+	bool single_threaded;
+	// Number of threads jobs run on, 0 uses every CPU the process can run on
+	u32 threads;
+	// Pin every thread to a CPU, copy the geometry to every NUMA node, and count loads from other nodes while rendering
+	bool pin;
+	bool replicate;
+	bool numa_stats;
+	// Render in this many forked worker processes, 0 renders in this one
+	// NOTE: The thread count is per worker process then
+	u32 processes;
+	// Time a worker process has to return a lease, 0 uses the default
+	f64 lease_timeout;
+	// Render part of the frame to a partial file instead of an image, the file name defaults to the output's with a .partial extension
+	bool partial;
+	partial_params_t partial_params;
+	const char *partial_file;
+	// Checkpoint file, and the seconds and finished tiles between checkpoints
+	// NOTE: The file name defaults to the output's with a .checkpoint extension
+	const char *checkpoint_file;
+	f64 checkpoint_interval;
+	u32 checkpoint_tiles;
+	bool checkpoint;
+	// Continue from the checkpoint file
+	bool resume;
+	// Seconds a cancelled render has to stop and save in, 0 uses the default
+	u32 stop_timeout;
+	// Time the program started
+	f64 start_time;
+} options_t;
+
+// Render the scene to the framebuffer, returns the time the first pixels were finished
+static f64 render_frame(scene_t *scene, const options_t *options, framebuffer_t *framebuffer, tile_stats_t *stats, farm_stats_t *farm_stats)
 {
-	// If there's still work to be done
-	if (queue->next_tile < queue->tile_count)
-	{
-		// Get the index of the next tile to render
-		// NOTE: Done atomically so that no other thread can work on this tile
-		const u32 index = atomic_inc(&queue->next_tile);
-		// Alias some data to save typing
-		rect_t area = queue->tiles[index].area;
-		lin_alloc_t *temp_alloc = &queue->tiles[index].temp_alloc;
-		// Call the render function on this tile
-		render(temp_alloc,
-			&queue->scene->world, 
-			&queue->scene->camera,
-			queue->scene->samples, 
-			queue->scene->bounces, 
-			queue->framebuffer, area);
-		// Increment the completed count atomically
-		atomic_inc(&queue->completed);
-		return true;
-	}
-	return false;
-}
-static void* thread_proc(void *data)
+	memset(stats, 0, sizeof(tile_stats_t));
+	memset(farm_stats, 0, sizeof(farm_stats_t));
+	if (options->processes > 0)
+	{
+		// Render in worker processes, handing tiles out to them
+		farm_params_t params;
+		params.process_count = options->processes;
+		params.threads = options->threads;
+		params.lease_timeout = options->lease_timeout;
+		farm_render(&scene->world, &scene->camera, scene->samples, scene->bounces, &scene->tiles, &params,
+			framebuffer, farm_stats);
+		return farm_stats->first_tile_time;
+	} else if (!options->single_threaded)
+	{
+		// Render using tile-based parallel method
+		tile_render(&scene->world, &scene->camera, scene->samples, scene->bounces, &scene->tiles,
+			framebuffer, job_thread_count(), stats);
+		return stats->first_tile_time;
+	} else {
+		// Render using a single core method
+		// NOTE: Only use this as a benchmark!
+		void *memory = malloc(TILE_MEMORY_SIZE);
+		assert(memory != NULL);
+		lin_alloc_t temp_alloc;
+		lin_alloc_init(&temp_alloc, TILE_MEMORY_SIZE, memory);
+
+		rect_t area = { 0,0,framebuffer->width,framebuffer->height};
+		const u32 pixel_count = render(&temp_alloc,
+			&scene->world, 
+			&scene->camera,
+			scene->samples, 
+			scene->bounces, 
+			framebuffer, area);
+		stats->cancelled = render_cancelled();
+		stats->samples_taken = (u64) pixel_count*(u64) scene->samples;
+		free(memory);
+	}
+	// NOTE: Single threaded renders finish every pixel at once
+	return time_now();
+};
+// Render a single image of the scene, and store it
+static void render_still(scene_t *scene, const options_t *options, framebuffer_t *framebuffer)
+{
+	// Samples a cancelled frame got
+	u64 samples_taken = 0;
+	bool cancelled = false;
+	// Begin rendering
+	printf("Rendering...");
+	{
+		const clock_t start = clock();
+		tile_stats_t tile_stats;
+		farm_stats_t farm_stats;
+		const f64 first_pixel_time = render_frame(scene, options, framebuffer, &tile_stats, &farm_stats);
+		cancelled = (tile_stats.cancelled || farm_stats.cancelled);
+		samples_taken = tile_stats.samples_taken + farm_stats.samples_taken;
+		// Output render time
+		const clock_t end = clock();
+		const double time = (double) (end - start) / CLOCKS_PER_SEC;
+		printf("done\nRender took %f seconds\n", time);
+		// Output the time from startup until the first tile was finished, which includes loading and building
+		printf("Time to first pixel: %f seconds\n", first_pixel_time - options->start_time);
+		// Output how evenly the work was spread, the tail is time cores sat idle at the end of the frame
+		if (tile_stats.worker_count > 0)
+		{
+			printf("Tiles: %ux%u tiles x %u sample ranges on %u workers, %u splits, %u steals, tail %f seconds (%.1f%% of the frame)\n",
+				tile_stats.tiles_x, tile_stats.tiles_y, tile_stats.range_count, tile_stats.worker_count, tile_stats.splits, tile_stats.steals,
+				tile_stats.tail_time, 100.0*tile_stats.tail_time / max(tile_stats.render_time, 1e-9));
+		}
+		// Output how much came from and went to checkpoints
+		if ((tile_stats.resumed_tiles > 0) || (tile_stats.checkpoints > 0))
+			printf("Checkpoints: resumed %u of %u tiles, wrote %u checkpoints\n", tile_stats.resumed_tiles, tile_stats.tile_count, tile_stats.checkpoints);
+		// Output how the worker processes did
+		if (farm_stats.process_count > 0)
+		{
+			printf("Processes: %u workers, %u leases, %u reassigned, %u workers lost, %u leases rendered by the coordinator\n",
+				farm_stats.process_count, farm_stats.lease_count, farm_stats.reassigned, farm_stats.lost_workers, farm_stats.local_leases);
+		}
+		// Output how much memory traffic went to other NUMA nodes
+		if (options->numa_stats)
+		{
+			const u64 loads = tile_stats.local_loads + tile_stats.remote_loads;
+			printf("NUMA: %u nodes, %llu node-local loads, %llu remote loads (%.2f%% remote)\n",
+				tile_stats.node_count, (unsigned long long) tile_stats.local_loads, (unsigned long long) tile_stats.remote_loads,
+				100.0*(f64) tile_stats.remote_loads / (f64) max(loads, 1));
+		}
+	}
+	// Output how much of a lazily built tree was needed
+	const bvh_t *bvh = &scene->world.bvh;
+	if (bvh->lazy)
+	{
+		bvh_lazy_stats_t stats;
+		bvh_lazy_stats(bvh, &stats);
+		printf("Lazy BVH: built %u of %u subtrees (%.1f%% of spheres), %u nodes, subtree builds took %f seconds\n",
+			stats.built_subtrees, stats.subtree_count,
+			100.0*(f64) stats.built_primitives / (f64) max(stats.primitive_count, 1),
+			stats.node_count, stats.build_time);
+	}
+	// Output how the paged geometry fit in its budget
+	const pager_t *pager = &scene->world.pager;
+	if (pager->chunk_count > 0)
+	{
+		page_stats_t stats;
+		page_stats(pager, &stats);
+		printf("Paging: %u chunks (%.1f MB file), %u page-ins, %u evictions, stalled for %f seconds\n",
+			stats.chunk_count, (f64) stats.file_bytes / (1024.0*1024.0), stats.page_ins, stats.evictions, stats.stall_time);
+		printf("Paging: %u chunks resident (%.1f MB, peak %.1f MB) of a %.1f MB budget\n",
+			stats.resident_chunks, (f64) stats.resident_bytes / (1024.0*1024.0),
+			(f64) stats.peak_resident_bytes / (1024.0*1024.0), (f64) stats.budget / (1024.0*1024.0));
+	}
+
+	#if 0
+	draw_bvh(
+		&scene->camera, 
+		&scene->world.bvh,
+		framebuffer);
+	#endif
+
+	// Allocate an output image
+	image_t image;
+	image_alloc(&image, scene->w, scene->h);
+	// Resolve the framebuffer to the image
+	printf("Storing framebuffer...");
+	{
+		const clock_t start = clock();
+		
+		framebuffer_resolve(&image, framebuffer);
+		
+		const clock_t end = clock();
+		const double time = (double) (end - start) / CLOCKS_PER_SEC;
+		printf("done\nStore took %f seconds\n", time);
+	}
+	image_save(&image, scene->output);
+	image_free(&image);
+	// Output how much of a cancelled frame the stored image has
+	if (cancelled)
+	{
+		const u64 frame_samples = (u64) scene->w*(u64) scene->h*(u64) scene->samples;
+		printf("Cancelled: \"%s\" has %llu of %llu samples (%.1f%%), pixels are averaged over the samples they got\n",
+			scene->output, (unsigned long long) samples_taken, (unsigned long long) frame_samples,
+			100.0*(f64) samples_taken / (f64) max(frame_samples, 1));
+	}
+};
+// Render part of the scene, and store it's sums for merging later, returns false if the partial file wasn't written
+static bool render_partial(scene_t *scene, const options_t *options)
 {
-	// Simple thread procedure to render tiles so long as some are available
-	render_queue_t *queue = (render_queue_t*) data;
-	while (render_tile(queue));
-	// Exit the thread when no more work is available to be done
-	return NULL;
+	char file_name[512];
+	if (options->partial_file)
+	{
+		snprintf(file_name, sizeof(file_name), "%s", options->partial_file);
+	} else {
+		const char *extension = strrchr(scene->output, '.');
+		const i32 base_len = extension ? (i32) (extension - scene->output) : (i32) strlen(scene->output);
+		snprintf(file_name, sizeof(file_name), "%.*s.partial", base_len, scene->output);
+	}
+	printf("Rendering partial...");
+	const f64 start = time_now();
+	if (!partial_render(file_name, scene->hash, &scene->world, &scene->camera, scene->w, scene->h,
+		scene->samples, scene->bounces, &scene->tiles, &options->partial_params))
+		return false;
+	printf("done\nPartial render took %f seconds, stored in \"%s\"\n", time_now() - start, file_name);
+	return true;
 };
-static void render_tiles(scene_t *scene, framebuffer_t *framebuffer, u32 worker_count)
+// Merge partial renders into an image
+static i32 merge_partials(const char *output, const char **file_names, u32 file_count)
 {
-	// Make sure the scene fits in the render queue
-	assert((scene->tiles_x*scene->tiles_y) <= MAX_TILES);
-	// Get the dimensions of a tile in pixels
-	const u32 tile_w = framebuffer->width / scene->tiles_x;
-	const u32 tile_h = framebuffer->height / scene->tiles_y;
-	// Allocate a render queue
-	// NOTE: Needs to be heap allocated for thread safety
-	render_queue_t *queue = malloc(sizeof(render_queue_t));
-	assert(queue != NULL);
-	memset(queue, 0, sizeof(render_queue_t));
-	// Set the queue input/output data pointers
-	queue->scene = scene;
-	queue->framebuffer = framebuffer;
-	// Set up each tile in the queue
-	for (u32 j = 0; j < scene->tiles_y; j++)
-	{
-		for (u32 i = 0; i < scene->tiles_x; i++)
-		{
-			// Get the current tile
-			render_tile_t *tile = queue->tiles + queue->tile_count++;
-			// Set the tile dimensions
-			tile->area.x = i*tile_w;
-			tile->area.y = j*tile_h;
-			tile->area.w = tile_w;
-			tile->area.h = tile_h;
-			// Allocate the tile scratch memory
-			void *memory = malloc(TILE_MEMORY_SIZE);
-			assert(memory != NULL);
-			// Initialize the scratch memory allocator
-			lin_alloc_init(&tile->temp_alloc, TILE_MEMORY_SIZE, memory);
-		};
-	};
-	// Create a bunch of worker threads, each running the rendering function 
-	const u32 thread_count = (worker_count-1);
-	for (u32 i = 0; i < thread_count; i++)
-	{
-		pthread_t thread;
-		pthread_create(&thread, NULL, thread_proc, queue);
-	}
-	// Keep doing jobs in the queue on the main thread too
-	while (render_tile(queue));
-	// Spinlock until all tiles are rendered
-	// NOTE: Prevents an early exit when there's no more tiles in the queue BUT some tiles are still being rendered
-	while (queue->completed < queue->tile_count)
-		_mm_pause();
-	// Free the tile memory
-	for (u32 i = 0; i < queue->tile_count; i++)
-	{
-		render_tile_t *tile = queue->tiles + i;
-		free(tile->temp_alloc.memory);
-	}
-	// Free the queue
-	free(queue);
+	printf("Merging %u partials...", file_count);
+	framebuffer_t framebuffer;
+	partial_stats_t stats;
+	if (!partial_merge(&framebuffer, file_names, file_count, &stats))
+		return 1;
+	printf("done\n%llu of %llu samples (%.1f%%)\n", (unsigned long long) stats.samples_taken, (unsigned long long) stats.frame_samples,
+		100.0*(f64) stats.samples_taken / (f64) max(stats.frame_samples, 1));
+
+	image_t image;
+	image_alloc(&image, framebuffer.width, framebuffer.height);
+	framebuffer_resolve(&image, &framebuffer);
+	image_save(&image, output);
+	image_free(&image);
+	framebuffer_free(&framebuffer);
+	return 0;
+};
+// Get the output file name of an animation frame, by adding the frame number before the extension
+static void frame_file_name(char *file_name, size_t size, const char *output, i32 frame)
+{
+	const char *extension = strrchr(output, '.');
+	const i32 base_len = extension ? (i32) (extension - output) : (i32) strlen(output);
+	snprintf(file_name, size, "%.*s_%04d%s", base_len, output, frame, extension ? extension : "");
+};
+// Render every frame of the scene animation
+// NOTE: The accelerator is refit between frames, and only rebuilt once its quality gets too low
+static void render_animation(scene_t *scene, const options_t *options, framebuffer_t *framebuffer)
+{
+	const animation_t *animation = &scene->animation;
+	world_t *world = &scene->world;
+	const accel_t *accel = world->accel;
+	accel_params_t params = { scene->bvh, scene->grid, NULL };
+	params.page = scene->page;
+	params.lod = scene->lod;
+
+	anim_player_t *player = malloc(sizeof(anim_player_t));
+	assert(player != NULL);
+	if (!anim_open(player, animation, world))
+	{
+		printf("Failed to open animation stream \"%s\"\n", animation->stream);
+		free(player);
+		return;
+	}
+
+	image_t image;
+	image_alloc(&image, scene->w, scene->h);
+	v3 *centers = malloc(world->sphere_count*sizeof(v3));
+	assert((centers != NULL) || (world->sphere_count == 0));
+	// The SAH cost right after the last full build, refits are compared against it
+	accel_stats_t stats;
+	accel->stats(world, &stats);
+	f32 build_cost = stats.cost;
+	// Totals for the final report
+	u32 rebuild_count = 0;
+	f64 total_refit = 0.0, total_rebuild = 0.0, total_render = 0.0;
+
+	printf("Rendering %d frames...\n", animation->frames);
+	printf("%6s %12s %12s %12s %10s\n", "frame", "refit", "rebuild", "render", "sah cost");
+	i32 frame;
+	for (frame = 0; frame < animation->frames; frame++)
+	{
+		if (!anim_frame(player, frame, centers))
+		{
+			printf("Animation stream ended after %d frames\n", frame);
+			break;
+		}
+		world_move_spheres(world, centers);
+		// Accelerators that can't be refit are rebuilt every frame
+		f64 refit_time = 0.0, rebuild_time = 0.0;
+		bool rebuild = (accel->refit == NULL);
+		if (!rebuild)
+		{
+			// Refit the existing structure to the moved spheres
+			const f64 refit_start = time_now();
+			accel->refit(world);
+			accel->stats(world, &stats);
+			refit_time = (time_now() - refit_start);
+			// Rebuild from scratch once refitting has degraded the structure too much
+			rebuild = (stats.cost > build_cost*animation->rebuild_threshold);
+		}
+		if (rebuild)
+		{
+			world_build_accel(world, accel, &params);
+			accel->stats(world, &stats);
+			rebuild_time = stats.build_time;
+			build_cost = stats.cost;
+			rebuild_count++;
+		}
+		// Render and store the frame
+		const f64 render_start = time_now();
+		tile_stats_t tile_stats;
+		farm_stats_t farm_stats;
+		render_frame(scene, options, framebuffer, &tile_stats, &farm_stats);
+		const f64 render_end = time_now();
+
+		char file_name[512];
+		frame_file_name(file_name, sizeof(file_name), scene->output, frame);
+		framebuffer_resolve(&image, framebuffer);
+		image_save(&image, file_name);
+		// Output the frame timing
+		const f64 render_time = (render_end - render_start);
+		printf("%6d %12.6f %12.6f %12.6f %10.2f\n", frame, refit_time, rebuild_time, render_time, stats.cost);
+
+		total_refit += refit_time;
+		total_rebuild += rebuild_time;
+		total_render += render_time;
+		// Keep the frame rendering was cancelled in, but don't start another
+		if (render_cancelled())
+		{
+			printf("Rendering was cancelled after %d frames\n", ++frame);
+			break;
+		}
+	}
+	printf("%d frames, %u rebuilds: refit took %f seconds, rebuild took %f seconds, render took %f seconds\n",
+		frame, rebuild_count, total_refit, total_rebuild, total_render);
+	// Cleanup
+	free(centers);
+	image_free(&image);
+	anim_close(player);
+	free(player);
+};
+
+// Seconds the render has to stop in once it's cancelled, and the signal that cancelled it
+static u32 stop_timeout;
+static volatile sig_atomic_t stop_signal;
+// Cancel rendering on the first SIGINT or SIGTERM, and exit at once on the second
+// NOTE: Only async-signal-safe calls are made here
+static void on_stop_signal(i32 signal)
+{
+	if (render_cancelled())
+		_exit(128 + signal);
+	stop_signal = signal;
+	render_cancel();
+	// Start the watchdog, in case stopping and saving takes longer than it should
+	alarm(stop_timeout);
+};
+// Exit once a cancelled render has had all of it's time to stop
+static void on_stop_timeout(i32 signal)
+{
+	const char message[] = "\nRender didn't stop in time, exiting without saving\n";
+	const ssize_t written = write(STDOUT_FILENO, message, sizeof(message) - 1);
+	(void) written;
+	_exit(128 + stop_signal);
+};
+// Cancel rendering on SIGINT and SIGTERM, and exit if it takes longer than the timeout to stop
+static void install_stop_handlers(u32 timeout)
+{
+	stop_timeout = (timeout > 0) ? timeout : DEFAULT_STOP_TIMEOUT;
+	struct sigaction action = {0};
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = on_stop_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = on_stop_timeout;
+	sigaction(SIGALRM, &action, NULL);
+};
+
+// Output the names of all registered accelerators
+static void print_accels()
+{
+	printf("Accelerators:\n");
+	printf("  %-8s %s\n", "auto", "Pick one from the sphere count and distribution");
+	for (u32 i = 0; i < accel_count(); i++)
+		printf("  %-8s %s\n", accel_get(i)->name, accel_get(i)->description);
+};
+// Find the accelerator to use for a scene, returns NULL if the name isn't registered
+static const accel_t* select_accel(const scene_t *scene, const char *name, accel_params_t *params)
+{
+	// Without a name, the parameters pick the accelerator like they always did
+	if (name[0] == '\0')
+	{
+		if (scene->grid.mode != GRID_NONE)
+			return &accel_grid;
+		return scene->bvh.compress ? &accel_qbvh : &accel_bvh;
+	}
+	if (strcmp(name, "auto") == 0)
+		return accel_auto(&scene->world, params);
+
+	const accel_t *accel = accel_find(name);
+	if (!accel)
+	{
+		printf("Unknown accelerator \"%s\"\n", name);
+		print_accels();
+	}
+	return accel;
 };
-#endif
 
 int main(int argc, const char *argv[])
 {
+	const f64 start_time = time_now();
+	// Register the accelerators before anything can select one
+	accel_register_defaults();
+
 	// Not enough command line arguments, early out with help message
 	if (argc < 2)
 	{
-		printf("Usage: %s scene_file\n", argv[0]);
+		printf("Usage: %s scene_file [--accel name] [--threads count] [--pin] [--replicate] [--numa-stats] [--processes count] [--lease-timeout seconds] [--single-threaded]\n", argv[0]);
+		printf("       %s scene_file [--region x,y,w,h] [--sample-range first,count] [--partial file]\n", argv[0]);
+		printf("       %s scene_file [--checkpoint file] [--checkpoint-interval seconds] [--checkpoint-tiles count] [--resume]\n", argv[0]);
+		printf("       %s scene_file [--stop-timeout seconds]\n", argv[0]);
+		printf("       %s --merge output_file partial_file...\n", argv[0]);
+		printf("       %s --bench-bvh [max_spheres] [max_workers]\n", argv[0]);
+		printf("       %s --bench-qbvh [spheres] [rays]\n", argv[0]);
+		printf("       %s --bench-layout [spheres] [rays]\n", argv[0]);
+		printf("       %s --bench-traversal [spheres] [rays]\n", argv[0]);
+		printf("       %s --bench-grid [spheres] [rays]\n", argv[0]);
+		printf("       %s --bench-lazy [spheres] [rays]\n", argv[0]);
+		printf("       %s --bench-accel scene_file [rays]\n", argv[0]);
+		printf("       %s --bench-import [particles] [file_prefix]\n", argv[0]);
+		printf("       %s --bench-lod scene_file [samples]\n", argv[0]);
+		printf("       %s --bench-sharing [workers] [passes]\n", argv[0]);
+		print_accels();
+		return 0;
+	}
+	// Benchmark the BVH builders
+	if (strcmp(argv[1], "--bench-bvh") == 0)
+	{
+		const u32 max_spheres = (argc > 2) ? atoi(argv[2]) : 10000000;
+		const u32 max_workers = (argc > 3) ? atoi(argv[3]) : job_thread_count();
+		bench_bvh_build(max_spheres, max_workers);
+		return 0;
+	}
+	// Check and benchmark the compressed BVH
+	if (strcmp(argv[1], "--bench-qbvh") == 0)
+	{
+		const u32 sphere_count = (argc > 2) ? atoi(argv[2]) : 1000000;
+		const u32 ray_count = (argc > 3) ? atoi(argv[3]) : 1000000;
+		bench_qbvh(sphere_count, ray_count);
+		return 0;
+	}
+	// Compare the tree memory layouts
+	if (strcmp(argv[1], "--bench-layout") == 0)
+	{
+		const u32 sphere_count = (argc > 2) ? atoi(argv[2]) : 1000000;
+		const u32 ray_count = (argc > 3) ? atoi(argv[3]) : 1000000;
+		bench_layout(sphere_count, ray_count);
+		return 0;
+	}
+	// Compare stack and stackless traversal
+	if (strcmp(argv[1], "--bench-traversal") == 0)
+	{
+		const u32 sphere_count = (argc > 2) ? atoi(argv[2]) : 1000000;
+		const u32 ray_count = (argc > 3) ? atoi(argv[3]) : 1000000;
+		bench_traversal(sphere_count, ray_count);
+		return 0;
+	}
+	// Compare grids against BVHs
+	if (strcmp(argv[1], "--bench-grid") == 0)
+	{
+		const u32 sphere_count = (argc > 2) ? atoi(argv[2]) : 1000000;
+		const u32 ray_count = (argc > 3) ? atoi(argv[3]) : 1000000;
+		bench_grid(sphere_count, ray_count);
+		return 0;
+	}
+	// Compare lazy and full BVH builds
+	if (strcmp(argv[1], "--bench-lazy") == 0)
+	{
+		const u32 sphere_count = (argc > 2) ? atoi(argv[2]) : 1000000;
+		const u32 ray_count = (argc > 3) ? atoi(argv[3]) : 100000;
+		bench_lazy(sphere_count, ray_count);
 		return 0;
 	}
+	// Time particle imports
+	if (strcmp(argv[1], "--bench-import") == 0)
+	{
+		const u32 particle_count = (argc > 2) ? atoi(argv[2]) : 10000000;
+		const char *file_prefix = (argc > 3) ? argv[3] : "particles";
+		bench_import(particle_count, file_prefix);
+		return 0;
+	}
+	// Compare every accelerator on a scene
+	if (strcmp(argv[1], "--bench-accel") == 0)
+	{
+		if (argc < 3)
+		{
+			printf("Missing scene file\n");
+			return 1;
+		}
+		const u32 ray_count = (argc > 3) ? atoi(argv[3]) : 1000000;
+		bench_accel(argv[2], ray_count);
+		return 0;
+	}
+	// Compare level of detail thresholds on a scene
+	if (strcmp(argv[1], "--bench-lod") == 0)
+	{
+		if (argc < 3)
+		{
+			printf("Missing scene file\n");
+			return 1;
+		}
+		const i32 samples = (argc > 3) ? atoi(argv[3]) : 16;
+		bench_lod(argv[2], samples);
+		return 0;
+	}
+	// Merge partial renders
+	if (strcmp(argv[1], "--merge") == 0)
+	{
+		if (argc < 4)
+		{
+			printf("Missing output or partial files\n");
+			return 1;
+		}
+		return merge_partials(argv[2], argv + 3, (u32) (argc - 3));
+	}
+	// Compare summing into a shared frame against tile local buffers
+	if (strcmp(argv[1], "--bench-sharing") == 0)
+	{
+		const u32 worker_count = (argc > 2) ? atoi(argv[2]) : job_thread_count();
+		const u32 passes = (argc > 3) ? atoi(argv[3]) : 1000;
+		bench_sharing(worker_count, passes);
+		return 0;
+	}
+	// Parse the render options following the scene file
+	const char *scene_file = argv[1];
+	options_t options = {0};
+	options.start_time = start_time;
+	for (i32 i = 2; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--accel") == 0) && ((i + 1) < argc))
+			options.accel = argv[++i];
+		else if ((strcmp(argv[i], "--threads") == 0) && ((i + 1) < argc))
+		{
+			const i32 threads = atoi(argv[++i]);
+			options.threads = (threads > 0) ? (u32) threads : 0;
+		}
+		else if (strcmp(argv[i], "--single-threaded") == 0)
+			options.single_threaded = true;
+		else if (strcmp(argv[i], "--pin") == 0)
+			options.pin = true;
+		else if (strcmp(argv[i], "--replicate") == 0)
+			options.replicate = true;
+		else if (strcmp(argv[i], "--numa-stats") == 0)
+			options.numa_stats = true;
+		else if ((strcmp(argv[i], "--processes") == 0) && ((i + 1) < argc))
+		{
+			const i32 processes = atoi(argv[++i]);
+			options.processes = (processes > 0) ? (u32) processes : 0;
+		}
+		else if ((strcmp(argv[i], "--lease-timeout") == 0) && ((i + 1) < argc))
+			options.lease_timeout = atof(argv[++i]);
+		else if ((strcmp(argv[i], "--region") == 0) && ((i + 1) < argc))
+		{
+			rect_t *region = &options.partial_params.region;
+			if (sscanf(argv[++i], "%d,%d,%d,%d", &region->x, &region->y, &region->w, &region->h) != 4)
+				printf("Region should be x,y,w,h\n");
+			options.partial = true;
+		}
+		else if ((strcmp(argv[i], "--sample-range") == 0) && ((i + 1) < argc))
+		{
+			partial_params_t *params = &options.partial_params;
+			if (sscanf(argv[++i], "%d,%d", &params->first_sample, &params->sample_count) != 2)
+				printf("Sample range should be first,count\n");
+			options.partial = true;
+		}
+		else if ((strcmp(argv[i], "--checkpoint") == 0) && ((i + 1) < argc))
+		{
+			options.checkpoint_file = argv[++i];
+			options.checkpoint = true;
+		}
+		else if ((strcmp(argv[i], "--checkpoint-interval") == 0) && ((i + 1) < argc))
+		{
+			options.checkpoint_interval = atof(argv[++i]);
+			options.checkpoint = true;
+		}
+		else if ((strcmp(argv[i], "--checkpoint-tiles") == 0) && ((i + 1) < argc))
+		{
+			const i32 tiles = atoi(argv[++i]);
+			options.checkpoint_tiles = (tiles > 0) ? (u32) tiles : 0;
+			options.checkpoint = true;
+		}
+		else if (strcmp(argv[i], "--resume") == 0)
+		{
+			options.resume = true;
+			options.checkpoint = true;
+		}
+		else if ((strcmp(argv[i], "--stop-timeout") == 0) && ((i + 1) < argc))
+		{
+			const i32 timeout = atoi(argv[++i]);
+			options.stop_timeout = (timeout > 0) ? (u32) timeout : 0;
+		}
+		else if ((strcmp(argv[i], "--partial") == 0) && ((i + 1) < argc))
+		{
+			options.partial_file = argv[++i];
+			options.partial = true;
+		}
+		else
+			printf("Unknown option \"%s\"\n", argv[i]);
+	}
+	// Start the worker threads before anything runs jobs on them
+	job_pool_init(options.threads, options.pin);
+	printf("Using %u threads%s, %u NUMA nodes\n", job_thread_count(), options.pin ? " (pinned)" : "", job_node_count());
 	// Seed the RNG
-	// TODO: Implement better, faster RNG
-	srand(time(NULL));
+	// NOTE: Only for the main thread, render samples are seeded from their pixel
+	rand_seed((u64) time(NULL));
 
 	// Load the scene from a JSON file
 	printf("Loading scene...");
-	scene_t *scene = scene_load(argv[1]);
+	// NOTE: Scripts that merge partials rely on a failed partial exiting with an error
+	i32 result = 0;
+	scene_t *scene = scene_load(scene_file);
 	if (scene)
 	{
 		printf("done\n");
 
-		// Build the BVH for the world
-		printf("Building bvh...");
-		world_build_bvh(&scene->world);
-		printf("done\n");
+		// Build the accelerator for the world
+		// NOTE: A tree is loaded from the cache file next to the scene if it has been built before
+		{
+			char cache_file[512];
+			snprintf(cache_file, sizeof(cache_file), "%s.bvh", scene_file);
+
+			scene->bvh.worker_count = job_thread_count();
+			// Animations need the spheres to write the page file again
+			scene->page.keep_spheres = (scene->animation.frames > 0);
+			accel_params_t params = { scene->bvh, scene->grid, cache_file };
+			params.page = scene->page;
+			params.lod = scene->lod;
+			const accel_t *accel = select_accel(scene, options.accel ? options.accel : scene->accel, &params);
+			// NOTE: A scene that reuses its page file never loaded the spheres, so nothing else can be built over it
+			if (accel && scene->page.reuse && (accel != &accel_paged))
+			{
+				printf("Scene spheres are only in the page file \"%s\", remove it to use the %s accelerator\n",
+					scene->page.file, accel->name);
+				accel = NULL;
+			}
+			if (!accel)
+			{
+				world_free(&scene->world);
+				free(scene);
+				return 1;
+			}
+			// Keep any parameters the automatic pick changed, for rebuilds
+			scene->grid = params.grid;
+
+			printf("Building %s accelerator...", accel->name);
+			world_build_accel(&scene->world, accel, &params);
+			if (scene->page.reuse && (scene->world.pager.chunk_count == 0))
+			{
+				printf("failed\n");
+				world_free(&scene->world);
+				free(scene);
+				return 1;
+			}
+			if (scene->page.reuse)
+				printf("reused \"%s\" (%u spheres)...", scene->page.file, scene->world.sphere_count);
+			accel_stats_t stats;
+			accel->stats(&scene->world, &stats);
+			printf("done\n%s build took %f seconds (%u nodes, %u references, %zu KB)\n",
+				accel->name, stats.build_time, stats.node_count, stats.index_count, stats.memory / 1024);
+			// Output startup time, comparing the cache load time against the original build time
+			const bvh_t *bvh = &scene->world.bvh;
+			if (bvh->mapping)
+				printf("BVH loaded from \"%s\" (build took %f seconds)\n", cache_file, bvh->build_time);
+		}
+		// Build the object and instance BVHs
+		if (scene->world.instance_count > 0)
+		{
+			printf("Building instance bvh...");
+			const f64 start = time_now();
+			world_build_instances(&scene->world, &scene->bvh);
+			const f64 end = time_now();
+			printf("done\nInstance BVH build took %f seconds\n", (end - start));
+			print_instance_stats(&scene->world);
+		}
+		// Copy the geometry to every NUMA node
+		// NOTE: Animations refit the tree in place, which the copies wouldn't see
+		scene->tiles.count_loads = options.numa_stats;
+		if (options.replicate)
+		{
+			if ((scene->animation.frames == 0) && world_replicate(&scene->world))
+				printf("Geometry replicated on %u NUMA nodes\n", scene->world.replica_count);
+			else
+				printf("Geometry not replicated, it needs pinned threads on several NUMA nodes, a fully built tree and a still image\n");
+		}
+
+		// Checkpoint still images rendered in tiles
+		char checkpoint_file[512];
+		if (options.checkpoint)
+		{
+			if ((scene->animation.frames > 0) || options.partial || (options.processes > 0) || options.single_threaded)
+				printf("Checkpoints are only written for still images rendered in tiles by this process\n");
+			if (options.checkpoint_file)
+			{
+				snprintf(checkpoint_file, sizeof(checkpoint_file), "%s", options.checkpoint_file);
+			} else {
+				const char *extension = strrchr(scene->output, '.');
+				const i32 base_len = extension ? (i32) (extension - scene->output) : (i32) strlen(scene->output);
+				snprintf(checkpoint_file, sizeof(checkpoint_file), "%.*s.checkpoint", base_len, scene->output);
+			}
+			tile_checkpoint_params_t *checkpoint = &scene->tiles.checkpoint;
+			checkpoint->file = (scene->animation.frames == 0) ? checkpoint_file : NULL;
+			checkpoint->scene_hash = scene->hash;
+			checkpoint->interval = options.checkpoint_interval;
+			checkpoint->tile_interval = options.checkpoint_tiles;
+			if ((checkpoint->interval <= 0.0) && (checkpoint->tile_interval == 0))
+				checkpoint->interval = TILE_DEFAULT_CHECKPOINT_INTERVAL;
+			checkpoint->resume = options.resume;
+		}
 
 		framebuffer_t framebuffer;
 		framebuffer_alloc(&framebuffer, scene->w, scene->h);
+		// Stop rendering on SIGINT or SIGTERM, the image is still saved with whatever samples it got
+		install_stop_handlers(options.stop_timeout);
 		
-		// Begin rendering
-		printf("Rendering...");
-		{
-			const clock_t start = clock();
-			#if USE_TILES
-				// Render using tile-based parallel method
-				render_tiles(scene, &framebuffer, 8);
-			#else
-				// Render using a single core method
-				// NOTE: Only use this as a benchmark!
-				rect_t area = { 0,0,framebuffer.width,framebuffer.height};
-				render(
-					&scene->world, 
-					&scene->camera,
-					scene->samples, 
-					scene->bounces, 
-					&framebuffer, area);
-			#endif
-			// Output render time
-			const clock_t end = clock();
-			const double time = (double) (end - start) / CLOCKS_PER_SEC;
-			printf("done\nRender took %f seconds\n", time);
-		}
-
-		#if 0
-		draw_bvh(
-			&scene->camera, 
-			scene->world.bvh,
-			&framebuffer);
-		#endif
-
-		// Allocate an output image
-		image_t image;
-		image_alloc(&image, scene->w, scene->h);
-		// Resolve the framebuffer to the image
-		printf("Storing framebuffer...");
-		{
-			const clock_t start = clock();
-			
-			framebuffer_resolve(&image, &framebuffer);
-			
-			const clock_t end = clock();
-			const double time = (double) (end - start) / CLOCKS_PER_SEC;
-			printf("done\nStore took %f seconds\n", time);
-		}
-		image_save(&image, scene->output);
+		// Render every frame if the scene is animated, otherwise a single image or part of one
+		if (scene->animation.frames > 0)
+			render_animation(scene, &options, &framebuffer);
+		else if (options.partial)
+			result = render_partial(scene, &options) ? 0 : 1;
+		else
+			render_still(scene, &options, &framebuffer);
+		// The output is stored, so the watchdog can't throw it away anymore
+		// NOTE: A cancelled render exits with 128 plus the signal, like a shell reports a process the signal killed,
+		// so a scheduler can tell a partial image from a finished one
+		alarm(0);
+		if (render_cancelled())
+			result = 128 + stop_signal;
 		// Cleanup
+		// NOTE: The page file is only scratch space for this run, unless the scene keeps it for the next one
+		const bool paged = (scene->world.pager.chunk_count > 0) && !scene->page.keep_file;
 		framebuffer_free(&framebuffer);
-		image_free(&image);
+		world_free(&scene->world);
+		if (paged)
+			remove(scene->page.file);
 		free(scene);
-	} else printf("Failed to load scene \"%s\"", argv[1]);
-	return 0;
+	} else {
+		printf("Failed to load scene \"%s\"\n", scene_file);
+		result = 1;
+	}
+	return result;
 }
\ No newline at end of file
@@ -0,0 +1,445 @@
+// NOTE: madvise and posix_fadvise aren't part of the base POSIX feature set
+#define _DEFAULT_SOURCE
+
+#include "page.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Page file identifier, "PTPG"
+#define PAGE_FILE_MAGIC		0x47505450
+#define PAGE_FILE_VERSION	2
+// Alignment of the arrays inside a chunk, chunks themselves start on a page
+#define PAGE_FILE_ALIGN		64
+// Default memory budget for resident chunks
+#define PAGE_DEFAULT_BUDGET	megabytes(256)
+// Default number of spheres in a chunk
+#define PAGE_DEFAULT_CHUNK_SIZE	65536
+
+// Page file header, followed by the chunks and then the chunk table
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	u32 chunk_count;
+	u32 sphere_size;
+	u64 table_offset;
+	// Hash of the geometry and parameters the file was built from
+	u64 key;
+} page_file_header_t;
+// Chunk table entry
+typedef struct
+{
+	aabb_t bounds;
+	u64 offset;
+	u64 size;
+	u32 node_count;
+	u32 sphere_count;
+} page_file_chunk_t;
+
+static inline u64 page_align(u64 offset, u64 alignment)
+{
+	return ((offset + alignment - 1) / alignment)*alignment;
+};
+static inline u64 page_size()
+{
+	return (u64) sysconf(_SC_PAGESIZE);
+};
+// Write zeros up to an aligned offset
+static bool page_write_padding(FILE *f, u64 *offset, u64 alignment)
+{
+	static const u8 zeros[4096] = {0};
+	const u64 aligned = page_align(*offset, alignment);
+	bool result = true;
+	while ((*offset < aligned) && result)
+	{
+		const size_t size = (size_t) min(aligned - *offset, (u64) sizeof(zeros));
+		result = (fwrite(zeros, 1, size, f) == size);
+		*offset += size;
+	}
+	return result;
+};
+
+// Get the key a page file is stored with, from the geometry's hash and everything that changes how it's chunked
+static u64 page_file_key(const page_params_t *params, size_t sphere_size, u32 chunk_size, const bvh_params_t *bvh_params)
+{
+	const u32 key[] = { PAGE_FILE_VERSION, (u32) sphere_size, sizeof(bvh_node_t), chunk_size, bvh_params->builder, bvh_params->optimize };
+	return hash_bytes(params->key, key, sizeof(key));
+};
+// Get the tree parameters of the chunks, which are always plain binary trees
+static bvh_params_t page_chunk_params(const bvh_params_t *bvh_params)
+{
+	bvh_params_t chunk_params = *bvh_params;
+	chunk_params.compress = false;
+	chunk_params.reorder = false;
+	chunk_params.stackless = false;
+	chunk_params.lazy = false;
+	return chunk_params;
+};
+static u32 page_chunk_size(const page_params_t *params)
+{
+	return (params->chunk_size > 0) ? params->chunk_size : PAGE_DEFAULT_CHUNK_SIZE;
+};
+
+// Spread the lower 10 bits of a value out to every third bit
+static inline u32 page_morton_expand(u32 v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+};
+static int page_key_compare(const void *a, const void *b)
+{
+	const u64 ka = *(const u64*) a;
+	const u64 kb = *(const u64*) b;
+	return (ka > kb) - (ka < kb);
+};
+// Sort the spheres along a morton curve, so consecutive runs of them are spatially coherent
+// NOTE: Returns sort keys with the sphere index in the low 32 bits, which have to be freed by the caller
+static u64* page_morton_order(const aabb_t *bounds, u32 count)
+{
+	aabb_t centroid_bounds = aabb_empty();
+	for (u32 i = 0; i < count; i++)
+	{
+		const v3 center = aabb_center(bounds[i]);
+		centroid_bounds = aabb_extend(centroid_bounds, center);
+	}
+	const v3 extent = v3_sub(centroid_bounds.max, centroid_bounds.min);
+	u64 *keys = malloc(count*sizeof(u64));
+	assert((keys != NULL) || (count == 0));
+	for (u32 i = 0; i < count; i++)
+	{
+		const v3 center = aabb_center(bounds[i]);
+		u32 cell[3];
+		for (u32 j = 0; j < 3; j++)
+		{
+			const f32 t = (extent.v[j] > 0.f) ? ((center.v[j] - centroid_bounds.min.v[j]) / extent.v[j]) : 0.f;
+			cell[j] = (u32) clamp((i32) (t*1024.f), 0, 1023);
+		}
+		const u32 code = (page_morton_expand(cell[0]) << 2) | (page_morton_expand(cell[1]) << 1) | page_morton_expand(cell[2]);
+		keys[i] = ((u64) code << 32) | i;
+	}
+	qsort(keys, count, sizeof(u64), page_key_compare);
+	return keys;
+};
+
+// Build a chunk from a run of sorted spheres and write it to the page file
+static bool page_write_chunk(FILE *f, u64 *offset, const u64 *keys, u32 count,
+	const aabb_t *bounds, const u8 *spheres, size_t sphere_size, const bvh_params_t *bvh_params, page_file_chunk_t *entry)
+{
+	// Gather the chunk bounds, and build its tree
+	aabb_t *chunk_bounds = malloc(count*sizeof(aabb_t));
+	u8 *chunk_spheres = malloc(count*sphere_size);
+	assert((chunk_bounds != NULL) && (chunk_spheres != NULL));
+	entry->bounds = aabb_empty();
+	for (u32 i = 0; i < count; i++)
+	{
+		chunk_bounds[i] = bounds[(u32) keys[i]];
+		entry->bounds = aabb_combine(entry->bounds, chunk_bounds[i]);
+	}
+	bvh_t bvh;
+	bvh_build(&bvh, chunk_bounds, count, bvh_params);
+	// Store the spheres in leaf order, so the leaves reference sequential memory
+	for (u32 i = 0; i < count; i++)
+	{
+		memcpy(chunk_spheres + i*sphere_size, spheres + (u32) keys[bvh.indices[i]]*sphere_size, sphere_size);
+		bvh.indices[i] = i;
+	}
+
+	// Nodes, indices and spheres, the chunk starts on a page so it can be paged in and out on its own
+	bool result = page_write_padding(f, offset, page_size());
+	entry->offset = *offset;
+	entry->node_count = bvh.node_count;
+	entry->sphere_count = count;
+	result &= (fwrite(bvh.nodes, sizeof(bvh_node_t), bvh.node_count, f) == bvh.node_count);
+	*offset += bvh.node_count*sizeof(bvh_node_t);
+	result &= page_write_padding(f, offset, PAGE_FILE_ALIGN);
+	result &= (fwrite(bvh.indices, sizeof(u32), count, f) == count);
+	*offset += count*sizeof(u32);
+	result &= page_write_padding(f, offset, PAGE_FILE_ALIGN);
+	result &= (fwrite(chunk_spheres, sphere_size, count, f) == count);
+	*offset += count*sphere_size;
+	entry->size = (*offset - entry->offset);
+
+	bvh_free(&bvh);
+	free(chunk_spheres);
+	free(chunk_bounds);
+	return result;
+};
+// Write every chunk to the page file, returns false if it couldn't be written
+static bool page_write(const char *file_name, u64 key, const aabb_t *bounds, const u8 *spheres, size_t sphere_size, u32 count,
+	u32 chunk_size, const bvh_params_t *bvh_params)
+{
+	FILE *f = fopen(file_name, "wb");
+	if (!f)
+		return false;
+
+	u64 *keys = page_morton_order(bounds, count);
+	page_file_header_t header = {0};
+	header.magic = PAGE_FILE_MAGIC;
+	header.version = PAGE_FILE_VERSION;
+	header.chunk_count = (count + chunk_size - 1) / chunk_size;
+	header.sphere_size = (u32) sphere_size;
+	header.key = key;
+	page_file_chunk_t *table = malloc(header.chunk_count*sizeof(page_file_chunk_t));
+	assert((table != NULL) || (header.chunk_count == 0));
+
+	// The header is written again once the table offset is known
+	bool result = (fwrite(&header, sizeof(header), 1, f) == 1);
+	u64 offset = sizeof(header);
+	for (u32 i = 0; (i < header.chunk_count) && result; i++)
+	{
+		const u32 first = i*chunk_size;
+		result = page_write_chunk(f, &offset, keys + first, min(count - first, chunk_size),
+			bounds, spheres, sphere_size, bvh_params, table + i);
+	}
+	result &= page_write_padding(f, &offset, PAGE_FILE_ALIGN);
+	header.table_offset = offset;
+	result &= (fwrite(table, sizeof(page_file_chunk_t), header.chunk_count, f) == header.chunk_count);
+	result &= (fseek(f, 0, SEEK_SET) == 0);
+	result &= (fwrite(&header, sizeof(header), 1, f) == 1);
+	// Flush the file and drop it from the page cache, so paging in really reads from the disk
+	result &= (fflush(f) == 0);
+	if (result)
+	{
+		fdatasync(fileno(f));
+		posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+	}
+	result &= (fclose(f) == 0);
+
+	free(table);
+	free(keys);
+	return result;
+};
+
+bool page_file_matches(const page_params_t *params, size_t sphere_size, const bvh_params_t *bvh_params)
+{
+	FILE *f = fopen(params->file, "rb");
+	if (!f)
+		return false;
+	page_file_header_t header;
+	const bvh_params_t chunk_params = page_chunk_params(bvh_params);
+	const bool result = (fread(&header, sizeof(header), 1, f) == 1) &&
+		(header.magic == PAGE_FILE_MAGIC) && (header.version == PAGE_FILE_VERSION) &&
+		(header.key == page_file_key(params, sphere_size, page_chunk_size(params), &chunk_params));
+	fclose(f);
+	return result;
+};
+bool page_build(pager_t *pager, const aabb_t *bounds, const void *spheres, size_t sphere_size, u32 count,
+	const page_params_t *params, const bvh_params_t *bvh_params)
+{
+	memset(pager, 0, sizeof(pager_t));
+	const bvh_params_t chunk_params = page_chunk_params(bvh_params);
+	const u32 chunk_size = page_chunk_size(params);
+	const u64 key = page_file_key(params, sphere_size, chunk_size, &chunk_params);
+	if (!page_write(params->file, key, bounds, spheres, sphere_size, count, chunk_size, &chunk_params))
+	{
+		remove(params->file);
+		return false;
+	}
+	return page_open(pager, params, sphere_size, bvh_params);
+};
+bool page_open(pager_t *pager, const page_params_t *params, size_t sphere_size, const bvh_params_t *bvh_params)
+{
+	memset(pager, 0, sizeof(pager_t));
+	const bvh_params_t chunk_params = page_chunk_params(bvh_params);
+	// Map the file in
+	const int fd = open(params->file, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if ((fstat(fd, &st) != 0) || ((size_t) st.st_size < sizeof(page_file_header_t)))
+	{
+		close(fd);
+		return false;
+	}
+	pager->mapping_size = st.st_size;
+	pager->mapping = mmap(NULL, pager->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pager->mapping == MAP_FAILED)
+	{
+		pager->mapping = NULL;
+		return false;
+	}
+	// NOTE: Chunks are paged in whole, reading ahead past them would only pull in chunks nobody asked for
+	madvise(pager->mapping, pager->mapping_size, MADV_RANDOM);
+
+	// Check the file was built from the same geometry, with room for its chunk table
+	const page_file_header_t *header = (const page_file_header_t*) pager->mapping;
+	if ((header->magic != PAGE_FILE_MAGIC) || (header->version != PAGE_FILE_VERSION) ||
+		(header->key != page_file_key(params, sphere_size, page_chunk_size(params), &chunk_params)) ||
+		((header->table_offset + (u64) header->chunk_count*sizeof(page_file_chunk_t)) > pager->mapping_size))
+	{
+		page_free(pager);
+		return false;
+	}
+	// Point the chunks into the mapping
+	const page_file_chunk_t *table = (const page_file_chunk_t*) (pager->mapping + header->table_offset);
+	pager->chunk_count = header->chunk_count;
+	pager->chunks = malloc(pager->chunk_count*sizeof(page_chunk_t));
+	aabb_t *chunk_bounds = malloc(pager->chunk_count*sizeof(aabb_t));
+	assert(((pager->chunks != NULL) && (chunk_bounds != NULL)) || (pager->chunk_count == 0));
+	for (u32 i = 0; i < pager->chunk_count; i++)
+	{
+		const page_file_chunk_t *entry = table + i;
+		page_chunk_t *chunk = pager->chunks + i;
+		memset(chunk, 0, sizeof(page_chunk_t));
+		chunk->bounds = entry->bounds;
+		chunk->offset = entry->offset;
+		chunk->size = page_align(entry->size, page_size());
+		// NOTE: Laid out the same way they were written
+		u64 offset = entry->offset;
+		chunk->bvh.node_count = entry->node_count;
+		chunk->bvh.nodes = (bvh_node_t*) (pager->mapping + offset);
+		offset = page_align(offset + entry->node_count*sizeof(bvh_node_t), PAGE_FILE_ALIGN);
+		chunk->bvh.index_count = entry->sphere_count;
+		chunk->bvh.indices = (u32*) (pager->mapping + offset);
+		offset = page_align(offset + entry->sphere_count*sizeof(u32), PAGE_FILE_ALIGN);
+		chunk->spheres = pager->mapping + offset;
+		chunk->sphere_count = entry->sphere_count;
+		chunk->state = PAGE_CHUNK_OUT;
+		chunk_bounds[i] = chunk->bounds;
+		pager->sphere_count += entry->sphere_count;
+	}
+	// The top level tree stays in memory
+	bvh_build(&pager->top, chunk_bounds, pager->chunk_count, &chunk_params);
+	free(chunk_bounds);
+
+	pager->residency = malloc(sizeof(page_residency_t));
+	assert(pager->residency != NULL);
+	memset(pager->residency, 0, sizeof(page_residency_t));
+	pager->residency->budget = (params->budget > 0) ? params->budget : PAGE_DEFAULT_BUDGET;
+	return true;
+};
+void page_free(pager_t *pager)
+{
+	bvh_free(&pager->top);
+	if (pager->mapping)
+		munmap(pager->mapping, pager->mapping_size);
+	free(pager->chunks);
+	free(pager->residency);
+	memset(pager, 0, sizeof(pager_t));
+};
+
+static inline void page_lock(page_residency_t *residency)
+{
+	while (!atomic_cas(&residency->lock, 0, 1))
+		_mm_pause();
+};
+static inline void page_unlock(page_residency_t *residency)
+{
+	atomic_store_release(&residency->lock, 0);
+};
+// Evict the least recently used chunk no ray is using, returns false if there is none
+// NOTE: Has to be called with the lock held
+static bool page_evict(const pager_t *pager)
+{
+	page_residency_t *residency = pager->residency;
+	page_chunk_t *oldest = NULL;
+	u32 oldest_age = 0;
+	for (u32 i = 0; i < pager->chunk_count; i++)
+	{
+		page_chunk_t *chunk = pager->chunks + i;
+		// NOTE: Ages are differences, so the clock can wrap around
+		const u32 age = (residency->clock - chunk->last_used);
+		if ((chunk->state == PAGE_CHUNK_RESIDENT) && (chunk->users == 0) && (!oldest || (age > oldest_age)))
+		{
+			oldest = chunk;
+			oldest_age = age;
+		}
+	}
+	if (!oldest)
+		return false;
+	// Drop the pages, the next access reads them from the file again
+	// NOTE: A ray that starts using the chunk right now still reads valid data, the pages just fault back in
+	madvise(pager->mapping + oldest->offset, oldest->size, MADV_DONTNEED);
+	oldest->state = PAGE_CHUNK_OUT;
+	residency->resident_bytes -= oldest->size;
+	residency->resident_chunks--;
+	residency->evictions++;
+	return true;
+};
+const page_chunk_t* page_acquire(const pager_t *pager, u32 index)
+{
+	assert(index < pager->chunk_count);
+	page_chunk_t *chunk = pager->chunks + index;
+	page_residency_t *residency = pager->residency;
+	atomic_inc(&chunk->users);
+	// Stamp the chunk with the clock, which only ticks when a chunk is paged in
+	// NOTE: Hits only read the clock, and only write the stamp when it's out of date, so render threads don't all
+	// write the same cache line on every chunk they visit
+	const u32 now = residency->clock;
+	if (chunk->last_used != now)
+		chunk->last_used = now;
+	if (atomic_load_acquire(&chunk->state) == PAGE_CHUNK_RESIDENT)
+		return chunk;
+
+	page_lock(residency);
+	const u32 state = chunk->state;
+	if (state == PAGE_CHUNK_OUT)
+	{
+		chunk->last_used = atomic_inc(&residency->clock);
+		// Make room for the chunk, then page it in outside of the lock
+		chunk->state = PAGE_CHUNK_LOADING;
+		while (((residency->resident_bytes + chunk->size) > residency->budget) && page_evict(pager))
+			;
+		residency->resident_bytes += chunk->size;
+		residency->peak_resident_bytes = max(residency->peak_resident_bytes, residency->resident_bytes);
+		residency->resident_chunks++;
+		page_unlock(residency);
+
+		const f64 start = time_now();
+		u8 *begin = pager->mapping + chunk->offset;
+		madvise(begin, chunk->size, MADV_WILLNEED);
+		// Touch every page, so the ray doesn't fault on each one separately
+		volatile u8 sink = 0;
+		for (u64 i = 0; i < chunk->size; i += page_size())
+			sink += begin[i];
+		(void) sink;
+		const f64 stall = (time_now() - start);
+
+		page_lock(residency);
+		residency->page_ins++;
+		residency->stall_time += stall;
+		page_unlock(residency);
+		atomic_store_release(&chunk->state, PAGE_CHUNK_RESIDENT);
+		return chunk;
+	}
+	page_unlock(residency);
+	if (state == PAGE_CHUNK_LOADING)
+	{
+		// Another ray is paging the chunk in, wait for it
+		const f64 start = time_now();
+		while (atomic_load_acquire(&chunk->state) != PAGE_CHUNK_RESIDENT)
+			_mm_pause();
+		page_lock(residency);
+		residency->stall_time += (time_now() - start);
+		page_unlock(residency);
+	}
+	return chunk;
+};
+void page_release(const pager_t *pager, u32 index)
+{
+	assert(index < pager->chunk_count);
+	atomic_dec(&pager->chunks[index].users);
+};
+void page_stats(const pager_t *pager, page_stats_t *stats)
+{
+	memset(stats, 0, sizeof(page_stats_t));
+	stats->chunk_count = pager->chunk_count;
+	stats->file_bytes = pager->mapping_size;
+	const page_residency_t *residency = pager->residency;
+	if (!residency)
+		return;
+	stats->budget = residency->budget;
+	stats->resident_chunks = residency->resident_chunks;
+	stats->resident_bytes = residency->resident_bytes;
+	stats->peak_resident_bytes = residency->peak_resident_bytes;
+	stats->page_ins = residency->page_ins;
+	stats->evictions = residency->evictions;
+	stats->stall_time = residency->stall_time;
+};
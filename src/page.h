@@ -0,0 +1,128 @@
+#ifndef PAGE_H
+#define PAGE_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "bvh.h"
+
+// Chunk residency state
+typedef enum
+{
+	// Only on disk
+	PAGE_CHUNK_OUT,
+	// Being paged in by a thread, others wait for it
+	PAGE_CHUNK_LOADING,
+	// In memory, counted against the budget
+	PAGE_CHUNK_RESIDENT,
+} page_chunk_state_t;
+
+// Paging parameters
+typedef struct
+{
+	// File the chunks are written to, and mapped back from
+	char file[512];
+	// Memory budget for resident chunks in bytes, 0 uses the default
+	u64 budget;
+	// Number of spheres in each chunk, 0 uses the default
+	u32 chunk_size;
+	// Keep the world sphere array after paging it out, for animations and tests
+	// NOTE: Otherwise the spheres only exist in the page file
+	bool keep_spheres;
+	// Keep the page file after the run, so later runs of the same geometry can map it again
+	bool keep_file;
+	// Hash of the geometry the spheres are made from, stored in the page file
+	u64 key;
+	// Map the kept page file instead of building one, the spheres were never loaded
+	bool reuse;
+} page_params_t;
+
+// Spatially coherent group of spheres with its own BVH, stored in the page file
+// NOTE: The spheres are in leaf order of the chunk BVH
+typedef struct
+{
+	// Bounds of the chunk spheres
+	aabb_t bounds;
+	// Byte range of the chunk data in the page file
+	u64 offset;
+	u64 size;
+	// Chunk BVH and spheres, pointing into the file mapping
+	// NOTE: Always valid, even when the chunk isn't resident the pages are just read from disk on access
+	bvh_t bvh;
+	const void *spheres;
+	u32 sphere_count;
+	// Residency state, the number of rays using the chunk, and the time it was last used
+	volatile u32 state;
+	volatile u32 users;
+	volatile u32 last_used;
+} page_chunk_t;
+
+// Paging statistics
+typedef struct
+{
+	u32 chunk_count;
+	u32 resident_chunks;
+	// Size of the page file, and the memory budget
+	u64 file_bytes;
+	u64 budget;
+	// Bytes of resident chunks, now and at most
+	u64 resident_bytes;
+	u64 peak_resident_bytes;
+	// Number of chunks paged in and evicted
+	u32 page_ins;
+	u32 evictions;
+	// Time rays spent waiting for chunks to be paged in, summed over every thread
+	f64 stall_time;
+} page_stats_t;
+
+// Residency bookkeeping, changed by rays during traversal
+typedef struct
+{
+	u64 budget;
+	// Counter for the least recently used order, ticks every time a chunk is paged in
+	volatile u32 clock;
+	// Spin lock guarding everything below
+	volatile u32 lock;
+	u64 resident_bytes;
+	u64 peak_resident_bytes;
+	u32 resident_chunks;
+	u32 page_ins;
+	u32 evictions;
+	f64 stall_time;
+} page_residency_t;
+
+// Out-of-core geometry, chunks are paged in from a memory mapped file as rays reach them and evicted least recently used first
+typedef struct
+{
+	// Top level BVH over the chunk bounds
+	bvh_t top;
+	u32 chunk_count;
+	page_chunk_t *chunks;
+	// Read-only mapping of the page file
+	u8 *mapping;
+	size_t mapping_size;
+	page_residency_t *residency;
+	// Number of spheres in every chunk
+	u32 sphere_count;
+} pager_t;
+
+// Split spheres into chunks, build a BVH for each one and write them to the page file, then map it
+// NOTE: Spheres are given as their bounds and raw sphere records of sphere_size bytes, so this doesn't depend on the world, returns false if the file couldn't be written.
+// Building needs every sphere in memory, along with their bounds and sort keys. To render more spheres than fit, keep the
+// page file: build it once where they fit, and later runs of the same geometry map it with page_open without loading them
+bool page_build(pager_t *pager, const aabb_t *bounds, const void *spheres, size_t sphere_size, u32 count,
+	const page_params_t *params, const bvh_params_t *bvh_params);
+// Check if the page file was built from the same geometry key and parameters, without mapping it
+bool page_file_matches(const page_params_t *params, size_t sphere_size, const bvh_params_t *bvh_params);
+// Map a page file built before, returns false if it's missing or was built from something else
+bool page_open(pager_t *pager, const page_params_t *params, size_t sphere_size, const bvh_params_t *bvh_params);
+void page_free(pager_t *pager);
+// Make a chunk resident, paging it in and evicting others over the budget if needed
+// NOTE: Every acquire has to be followed by a release once the ray is done with the chunk
+const page_chunk_t* page_acquire(const pager_t *pager, u32 chunk);
+void page_release(const pager_t *pager, u32 chunk);
+// Get the paging statistics
+void page_stats(const pager_t *pager, page_stats_t *stats);
+
+#endif
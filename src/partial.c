@@ -0,0 +1,283 @@
+#include "partial.h"
+
+// Partial render file being merged
+typedef struct
+{
+	const char *name;
+	FILE *file;
+	partial_header_t header;
+} partial_file_t;
+
+// Get the size of a range's sums in a file, and where the sums of a range and the sample counts start
+static size_t partial_plane_size(const partial_header_t *header)
+{
+	return (size_t) header->region.w*(size_t) header->region.h*sizeof(v3);
+};
+static long partial_plane_offset(const partial_header_t *header, u32 range)
+{
+	return (long) (sizeof(partial_header_t) + (size_t) (range - header->first_range)*partial_plane_size(header));
+};
+static long partial_counts_offset(const partial_header_t *header)
+{
+	return partial_plane_offset(header, header->first_range + header->file_range_count);
+};
+
+bool partial_render(
+	const char *file_name, u64 scene_hash,
+	const world_t *world,
+	const camera_t *camera,
+	i32 width, i32 height,
+	i32 samples, i32 bounces,
+	const tile_params_t *tile_params,
+	const partial_params_t *params)
+{
+	// Split the samples into the same ranges the tiles use, so merged partials add up like a full render
+	tile_layout_t layout;
+	tile_layout(tile_params, (u32) width, (u32) height, samples, 1, &layout);
+
+	partial_header_t header = {0};
+	header.magic = PARTIAL_MAGIC;
+	header.version = PARTIAL_VERSION;
+	header.scene_hash = scene_hash;
+	header.width = (u32) width;
+	header.height = (u32) height;
+	header.samples = layout.samples;
+	header.range_samples = layout.range_samples;
+	header.range_count = layout.range_count;
+	// Clip the region to the frame
+	rect_t region = params->region;
+	if ((region.w <= 0) || (region.h <= 0))
+	{
+		region.x = region.y = 0;
+		region.w = width;
+		region.h = height;
+	}
+	const i32 x0 = clamp(region.x, 0, width);
+	const i32 y0 = clamp(region.y, 0, height);
+	const i32 x1 = clamp(region.x + region.w, x0, width);
+	const i32 y1 = clamp(region.y + region.h, y0, height);
+	header.region.x = x0;
+	header.region.y = y0;
+	header.region.w = (x1 - x0);
+	header.region.h = (y1 - y0);
+	if ((header.region.w == 0) || (header.region.h == 0))
+	{
+		printf("Partial region is outside the frame\n");
+		return false;
+	}
+	// Find the sample ranges, the samples have to start and end on their boundaries
+	const i32 first_sample = max(params->first_sample, 0);
+	const i32 end_sample = (params->sample_count > 0) ? min(first_sample + params->sample_count, layout.samples) : layout.samples;
+	if ((first_sample >= end_sample) || ((first_sample % (i32) layout.range_samples) != 0) ||
+		(((end_sample % (i32) layout.range_samples) != 0) && (end_sample != layout.samples)))
+	{
+		printf("Partial samples [%d, %d) don't line up with the %u sample ranges of the scene\n",
+			first_sample, end_sample, layout.range_samples);
+		return false;
+	}
+	header.first_range = (u32) first_sample / layout.range_samples;
+	header.file_range_count = ((u32) end_sample + layout.range_samples - 1) / layout.range_samples - header.first_range;
+
+	char temp_name[512];
+	snprintf(temp_name, sizeof(temp_name), "%s.tmp", file_name);
+	FILE *file = fopen(temp_name, "wb");
+	if (!file)
+	{
+		printf("Failed to create partial file \"%s\"\n", temp_name);
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, file);
+	// Render the sums of every range in turn, rows padded like tile sums
+	const rect_t area = header.region;
+	const u32 stride = (u32) (area.w + TILE_ROW_PIXELS - 1) / TILE_ROW_PIXELS * TILE_ROW_PIXELS;
+	const size_t size = (size_t) stride*(size_t) area.h*sizeof(v3);
+	v3 *sums = aligned_alloc(CACHE_LINE_SIZE, size);
+	assert(sums != NULL);
+	bool cancelled = false;
+	for (u32 r = header.first_range; (r < (header.first_range + header.file_range_count)) && !cancelled; r++)
+	{
+		const i32 range_first = (i32) (r*layout.range_samples);
+		const i32 range_count = min((i32) layout.range_samples, layout.samples - range_first);
+		memset(sums, 0, size);
+		cancelled = !tile_render_sums(world, camera, width, height, range_first, range_count, bounces, area, sums, stride);
+		for (i32 j = 0; (j < area.h) && !cancelled; j++)
+			fwrite(sums + j*stride, sizeof(v3), (size_t) area.w, file);
+	}
+	free(sums);
+	// NOTE: Every pixel of a partial has the same samples, so one that was cut short isn't written at all
+	if (cancelled)
+	{
+		printf("Rendering was cancelled, partial file \"%s\" wasn't written\n", file_name);
+		fclose(file);
+		remove(temp_name);
+		return false;
+	}
+	// Every pixel of the region has the same number of samples
+	const u32 count = (u32) (end_sample - first_sample);
+	for (i32 i = 0; i < (area.w*area.h); i++)
+		fwrite(&count, sizeof(u32), 1, file);
+
+	const bool failed = (ferror(file) != 0);
+	if ((fclose(file) != 0) || failed || (rename(temp_name, file_name) != 0))
+	{
+		printf("Failed to write partial file \"%s\"\n", file_name);
+		remove(temp_name);
+		return false;
+	}
+	return true;
+};
+
+// Open a partial file and check it's header
+static bool partial_open(partial_file_t *partial, const char *file_name)
+{
+	partial->name = file_name;
+	partial->file = fopen(file_name, "rb");
+	if (!partial->file)
+	{
+		printf("Failed to open partial file \"%s\"\n", file_name);
+		return false;
+	}
+	const partial_header_t *header = &partial->header;
+	if ((fread(&partial->header, sizeof(partial_header_t), 1, partial->file) != 1) ||
+		(header->magic != PARTIAL_MAGIC) || (header->version != PARTIAL_VERSION))
+	{
+		printf("\"%s\" isn't a partial render file, or is from another version\n", file_name);
+		return false;
+	}
+	// The region and ranges have to be inside the frame
+	const rect_t region = header->region;
+	if ((region.x < 0) || (region.y < 0) || (region.w <= 0) || (region.h <= 0) ||
+		((u32) (region.x + region.w) > header->width) || ((u32) (region.y + region.h) > header->height) ||
+		((header->first_range + header->file_range_count) > header->range_count))
+	{
+		printf("Partial file \"%s\" has a region or ranges outside the frame\n", file_name);
+		return false;
+	}
+	return true;
+};
+// Check that two partials are of the same frame
+static bool partial_matches(const partial_file_t *a, const partial_file_t *b)
+{
+	if (a->header.scene_hash != b->header.scene_hash)
+	{
+		printf("Partial files \"%s\" and \"%s\" are from different scenes\n", a->name, b->name);
+		return false;
+	}
+	if ((a->header.width != b->header.width) || (a->header.height != b->header.height) || (a->header.samples != b->header.samples) ||
+		(a->header.range_samples != b->header.range_samples) || (a->header.range_count != b->header.range_count))
+	{
+		printf("Partial files \"%s\" and \"%s\" have different frame sizes or samples\n", a->name, b->name);
+		return false;
+	}
+	return true;
+};
+bool partial_merge(framebuffer_t *framebuffer, const char **file_names, u32 file_count, partial_stats_t *stats)
+{
+	memset(stats, 0, sizeof(partial_stats_t));
+	memset(framebuffer, 0, sizeof(framebuffer_t));
+	if (file_count == 0)
+	{
+		printf("No partial files to merge\n");
+		return false;
+	}
+	partial_file_t *partials = malloc(file_count*sizeof(partial_file_t));
+	assert(partials != NULL);
+	memset(partials, 0, file_count*sizeof(partial_file_t));
+	bool result = true;
+	for (u32 i = 0; (i < file_count) && result; i++)
+		result = partial_open(partials + i, file_names[i]) && partial_matches(partials, partials + i);
+
+	v3 *sums = NULL, *plane = NULL;
+	u32 *counts = NULL, *owners = NULL, *row_counts = NULL;
+	const partial_header_t *frame = &partials[0].header;
+	const size_t pixel_count = (size_t) frame->width*(size_t) frame->height;
+	if (result)
+	{
+		sums = calloc(max(pixel_count, 1), sizeof(v3));
+		plane = malloc(max(pixel_count, 1)*sizeof(v3));
+		counts = calloc(max(pixel_count, 1), sizeof(u32));
+		owners = malloc(max(pixel_count, 1)*sizeof(u32));
+		row_counts = malloc(max(frame->width, 1)*sizeof(u32));
+		assert((sums != NULL) && (plane != NULL) && (counts != NULL) && (owners != NULL) && (row_counts != NULL));
+	}
+	// Add up the ranges in order, every pixel of a range comes from one file at most
+	for (u32 r = 0; result && (r < frame->range_count); r++)
+	{
+		memset(owners, 0, pixel_count*sizeof(u32));
+		for (u32 i = 0; result && (i < file_count); i++)
+		{
+			const partial_header_t *header = &partials[i].header;
+			if ((r < header->first_range) || (r >= (header->first_range + header->file_range_count)))
+				continue;
+			const rect_t region = header->region;
+			fseek(partials[i].file, partial_plane_offset(header, r), SEEK_SET);
+			for (i32 j = 0; result && (j < region.h); j++)
+			{
+				const size_t row = (size_t) (region.y + j)*frame->width + (size_t) region.x;
+				for (i32 x = 0; x < region.w; x++)
+				{
+					if (owners[row + x] != 0)
+					{
+						printf("Partial files \"%s\" and \"%s\" overlap\n", partials[owners[row + x] - 1].name, partials[i].name);
+						result = false;
+						break;
+					}
+					owners[row + x] = i + 1;
+				}
+				if (result && (fread(plane + row, sizeof(v3), (size_t) region.w, partials[i].file) != (size_t) region.w))
+				{
+					printf("Partial file \"%s\" is cut short\n", partials[i].name);
+					result = false;
+				}
+			}
+		}
+		for (size_t p = 0; result && (p < pixel_count); p++)
+		{
+			if (owners[p] != 0)
+				sums[p] = v3_add(sums[p], plane[p]);
+		}
+	}
+	// Add up the samples every pixel got
+	for (u32 i = 0; result && (i < file_count); i++)
+	{
+		const partial_header_t *header = &partials[i].header;
+		const rect_t region = header->region;
+		fseek(partials[i].file, partial_counts_offset(header), SEEK_SET);
+		for (i32 j = 0; result && (j < region.h); j++)
+		{
+			if (fread(row_counts, sizeof(u32), (size_t) region.w, partials[i].file) != (size_t) region.w)
+			{
+				printf("Partial file \"%s\" is cut short\n", partials[i].name);
+				result = false;
+				break;
+			}
+			const size_t row = (size_t) (region.y + j)*frame->width + (size_t) region.x;
+			for (i32 x = 0; x < region.w; x++)
+				counts[row + x] += row_counts[x];
+		}
+	}
+	// Average the samples of every pixel, pixels without any stay black
+	if (result)
+	{
+		framebuffer_alloc(framebuffer, (i32) frame->width, (i32) frame->height);
+		for (size_t p = 0; p < pixel_count; p++)
+		{
+			framebuffer->pixels[p] = (counts[p] > 0) ? v3_scale(sums[p], 1.f / (f32) counts[p]) : V3(0.f, 0.f, 0.f);
+			stats->samples_taken += counts[p];
+		}
+		stats->file_count = file_count;
+		stats->frame_samples = (u64) pixel_count*(u64) frame->samples;
+	}
+	for (u32 i = 0; i < file_count; i++)
+	{
+		if (partials[i].file)
+			fclose(partials[i].file);
+	}
+	free(partials);
+	free(sums);
+	free(plane);
+	free(counts);
+	free(owners);
+	free(row_counts);
+	return result;
+};
@@ -0,0 +1,71 @@
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "framebuffer.h"
+#include "world.h"
+#include "tile.h"
+
+// Partial render file identifier and version, the version changes with the layout
+#define PARTIAL_MAGIC	0x54524150
+#define PARTIAL_VERSION	1
+
+// Header of a partial render file
+// NOTE: Followed by the sums of every sample range in the file, each a row by row plane of the region's pixels,
+// then the number of samples summed for every pixel of the region
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	// Hash of the scene file the partial was rendered from
+	u64 scene_hash;
+	// Size of the whole frame, and the samples of every pixel and the ranges they're split into
+	u32 width, height;
+	i32 samples;
+	u32 range_samples;
+	u32 range_count;
+	// Pixels in the file, and the sample ranges [first_range, first_range+file_range_count) they have sums for
+	rect_t region;
+	u32 first_range;
+	u32 file_range_count;
+} partial_header_t;
+
+// Part of a frame to render
+typedef struct
+{
+	// Pixels to render, an empty region renders the whole frame
+	rect_t region;
+	// Samples [first_sample, first_sample+sample_count) of every pixel, a count of 0 renders the rest of them
+	// NOTE: Has to start and end on the boundaries of the tile sample ranges, or at the last sample
+	i32 first_sample, sample_count;
+} partial_params_t;
+
+// Partial merge statistics
+typedef struct
+{
+	u32 file_count;
+	// Samples the partials had, and the samples a full frame has
+	u64 samples_taken;
+	u64 frame_samples;
+} partial_stats_t;
+
+// Render part of the frame, and write it's sums to a file
+// NOTE: The file is written under a temporary name and renamed once it's complete, so it's never left half written
+bool partial_render(
+	const char *file_name, u64 scene_hash,
+	const world_t *world,
+	const camera_t *camera,
+	i32 width, i32 height,
+	i32 samples, i32 bounces,
+	const tile_params_t *tile_params,
+	const partial_params_t *params);
+// Combine partial render files into a framebuffer, with every pixel the average of the samples it has
+// NOTE: Ranges are added in order whatever order the files are in, so the result is exactly the same for any order,
+// and the same as rendering the frame at once when the partials cover all of it. Partials have to come from the same
+// scene and must not overlap
+bool partial_merge(framebuffer_t *framebuffer, const char **file_names, u32 file_count, partial_stats_t *stats);
+
+#endif
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include "perf.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Generic cache event config, for reads
+#define PERF_CACHE_EVENT(cache, result) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static i32 perf_open_event(u64 config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	// Count the calling thread, on any CPU
+	return (i32) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+};
+bool perf_open(perf_t *perf)
+{
+	const u64 configs[PERF_COUNTER_COUNT] =
+	{
+		PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+		PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS),
+		PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+		PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS),
+		PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_NODE, PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+		PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_NODE, PERF_COUNT_HW_CACHE_RESULT_MISS),
+	};
+	bool result = false;
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		perf->fd[i] = perf_open_event(configs[i]);
+		result |= (perf->fd[i] >= 0);
+	}
+	return result;
+};
+void perf_begin(perf_t *perf)
+{
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if (perf->fd[i] >= 0)
+		{
+			ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+};
+void perf_end(perf_t *perf, u64 values[PERF_COUNTER_COUNT])
+{
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		values[i] = 0;
+		if (perf->fd[i] < 0)
+			continue;
+
+		ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		// Value, time enabled, time running
+		u64 data[3];
+		if ((read(perf->fd[i], data, sizeof(data)) == sizeof(data)) && (data[2] > 0))
+			values[i] = (u64) ((f64) data[0] * ((f64) data[1] / (f64) data[2]));
+	}
+};
+void perf_close(perf_t *perf)
+{
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if (perf->fd[i] >= 0)
+			close(perf->fd[i]);
+		perf->fd[i] = -1;
+	}
+};
+#else
+bool perf_open(perf_t *perf)
+{
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; i++)
+		perf->fd[i] = -1;
+	return false;
+};
+void perf_begin(perf_t *perf) {};
+void perf_end(perf_t *perf, u64 values[PERF_COUNTER_COUNT])
+{
+	memset(values, 0, PERF_COUNTER_COUNT*sizeof(u64));
+};
+void perf_close(perf_t *perf) {};
+#endif
@@ -0,0 +1,35 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "core.h"
+
+// Hardware cache counters, every miss counter directly follows it's access counter
+// NOTE: There's no portable L2 event, so the last level cache is counted instead.
+// Node misses are loads served from the memory of another NUMA node
+typedef enum
+{
+	PERF_L1D_ACCESS,
+	PERF_L1D_MISS,
+	PERF_LLC_ACCESS,
+	PERF_LLC_MISS,
+	PERF_NODE_ACCESS,
+	PERF_NODE_MISS,
+	PERF_COUNTER_COUNT,
+} perf_counter_t;
+
+// Counter set for the calling thread
+typedef struct
+{
+	i32 fd[PERF_COUNTER_COUNT];
+} perf_t;
+
+// Open the counters, returns false if none are available (not Linux, no permission, no PMU)
+bool perf_open(perf_t *perf);
+// Reset and start counting
+void perf_begin(perf_t *perf);
+// Stop counting and read the counters, unavailable counters read as 0
+// NOTE: Values are scaled up if the kernel had to multiplex the counters
+void perf_end(perf_t *perf, u64 values[PERF_COUNTER_COUNT]);
+void perf_close(perf_t *perf);
+
+#endif
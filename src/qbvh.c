@@ -0,0 +1,205 @@
+#include "qbvh.h"
+
+// Smallest exponent a grid cell can have, keeps the cell size a normal float
+#define QBVH_MIN_EXPONENT	-126
+
+// Decode a quantized coordinate, exactly the way traversal does
+static inline f32 qbvh_decode(f32 origin, f32 scale, u32 q)
+{
+	return origin + (f32) q*scale;
+};
+// Quantize the bounds of a child on one axis, rounding outwards so the decoded box always contains the child
+static void qbvh_quantize(f32 origin, f32 scale, f32 lo, f32 hi, u8 *q_lo, u8 *q_hi)
+{
+	i32 q_min = (i32) f32_floor((lo - origin) / scale);
+	i32 q_max = (i32) f32_ceil((hi - origin) / scale);
+	q_min = clamp(q_min, 0, 255);
+	q_max = clamp(q_max, 0, 255);
+	// Fix up any rounding error in the division
+	while ((q_min > 0) && (qbvh_decode(origin, scale, q_min) > lo))
+		q_min--;
+	while ((q_max < 255) && (qbvh_decode(origin, scale, q_max) < hi))
+		q_max++;
+	*q_lo = (u8) q_min;
+	*q_hi = (u8) q_max;
+};
+// Pick the grid cell exponent for one axis of a node, so that 255 cells cover the whole node
+static i8 qbvh_exponent(f32 lo, f32 hi)
+{
+	const f32 extent = (hi - lo);
+	i32 exponent = QBVH_MIN_EXPONENT;
+	if (extent > 0.f)
+		exponent = max((i32) f32_ceil(f32_log2(extent / 255.f)), QBVH_MIN_EXPONENT);
+	// Make sure the last cell reaches the maximum, despite rounding
+	while (qbvh_decode(lo, ldexpf(1.f, exponent), 255) < hi)
+		exponent++;
+	assert(exponent <= 127);
+	return (i8) exponent;
+};
+
+// Emit the compressed node for a binary node and everything below it, returns the index of the new node
+static u32 qbvh_emit(qbvh_t *qbvh, const bvh_t *bvh, u32 bvh_index)
+{
+	const bvh_node_t *bvh_node = bvh->nodes + bvh_index;
+	// Start with the children of the binary node, or the node itself if it's a leaf
+	u32 children[QBVH_WIDTH];
+	u32 child_count = 0;
+	if (bvh_node->count == 0)
+	{
+		children[child_count++] = (bvh_index + 1);
+		children[child_count++] = (bvh_index + bvh_node->offset);
+	} else {
+		children[child_count++] = bvh_index;
+	}
+	// Pull grandchildren up until the node is full, opening the largest branch first
+	while (child_count < QBVH_WIDTH)
+	{
+		i32 largest = -1;
+		f32 largest_area = -1.f;
+		for (u32 i = 0; i < child_count; i++)
+		{
+			const bvh_node_t *child = bvh->nodes + children[i];
+			const f32 area = aabb_area(child->aabb);
+			if ((child->count == 0) && (area > largest_area))
+			{
+				largest = i;
+				largest_area = area;
+			}
+		}
+		// Only leaves left
+		if (largest < 0)
+			break;
+		// Replace the branch with it's children
+		const u32 branch = children[largest];
+		children[largest] = (branch + 1);
+		children[child_count++] = (branch + bvh->nodes[branch].offset);
+	}
+
+	// Allocate the new node
+	const u32 index = qbvh->node_count++;
+	qbvh_node_t *node = qbvh->nodes + index;
+	memset(node, 0, sizeof(qbvh_node_t));
+	// Set up the quantization grid over the node bounds
+	const aabb_t aabb = bvh_node->aabb;
+	node->origin = aabb.min;
+	node->exponent[0] = qbvh_exponent(aabb.min.x, aabb.max.x);
+	node->exponent[1] = qbvh_exponent(aabb.min.y, aabb.max.y);
+	node->exponent[2] = qbvh_exponent(aabb.min.z, aabb.max.z);
+	node->child_count = child_count;
+
+	const v3 scale = qbvh_node_scale(node);
+	for (u32 i = 0; i < child_count; i++)
+	{
+		const bvh_node_t *child = bvh->nodes + children[i];
+		qbvh_quantize(node->origin.x, scale.x, child->aabb.min.x, child->aabb.max.x, node->min_x + i, node->max_x + i);
+		qbvh_quantize(node->origin.y, scale.y, child->aabb.min.y, child->aabb.max.y, node->min_y + i, node->max_y + i);
+		qbvh_quantize(node->origin.z, scale.z, child->aabb.min.z, child->aabb.max.z, node->min_z + i, node->max_z + i);
+	}
+	// Emit the children
+	// NOTE: The node array never moves during the build, so the pointer stays valid
+	for (u32 i = 0; i < child_count; i++)
+	{
+		const bvh_node_t *child = bvh->nodes + children[i];
+		if (child->count == 0)
+		{
+			node->child[i] = qbvh_emit(qbvh, bvh, children[i]);
+			node->count[i] = 0;
+		} else {
+			assert(child->count <= 255);
+			node->child[i] = child->offset;
+			node->count[i] = (u8) child->count;
+		}
+	}
+	return index;
+};
+void qbvh_build(qbvh_t *qbvh, const bvh_t *bvh)
+{
+	memset(qbvh, 0, sizeof(qbvh_t));
+	if (bvh->node_count == 0)
+		return;
+
+	// Every compressed node swallows at least one binary branch, or the root leaf
+	const u32 max_nodes = (bvh->node_count / 2) + 1;
+	qbvh->nodes = aligned_alloc(64, max_nodes*sizeof(qbvh_node_t));
+	assert(qbvh->nodes != NULL);
+	qbvh_emit(qbvh, bvh, 0);
+	// Leaves reference the same primitive ranges as the binary tree
+	qbvh->index_count = bvh->index_count;
+	qbvh->indices = malloc(bvh->index_count*sizeof(u32));
+	assert(qbvh->indices != NULL);
+	memcpy(qbvh->indices, bvh->indices, bvh->index_count*sizeof(u32));
+};
+// Get the height of the subtree below a node, in nodes
+static u32 qbvh_height(const qbvh_t *qbvh, u32 index)
+{
+	const qbvh_node_t *node = qbvh->nodes + index;
+	u32 height = 0;
+	for (u32 i = 0; i < node->child_count; i++)
+	{
+		if (node->count[i] == 0)
+			height = max(height, qbvh_height(qbvh, node->child[i]));
+	}
+	return height + 1;
+};
+static void qbvh_veb(const qbvh_t *qbvh, u32 index, u32 height, u32 *remap, u32 *next);
+// Lay out every subtree that starts a number of levels below a node
+static void qbvh_veb_bottom(const qbvh_t *qbvh, u32 index, u32 depth, u32 height, u32 *remap, u32 *next)
+{
+	const qbvh_node_t *node = qbvh->nodes + index;
+	for (u32 i = 0; i < node->child_count; i++)
+	{
+		if (node->count[i] != 0)
+			continue;
+		if (depth == 1)
+			qbvh_veb(qbvh, node->child[i], height, remap, next);
+		else
+			qbvh_veb_bottom(qbvh, node->child[i], depth - 1, height, remap, next);
+	}
+};
+// Lay out the subtree below a node, cut off at a height
+// NOTE: The top half of the subtree goes first, followed by each of the bottom half subtrees, all laid out the same way
+static void qbvh_veb(const qbvh_t *qbvh, u32 index, u32 height, u32 *remap, u32 *next)
+{
+	if (height == 1)
+	{
+		remap[index] = (*next)++;
+		return;
+	}
+	const u32 top = (height / 2);
+	qbvh_veb(qbvh, index, top, remap, next);
+	qbvh_veb_bottom(qbvh, index, top, height - top, remap, next);
+};
+void qbvh_reorder(qbvh_t *qbvh)
+{
+	if (qbvh->node_count == 0)
+		return;
+
+	// Get the new position of every node
+	u32 *remap = malloc(qbvh->node_count*sizeof(u32));
+	assert(remap != NULL);
+	u32 next = 0;
+	qbvh_veb(qbvh, 0, qbvh_height(qbvh, 0), remap, &next);
+	assert(next == qbvh->node_count);
+	// Move the nodes, pointing the branches at the moved children
+	qbvh_node_t *nodes = aligned_alloc(64, qbvh->node_count*sizeof(qbvh_node_t));
+	assert(nodes != NULL);
+	for (u32 i = 0; i < qbvh->node_count; i++)
+	{
+		qbvh_node_t *node = nodes + remap[i];
+		*node = qbvh->nodes[i];
+		for (u32 j = 0; j < node->child_count; j++)
+		{
+			if (node->count[j] == 0)
+				node->child[j] = remap[node->child[j]];
+		}
+	}
+	free(qbvh->nodes);
+	qbvh->nodes = nodes;
+	free(remap);
+};
+void qbvh_free(qbvh_t *qbvh)
+{
+	free(qbvh->nodes);
+	free(qbvh->indices);
+	memset(qbvh, 0, sizeof(qbvh_t));
+};
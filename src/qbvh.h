@@ -0,0 +1,69 @@
+#ifndef QBVH_H
+#define QBVH_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "bvh.h"
+
+// Maximum number of children of a compressed node
+#define QBVH_WIDTH	4
+
+// Compressed 4-wide BVH node, exactly one cache line
+// NOTE: Child bounds are stored in 8-bit grid cells relative to the node bounds, rounded outwards
+typedef struct
+{
+	// Origin of the quantization grid, the minimum corner of the node bounds
+	v3 origin;
+	// Power of two exponent of the grid cell size on each axis
+	i8 exponent[3];
+	// Number of used child slots
+	u8 child_count;
+	// Quantized child bounds
+	u8 min_x[QBVH_WIDTH];
+	u8 min_y[QBVH_WIDTH];
+	u8 min_z[QBVH_WIDTH];
+	u8 max_x[QBVH_WIDTH];
+	u8 max_y[QBVH_WIDTH];
+	u8 max_z[QBVH_WIDTH];
+	// Internal children: index of the child node
+	// Leaf children: index of the first primitive in the index list
+	u32 child[QBVH_WIDTH];
+	// Number of primitives in leaf children, 0 for internal children
+	u8 count[QBVH_WIDTH];
+	u8 padding[4];
+} qbvh_node_t;
+
+// Compressed BVH data structure
+typedef struct
+{
+	// Node array, the root is always the first node
+	u32 node_count;
+	qbvh_node_t *nodes;
+	// Primitive index list, leaves reference ranges of this list
+	u32 index_count;
+	u32 *indices;
+} qbvh_t;
+
+// Compress a binary BVH into a 4-wide quantized one
+void qbvh_build(qbvh_t *qbvh, const bvh_t *bvh);
+void qbvh_free(qbvh_t *qbvh);
+// Lay the nodes out in van Emde Boas order, so that subtrees are clustered in memory at every scale
+// NOTE: Cache-oblivious, a ray walking down the tree touches few cache lines and pages without tuning for either
+void qbvh_reorder(qbvh_t *qbvh);
+
+// Get the size of the grid cells on each axis of a node
+static inline v3 qbvh_node_scale(const qbvh_node_t *node)
+{
+	// NOTE: Built straight from the exponent bits, so it's exactly a power of two
+	v3 scale;
+	for (u32 i = 0; i < 3; i++)
+	{
+		const u32 bits = (u32) (node->exponent[i] + 127) << 23;
+		memcpy(scale.v + i, &bits, sizeof(f32));
+	}
+	return scale;
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "render.h"
 
+#include <signal.h>
+
 static inline f32 schlick(f32 cos, f32 ref_idx)
 {
 	const f32 r_0 = f32_square((1.f - ref_idx) / (1.f + ref_idx));
@@ -116,12 +118,58 @@ static v3 sample(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray, i32 b
 		{
 			acc = v3_mul(acc, attenuation);
 		}
+		// Carry the ray cone over the bounce, widened to the hit and keeping it's spread angle
+		// NOTE: The spread is per unit of t, so it's scaled by the change in direction length
+		new_ray.width = ray.width + ray.spread*hit.t;
+		new_ray.spread = ray.spread*(v3_len(new_ray.direction) / v3_len(ray.direction));
 		ray = new_ray;
 	};
 	return color;
 };
 
-void render(lin_alloc_t *temp_alloc,
+// Set once rendering is cancelled
+static volatile sig_atomic_t render_cancel_flag = 0;
+
+void render_cancel()
+{
+	render_cancel_flag = 1;
+};
+bool render_cancelled()
+{
+	return (render_cancel_flag != 0);
+};
+
+// Sum a range of the samples of a pixel, returns false if rendering was cancelled before they were all taken
+// NOTE: Each sample is seeded from the pixel and it's index, so it's the same whichever worker takes it and whatever else it rendered.
+// The cancel flag is checked before every sample, so cancelling waits for a single sample at most
+static bool pixel_sum(lin_alloc_t *temp_alloc,
+	const world_t *world,
+	const camera_t *camera,
+	u32 i, u32 j, i32 width, i32 height,
+	i32 first_sample, i32 sample_count, i32 bounces, v3 *sum)
+{
+	// Width of a pixel on the focus plane, which camera rays reach at t = 1
+	const f32 pixel_spread = v3_len(camera->v) / (f32) height;
+
+	v3 color = V3(0.f, 0.f, 0.f);
+	for (i32 s = first_sample; s < (first_sample + sample_count); s++)
+	{
+		if (render_cancel_flag)
+			return false;
+		rand_seed(((u64) j << 48) | ((u64) i << 32) | (u64) s);
+		// Get the current UV of this sample
+		const f32 u = (((f32) i + f32_rand()) / (f32) width);
+		const f32 v = (((f32) j + f32_rand()) / (f32) height);
+		// Generate a ray from the camera to the sample
+		ray_t ray = camera_ray(camera, u,v);
+		ray.spread = pixel_spread;
+		// Generate a sample and add it to the color
+		color = v3_add(color, sample(temp_alloc, world, ray, bounces));
+	}
+	*sum = color;
+	return true;
+};
+u32 render(lin_alloc_t *temp_alloc,
 	const world_t *world, 
 	const camera_t *camera, 
 	i32 samples, i32 bounces,
@@ -133,25 +181,41 @@ void render(lin_alloc_t *temp_alloc,
 		// Iterate over each pixel
 		for (u32 i = area.x; i < (area.x+area.w); i++)
 		{
-			// Final output color in RGB space
-			v3 color = V3(0.f, 0.f, 0.f);
-			// For each sample
-			for (u32 s = 0; s < samples; s++)
-			{
-				// Get the current UV of this sample
-				const f32 u = (((f32) i + f32_rand()) / (f32) framebuffer->width);
-				const f32 v = (((f32) j + f32_rand()) / (f32) framebuffer->height);
-				// Generate a ray from the camera to the sample
-				ray_t ray = camera_ray(camera, u,v);
-				// Generate a sample and add it to the color
-				color = v3_add(color, sample(temp_alloc, world, ray, bounces));
-			}
-			// Normalize the output color by the number of samples
+			// Sum every sample, and normalize the output color by the number of samples
+			// NOTE: Pixels that weren't reached before rendering was cancelled are left as they were
+			v3 color;
+			if (!pixel_sum(temp_alloc, world, camera, i, j,
+				framebuffer->width, framebuffer->height, 0, samples, bounces, &color))
+				return (j - area.y)*area.w + (i - area.x);
 			color = v3_scale(color, (1.f / (f32) samples));
 			// Store the final color
 			framebuffer->pixels[j*framebuffer->width + i] = color;
 		}
 	};
+	return area.w*area.h;
+};
+u32 render_sums(lin_alloc_t *temp_alloc,
+	const world_t *world,
+	const camera_t *camera,
+	i32 width, i32 height,
+	i32 first_sample, i32 sample_count, i32 bounces,
+	rect_t area, v3 *sums, u32 stride)
+{
+	// For each row of the area to render
+	for (u32 j = 0; j < area.h; j++)
+	{
+		// Add the samples of each pixel to it's sum
+		v3 *row = sums + j*stride;
+		for (u32 i = 0; i < area.w; i++)
+		{
+			v3 color;
+			if (!pixel_sum(temp_alloc, world, camera, area.x + i, area.y + j,
+				width, height, first_sample, sample_count, bounces, &color))
+				return j*area.w + i;
+			row[i] = v3_add(row[i], color);
+		}
+	}
+	return area.w*area.h;
 };
 
 static void draw_line(framebuffer_t *framebuffer, v2 a, v2 b, v3 color)
@@ -227,14 +291,13 @@ static void draw_aabb(m44 camera, aabb_t aabb, framebuffer_t *framebuffer)
 	}
 	#endif
 };
-static void draw_bvh_node(m44 camera, const bvh_t *bvh, framebuffer_t *framebuffer)
+static void draw_bvh_leaves(m44 camera, const bvh_t *bvh, framebuffer_t *framebuffer)
 {
-	if (!bvh->leaf)
+	for (u32 i = 0; i < bvh->node_count; i++)
 	{
-		draw_bvh_node(camera, bvh->l, framebuffer);
-		draw_bvh_node(camera, bvh->r, framebuffer);
-	} else {
-		draw_aabb(camera, bvh->aabb, framebuffer);
+		const bvh_node_t *node = bvh->nodes + i;
+		if (node->count != 0)
+			draw_aabb(camera, node->aabb, framebuffer);
 	}
 };
 void draw_bvh(const camera_t *camera, const bvh_t *bvh, framebuffer_t *framebuffer)
@@ -245,5 +308,5 @@ void draw_bvh(const camera_t *camera, const bvh_t *bvh, framebuffer_t *framebuff
 		aspect, 
 		0.1f, 10.f);
 	const m44 v = m44_lookAt(camera->position, camera->at, camera->up);
-	draw_bvh_node(m44_mul(p, v), bvh, framebuffer);
+	draw_bvh_leaves(m44_mul(p, v), bvh, framebuffer);
 };
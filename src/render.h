@@ -9,7 +9,9 @@
 
 #include "world.h"
 
-void render(
+// Render every sample of the pixels in an area, normalized, returns the number of pixels finished row by row
+// NOTE: Stops at the first pixel it hasn't finished once rendering is cancelled
+u32 render(
 	// Temporary allocation space
 	lin_alloc_t *temp_alloc,
 	// Input world structure
@@ -21,6 +23,26 @@ void render(
 	// Output framebuffer and area to render
 	framebuffer_t *framebuffer, rect_t area);
 
+// Cancel rendering, render and render_sums return without finishing once they see it
+// NOTE: Safe to call from a signal handler
+void render_cancel();
+bool render_cancelled();
+
+// Add a range of the samples of every pixel in an area to their sums, without normalizing them
+// returns the number of pixels summed, row by row, fewer than the area has if rendering was cancelled
+// NOTE: Sums are stored row by row, stride pixels apart. Pixels get the same samples however the work is split,
+// only the order sums are added in changes the result
+u32 render_sums(
+	lin_alloc_t *temp_alloc,
+	const world_t *world,
+	const camera_t *camera,
+	// Image dimensions in pixels
+	i32 width, i32 height,
+	// Samples [first_sample, first_sample+sample_count) of each pixel
+	i32 first_sample, i32 sample_count, i32 bounces,
+	// Area to render, and the sums of it's pixels
+	rect_t area, v3 *sums, u32 stride);
+
 void draw_bvh(const camera_t *camera, const bvh_t *bvh, framebuffer_t *framebuffer);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,562 @@
+#include "bvh.h"
+#include "job.h"
+
+// Number of bins split candidates are evaluated at, per axis
+#define SAH_BINS				16
+// Largest number of primitives a leaf can hold
+#define SAH_MAX_LEAF_SIZE		4
+// Ranges with at least this many primitives are binned by all workers
+#define SAH_PARALLEL_BINNING	65536
+// Number of subtrees each worker gets
+#define SAH_TASKS_PER_WORKER	16
+// Child references with this bit set point to a subtree task instead of a top node
+#define SAH_TASK				0x80000000
+
+// Primitives binned along an axis
+typedef struct
+{
+	aabb_t aabb;
+	u32 count;
+} sah_bin_t;
+typedef struct
+{
+	sah_bin_t bins[3][SAH_BINS];
+} sah_bins_t;
+
+// Mapping from primitive centers to bins
+typedef struct
+{
+	v3 origin;
+	v3 scale;
+} sah_binning_t;
+
+// Node in the top of the tree, above the subtree tasks
+typedef struct
+{
+	aabb_t aabb;
+	// Child references
+	u32 l, r;
+	// Number of flat nodes in this subtree
+	u32 size;
+} sah_top_t;
+
+// Subtree built by a single worker
+typedef struct
+{
+	// Primitive range
+	u32 first;
+	u32 count;
+	// Worker arena the subtree was built in, and where it starts
+	u32 worker;
+	u32 offset;
+	// Number of nodes in the subtree
+	u32 size;
+	// Position of the subtree in the final node array
+	u32 position;
+} sah_task_t;
+
+// Node memory owned by a single worker
+// NOTE: Aligned, so that workers never write to the same cache line
+typedef struct
+{
+	bvh_node_t *nodes;
+	u32 count;
+	u32 capacity;
+} align_64 sah_arena_t;
+
+// Shared state of an SAH build
+typedef struct
+{
+	// Input primitives, and their centers
+	const aabb_t *bounds;
+	v3 *centers;
+	u32 count;
+	u32 worker_count;
+	// Primitive order, partitioned in place
+	u32 *indices;
+	// Range binned by all workers, and the per worker results
+	u32 range_first;
+	u32 range_count;
+	sah_binning_t binning;
+	aabb_t worker_bounds[MAX_WORKERS];
+	aabb_t worker_center_bounds[MAX_WORKERS];
+	sah_bins_t worker_bins[MAX_WORKERS];
+	// Top of the tree
+	u32 top_count;
+	u32 top_capacity;
+	sah_top_t *top;
+	// Subtrees, any range with at most task_size primitives is a task
+	u32 task_size;
+	u32 task_count;
+	u32 task_capacity;
+	sah_task_t *tasks;
+	volatile u32 next_task;
+	// Per worker node memory
+	sah_arena_t arenas[MAX_WORKERS];
+	// Output tree
+	bvh_t *bvh;
+} sah_build_t;
+
+static inline u32 sah_bin(const sah_binning_t *binning, v3 center, u32 axis)
+{
+	const i32 bin = (i32) ((center.v[axis] - binning->origin.v[axis]) * binning->scale.v[axis]);
+	return clamp(bin, 0, SAH_BINS-1);
+};
+
+// Get the bounds and center bounds of a range of primitives
+static void sah_range_bounds(const sah_build_t *build, u32 first, u32 count,
+	aabb_t *bounds, aabb_t *center_bounds)
+{
+	aabb_t b = aabb_empty();
+	aabb_t c = aabb_empty();
+	for (u32 i = first; i < (first + count); i++)
+	{
+		const u32 index = build->indices[i];
+		b = aabb_combine(b, build->bounds[index]);
+		c = aabb_extend(c, build->centers[index]);
+	}
+	*bounds = b;
+	*center_bounds = c;
+};
+// Sort a range of primitives into bins along each axis
+static void sah_range_bin(const sah_build_t *build, u32 first, u32 count,
+	const sah_binning_t *binning, sah_bins_t *bins)
+{
+	for (u32 axis = 0; axis < 3; axis++)
+	{
+		for (u32 i = 0; i < SAH_BINS; i++)
+		{
+			bins->bins[axis][i].aabb = aabb_empty();
+			bins->bins[axis][i].count = 0;
+		}
+	}
+	for (u32 i = first; i < (first + count); i++)
+	{
+		const u32 index = build->indices[i];
+		for (u32 axis = 0; axis < 3; axis++)
+		{
+			sah_bin_t *bin = bins->bins[axis] + sah_bin(binning, build->centers[index], axis);
+			bin->aabb = aabb_combine(bin->aabb, build->bounds[index]);
+			bin->count++;
+		}
+	}
+};
+static void sah_bounds_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	sah_build_t *build = (sah_build_t*) data;
+
+	u32 first, count;
+	job_range(build->range_count, worker_index, worker_count, &first, &count);
+	sah_range_bounds(build, build->range_first + first, count,
+		build->worker_bounds + worker_index,
+		build->worker_center_bounds + worker_index);
+};
+static void sah_bin_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	sah_build_t *build = (sah_build_t*) data;
+
+	u32 first, count;
+	job_range(build->range_count, worker_index, worker_count, &first, &count);
+	sah_range_bin(build, build->range_first + first, count,
+		&build->binning, build->worker_bins + worker_index);
+};
+
+// Decide how to split a range of primitives, and partition it
+// Returns false if the range should become a leaf, otherwise the size of the left side is stored in mid
+// NOTE: The binning is spread over all workers if parallel is set, the result is the same either way
+static bool sah_split(sah_build_t *build, u32 first, u32 count, bool parallel,
+	aabb_t *aabb, u32 *mid)
+{
+	// Get the bounds of the range
+	aabb_t center_bounds;
+	if (parallel)
+	{
+		build->range_first = first;
+		build->range_count = count;
+		jobs_run(build->worker_count, sah_bounds_proc, build);
+		*aabb = build->worker_bounds[0];
+		center_bounds = build->worker_center_bounds[0];
+		for (u32 i = 1; i < build->worker_count; i++)
+		{
+			*aabb = aabb_combine(*aabb, build->worker_bounds[i]);
+			center_bounds = aabb_combine(center_bounds, build->worker_center_bounds[i]);
+		}
+	} else {
+		sah_range_bounds(build, first, count, aabb, &center_bounds);
+	}
+	if (count == 1)
+		return false;
+
+	// Map the center bounds to the bins
+	sah_binning_t binning;
+	binning.origin = center_bounds.min;
+	bool splittable = false;
+	for (u32 axis = 0; axis < 3; axis++)
+	{
+		const f32 extent = (center_bounds.max.v[axis] - center_bounds.min.v[axis]);
+		binning.scale.v[axis] = (extent > 1e-12f) ? ((f32) SAH_BINS / extent) : 0.f;
+		splittable |= (binning.scale.v[axis] != 0.f);
+	}
+	// Sort the primitives into bins
+	sah_bins_t local_bins;
+	sah_bins_t *bins = &local_bins;
+	if (splittable)
+	{
+		if (parallel)
+		{
+			build->binning = binning;
+			jobs_run(build->worker_count, sah_bin_proc, build);
+			// Merge the worker bins, in order
+			bins = build->worker_bins;
+			for (u32 w = 1; w < build->worker_count; w++)
+			{
+				for (u32 axis = 0; axis < 3; axis++)
+				{
+					for (u32 i = 0; i < SAH_BINS; i++)
+					{
+						sah_bin_t *bin = bins->bins[axis] + i;
+						const sah_bin_t *other = build->worker_bins[w].bins[axis] + i;
+						bin->aabb = aabb_combine(bin->aabb, other->aabb);
+						bin->count += other->count;
+					}
+				}
+			}
+		} else {
+			sah_range_bin(build, first, count, &binning, bins);
+		}
+	}
+	// Find the cheapest split between two bins
+	i32 best_axis = -1;
+	u32 best_split = 0;
+	f32 best_cost = FLT_MAX;
+	for (u32 axis = 0; (axis < 3) && splittable; axis++)
+	{
+		if (binning.scale.v[axis] == 0.f)
+			continue;
+		const sah_bin_t *axis_bins = bins->bins[axis];
+		// Sweep from the right, storing the area and count of everything right of each split
+		f32 right_area[SAH_BINS];
+		u32 right_count[SAH_BINS];
+		aabb_t right = aabb_empty();
+		u32 right_total = 0;
+		for (u32 i = (SAH_BINS-1); i > 0; i--)
+		{
+			right = aabb_combine(right, axis_bins[i].aabb);
+			right_total += axis_bins[i].count;
+			right_area[i] = aabb_area(right);
+			right_count[i] = right_total;
+		}
+		// Sweep from the left, evaluating each split
+		aabb_t left = aabb_empty();
+		u32 left_total = 0;
+		for (u32 i = 1; i < SAH_BINS; i++)
+		{
+			left = aabb_combine(left, axis_bins[i-1].aabb);
+			left_total += axis_bins[i-1].count;
+			if ((left_total == 0) || (right_count[i] == 0))
+				continue;
+
+			const f32 cost = aabb_area(left)*left_total + right_area[i]*right_count[i];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+			}
+		}
+	}
+	// Compare against the cost of not splitting at all
+	const f32 area = aabb_area(*aabb);
+	const f32 leaf_cost = BVH_COST_INTERSECT*count;
+	const f32 split_cost = BVH_COST_TRAVERSAL + BVH_COST_INTERSECT*best_cost / area;
+	if ((count <= SAH_MAX_LEAF_SIZE) && ((best_axis == -1) || (leaf_cost <= split_cost)))
+		return false;
+
+	if (best_axis == -1)
+	{
+		// The primitives can't be told apart, split the list in half
+		*mid = (count / 2);
+	} else {
+		// Partition the primitives around the split
+		u32 i = first;
+		u32 j = first + count;
+		while (i < j)
+		{
+			if (sah_bin(&binning, build->centers[build->indices[i]], best_axis) < best_split)
+			{
+				i++;
+			} else {
+				j--;
+				swap(u32, build->indices[i], build->indices[j]);
+			}
+		}
+		*mid = (i - first);
+	}
+	return true;
+};
+
+// Build a subtree into a worker's arena, returns the index of the new node in the arena
+static u32 sah_build_node(sah_build_t *build, sah_arena_t *arena, u32 first, u32 count)
+{
+	// Grow the arena if needed
+	// NOTE: Only the owning worker ever touches its arena
+	if (arena->count == arena->capacity)
+	{
+		arena->capacity = max(2*arena->capacity, 1024);
+		arena->nodes = realloc(arena->nodes, arena->capacity*sizeof(bvh_node_t));
+		assert(arena->nodes != NULL);
+	}
+	const u32 index = arena->count++;
+
+	aabb_t aabb;
+	u32 mid;
+	if (sah_split(build, first, count, false, &aabb, &mid))
+	{
+		// NOTE: The left child always directly follows its parent
+		sah_build_node(build, arena, first, mid);
+		const u32 r = sah_build_node(build, arena, first + mid, count - mid);
+		arena->nodes[index].offset = (r - index);
+		arena->nodes[index].count = 0;
+	} else {
+		arena->nodes[index].offset = first;
+		arena->nodes[index].count = count;
+	}
+	arena->nodes[index].aabb = aabb;
+	return index;
+};
+static void sah_task_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	sah_build_t *build = (sah_build_t*) data;
+	sah_arena_t *arena = build->arenas + worker_index;
+	// NOTE: Subtrees vary in size, so tasks are handed out one at a time
+	for (u32 i = atomic_inc(&build->next_task); i < build->task_count; i = atomic_inc(&build->next_task))
+	{
+		sah_task_t *task = build->tasks + i;
+		task->worker = worker_index;
+		task->offset = arena->count;
+		sah_build_node(build, arena, task->first, task->count);
+		task->size = (arena->count - task->offset);
+	}
+};
+static void sah_copy_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	sah_build_t *build = (sah_build_t*) data;
+
+	u32 first, count;
+	job_range(build->task_count, worker_index, worker_count, &first, &count);
+	// Copy each subtree to its final position
+	// NOTE: Subtrees only use offsets relative to their own nodes, so they can be moved as-is
+	for (u32 i = first; i < (first + count); i++)
+	{
+		const sah_task_t *task = build->tasks + i;
+		const sah_arena_t *arena = build->arenas + task->worker;
+		memcpy(build->bvh->nodes + task->position, arena->nodes + task->offset, task->size*sizeof(bvh_node_t));
+	}
+};
+
+// Build the top of the tree, splitting it into subtree tasks, returns a child reference
+static u32 sah_build_top(sah_build_t *build, u32 first, u32 count)
+{
+	if (count <= build->task_size)
+	{
+		if (build->task_count == build->task_capacity)
+		{
+			build->task_capacity = max(2*build->task_capacity, 64);
+			build->tasks = realloc(build->tasks, build->task_capacity*sizeof(sah_task_t));
+			assert(build->tasks != NULL);
+		}
+		const u32 index = build->task_count++;
+		build->tasks[index].first = first;
+		build->tasks[index].count = count;
+		return (SAH_TASK | index);
+	}
+	if (build->top_count == build->top_capacity)
+	{
+		build->top_capacity = max(2*build->top_capacity, 64);
+		build->top = realloc(build->top, build->top_capacity*sizeof(sah_top_t));
+		assert(build->top != NULL);
+	}
+	const u32 index = build->top_count++;
+	// NOTE: The task size is never smaller than a leaf, so the top of the tree always splits
+	aabb_t aabb;
+	u32 mid;
+	const bool parallel = (count >= SAH_PARALLEL_BINNING) && (build->worker_count > 1);
+	sah_split(build, first, count, parallel, &aabb, &mid);
+
+	const u32 l = sah_build_top(build, first, mid);
+	const u32 r = sah_build_top(build, first + mid, count - mid);
+	build->top[index].aabb = aabb;
+	build->top[index].l = l;
+	build->top[index].r = r;
+	return index;
+};
+static u32 sah_top_size(sah_build_t *build, u32 child)
+{
+	if (child & SAH_TASK)
+		return build->tasks[child & ~SAH_TASK].size;
+	sah_top_t *top = build->top + child;
+	top->size = 1 + sah_top_size(build, top->l) + sah_top_size(build, top->r);
+	return top->size;
+};
+// Write the top of the tree to the flat node array, and assign the positions of the subtrees
+static void sah_layout_top(sah_build_t *build, u32 child, u32 position)
+{
+	if (child & SAH_TASK)
+	{
+		build->tasks[child & ~SAH_TASK].position = position;
+		return;
+	}
+	const sah_top_t *top = build->top + child;
+	const u32 left_size = (top->l & SAH_TASK) ? build->tasks[top->l & ~SAH_TASK].size : build->top[top->l].size;
+
+	bvh_node_t *node = build->bvh->nodes + position;
+	node->aabb = top->aabb;
+	node->offset = 1 + left_size;
+	node->count = 0;
+	sah_layout_top(build, top->l, position + 1);
+	sah_layout_top(build, top->r, position + 1 + left_size);
+};
+
+void bvh_build_sah(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params)
+{
+	if (count == 0)
+		return;
+
+	sah_build_t *build = malloc(sizeof(sah_build_t));
+	assert(build != NULL);
+	memset(build, 0, sizeof(sah_build_t));
+	build->bounds = bounds;
+	build->count = count;
+	build->worker_count = clamp(params->worker_count, 1, MAX_WORKERS);
+	build->bvh = bvh;
+	// The primitive order is partitioned directly in the output index list
+	bvh->index_count = count;
+	bvh->indices = malloc(count*sizeof(u32));
+	build->indices = bvh->indices;
+	build->centers = malloc(count*sizeof(v3));
+	assert((bvh->indices != NULL) && (build->centers != NULL));
+	for (u32 i = 0; i < count; i++)
+	{
+		build->indices[i] = i;
+		build->centers[i] = aabb_center(bounds[i]);
+	}
+
+	// Build the top of the tree, binning large ranges in parallel
+	build->task_size = max(count / (build->worker_count*SAH_TASKS_PER_WORKER), SAH_MAX_LEAF_SIZE);
+	const u32 root = sah_build_top(build, 0, count);
+	// Build the subtrees in parallel
+	jobs_run(build->worker_count, sah_task_proc, build);
+	// Move the top and the subtrees into a single depth-first node array
+	bvh->node_count = sah_top_size(build, root);
+	bvh->nodes = malloc(bvh->node_count*sizeof(bvh_node_t));
+	assert(bvh->nodes != NULL);
+	sah_layout_top(build, root, 0);
+	jobs_run(build->worker_count, sah_copy_proc, build);
+
+	// Free the build buffers
+	for (u32 i = 0; i < build->worker_count; i++)
+		free(build->arenas[i].nodes);
+	free(build->tasks);
+	free(build->top);
+	free(build->centers);
+	free(build);
+};
+
+// Number of subtrees a lazy build aims to defer
+#define SAH_LAZY_SUBTREES		4096
+// Smallest number of primitives in a deferred subtree
+#define SAH_LAZY_MIN_SIZE		64
+
+void bvh_build_lazy(bvh_t *bvh, const aabb_t *bounds, u32 count, const bvh_params_t *params)
+{
+	if (count == 0)
+		return;
+
+	bvh_lazy_t *lazy = malloc(sizeof(bvh_lazy_t));
+	sah_build_t *build = malloc(sizeof(sah_build_t));
+	assert((lazy != NULL) && (build != NULL));
+	memset(lazy, 0, sizeof(bvh_lazy_t));
+	memset(build, 0, sizeof(sah_build_t));
+	// Subtrees are built long after the caller's bounds are gone, so they're copied
+	lazy->bounds = malloc(count*sizeof(aabb_t));
+	lazy->centers = malloc(count*sizeof(v3));
+	bvh->index_count = count;
+	bvh->indices = malloc(count*sizeof(u32));
+	assert((lazy->bounds != NULL) && (lazy->centers != NULL) && (bvh->indices != NULL));
+	memcpy(lazy->bounds, bounds, count*sizeof(aabb_t));
+	for (u32 i = 0; i < count; i++)
+	{
+		bvh->indices[i] = i;
+		lazy->centers[i] = aabb_center(bounds[i]);
+	}
+	build->bounds = lazy->bounds;
+	build->centers = lazy->centers;
+	build->indices = bvh->indices;
+	build->count = count;
+	build->worker_count = clamp(params->worker_count, 1, MAX_WORKERS);
+	build->bvh = bvh;
+
+	// Build the top of the tree, every task becomes a deferred node
+	build->task_size = max(count / SAH_LAZY_SUBTREES, SAH_LAZY_MIN_SIZE);
+	const u32 root = sah_build_top(build, 0, count);
+	for (u32 i = 0; i < build->task_count; i++)
+		build->tasks[i].size = 1;
+	bvh->node_count = sah_top_size(build, root);
+	bvh->nodes = malloc(bvh->node_count*sizeof(bvh_node_t));
+	assert(bvh->nodes != NULL);
+	sah_layout_top(build, root, 0);
+
+	// Set up the deferred nodes, and the subtrees below them
+	lazy->subtree_count = build->task_count;
+	lazy->subtrees = malloc(lazy->subtree_count*sizeof(bvh_subtree_t));
+	assert(lazy->subtrees != NULL);
+	memset(lazy->subtrees, 0, lazy->subtree_count*sizeof(bvh_subtree_t));
+	for (u32 i = 0; i < build->task_count; i++)
+	{
+		const sah_task_t *task = build->tasks + i;
+		bvh_subtree_t *subtree = lazy->subtrees + i;
+		subtree->first = task->first;
+		subtree->count = task->count;
+		subtree->state = BVH_SUBTREE_DEFERRED;
+
+		aabb_t center_bounds;
+		bvh_node_t *node = bvh->nodes + task->position;
+		sah_range_bounds(build, task->first, task->count, &node->aabb, &center_bounds);
+		node->offset = i;
+		node->count = BVH_DEFERRED;
+	}
+	// Only the primitive data is needed from here on
+	free(build->tasks);
+	free(build->top);
+	build->tasks = NULL;
+	build->top = NULL;
+	build->task_count = build->top_count = 0;
+	build->bvh = NULL;
+	lazy->build = build;
+	bvh->lazy = lazy;
+};
+const bvh_node_t* bvh_subtree(const bvh_t *bvh, u32 index)
+{
+	bvh_subtree_t *subtree = bvh->lazy->subtrees + index;
+	if (atomic_load_acquire(&subtree->state) == BVH_SUBTREE_BUILT)
+		return subtree->nodes;
+	// Claim the subtree, the thread that does builds it
+	if (atomic_cas(&subtree->state, BVH_SUBTREE_DEFERRED, BVH_SUBTREE_BUILDING))
+	{
+		const f64 start = time_now();
+		// NOTE: Serial builds only read the shared primitive data, and partition the subtree's own range
+		sah_arena_t arena = {0};
+		sah_build_node((sah_build_t*) bvh->lazy->build, &arena, subtree->first, subtree->count);
+		subtree->nodes = realloc(arena.nodes, arena.count*sizeof(bvh_node_t));
+		subtree->node_count = arena.count;
+		subtree->build_time = (time_now() - start);
+		// Publish the subtree, the nodes are visible to any thread that sees it built
+		atomic_store_release(&subtree->state, BVH_SUBTREE_BUILT);
+		return subtree->nodes;
+	}
+	// Another thread is building it, wait for it to be published
+	// NOTE: Subtrees are small, so this doesn't take long and is rare
+	while (atomic_load_acquire(&subtree->state) != BVH_SUBTREE_BUILT)
+		_mm_pause();
+	return subtree->nodes;
+};
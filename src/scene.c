@@ -1,6 +1,9 @@
 #include "scene.h"
+#include "gen.h"
+#include "import.h"
 
 #include <jsmn.h>
+#include <sys/stat.h>
 
 typedef struct
 {
@@ -8,7 +11,8 @@ typedef struct
 	
 	i32 token_count;
 	i32 current_token;
-	jsmntok_t tokens[256];
+	// NOTE: Sized for the scene file when it's loaded, instances alone can take thousands of tokens
+	jsmntok_t *tokens;
 } parser_t;
 
 static const jsmntok_t* parser_get(parser_t *parser)
@@ -16,11 +20,19 @@ static const jsmntok_t* parser_get(parser_t *parser)
 	return parser->tokens + parser->current_token++;
 };
 
+// Step past the children of a token that was just read, so a value can be skipped whatever it holds
+static void parser_skip(parser_t *parser, const jsmntok_t *token)
+{
+	while ((parser->current_token < parser->token_count) && (parser->tokens[parser->current_token].start < token->end))
+		parser->current_token++;
+};
+
 static bool parser_check_equals(const parser_t *parser, const jsmntok_t *token, const char *check)
 {
 	const char  *tok_str = (parser->string + token->start);
 	const size_t tok_len = (token->end-token->start);
-	return (strncmp(check, tok_str, tok_len) == 0);
+	// NOTE: Lengths are compared too, so that keys that are prefixes of each other don't match
+	return (strlen(check) == tok_len) && (strncmp(check, tok_str, tok_len) == 0);
 };
 static i32 parser_get_i32(const parser_t *parser, const jsmntok_t *token)
 {
@@ -48,6 +60,11 @@ static f32 parser_get_f32(const parser_t *parser, const jsmntok_t *token)
 	free(str);
 	return v;
 };
+static bool parser_get_bool(const parser_t *parser, const jsmntok_t *token)
+{
+	assert(token->type == JSMN_PRIMITIVE);
+	return (parser->string[token->start] == 't');
+};
 static void parser_get_str(const parser_t *parser, const jsmntok_t *token, 
 	char *str, size_t str_len)
 {
@@ -87,14 +104,46 @@ static void scene_parse_render(scene_t *scene, parser_t *parser)
 
 		if (parser_check_equals(parser, name, "samples"))   scene->samples = parser_get_i32(parser, value);
 		if (parser_check_equals(parser, name, "bounces"))   scene->bounces = parser_get_i32(parser, value);
+		if (parser_check_equals(parser, name, "sample_range")) scene->tiles.sample_range = parser_get_i32(parser, value);
 		if (parser_check_equals(parser, name, "background")) background = parser_get_v3(parser, value);
+		if (parser_check_equals(parser, name, "bvh_optimize")) scene->bvh.optimize = parser_get_bool(parser, value);
+		if (parser_check_equals(parser, name, "bvh_compress")) scene->bvh.compress = parser_get_bool(parser, value);
+		if (parser_check_equals(parser, name, "bvh_reorder"))  scene->bvh.reorder = parser_get_bool(parser, value);
+		if (parser_check_equals(parser, name, "bvh_stackless")) scene->bvh.stackless = parser_get_bool(parser, value);
+		if (parser_check_equals(parser, name, "bvh_lazy"))   scene->bvh.lazy = parser_get_bool(parser, value);
+		if (parser_check_equals(parser, name, "bvh"))
+		{
+			if (parser_check_equals(parser, value, "median")) scene->bvh.builder = BVH_BUILD_MEDIAN;
+			if (parser_check_equals(parser, value, "lbvh"))   scene->bvh.builder = BVH_BUILD_LBVH;
+			if (parser_check_equals(parser, value, "sah"))    scene->bvh.builder = BVH_BUILD_SAH;
+		}
+		if (parser_check_equals(parser, name, "accel")) parser_get_str(parser, value, scene->accel, static_len(scene->accel));
+		if (parser_check_equals(parser, name, "grid_density")) scene->grid.density = parser_get_f32(parser, value);
+		if (parser_check_equals(parser, name, "grid"))
+		{
+			if (parser_check_equals(parser, value, "none"))   scene->grid.mode = GRID_NONE;
+			if (parser_check_equals(parser, value, "dense"))  scene->grid.mode = GRID_DENSE;
+			if (parser_check_equals(parser, value, "hashed")) scene->grid.mode = GRID_HASHED;
+		}
+		// NOTE: The page budget is given in megabytes
+		if (parser_check_equals(parser, name, "page_file"))   parser_get_str(parser, value, scene->page.file, static_len(scene->page.file));
+		if (parser_check_equals(parser, name, "page_budget")) scene->page.budget = (u64) (parser_get_f32(parser, value)*1024.f*1024.f);
+		if (parser_check_equals(parser, name, "page_chunk"))  scene->page.chunk_size = parser_get_i32(parser, value);
+		if (parser_check_equals(parser, name, "page_keep"))   scene->page.keep_file = parser_get_bool(parser, value);
+		if (parser_check_equals(parser, name, "lod_threshold")) scene->lod.threshold = parser_get_f32(parser, value);
 		if (parser_check_equals(parser, name, "tiles"))
 		{
 			assert(value->type == JSMN_ARRAY);
 			assert(value->size == 2);
 
-			scene->tiles_x = parser_get_i32(parser, parser_get(parser));
-			scene->tiles_y = parser_get_i32(parser, parser_get(parser));
+			scene->tiles.tiles_x = parser_get_i32(parser, parser_get(parser));
+			scene->tiles.tiles_y = parser_get_i32(parser, parser_get(parser));
+		}
+		if (parser_check_equals(parser, name, "tile_order"))
+		{
+			if (parser_check_equals(parser, value, "center"))  scene->tiles.order = TILE_ORDER_CENTER;
+			if (parser_check_equals(parser, value, "hilbert")) scene->tiles.order = TILE_ORDER_HILBERT;
+			if (parser_check_equals(parser, value, "rows"))    scene->tiles.order = TILE_ORDER_ROWS;
 		}
 	};
 
@@ -103,7 +152,7 @@ static void scene_parse_render(scene_t *scene, parser_t *parser)
 	#if 0
 	printf("RENDER: %d samples %d bounces %dx%d tiles\n", 
 		scene->samples, scene->bounces,
-		scene->tiles_x, scene->tiles_y);
+		scene->tiles.tiles_x, scene->tiles.tiles_y);
 	#endif
 }
 static void scene_parse_image(scene_t *scene, parser_t *parser)
@@ -166,7 +215,38 @@ static void scene_parse_camera(scene_t *scene, parser_t *parser)
 		position, at, up,
 		fov, aperture, aspect_ratio);
 };
-static void scene_parse_sphere(scene_t *scene, parser_t *parser)
+static void scene_parse_animation(scene_t *scene, parser_t *parser)
+{
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
+
+	animation_t *animation = &scene->animation;
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *name = parser_get(parser);
+		const jsmntok_t *value = parser_get(parser);
+
+		if (parser_check_equals(parser, name, "frames"))            animation->frames = parser_get_i32(parser, value);
+		if (parser_check_equals(parser, name, "rebuild_threshold")) animation->rebuild_threshold = parser_get_f32(parser, value);
+		if (parser_check_equals(parser, name, "stream"))            parser_get_str(parser, value, animation->stream, static_len(animation->stream));
+	};
+};
+// Parse a material key of an object, does nothing if the key isn't a material key
+static void parser_get_material(parser_t *parser, const jsmntok_t *name, const jsmntok_t *value, material_t *material)
+{
+	if (parser_check_equals(parser, name, "fuzz"))          material->fuzz = parser_get_f32(parser, value);
+	if (parser_check_equals(parser, name, "albedo"))        material->albedo = parser_get_v3(parser, value);
+	if (parser_check_equals(parser, name, "emittance"))     material->emittance = parser_get_v3(parser, value);
+	if (parser_check_equals(parser, name, "refractivity"))	material->refractivity = parser_get_f32(parser, value);
+	if (parser_check_equals(parser, name, "material_type"))
+	{
+		if (parser_check_equals(parser, value, "metal")) material->type = MATERIAL_METAL;
+		if (parser_check_equals(parser, value, "dielectric")) material->type = MATERIAL_DIELECTRIC;
+		if (parser_check_equals(parser, value, "lambertian")) material->type = MATERIAL_LAMBERTIAN;
+	};
+};
+// Parse a sphere object, any keyframes it has are written to the keyframe list
+static sphere_t parser_get_sphere(parser_t *parser, u32 *keyframe_count, v3 *keyframes)
 {
 	f32 radius = 0.f;
 	v3 center = V3(0.f, 0.f, 0.f);
@@ -183,15 +263,15 @@ static void scene_parse_sphere(scene_t *scene, parser_t *parser)
 
 		if (parser_check_equals(parser, name, "center"))        center = parser_get_v3(parser, value);
 		if (parser_check_equals(parser, name, "radius"))        radius = parser_get_f32(parser, value);
-		if (parser_check_equals(parser, name, "fuzz"))          material.fuzz = parser_get_f32(parser, value);
-		if (parser_check_equals(parser, name, "albedo"))        material.albedo = parser_get_v3(parser, value);
-		if (parser_check_equals(parser, name, "emittance"))     material.emittance = parser_get_v3(parser, value);
-		if (parser_check_equals(parser, name, "refractivity"))	material.refractivity = parser_get_f32(parser, value);
-		if (parser_check_equals(parser, name, "material_type"))
-		{
-			if (parser_check_equals(parser, value, "metal")) material.type = MATERIAL_METAL;
-			if (parser_check_equals(parser, value, "dielectric")) material.type = MATERIAL_DIELECTRIC;
-			if (parser_check_equals(parser, value, "lambertian")) material.type = MATERIAL_LAMBERTIAN;
+		parser_get_material(parser, name, value, &material);
+		if (parser_check_equals(parser, name, "keyframes"))
+		{
+			assert(value->type == JSMN_ARRAY);
+			assert(value->size <= MAX_KEYFRAMES);
+
+			*keyframe_count = value->size;
+			for (u32 j = 0; j < value->size; j++)
+				keyframes[j] = parser_get_v3(parser, parser_get(parser));
 		};
 	};
 
@@ -202,13 +282,270 @@ static void scene_parse_sphere(scene_t *scene, parser_t *parser)
 	printf("MATERIAL: %d\n", material_type);
 	#endif
 
-	assert((scene->world.sphere_count + 1) < MAX_SPHERES);
+	sphere_t sphere;
+	sphere.radius = radius;
+	sphere.center = center;
+	sphere.material = material;
+	sphere.aabb = sphere_aabb(center, radius);
+	return sphere;
+};
+static void scene_parse_sphere(scene_t *scene, parser_t *parser)
+{
+	u32 keyframe_count = 0;
+	v3 keyframes[MAX_KEYFRAMES];
+	const sphere_t sphere = parser_get_sphere(parser, &keyframe_count, keyframes);
+	// Keyframes are stored in the animation data, by scene index
+	const u32 index = scene->world.sphere_count;
+	if (index < MAX_SPHERES)
+	{
+		scene->animation.keyframe_count[index] = keyframe_count;
+		memcpy(scene->animation.keyframes[index], keyframes, keyframe_count*sizeof(v3));
+	} else if (keyframe_count > 0) {
+		printf("Sphere %u has keyframes, but only the first %u spheres can be animated\n", index, MAX_SPHERES);
+	}
+	world_add_sphere(&scene->world, &sphere);
+};
+// Parse a generator material, a material with the relative weight it's picked with
+static void scene_parse_generator_material(gen_params_t *params, parser_t *parser)
+{
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
+	assert(params->material_count < MAX_GEN_MATERIALS);
+
+	material_t *material = params->materials + params->material_count;
+	f32 *weight = params->weights + params->material_count++;
+	memset(material, 0, sizeof(material_t));
+	*weight = 1.f;
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *name = parser_get(parser);
+		const jsmntok_t *value = parser_get(parser);
+
+		if (parser_check_equals(parser, name, "weight")) *weight = parser_get_f32(parser, value);
+		parser_get_material(parser, name, value, material);
+	};
+};
+// Parse a sphere field generator, and generate it's spheres straight into the world
+static void scene_parse_generator(scene_t *scene, parser_t *parser)
+{
+	gen_params_t params;
+	gen_params_init(&params);
+
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
+
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *name = parser_get(parser);
+		if (parser_check_equals(parser, name, "materials"))
+		{
+			const jsmntok_t *list = parser_get(parser);
+			assert(list->type == JSMN_ARRAY);
+			for (u32 j = 0; j < list->size; j++)
+				scene_parse_generator_material(&params, parser);
+			continue;
+		}
+		const jsmntok_t *value = parser_get(parser);
+		if (parser_check_equals(parser, name, "type"))
+		{
+			if (parser_check_equals(parser, value, "random"))    params.type = GEN_RANDOM;
+			if (parser_check_equals(parser, value, "grid"))      params.type = GEN_GRID;
+			if (parser_check_equals(parser, value, "poisson"))   params.type = GEN_POISSON;
+			if (parser_check_equals(parser, value, "clustered")) params.type = GEN_CLUSTERED;
+		}
+		// NOTE: Parsed as a float, so big counts can be written like 1e7
+		if (parser_check_equals(parser, name, "count"))        params.count = (u32) parser_get_f32(parser, value);
+		if (parser_check_equals(parser, name, "min"))          params.bounds.min = parser_get_v3(parser, value);
+		if (parser_check_equals(parser, name, "max"))          params.bounds.max = parser_get_v3(parser, value);
+		if (parser_check_equals(parser, name, "radius"))
+		{
+			assert(value->type == JSMN_ARRAY);
+			assert(value->size == 2);
+
+			params.radius_min = parser_get_f32(parser, parser_get(parser));
+			params.radius_max = parser_get_f32(parser, parser_get(parser));
+		}
+		if (parser_check_equals(parser, name, "clusters"))     params.cluster_count = parser_get_i32(parser, value);
+		if (parser_check_equals(parser, name, "cluster_size")) params.cluster_size = parser_get_f32(parser, value);
+		if (parser_check_equals(parser, name, "seed"))         params.seed = (u64) parser_get_i32(parser, value);
+	};
+
+	const u32 count = gen_spheres(&scene->world, &params);
+	if (count < params.count)
+		printf("Generator only had room for %u of %u spheres\n", count, params.count);
+};
+// Parse a particle file import, and stream the particles straight into the world
+static void scene_parse_import(scene_t *scene, parser_t *parser)
+{
+	char file_name[512] = "";
+	import_params_t params;
+	import_params_init(&params);
+
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
+
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *name = parser_get(parser);
+		if (parser_check_equals(parser, name, "materials"))
+		{
+			// Material ids index this list
+			const jsmntok_t *list = parser_get(parser);
+			assert(list->type == JSMN_ARRAY);
+			assert(list->size <= MAX_IMPORT_MATERIALS);
+			for (u32 j = 0; j < list->size; j++)
+			{
+				const jsmntok_t *material = parser_get(parser);
+				assert(material->type == JSMN_OBJECT);
+				material_t *out = params.materials + params.material_count++;
+				memset(out, 0, sizeof(material_t));
+				for (u32 k = 0; k < material->size; k++)
+				{
+					const jsmntok_t *key = parser_get(parser);
+					parser_get_material(parser, key, parser_get(parser), out);
+				}
+			}
+			continue;
+		}
+		const jsmntok_t *value = parser_get(parser);
+		if (parser_check_equals(parser, name, "file"))    parser_get_str(parser, value, file_name, static_len(file_name));
+		if (parser_check_equals(parser, name, "workers")) params.worker_count = parser_get_i32(parser, value);
+		if (parser_check_equals(parser, name, "format"))
+		{
+			if (parser_check_equals(parser, value, "binary")) params.format = IMPORT_BINARY;
+			if (parser_check_equals(parser, value, "csv"))    params.format = IMPORT_CSV;
+		}
+	};
+
+	import_stats_t stats;
+	if (!import_particles(&scene->world, file_name, &params, &stats))
+	{
+		printf("Failed to import particles from \"%s\"\n", file_name);
+		return;
+	}
+	const f64 megabytes = (f64) stats.bytes / (1024.0*1024.0);
+	printf("Imported %u particles from \"%s\" (%.1f MB in %f seconds, %.1f MB/s)\n",
+		stats.count, file_name, megabytes, stats.time, megabytes / max(stats.time, 1e-9));
+	if (stats.bad_rows > 0)
+		printf("WARNING: Skipped %u rows that couldn't be parsed\n", stats.bad_rows);
+	if (stats.unknown_materials > 0)
+		printf("WARNING: %u particles have a material id without a material\n", stats.unknown_materials);
+};
+static void scene_parse_object(scene_t *scene, parser_t *parser)
+{
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
+
+	object_t *object = scene->world.objects + world_add_object(&scene->world, "");
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *name = parser_get(parser);
+		if (parser_check_equals(parser, name, "name")) parser_get_str(parser, parser_get(parser), object->name, static_len(object->name));
+		else if (parser_check_equals(parser, name, "sphere"))
+		{
+			// NOTE: Objects can't be animated, so keyframes are ignored
+			u32 keyframe_count;
+			v3 keyframes[MAX_KEYFRAMES];
+			const sphere_t sphere = parser_get_sphere(parser, &keyframe_count, keyframes);
+			object_add_sphere(object, &sphere);
+		} else {
+			// Skip the whole value of anything else, or it would be read as the next key
+			printf("Unknown object key \"%.*s\", skipped\n", name->end - name->start, parser->string + name->start);
+			parser_skip(parser, parser_get(parser));
+		}
+	};
+};
+static void scene_parse_instance(scene_t *scene, parser_t *parser)
+{
+	char object_name[64] = "";
+	v3 position = V3(0.f, 0.f, 0.f);
+	v3 rotation = V3(0.f, 0.f, 0.f);
+	v3 scale = V3(1.f, 1.f, 1.f);
+
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
 
-	const u32 index = scene->world.sphere_count++;
-	scene->world.spheres[index].radius = radius;
-	scene->world.spheres[index].center = center;
-	scene->world.spheres[index].material = material;
-	scene->world.spheres[index].aabb = sphere_aabb(center, radius);
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *name = parser_get(parser);
+		const jsmntok_t *value = parser_get(parser);
+
+		if (parser_check_equals(parser, name, "object"))	parser_get_str(parser, value, object_name, static_len(object_name));
+		if (parser_check_equals(parser, name, "position"))	position = parser_get_v3(parser, value);
+		if (parser_check_equals(parser, name, "rotation"))	rotation = parser_get_v3(parser, value);
+		if (parser_check_equals(parser, name, "scale"))		scale = parser_get_v3(parser, value);
+	};
+
+	// NOTE: Objects have to be defined before they're instanced
+	u32 object;
+	if (!world_find_object(&scene->world, object_name, &object))
+	{
+		printf("Unknown object \"%s\", instance skipped\n", object_name);
+		return;
+	}
+	// Scale, then rotate (in degrees, around x, y, then z), then translate
+	m44 transform = m44_scale(scale.x, scale.y, scale.z);
+	transform = m44_mul(m44_rotationX(to_radians(rotation.x)), transform);
+	transform = m44_mul(m44_rotationY(to_radians(rotation.y)), transform);
+	transform = m44_mul(m44_rotationZ(to_radians(rotation.z)), transform);
+	transform = m44_mul(m44_translation(position.x, position.y, position.z), transform);
+	world_add_instance(&scene->world, object, transform);
+};
+// Check if a top level key makes spheres
+static bool scene_is_geometry(const parser_t *parser, const jsmntok_t *token)
+{
+	return parser_check_equals(parser, token, "sphere") || parser_check_equals(parser, token, "generator") ||
+		parser_check_equals(parser, token, "import");
+};
+// Read the render parameters and hash the geometry the scene describes, without making any spheres, to see if a kept
+// page file was built from it
+// NOTE: Generators are deterministic, so their parameters stand in for the spheres. Imported files are keyed by
+// their size and modification time instead of being read
+static void scene_check_pages(scene_t *scene, parser_t *parser)
+{
+	const jsmntok_t *top = parser_get(parser);
+	assert(top->type == JSMN_OBJECT);
+
+	u64 key = HASH_SEED;
+	bool animated = false;
+	for (u32 i = 0; i < top->size; i++)
+	{
+		const jsmntok_t *token = parser_get(parser);
+		if (parser_check_equals(parser, token, "render"))
+		{
+			scene_parse_render(scene, parser);
+			continue;
+		}
+		animated |= parser_check_equals(parser, token, "animation");
+		const jsmntok_t *value = parser_get(parser);
+		if (scene_is_geometry(parser, token))
+		{
+			key = hash_bytes(key, parser->string + token->start, (size_t) (token->end - token->start));
+			key = hash_bytes(key, parser->string + value->start, (size_t) (value->end - value->start));
+			// Find the file an import reads
+			for (i32 j = parser->current_token; (j + 1) < parser->token_count && (parser->tokens[j].start < value->end); j++)
+			{
+				const jsmntok_t *file = parser->tokens + j + 1;
+				if (!parser_check_equals(parser, parser->tokens + j, "file") || (file->type != JSMN_STRING))
+					continue;
+				char file_name[512];
+				parser_get_str(parser, file, file_name, static_len(file_name));
+				struct stat st;
+				const i64 file_key[2] = { 0, 0 };
+				key = (stat(file_name, &st) == 0) ?
+					hash_bytes(hash_bytes(key, &st.st_size, sizeof(st.st_size)), &st.st_mtime, sizeof(st.st_mtime)) :
+					hash_bytes(key, file_key, sizeof(file_key));
+			}
+		}
+		parser_skip(parser, value);
+	};
+	parser->current_token = 0;
+
+	// Only scenes rendered with the paged accelerator can leave their spheres in the page file
+	// NOTE: Animations move the spheres, so they always need them
+	scene->page.key = key;
+	scene->page.reuse = scene->page.keep_file && !animated && (strcmp(scene->accel, "paged") == 0) &&
+		page_file_matches(&scene->page, sizeof(sphere_t), &scene->bvh);
 };
 static void scene_parse(scene_t *scene, parser_t *parser)
 {
@@ -218,10 +555,21 @@ static void scene_parse(scene_t *scene, parser_t *parser)
 	for (u32 i = 0; i < top->size; i++)
 	{
 		const jsmntok_t *token = parser_get(parser);
+		// The spheres are already in the page file
+		if (scene->page.reuse && scene_is_geometry(parser, token))
+		{
+			parser_skip(parser, parser_get(parser));
+			continue;
+		}
 		if (parser_check_equals(parser, token, "render"))	scene_parse_render(scene, parser);
 		if (parser_check_equals(parser, token, "image"))	scene_parse_image(scene, parser);
 		if (parser_check_equals(parser, token, "camera"))	scene_parse_camera(scene, parser);
 		if (parser_check_equals(parser, token, "sphere"))	scene_parse_sphere(scene, parser);
+		if (parser_check_equals(parser, token, "generator"))	scene_parse_generator(scene, parser);
+		if (parser_check_equals(parser, token, "import"))	scene_parse_import(scene, parser);
+		if (parser_check_equals(parser, token, "animation"))	scene_parse_animation(scene, parser);
+		if (parser_check_equals(parser, token, "object"))	scene_parse_object(scene, parser);
+		if (parser_check_equals(parser, token, "instance"))	scene_parse_instance(scene, parser);
 	};
 };
 scene_t* scene_load(const char *file_name)
@@ -239,17 +587,32 @@ scene_t* scene_load(const char *file_name)
 		p.string = code;
 		p.current_token = 0;
 
-		p.token_count = jsmn_parse(&parser, 
-			p.string, len, 
-			p.tokens, static_len(p.tokens));
+		// Count the tokens first, then parse them into a list just big enough
+		p.token_count = jsmn_parse(&parser, p.string, len, NULL, 0);
+		p.tokens = malloc(max(p.token_count, 1)*sizeof(jsmntok_t));
+		assert(p.tokens != NULL);
+		if (p.token_count > 0)
+		{
+			jsmn_init(&parser);
+			p.token_count = jsmn_parse(&parser, 
+				p.string, len, 
+				p.tokens, (u32) p.token_count);
+		}
 		if (p.token_count > 0)
 		{
 			scene = malloc(sizeof(scene_t));
 			assert(scene != NULL);
 			memset(scene, 0, sizeof(scene_t));
+			// Default to rebuilding animated BVHs once they get half again as expensive
+			scene->animation.rebuild_threshold = 1.5f;
 
+			// Page files go next to the scene unless it says otherwise
+			snprintf(scene->page.file, sizeof(scene->page.file), "%s.pages", file_name);
+			scene_check_pages(scene, &p);
 			scene_parse(scene, &p);
+			scene->hash = hash_bytes(HASH_SEED, code, len);
 		};
+		free(p.tokens);
 	};
 	return scene;
 };
\ No newline at end of file
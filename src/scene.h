@@ -5,6 +5,8 @@
 #include "util.h"
 
 #include "world.h"
+#include "anim.h"
+#include "tile.h"
 
 typedef struct
 {
@@ -13,10 +15,25 @@ typedef struct
 	char output[512];
 	// Render data
 	i32 samples, bounces;
-	i32 tiles_x, tiles_y;
+	// Tile size, order and sample ranges
+	tile_params_t tiles;
+	// Accelerator name, "auto" to pick one for the scene, empty to pick from the parameters below
+	char accel[32];
+	// BVH construction parameters
+	bvh_params_t bvh;
+	// Grid construction parameters, selects the grid accelerator unless the mode is none
+	grid_params_t grid;
+	// Paging parameters, for the paged accelerator
+	page_params_t page;
+	// Level of detail parameters, for the LOD accelerator
+	lod_params_t lod;
 	// World data
 	world_t world;
 	camera_t camera;
+	// Animation data
+	animation_t animation;
+	// Hash of the scene file, partial renders and checkpoints can only be combined with ones from the same scene
+	u64 hash;
 } scene_t;
 
 // Load a scene from a JSON file
@@ -0,0 +1,809 @@
+// NOTE: Needed for sched_yield
+#define _POSIX_C_SOURCE 200809L
+
+#include "tile.h"
+#include "job.h"
+#include "perf.h"
+#include "render.h"
+#include "checkpoint.h"
+
+#include <sched.h>
+
+// A running tile splits while other workers are idle, once it has taken this many times longer than the worker's finished tiles of the same size
+#define TILE_SPLIT_FACTOR		2.0
+// Fewest rows in each half of a split tile
+#define TILE_MIN_SPLIT_ROWS		2
+// Default number of sample ranges each tile's samples are split into
+#define TILE_DEFAULT_RANGES		4
+// Auto sized tiles give every worker about this many, and are between the min and max size on a side
+#define TILE_TILES_PER_WORKER	8
+#define TILE_MIN_SIZE			16
+#define TILE_MAX_SIZE			64
+// Number of times an idle worker spins before giving up it's core to busy ones
+#define TILE_IDLE_SPINS			64
+
+// Queue of tasks owned by a single worker, the owner takes them from the back and thieves from the front
+// NOTE: Aligned, so that workers never write to the same cache line
+typedef struct
+{
+	// Spin lock guarding the task array
+	volatile u32 lock;
+	// Queued tasks are [first, first+count) of the array
+	// NOTE: Thieves peek at the count without the lock
+	u32 first;
+	volatile u32 count;
+	u32 capacity;
+	tile_task_t *tasks;
+	// Time spent on finished tasks, and their pixel samples, for the split threshold
+	f64 busy_time;
+	u64 busy_samples;
+	// Scratch memory allocator for fast, thread-safe allocations
+	lin_alloc_t temp_alloc;
+	// Time the worker ran out of work
+	f64 done_time;
+	u32 steals;
+	u32 splits;
+	// NUMA node of the worker, and the loads it made from memory on it's own node and others
+	u32 node;
+	u64 local_loads;
+	u64 remote_loads;
+} align_64 tile_worker_t;
+
+// Samples of a tile, summed apart for every range until they're all done
+// NOTE: Aligned, so that workers finishing neighbouring tiles never write to the same cache line
+typedef struct
+{
+	rect_t area;
+	// Spin lock guarding the allocation of the sums
+	volatile u32 lock;
+	// Number of the tile's tasks queued or being rendered, the last one to finish merges the sums
+	volatile u32 pending;
+	// Set once the tile is merged into the framebuffer
+	volatile u32 done;
+	// Number of pixels summed in every row of every range, allocated with the sums
+	// NOTE: Rows are only left unfinished when rendering is cancelled, the pixels get the ranges they have then
+	u32 *rows_done;
+	// Pixels from one row of the sums to the next, and from one range to the next
+	u32 stride;
+	size_t range_size;
+	// Sums of every sample range, one tile sized buffer after the other
+	// NOTE: Allocated once the first task of the tile starts, and freed when they're merged.
+	// Rows start on a cache line, so the tasks of a split tile or of other ranges never share one
+	v3 *sums;
+} align_64 tile_t;
+
+// Shared state of the workers rendering a frame
+typedef struct
+{
+	// Input and output pointers
+	const world_t *world;
+	const camera_t *camera;
+	i32 samples, bounces;
+	framebuffer_t *framebuffer;
+	u32 worker_count;
+	tile_worker_t *workers;
+	// Count the node local and remote loads of every worker
+	bool count_loads;
+	u32 tile_count;
+	tile_t *tiles;
+	// Samples of each pixel are split into ranges of range_samples each
+	u32 range_count;
+	u32 range_samples;
+	// Number of tasks queued or being rendered, workers stop once it reaches 0
+	// NOTE: Splits are counted before the tile they came from finishes, so this never reaches 0 early
+	volatile u32 pending;
+	// Number of workers with nothing to do, splits are only worth it when someone can steal them
+	volatile u32 idle;
+	// Number of finished tasks, and the time the first one finished
+	volatile u32 tasks_done;
+	f64 first_tile_time;
+	// Checkpoint parameters and number of finished tiles
+	const tile_checkpoint_params_t *checkpoint;
+	u32 tiles_x, tiles_y;
+	volatile u32 tiles_done;
+	// Spin lock held by the worker writing a checkpoint, the time the next one is due and the number written
+	volatile u32 checkpoint_lock;
+	f64 next_checkpoint;
+	u32 checkpoints;
+} tile_queue_t;
+
+static inline void tile_lock(volatile u32 *lock)
+{
+	while (!atomic_cas(lock, 0, 1))
+		_mm_pause();
+};
+static inline void tile_unlock(volatile u32 *lock)
+{
+	atomic_store_release(lock, 0);
+};
+// Add a task to the back of a worker's queue
+static void tile_push(tile_worker_t *worker, tile_task_t task)
+{
+	tile_lock(&worker->lock);
+	if ((worker->first + worker->count) == worker->capacity)
+	{
+		// Move the queue back to the start of the array, or grow it when it's full
+		if (worker->first > 0)
+		{
+			memmove(worker->tasks, worker->tasks + worker->first, worker->count*sizeof(tile_task_t));
+			worker->first = 0;
+		} else {
+			worker->capacity = max(worker->capacity*2, 16);
+			worker->tasks = realloc(worker->tasks, worker->capacity*sizeof(tile_task_t));
+			assert(worker->tasks != NULL);
+		}
+	}
+	worker->tasks[worker->first + worker->count++] = task;
+	tile_unlock(&worker->lock);
+};
+// Take the task at the back of the worker's own queue, returns false if it's empty
+static bool tile_pop(tile_worker_t *worker, tile_task_t *task)
+{
+	bool result = false;
+	tile_lock(&worker->lock);
+	if (worker->count > 0)
+	{
+		*task = worker->tasks[worker->first + --worker->count];
+		result = true;
+	}
+	tile_unlock(&worker->lock);
+	return result;
+};
+// Take the task at the front of another worker's queue, the one queued first and furthest from what the owner is working on
+// NOTE: Workers on the same NUMA node are robbed first, their tiles sum into memory on the thief's node too
+static bool tile_steal(tile_queue_t *queue, u32 worker_index, tile_task_t *task)
+{
+	const u32 node = queue->workers[worker_index].node;
+	for (u32 pass = 0; pass < 2; pass++)
+	{
+		for (u32 i = 1; i < queue->worker_count; i++)
+		{
+			tile_worker_t *victim = queue->workers + ((worker_index + i) % queue->worker_count);
+			if ((victim->node == node) != (pass == 0))
+				continue;
+			// Skip empty queues without taking the lock, so idle workers don't hammer it
+			if (atomic_load_acquire(&victim->count) == 0)
+				continue;
+			bool result = false;
+			tile_lock(&victim->lock);
+			if (victim->count > 0)
+			{
+				*task = victim->tasks[victim->first++];
+				victim->count--;
+				result = true;
+			}
+			tile_unlock(&victim->lock);
+			if (result)
+				return true;
+		}
+	}
+	return false;
+};
+// Get the sums of a tile's sample range, allocating them if this is the first of it's tasks to start
+static v3* tile_sums(const tile_queue_t *queue, tile_t *tile, u32 range)
+{
+	tile_lock(&tile->lock);
+	if (!tile->sums)
+	{
+		// NOTE: Ranges are a whole number of padded rows, so the size is a whole number of cache lines
+		const size_t size = max(tile->range_size*queue->range_count, TILE_ROW_PIXELS)*sizeof(v3);
+		tile->sums = aligned_alloc(CACHE_LINE_SIZE, size);
+		tile->rows_done = calloc(max(tile->area.h*queue->range_count, 1), sizeof(u32));
+		assert((tile->sums != NULL) && (tile->rows_done != NULL));
+		memset(tile->sums, 0, size);
+	}
+	tile_unlock(&tile->lock);
+	return tile->sums + range*tile->range_size;
+};
+// Merge a tile's sums once all of it's ranges are done
+static void tile_merge(const tile_queue_t *queue, tile_t *tile)
+{
+	tile_resolve(queue->framebuffer, tile->area, tile->sums, tile->stride, tile->range_size, queue->range_count, queue->samples);
+	free(tile->sums);
+	free(tile->rows_done);
+	tile->sums = NULL;
+	tile->rows_done = NULL;
+};
+// Write a checkpoint of the tiles finished so far
+// NOTE: Only pixels of finished tiles are read, nothing writes to them anymore
+static void tile_checkpoint(tile_queue_t *queue)
+{
+	const framebuffer_t *framebuffer = queue->framebuffer;
+	checkpoint_t checkpoint = {0};
+	checkpoint_header_t *header = &checkpoint.header;
+	header->magic = CHECKPOINT_MAGIC;
+	header->version = CHECKPOINT_VERSION;
+	header->scene_hash = queue->checkpoint->scene_hash;
+	header->width = (u32) framebuffer->width;
+	header->height = (u32) framebuffer->height;
+	header->samples = queue->samples;
+	header->range_samples = queue->range_samples;
+	header->tiles_x = queue->tiles_x;
+	header->tiles_y = queue->tiles_y;
+	checkpoint_alloc(&checkpoint);
+	for (u32 i = 0; i < queue->tile_count; i++)
+	{
+		tile_t *tile = queue->tiles + i;
+		if (!atomic_load_acquire(&tile->done))
+			continue;
+		checkpoint.tiles_done[i] = 1;
+		header->done_count++;
+		const rect_t area = tile->area;
+		for (i32 j = 0; j < area.h; j++)
+		{
+			const size_t row = (size_t) (area.y + j)*framebuffer->width + (size_t) area.x;
+			memcpy(checkpoint.pixels + row, framebuffer->pixels + row, area.w*sizeof(v3));
+			for (i32 x = 0; x < area.w; x++)
+				checkpoint.counts[row + x] = (u32) queue->samples;
+		}
+	}
+	if (checkpoint_write(queue->checkpoint->file, &checkpoint))
+		queue->checkpoints++;
+	checkpoint_free(&checkpoint);
+};
+// Mark a merged tile as finished, and write a checkpoint if one is due
+static void tile_finish(tile_queue_t *queue, tile_t *tile)
+{
+	atomic_store_release(&tile->done, 1);
+	const u32 done = atomic_inc(&queue->tiles_done) + 1;
+	const tile_checkpoint_params_t *params = queue->checkpoint;
+	if (!params->file)
+		return;
+	const bool tiles_due = (params->tile_interval > 0) && ((done % params->tile_interval) == 0);
+	if (!tiles_due && (params->interval <= 0.0))
+		return;
+	// One worker writes it while the others keep rendering, checkpoints that come due meanwhile are skipped
+	if (!atomic_cas(&queue->checkpoint_lock, 0, 1))
+		return;
+	const f64 now = time_now();
+	if (tiles_due || ((params->interval > 0.0) && (now >= queue->next_checkpoint)))
+	{
+		tile_checkpoint(queue);
+		queue->next_checkpoint = time_now() + params->interval;
+	}
+	atomic_store_release(&queue->checkpoint_lock, 0);
+};
+// Render a task row by row, splitting off the rest once it runs past the split threshold
+static void tile_run(tile_queue_t *queue, tile_worker_t *worker, tile_task_t task)
+{
+	const framebuffer_t *framebuffer = queue->framebuffer;
+	tile_t *tile = queue->tiles + task.tile;
+	const i32 first_sample = task.range*queue->range_samples;
+	const i32 sample_count = min(queue->range_samples, queue->samples - first_sample);
+	v3 *sums = tile_sums(queue, tile, task.range);
+	// Replicated geometry is read from the copy on the worker's node
+	const world_t *world = world_local(queue->world);
+
+	const f64 start = time_now();
+	// Average cost of a pixel sample so far, no tile splits until the worker has finished one
+	const f64 sample_time = (worker->busy_samples > 0) ? (worker->busy_time / (f64) worker->busy_samples) : 0.0;
+
+	rect_t area = task.area;
+	for (i32 row = 0; row < area.h; row++)
+	{
+		const rect_t line = { area.x, area.y + row, area.w, 1 };
+		const u32 finished = render_sums(&worker->temp_alloc,
+			world,
+			queue->camera,
+			framebuffer->width, framebuffer->height,
+			first_sample, sample_count,
+			queue->bounces,
+			line, sums + (line.y - tile->area.y)*tile->stride + (line.x - tile->area.x), tile->stride);
+		tile->rows_done[task.range*tile->area.h + (line.y - tile->area.y)] = finished;
+		// Leave the tile as it is once rendering is cancelled, the frame is resolved from what's there
+		if (finished < (u32) line.w)
+			return;
+		// Split the rest of an expensive tile, and queue the bottom half so idle workers can steal it
+		const i32 rest = area.h - (row + 1);
+		if ((sample_time > 0.0) && (rest >= 2*TILE_MIN_SPLIT_ROWS) && (atomic_load_acquire(&queue->idle) > 0))
+		{
+			const f64 expected = TILE_SPLIT_FACTOR*sample_time*(f64) (area.w*area.h*sample_count);
+			if ((time_now() - start) > expected)
+			{
+				const i32 half = rest / 2;
+				tile_task_t split = task;
+				split.area.y = area.y + area.h - half;
+				split.area.h = half;
+				area.h -= half;
+				atomic_inc(&tile->pending);
+				atomic_inc(&queue->pending);
+				tile_push(worker, split);
+				worker->splits++;
+			}
+		}
+	}
+	worker->busy_time += (time_now() - start);
+	worker->busy_samples += (u64) (area.w*area.h*sample_count);
+	// The last task of a tile merges it's sample ranges
+	if (atomic_dec(&tile->pending) == 1)
+	{
+		tile_merge(queue, tile);
+		tile_finish(queue, tile);
+	}
+};
+static void tile_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	tile_queue_t *queue = (tile_queue_t*) data;
+	tile_worker_t *worker = queue->workers + worker_index;
+	// Allocate the worker scratch memory here, so it's on the worker's node
+	if (!worker->temp_alloc.memory)
+	{
+		void *memory = malloc(TILE_MEMORY_SIZE);
+		assert(memory != NULL);
+		lin_alloc_init(&worker->temp_alloc, TILE_MEMORY_SIZE, memory);
+	}
+	perf_t perf;
+	const bool counting = queue->count_loads && perf_open(&perf);
+	if (counting)
+		perf_begin(&perf);
+	// Render tiles from the worker's own queue first, then steal from the others
+	u32 spins = 0;
+	bool idle = false;
+	while (!render_cancelled())
+	{
+		tile_task_t task;
+		bool stolen = false;
+		if (!tile_pop(worker, &task))
+		{
+			stolen = tile_steal(queue, worker_index, &task);
+			if (!stolen)
+			{
+				// Everything is done once no tasks are queued or running
+				if (atomic_load_acquire(&queue->pending) == 0)
+					break;
+				if (!idle)
+				{
+					atomic_inc(&queue->idle);
+					idle = true;
+				}
+				// Others are still busy, and might split their tiles
+				if (++spins < TILE_IDLE_SPINS)
+					_mm_pause();
+				else
+					sched_yield();
+				continue;
+			}
+		}
+		if (idle)
+		{
+			atomic_dec(&queue->idle);
+			idle = false;
+		}
+		worker->steals += stolen ? 1 : 0;
+		spins = 0;
+		tile_run(queue, worker, task);
+		// Remember when the first pixels were ready
+		if (atomic_inc(&queue->tasks_done) == 0)
+			queue->first_tile_time = time_now();
+		atomic_dec(&queue->pending);
+	}
+	worker->done_time = time_now();
+	if (counting)
+	{
+		u64 counters[PERF_COUNTER_COUNT];
+		perf_end(&perf, counters);
+		perf_close(&perf);
+		worker->local_loads += counters[PERF_NODE_ACCESS];
+		worker->remote_loads += counters[PERF_NODE_MISS];
+	}
+};
+
+// Get the distance of a point along a Hilbert curve filling an n by n grid, n has to be a power of 2
+static u32 tile_hilbert(u32 n, u32 x, u32 y)
+{
+	u32 d = 0;
+	for (u32 s = n / 2; s > 0; s /= 2)
+	{
+		const u32 rx = ((x & s) > 0);
+		const u32 ry = ((y & s) > 0);
+		d += s*s*((3*rx) ^ ry);
+		// Rotate the quadrant, so the curve inside it lines up with the ones next to it
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = (n - 1) - x;
+				y = (n - 1) - y;
+			}
+			swap(u32, x, y);
+		}
+	}
+	return d;
+};
+static int tile_compare_keys(const void *a, const void *b)
+{
+	const u64 ka = *((const u64*) a);
+	const u64 kb = *((const u64*) b);
+	return (ka > kb) - (ka < kb);
+};
+// NOTE: Keys hold the tile index in the low bits, so ties are broken the same way every time
+void tile_sort(u32 tiles_x, u32 tiles_y, tile_order_t order, u32 *indices)
+{
+	const u32 count = tiles_x*tiles_y;
+	u64 *keys = malloc(max(count, 1)*sizeof(u64));
+	assert(keys != NULL);
+	u32 n = 1;
+	while ((n < tiles_x) || (n < tiles_y))
+		n *= 2;
+	for (u32 i = 0; i < count; i++)
+	{
+		const u32 x = (i % tiles_x);
+		const u32 y = (i / tiles_x);
+		u64 key = i;
+		if (order == TILE_ORDER_HILBERT)
+		{
+			key = tile_hilbert(n, x, y);
+		} else if (order == TILE_ORDER_CENTER) {
+			// Squared distance from the middle, in half tiles so it stays an integer
+			const i64 dx = (i64) (2*x + 1) - (i64) tiles_x;
+			const i64 dy = (i64) (2*y + 1) - (i64) tiles_y;
+			key = (u64) (dx*dx + dy*dy);
+		}
+		keys[i] = (key << 32) | i;
+	}
+	qsort(keys, count, sizeof(u64), tile_compare_keys);
+	for (u32 i = 0; i < count; i++)
+		indices[i] = (u32) keys[i];
+	free(keys);
+};
+
+void tile_layout(const tile_params_t *params, u32 width, u32 height, i32 samples, u32 worker_count, tile_layout_t *layout)
+{
+	worker_count = clamp(worker_count, 1, MAX_WORKERS);
+	// Pick the number of tiles, unless they were given
+	// NOTE: Enough tiles for every worker to get several, as close to square as the frame allows
+	u32 tiles_x = (params->tiles_x > 0) ? (u32) params->tiles_x : 0;
+	u32 tiles_y = (params->tiles_y > 0) ? (u32) params->tiles_y : 0;
+	if ((tiles_x == 0) || (tiles_y == 0))
+	{
+		const f32 area = (f32) (width*height) / (f32) (worker_count*TILE_TILES_PER_WORKER);
+		const f32 size = clamp(f32_sqrt(area), (f32) TILE_MIN_SIZE, (f32) TILE_MAX_SIZE);
+		tiles_x = (u32) ((f32) width / size + 0.5f);
+		tiles_y = (u32) ((f32) height / size + 0.5f);
+	}
+	layout->width = width;
+	layout->height = height;
+	layout->tiles_x = clamp(tiles_x, 1, max(width, 1));
+	layout->tiles_y = clamp(tiles_y, 1, max(height, 1));
+	layout->tile_count = layout->tiles_x*layout->tiles_y;
+	// Split the samples of every pixel into ranges
+	layout->samples = max(samples, 1);
+	u32 range_samples = (params->sample_range > 0) ? (u32) params->sample_range : (layout->samples + TILE_DEFAULT_RANGES - 1) / TILE_DEFAULT_RANGES;
+	layout->range_samples = clamp(range_samples, 1, (u32) layout->samples);
+	layout->range_count = (layout->samples + layout->range_samples - 1) / layout->range_samples;
+};
+rect_t tile_area(const tile_layout_t *layout, u32 tile)
+{
+	// NOTE: Tile edges are rounded down from even splits, so every pixel is covered once and sizes differ by a pixel at most
+	const u32 x = (tile % layout->tiles_x);
+	const u32 y = (tile / layout->tiles_x);
+	const u32 x0 = (u32) (((u64) x*layout->width) / layout->tiles_x);
+	const u32 y0 = (u32) (((u64) y*layout->height) / layout->tiles_y);
+	const u32 x1 = (u32) (((u64) (x + 1)*layout->width) / layout->tiles_x);
+	const u32 y1 = (u32) (((u64) (y + 1)*layout->height) / layout->tiles_y);
+	const rect_t area = { (i32) x0, (i32) y0, (i32) (x1 - x0), (i32) (y1 - y0) };
+	return area;
+};
+void tile_resolve(framebuffer_t *framebuffer, rect_t area, const v3 *sums, u32 stride, size_t range_size, u32 range_count, i32 samples)
+{
+	const f32 inv_samples = 1.f / (f32) samples;
+	for (i32 j = 0; j < area.h; j++)
+	{
+		for (i32 i = 0; i < area.w; i++)
+		{
+			const size_t index = (size_t) j*stride + (size_t) i;
+			v3 color = sums[index];
+			for (u32 r = 1; r < range_count; r++)
+				color = v3_add(color, sums[r*range_size + index]);
+			framebuffer->pixels[(area.y + j)*framebuffer->width + (area.x + i)] = v3_scale(color, inv_samples);
+		}
+	}
+};
+
+u64 tile_resolve_partial(framebuffer_t *framebuffer, rect_t area, const v3 *sums, u32 stride, size_t range_size,
+	u32 range_count, u32 range_samples, i32 samples, const u32 *rows_done)
+{
+	u64 taken = 0;
+	for (i32 j = 0; j < area.h; j++)
+	{
+		for (i32 i = 0; i < area.w; i++)
+		{
+			// Add the ranges the pixel got in order, and count their samples
+			const size_t index = (size_t) j*stride + (size_t) i;
+			v3 color = V3(0.f, 0.f, 0.f);
+			u32 count = 0;
+			for (u32 r = 0; sums && (r < range_count); r++)
+			{
+				if ((u32) i >= rows_done[r*area.h + j])
+					continue;
+				color = v3_add(color, sums[r*range_size + index]);
+				count += (u32) min((i32) range_samples, samples - (i32) (r*range_samples));
+			}
+			framebuffer->pixels[(area.y + j)*framebuffer->width + (area.x + i)] = (count > 0) ? v3_scale(color, 1.f / (f32) count) : color;
+			taken += count;
+		}
+	}
+	return taken;
+};
+// Area being rendered by every thread of the pool, row by row
+typedef struct
+{
+	const world_t *world;
+	const camera_t *camera;
+	i32 width, height;
+	i32 first_sample, sample_count;
+	i32 bounces;
+	rect_t area;
+	v3 *sums;
+	u32 stride;
+	// Next row to render
+	volatile u32 next_row;
+} tile_rows_t;
+
+static void tile_rows_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	tile_rows_t *rows = (tile_rows_t*) data;
+	void *memory = malloc(TILE_MEMORY_SIZE);
+	assert(memory != NULL);
+	lin_alloc_t temp_alloc;
+	lin_alloc_init(&temp_alloc, TILE_MEMORY_SIZE, memory);
+	// Replicated geometry is read from the copy on the worker's node
+	const world_t *world = world_local(rows->world);
+	u32 row;
+	while (((row = atomic_inc(&rows->next_row)) < (u32) rows->area.h) && !render_cancelled())
+	{
+		const rect_t line = { rows->area.x, rows->area.y + (i32) row, rows->area.w, 1 };
+		render_sums(&temp_alloc,
+			world,
+			rows->camera,
+			rows->width, rows->height,
+			rows->first_sample, rows->sample_count,
+			rows->bounces,
+			line, rows->sums + row*rows->stride, rows->stride);
+	}
+	free(memory);
+};
+bool tile_render_sums(
+	const world_t *world,
+	const camera_t *camera,
+	i32 width, i32 height,
+	i32 first_sample, i32 sample_count, i32 bounces,
+	rect_t area, v3 *sums, u32 stride)
+{
+	tile_rows_t rows = {0};
+	rows.world = world;
+	rows.camera = camera;
+	rows.width = width;
+	rows.height = height;
+	rows.first_sample = first_sample;
+	rows.sample_count = sample_count;
+	rows.bounces = bounces;
+	rows.area = area;
+	rows.sums = sums;
+	rows.stride = stride;
+	jobs_run(clamp((u32) area.h, 1, job_thread_count()), tile_rows_proc, &rows);
+	return !render_cancelled();
+};
+
+// Get the worker that first touched a framebuffer row, see framebuffer_alloc
+static u32 tile_row_worker(u32 rows, u32 row)
+{
+	const u32 thread_count = job_thread_count();
+	for (u32 i = 0; i < thread_count; i++)
+	{
+		u32 first, count;
+		job_node_range(rows, i, thread_count, &first, &count);
+		if ((row >= first) && (row < (first + count)))
+			return i;
+	}
+	return 0;
+};
+
+void tile_render(
+	const world_t *world,
+	const camera_t *camera,
+	i32 samples, i32 bounces,
+	const tile_params_t *params,
+	framebuffer_t *framebuffer, u32 worker_count, tile_stats_t *stats)
+{
+	const f64 start = time_now();
+	worker_count = clamp(worker_count, 1, MAX_WORKERS);
+	const u32 width = framebuffer->width;
+	const u32 height = framebuffer->height;
+	// Continue from a checkpoint of the same frame, split into the same tiles
+	tile_params_t layout_params = *params;
+	checkpoint_t resumed = {0};
+	bool resuming = false;
+	if (params->checkpoint.file && params->checkpoint.resume)
+	{
+		resuming = checkpoint_read(params->checkpoint.file, &resumed);
+		if (!resuming)
+			printf("No checkpoint in \"%s\", rendering the whole frame\n", params->checkpoint.file);
+		resuming = resuming && (resumed.header.scene_hash == params->checkpoint.scene_hash) &&
+			(resumed.header.width == width) && (resumed.header.height == height);
+		if (resuming)
+		{
+			layout_params.tiles_x = (i32) resumed.header.tiles_x;
+			layout_params.tiles_y = (i32) resumed.header.tiles_y;
+		}
+	}
+	tile_layout_t layout;
+	tile_layout(&layout_params, width, height, samples, worker_count, &layout);
+	if (resumed.tiles_done && (!resuming || (resumed.header.samples != layout.samples) || (resumed.header.range_samples != layout.range_samples)))
+	{
+		printf("Checkpoint \"%s\" is of another frame, rendering the whole frame\n", params->checkpoint.file);
+		resuming = false;
+	}
+	const u32 tiles_x = layout.tiles_x;
+	const u32 tiles_y = layout.tiles_y;
+	const u32 tile_count = layout.tile_count;
+
+	tile_queue_t queue = {0};
+	queue.world = world;
+	queue.camera = camera;
+	queue.samples = layout.samples;
+	queue.bounces = bounces;
+	queue.framebuffer = framebuffer;
+	queue.worker_count = worker_count;
+	queue.range_samples = layout.range_samples;
+	queue.range_count = layout.range_count;
+	// Set up the tiles, each one is rendered by a task for every sample range
+	queue.tile_count = tile_count;
+	queue.tiles = aligned_alloc(CACHE_LINE_SIZE, tile_count*sizeof(tile_t));
+	assert(queue.tiles != NULL);
+	memset(queue.tiles, 0, tile_count*sizeof(tile_t));
+	for (u32 i = 0; i < tile_count; i++)
+	{
+		tile_t *tile = queue.tiles + i;
+		tile->area = tile_area(&layout, i);
+		tile->stride = (tile->area.w + TILE_ROW_PIXELS - 1) / TILE_ROW_PIXELS * TILE_ROW_PIXELS;
+		tile->range_size = (size_t) tile->stride*tile->area.h;
+		tile->pending = queue.range_count;
+		// Finished tiles of a checkpoint are copied, and have nothing left to render
+		if (resuming && resumed.tiles_done[i])
+		{
+			const rect_t area = tile->area;
+			for (i32 j = 0; j < area.h; j++)
+			{
+				const size_t row = (size_t) (area.y + j)*width + (size_t) area.x;
+				memcpy(framebuffer->pixels + row, resumed.pixels + row, area.w*sizeof(v3));
+			}
+			tile->pending = 0;
+			tile->done = 1;
+			queue.tiles_done++;
+		}
+	}
+	checkpoint_free(&resumed);
+	const u32 resumed_tiles = queue.tiles_done;
+	queue.checkpoint = &params->checkpoint;
+	queue.tiles_x = tiles_x;
+	queue.tiles_y = tiles_y;
+	queue.next_checkpoint = start + params->checkpoint.interval;
+	// Order the tiles, tasks go out tile by tile in that order
+	u32 *order = malloc(tile_count*sizeof(u32));
+	assert(order != NULL);
+	tile_sort(tiles_x, tiles_y, params->order, order);
+	const u32 task_count = tile_count*queue.range_count;
+
+	queue.workers = aligned_alloc(CACHE_LINE_SIZE, worker_count*sizeof(tile_worker_t));
+	assert(queue.workers != NULL);
+	memset(queue.workers, 0, worker_count*sizeof(tile_worker_t));
+	queue.count_loads = params->count_loads;
+	for (u32 i = 0; i < worker_count; i++)
+		queue.workers[i].node = job_node(i);
+	// Across NUMA nodes, tiles go to the workers of the node the framebuffer rows under them are on, see framebuffer_alloc
+	const bool numa = (job_node_count() > 1);
+	u32 *tile_nodes = malloc(tile_count*sizeof(u32));
+	assert(tile_nodes != NULL);
+	for (u32 i = 0; i < tile_count; i++)
+	{
+		const rect_t area = queue.tiles[i].area;
+		tile_nodes[i] = numa ? job_node(tile_row_worker(height, area.y + area.h / 2)) : 0;
+	}
+	u32 *node_tasks = malloc(max(task_count, 1)*sizeof(u32));
+	assert(node_tasks != NULL);
+	for (u32 i = 0; i < worker_count; i++)
+	{
+		tile_worker_t *worker = queue.workers + i;
+		// Gather the tasks of the worker's node in order, and find it's place among the node's workers
+		u32 node_task_count = 0;
+		for (u32 j = 0; j < task_count; j++)
+		{
+			const tile_t *tile = queue.tiles + order[j / queue.range_count];
+			if ((tile_nodes[order[j / queue.range_count]] == worker->node) && !tile->done)
+				node_tasks[node_task_count++] = j;
+		}
+		u32 rank = 0, node_workers = 0;
+		for (u32 j = 0; j < worker_count; j++)
+		{
+			if (queue.workers[j].node == worker->node)
+			{
+				rank += (j < i) ? 1 : 0;
+				node_workers++;
+			}
+		}
+		// Along a curve, each worker starts with a contiguous run of tasks so it's tiles are close together.
+		// Center out, workers are dealt tasks in turn so they all start in the middle
+		// NOTE: Queued backwards so the owner renders them in order, thieves take the last ones
+		u32 first, count, step;
+		if (params->order == TILE_ORDER_CENTER)
+		{
+			first = rank;
+			count = (node_task_count > rank) ? ((node_task_count - rank + node_workers - 1) / node_workers) : 0;
+			step = node_workers;
+		} else {
+			job_range(node_task_count, rank, node_workers, &first, &count);
+			step = 1;
+		}
+		for (u32 j = count; j-- > 0;)
+		{
+			const u32 index = node_tasks[first + j*step];
+			tile_task_t task;
+			task.tile = order[index / queue.range_count];
+			task.range = index % queue.range_count;
+			task.area = queue.tiles[task.tile].area;
+			tile_push(worker, task);
+		}
+	}
+	free(node_tasks);
+	free(tile_nodes);
+	free(order);
+	queue.pending = (tile_count - resumed_tiles)*queue.range_count;
+	// Render tiles on all the workers, the main thread included
+	// NOTE: Returns once every worker is done, so all tiles are rendered unless rendering was cancelled
+	jobs_run(worker_count, tile_proc, &queue);
+	// Resolve what a cancelled frame has, every pixel is the average of the samples it got
+	u64 samples_taken = 0;
+	if (render_cancelled())
+	{
+		// The last checkpoint gets the tiles finished since, so resuming renders the rest
+		if (params->checkpoint.file)
+			tile_checkpoint(&queue);
+		for (u32 i = 0; i < tile_count; i++)
+		{
+			tile_t *tile = queue.tiles + i;
+			if (tile->done)
+			{
+				samples_taken += (u64) (tile->area.w*tile->area.h)*(u64) queue.samples;
+				continue;
+			}
+			samples_taken += tile_resolve_partial(framebuffer, tile->area, tile->sums, tile->stride, tile->range_size,
+				queue.range_count, queue.range_samples, queue.samples, tile->rows_done);
+			free(tile->sums);
+			free(tile->rows_done);
+		}
+	} else {
+		samples_taken = (u64) width*(u64) height*(u64) queue.samples;
+	}
+
+	// Gather the statistics, and free the workers
+	memset(stats, 0, sizeof(tile_stats_t));
+	stats->worker_count = worker_count;
+	stats->tile_count = tile_count;
+	stats->tiles_x = tiles_x;
+	stats->tiles_y = tiles_y;
+	stats->range_count = queue.range_count;
+	stats->first_tile_time = queue.first_tile_time;
+	stats->resumed_tiles = resumed_tiles;
+	stats->cancelled = render_cancelled();
+	stats->samples_taken = samples_taken;
+	stats->checkpoints = queue.checkpoints;
+	f64 first_done = FLT_MAX, last_done = 0.0;
+	for (u32 i = 0; i < worker_count; i++)
+	{
+		tile_worker_t *worker = queue.workers + i;
+		stats->splits += worker->splits;
+		stats->steals += worker->steals;
+		stats->local_loads += worker->local_loads;
+		stats->remote_loads += worker->remote_loads;
+		first_done = min(first_done, worker->done_time);
+		last_done = max(last_done, worker->done_time);
+		free(worker->temp_alloc.memory);
+		free(worker->tasks);
+	}
+	stats->tail_time = (last_done - first_done);
+	stats->node_count = job_node_count();
+	stats->render_time = (time_now() - start);
+	free(queue.workers);
+	free(queue.tiles);
+};
@@ -0,0 +1,151 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include "core.h"
+#include "util.h"
+#include "geom.h"
+
+#include "framebuffer.h"
+#include "world.h"
+
+// Maximum amount of memory that can be allocated from a worker's scratch allocator
+#define TILE_MEMORY_SIZE	kilobytes(16)
+// Rows of a tile's sums are padded to a multiple of this many pixels, the fewest whole pixels that end on a cache line
+#define TILE_ROW_PIXELS		(CACHE_LINE_SIZE / 4)
+
+// Order tiles are handed out in
+typedef enum
+{
+	// Outwards from the middle of the frame, so a preview of the center arrives first
+	TILE_ORDER_CENTER,
+	// Along a Hilbert curve, so every worker's tiles are close together on screen and in the scene
+	TILE_ORDER_HILBERT,
+	// Row by row, left to right
+	TILE_ORDER_ROWS,
+} tile_order_t;
+
+// Time between checkpoints when neither a time or a number of tiles is given, in seconds
+#define TILE_DEFAULT_CHECKPOINT_INTERVAL	300.0
+
+// Checkpoint parameters
+typedef struct
+{
+	// File checkpoints are written to and resumed from, none are written unless it's set
+	const char *file;
+	// Hash of the scene, checkpoints are only resumed from for the same one
+	u64 scene_hash;
+	// Seconds, and number of finished tiles, between checkpoints. Either can be 0 to not checkpoint on it
+	f64 interval;
+	u32 tile_interval;
+	// Continue from the tiles finished in the checkpoint file, if it's of the same frame
+	bool resume;
+} tile_checkpoint_params_t;
+
+// Tile parameters
+typedef struct
+{
+	// Number of tiles across and down the frame, 0 picks them from the resolution and the number of workers
+	// NOTE: Tiles that don't divide the frame evenly differ by a pixel at most
+	i32 tiles_x, tiles_y;
+	// Number of samples of each pixel rendered as a single task, 0 splits them into a few ranges
+	i32 sample_range;
+	tile_order_t order;
+	// Count the loads every worker makes from memory on it's own NUMA node and on others, with the perf counters
+	bool count_loads;
+	tile_checkpoint_params_t checkpoint;
+} tile_params_t;
+
+// Tiles the frame is split into, and the ranges the samples of every pixel are split into
+typedef struct
+{
+	u32 width, height;
+	u32 tiles_x, tiles_y;
+	u32 tile_count;
+	i32 samples;
+	// Every range but the last has range_samples samples
+	u32 range_samples;
+	u32 range_count;
+} tile_layout_t;
+
+// Piece of the frame rendered by a single worker at a time, a range of the samples of part of a tile
+typedef struct
+{
+	u32 tile;
+	// Sample range, samples [range*range_samples, (range+1)*range_samples) of each pixel
+	u32 range;
+	// Rows of the tile to render, split tiles render part of it
+	rect_t area;
+} tile_task_t;
+
+// Tile scheduling statistics for a frame
+typedef struct
+{
+	u32 worker_count;
+	// Number of tiles the frame started with, and the number of ranges their samples were split into
+	u32 tile_count;
+	u32 tiles_x, tiles_y;
+	u32 range_count;
+	// Number of times a running task was split
+	u32 splits;
+	// Number of tasks workers took from another worker
+	u32 steals;
+	// Time the first task finished
+	f64 first_tile_time;
+	// Time from the first worker running out of work to the last one finishing, in seconds
+	// NOTE: Ideally close to the cost of the cheapest task, everything above it is time cores sat idle
+	f64 tail_time;
+	// Time the frame took, in seconds
+	f64 render_time;
+	// Number of NUMA nodes the workers were on, and the loads they made from their own node's memory and from other nodes
+	// NOTE: Loads are only counted when asked to, and read 0 if the counters are unavailable
+	u32 node_count;
+	u64 local_loads;
+	u64 remote_loads;
+	// Number of tiles taken from a checkpoint instead of being rendered, and the number of checkpoints written
+	u32 resumed_tiles;
+	u32 checkpoints;
+	// Set if rendering was cancelled before the frame was done, and the pixel samples the frame got
+	bool cancelled;
+	u64 samples_taken;
+} tile_stats_t;
+
+// Split a frame into tiles and sample ranges, sized for a number of workers unless the parameters give them
+void tile_layout(const tile_params_t *params, u32 width, u32 height, i32 samples, u32 worker_count, tile_layout_t *layout);
+// Get the pixels of a tile
+rect_t tile_area(const tile_layout_t *layout, u32 tile);
+// Sort the tiles into the order they're handed out in
+void tile_sort(u32 tiles_x, u32 tiles_y, tile_order_t order, u32 *indices);
+// Add the sums of every sample range of an area in order, and store their average in the framebuffer
+// NOTE: Sums are stored row by row stride pixels apart, and every range range_size pixels after the one before.
+// Always added in the same order, so the result doesn't depend on which ranges finished first
+void tile_resolve(framebuffer_t *framebuffer, rect_t area, const v3 *sums, u32 stride, size_t range_size, u32 range_count, i32 samples);
+// Store the average of the ranges every pixel of an area got before rendering was cancelled, returns the samples they had
+// NOTE: Each range's rows have rows_done pixels summed, in a range by range array of every row. Pixels without any are black
+u64 tile_resolve_partial(framebuffer_t *framebuffer, rect_t area, const v3 *sums, u32 stride, size_t range_size,
+	u32 range_count, u32 range_samples, i32 samples, const u32 *rows_done);
+
+// Add a range of the samples of every pixel in an area to their sums, on every thread of the job pool
+// returns false if rendering was cancelled before they were all done
+// NOTE: Threads take a row at a time, the sums are stored the same way as render_sums stores them
+bool tile_render_sums(
+	const world_t *world,
+	const camera_t *camera,
+	i32 width, i32 height,
+	i32 first_sample, i32 sample_count, i32 bounces,
+	rect_t area, v3 *sums, u32 stride);
+
+// Render the frame in tiles on the job pool, every sample range of a tile is a separate task
+// NOTE: Ranges are summed apart and merged in order once the tile is done, so the image doesn't depend on the schedule.
+// Each worker renders tasks from it's own queue, and steals from the others once it runs out.
+// Tiles that take far longer than the ones finished so far split once others run out of work, so they can steal the rest.
+// With a checkpoint file, finished tiles are written to it as they're done, and a resumed frame keeps the tiles of the
+// checkpoint and only renders the ones that weren't finished. Once rendering is cancelled the workers stop at the next sample,
+// and every pixel gets the average of the sample ranges it finished
+void tile_render(
+	const world_t *world,
+	const camera_t *camera,
+	i32 samples, i32 bounces,
+	const tile_params_t *params,
+	framebuffer_t *framebuffer, u32 worker_count, tile_stats_t *stats);
+
+#endif
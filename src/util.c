@@ -1,5 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "util.h"
 
+#include <time.h>
+
 static inline size_t alignment_padding(size_t base, size_t alignment)
 {
 	const size_t mult = (base / alignment) + 1;
@@ -7,13 +11,32 @@ static inline size_t alignment_padding(size_t base, size_t alignment)
 	return aligned - base;
 };
 
+// Random number generator state (splitmix64) of each thread
+// NOTE: Thread local, so render workers never contend for a shared generator like rand()'s
+static _Thread_local u64 rand_state = 0;
+
+static inline u64 rand_mix(u64 z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+};
+static inline u64 rand_u64()
+{
+	return rand_mix(rand_state += 0x9E3779B97F4A7C15ull);
+};
+void rand_seed(u64 seed)
+{
+	// Mixed, so nearby seeds start far apart in the sequence
+	rand_state = rand_mix(seed);
+};
 f32 f32_rand()
 {
-	return ((f32) rand()/(f32) (RAND_MAX));
+	return (f32) (rand_u64() >> 40) * (1.f / 16777216.f);
 }
 u32 u32_rand(u32 lo, u32 hi)
 {
-	return (rand() % (hi - lo + 1)) + lo; 
+	return (u32) ((rand_u64() >> 32) % (hi - lo + 1)) + lo;
 };
 v2 v2_unit_rand()
 {
@@ -36,6 +59,13 @@ v3 v3_unit_rand()
 	return p;
 };
 
+f64 time_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (f64) ts.tv_sec + (f64) ts.tv_nsec*1e-9;
+};
+
 char* load_entire_file(const char *file_name, size_t *size)
 {
 	char *buffer = NULL;
@@ -56,6 +86,17 @@ char* load_entire_file(const char *file_name, size_t *size)
 	return buffer;
 };
 
+u64 hash_bytes(u64 hash, const void *data, size_t size)
+{
+	const u8 *bytes = (const u8*) data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+};
+
 void lin_alloc_init(lin_alloc_t *lin_alloc, size_t size, void *memory)
 {
 	lin_alloc->used = 0;
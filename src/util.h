@@ -7,7 +7,9 @@
 #include "core.h"
 #include "geom.h"
 
-// rand range [0.f, 1.f]
+// Seed the random number generator of the calling thread, every thread has it's own
+void rand_seed(u64 seed);
+// rand range [0.f, 1.f)
 f32 f32_rand();
 
 u32 u32_rand(u32 lo, u32 hi);
@@ -15,7 +17,13 @@ u32 u32_rand(u32 lo, u32 hi);
 v2 v2_unit_rand();
 v3 v3_unit_rand();
 
+// Wall clock time in seconds, only useful for measuring durations
+f64 time_now();
+
 char* load_entire_file(const char *file_name, size_t *size);
+// Add a block of memory to a 64-bit FNV-1a hash, start from HASH_SEED
+#define HASH_SEED	0xCBF29CE484222325ull
+u64 hash_bytes(u64 hash, const void *data, size_t size);
 
 typedef struct
 {
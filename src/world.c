@@ -1,4 +1,5 @@
 #include "world.h"
+#include "accel.h"
 
 // Get the AABB for a sphere
 aabb_t sphere_aabb(v3 center, f32 radius)
@@ -9,119 +10,374 @@ aabb_t sphere_aabb(v3 center, f32 radius)
 	return aabb;
 };
 
-// Hit test a sphere against a ray
-static bool sphere_hit(const sphere_t *sphere, ray_t ray, 
-	f32 t_min, f32 t_max, hit_t *hit)
+// Gather the bounding boxes of every sphere, the returned list has to be freed by the caller
+static aabb_t* world_sphere_bounds(const world_t *world)
 {
-	const v3 oc = v3_sub(ray.origin, sphere->center);
-	const f32 a = v3_dot(ray.direction, ray.direction);
-	const f32 b = v3_dot(ray.direction, oc);
-	const f32 c = v3_dot(oc, oc) - f32_square(sphere->radius);
-	
-	const f32 det = b*b - a*c;
-	if (det > 0.f)
+	aabb_t *bounds = malloc(world->sphere_count*sizeof(aabb_t));
+	assert((bounds != NULL) || (world->sphere_count == 0));
+	for (u32 i = 0; i < world->sphere_count; i++)
+		bounds[i] = world->spheres[i].aabb;
+	return bounds;
+};
+void world_build_bvh(world_t *world, const bvh_params_t *params, const char *cache_file)
+{
+	// Free the previous tree, if there is one
+	bvh_free(&world->bvh);
+	qbvh_free(&world->qbvh);
+	// Gather the bounding boxes of every sphere
+	aabb_t *bounds = world_sphere_bounds(world);
+	// Lazy trees are only partly built, so everything that needs the whole tree is skipped
+	if (params->lazy)
 	{
-		const f32 t_0 = (-b - f32_sqrt(det)) / (a);
-		const f32 t_1 = (-b + f32_sqrt(det)) / (a);
-		const f32 t = min(t_0, t_1);
-
-		if ((t > t_min) && (t < t_max))
+		bvh_build(&world->bvh, bounds, world->sphere_count, params);
+		free(bounds);
+		return;
+	}
+	// Try to load a tree built from the same spheres before building a new one
+	const u64 hash = bvh_hash(bounds, world->sphere_count, params);
+	if (!cache_file || !bvh_load(&world->bvh, hash, cache_file))
+	{
+		// Build the world BVH
+		bvh_build(&world->bvh, bounds, world->sphere_count, params);
+		// Store it for the next run
+		if (cache_file && !bvh_save(&world->bvh, hash, cache_file))
+			printf("Failed to write bvh cache \"%s\"\n", cache_file);
+	}
+	// Compress the tree for traversal
+	if (params->compress)
+		qbvh_build(&world->qbvh, &world->bvh);
+	// Move the spheres into leaf order, remembering where each came from
+	if (params->reorder)
+	{
+		if (!world->sphere_order)
 		{
-			const v3 position = ray_point(ray, t);
-			const v3 normal = v3_norm(v3_sub(position, sphere->center));
-
-			hit->t = t;
-			hit->normal = normal;
-			hit->position = position;
-			hit->material = sphere->material;
-			return true;
+			world->sphere_order = malloc(world->sphere_count*sizeof(u32));
+			assert(world->sphere_order != NULL);
+			for (u32 i = 0; i < world->sphere_count; i++)
+				world->sphere_order[i] = i;
 		}
+		spheres_reorder(world->spheres, &world->bvh, &world->qbvh, world->sphere_order);
+		qbvh_reorder(&world->qbvh);
 	}
-	return false;
+	// Link the tree for stackless traversal
+	if (params->stackless)
+		bvh_link(&world->bvh);
+	// Free the temp bounds list
+	free(bounds);
 };
+void world_build_grid(world_t *world, const grid_params_t *params)
+{
+	grid_free(&world->grid);
+	aabb_t *bounds = world_sphere_bounds(world);
+	grid_build(&world->grid, bounds, world->sphere_count, params);
+	free(bounds);
+};
+bool world_build_paged(world_t *world, const page_params_t *params, const bvh_params_t *bvh_params)
+{
+	page_free(&world->pager);
+	// Map the page file kept by an earlier run, the scene didn't load any spheres
+	if (params->reuse)
+	{
+		if (!page_open(&world->pager, params, sizeof(sphere_t), bvh_params))
+		{
+			printf("Failed to map page file \"%s\"\n", params->file);
+			return false;
+		}
+		world->sphere_count = world->pager.sphere_count;
+		return true;
+	}
+	aabb_t *bounds = world_sphere_bounds(world);
+	const bool result = page_build(&world->pager, bounds, world->spheres, sizeof(sphere_t), world->sphere_count, params, bvh_params);
+	free(bounds);
+	if (!result)
+	{
+		printf("Failed to write page file \"%s\"\n", params->file);
+		return false;
+	}
+	// The page file holds every sphere now
+	if (!params->keep_spheres)
+	{
+		free(world->spheres);
+		world->spheres = NULL;
+		world->sphere_capacity = 0;
+	}
+	return true;
+};
+void world_build_lod(world_t *world, const lod_params_t *params)
+{
+	lod_free(&world->lod);
+	// Every sphere is a fully covering proxy of itself
+	lod_proxy_t *primitives = malloc(world->sphere_count*sizeof(lod_proxy_t));
+	assert((primitives != NULL) || (world->sphere_count == 0));
+	for (u32 i = 0; i < world->sphere_count; i++)
+	{
+		const sphere_t *sphere = world->spheres + i;
+		lod_proxy_t *proxy = primitives + i;
+		proxy->center = sphere->center;
+		proxy->radius = sphere->radius;
+		proxy->emittance = sphere->material.emittance;
+		lod_pack(proxy, sphere->material.albedo, 1.f);
+	}
+	lod_build(&world->lod, &world->bvh, primitives, params);
+	free(primitives);
+};
+void world_build_instances(world_t *world, const bvh_params_t *instance_params)
+{
+	// Objects are small, and reordering needs their whole tree, so they're never built lazily
+	bvh_params_t params_copy = *instance_params;
+	params_copy.lazy = false;
+	const bvh_params_t *params = &params_copy;
+
+	// Build the object space BVH of every object
+	for (u32 i = 0; i < world->object_count; i++)
+	{
+		object_t *object = world->objects + i;
+		bvh_free(&object->bvh);
 
-static int bvh_compare_x(const void *a, const void *b)
+		aabb_t *bounds = malloc(object->sphere_count*sizeof(aabb_t));
+		assert((bounds != NULL) || (object->sphere_count == 0));
+		for (u32 j = 0; j < object->sphere_count; j++)
+			bounds[j] = object->spheres[j].aabb;
+		bvh_build(&object->bvh, bounds, object->sphere_count, params);
+		free(bounds);
+		// Objects don't move, so their spheres can be reordered without keeping track
+		if (params->reorder)
+			spheres_reorder(object->spheres, &object->bvh, NULL, NULL);
+	}
+	// Get the world space bounds of every instance, from the root of it's object BVH
+	aabb_t *bounds = malloc(world->instance_count*sizeof(aabb_t));
+	assert((bounds != NULL) || (world->instance_count == 0));
+	for (u32 i = 0; i < world->instance_count; i++)
+	{
+		const instance_t *instance = world->instances + i;
+		const bvh_t *bvh = &world->objects[instance->object].bvh;
+		// NOTE: Empty objects get an empty box, which no ray can hit
+		bounds[i] = (bvh->node_count > 0) ? aabb_transform(bvh->nodes[0].aabb, instance->transform) : aabb_empty();
+	}
+	// Build the top level BVH
+	bvh_free(&world->instance_bvh);
+	bvh_build(&world->instance_bvh, bounds, world->instance_count, params);
+	free(bounds);
+};
+void world_move_spheres(world_t *world, const v3 *centers)
+{
+	for (u32 i = 0; i < world->sphere_count; i++)
+	{
+		sphere_t *sphere = world->spheres + i;
+		// NOTE: Centers are in scene order, which the spheres might not be in anymore
+		sphere->center = centers[world->sphere_order ? world->sphere_order[i] : i];
+		sphere->aabb = sphere_aabb(sphere->center, sphere->radius);
+	}
+};
+void world_refit_bvh(world_t *world)
 {
-	const sphere_t *sphere_a = *(sphere_t**) a;
-	const sphere_t *sphere_b = *(sphere_t**) b;
-	return ((sphere_a->aabb.min.x - sphere_b->aabb.min.x) < 0.f) ? -1 : 1;
+	aabb_t *bounds = world_sphere_bounds(world);
+	bvh_refit(&world->bvh, bounds);
+	free(bounds);
+	// The compressed tree can't be refit, so it's rebuilt from the refit one
+	if (world->qbvh.node_count > 0)
+	{
+		qbvh_free(&world->qbvh);
+		qbvh_build(&world->qbvh, &world->bvh);
+		// NOTE: The spheres are still in leaf order, only the nodes have to be laid out again
+		if (world->sphere_order)
+			qbvh_reorder(&world->qbvh);
+	}
+};
+// Free the arrays a replica owns, the rest belongs to the world
+static void world_free_replica(world_t *replica)
+{
+	bvh_free(&replica->bvh);
+	qbvh_free(&replica->qbvh);
+	lod_free(&replica->lod);
+	free(replica->spheres);
 };
-static int bvh_compare_y(const void *a, const void *b)
+static void world_free_replicas(world_t *world)
 {
-	const sphere_t *sphere_a = *(sphere_t**) a;
-	const sphere_t *sphere_b = *(sphere_t**) b;
-	return ((sphere_a->aabb.min.y - sphere_b->aabb.min.y) < 0.f) ? -1 : 1;
+	for (u32 i = 0; i < world->replica_count; i++)
+		world_free_replica(world->replicas + i);
+	free(world->replicas);
+	world->replicas = NULL;
+	world->replica_count = 0;
 };
-static int bvh_compare_z(const void *a, const void *b)
+// Copy an array to new memory, first touched by the calling thread
+static void* world_copy(const void *data, size_t size)
 {
-	const sphere_t *sphere_a = *(sphere_t**) a;
-	const sphere_t *sphere_b = *(sphere_t**) b;
-	return ((sphere_a->aabb.min.z - sphere_b->aabb.min.z) < 0.f) ? -1 : 1;
+	if (!data)
+		return NULL;
+	void *copy = malloc(max(size, 1));
+	assert(copy != NULL);
+	memcpy(copy, data, size);
+	return copy;
 };
-// Build a BVH recursively, based on a list of spheres
-static bvh_t* build_bvh(sphere_t **spheres, u32 sphere_count)
+static void world_copy_replica(world_t *replica, const world_t *world)
 {
-	if (sphere_count > 2)
+	*replica = *world;
+	replica->replica_count = 0;
+	replica->replicas = NULL;
+	replica->spheres = world_copy(world->spheres, world->sphere_count*sizeof(sphere_t));
+	// NOTE: Copies are always on the heap, even if the tree was mapped from the cache file
+	replica->bvh.mapping = NULL;
+	replica->bvh.mapping_size = 0;
+	replica->bvh.nodes = world_copy(world->bvh.nodes, world->bvh.node_count*sizeof(bvh_node_t));
+	replica->bvh.indices = world_copy(world->bvh.indices, world->bvh.index_count*sizeof(u32));
+	replica->bvh.skips = world_copy(world->bvh.skips, world->bvh.node_count*sizeof(u32));
+	replica->qbvh.nodes = world_copy(world->qbvh.nodes, world->qbvh.node_count*sizeof(qbvh_node_t));
+	replica->qbvh.indices = world_copy(world->qbvh.indices, world->qbvh.index_count*sizeof(u32));
+	replica->lod.proxies = world_copy(world->lod.proxies, world->lod.proxy_count*sizeof(lod_proxy_t));
+	replica->lod.touched = NULL;
+};
+// Shared state of the threads replicating a world
+typedef struct
+{
+	world_t *world;
+	// Flag for every node that has been copied
+	volatile u32 copied[MAX_WORKERS];
+} world_replicate_t;
+
+static void world_replicate_proc(void *data, u32 worker_index, u32 worker_count)
+{
+	world_replicate_t *job = (world_replicate_t*) data;
+	world_t *world = job->world;
+	// The first thread of each node to get here copies the world for it
+	const u32 node = job_node(job_thread_index());
+	if ((node < world->replica_count) && atomic_cas(job->copied + node, 0, 1))
+		world_copy_replica(world->replicas + node, world);
+};
+bool world_replicate(world_t *world)
+{
+	world_free_replicas(world);
+	const u32 node_count = min(job_node_count(), MAX_WORKERS);
+	if (node_count < 2)
+		return false;
+	// Everything the replicas read has to be in the copied arrays
+	if (world->bvh.lazy || (world->pager.chunk_count > 0) || (world->grid.slot_count > 0))
+		return false;
+
+	world->replica_count = node_count;
+	world->replicas = malloc(node_count*sizeof(world_t));
+	assert(world->replicas != NULL);
+	world_replicate_t *job = malloc(sizeof(world_replicate_t));
+	assert(job != NULL);
+	memset(job, 0, sizeof(world_replicate_t));
+	job->world = world;
+	jobs_run(job_thread_count(), world_replicate_proc, job);
+	// Nodes none of the threads got to are copied here, just not on their own memory
+	for (u32 i = 0; i < node_count; i++)
+	{
+		if (!job->copied[i])
+			world_copy_replica(world->replicas + i, world);
+	}
+	free(job);
+	return true;
+};
+
+void world_free(world_t *world)
+{
+	world_free_replicas(world);
+	bvh_free(&world->bvh);
+	qbvh_free(&world->qbvh);
+	grid_free(&world->grid);
+	page_free(&world->pager);
+	lod_free(&world->lod);
+	free(world->spheres);
+	free(world->sphere_order);
+	for (u32 i = 0; i < world->object_count; i++)
+	{
+		object_t *object = world->objects + i;
+		bvh_free(&object->bvh);
+		free(object->spheres);
+	}
+	bvh_free(&world->instance_bvh);
+	free(world->instances);
+};
+
+void world_add_sphere(world_t *world, const sphere_t *sphere)
+{
+	*world_add_spheres(world, 1) = *sphere;
+};
+void world_reserve_spheres(world_t *world, u32 capacity)
+{
+	if (capacity > world->sphere_capacity)
+	{
+		world->sphere_capacity = capacity;
+		world->spheres = realloc(world->spheres, (size_t) world->sphere_capacity*sizeof(sphere_t));
+		assert(world->spheres != NULL);
+	}
+};
+sphere_t* world_add_spheres(world_t *world, u32 count)
+{
+	// Grow the sphere array until the new spheres fit
+	assert(count <= (0xFFFFFFFF - world->sphere_count));
+	if ((world->sphere_count + count) > world->sphere_capacity)
+	{
+		u64 capacity = max(world->sphere_capacity, 64);
+		while (capacity < ((u64) world->sphere_count + count))
+			capacity *= 2;
+		world_reserve_spheres(world, (u32) min(capacity, 0xFFFFFFFFull));
+	}
+	sphere_t *spheres = world->spheres + world->sphere_count;
+	world->sphere_count += count;
+	return spheres;
+};
+u32 world_add_object(world_t *world, const char *name)
+{
+	assert(world->object_count < MAX_OBJECTS);
+	const u32 index = world->object_count++;
+
+	object_t *object = world->objects + index;
+	memset(object, 0, sizeof(object_t));
+	strncpy(object->name, name, static_len(object->name) - 1);
+	return index;
+};
+bool world_find_object(const world_t *world, const char *name, u32 *index)
+{
+	for (u32 i = 0; i < world->object_count; i++)
 	{
-		// Sort spheres along a random axis
-		const u32 axis = u32_rand(0, 2);
-		switch (axis)
+		if (strcmp(world->objects[i].name, name) == 0)
 		{
-			case 0: qsort(spheres, sphere_count, sizeof(sphere_t*), bvh_compare_x); break;
-			case 1: qsort(spheres, sphere_count, sizeof(sphere_t*), bvh_compare_y); break;
-			case 2: qsort(spheres, sphere_count, sizeof(sphere_t*), bvh_compare_z); break;
+			*index = i;
+			return true;
 		}
 	}
-
-	// Allocate a new BVH node
-	bvh_t *bvh = malloc(sizeof(bvh_t));
-	assert(bvh != NULL);
-	memset(bvh, 0, sizeof(bvh_t));
-	// If theres only one sphere left, it's a leaf
-	if (sphere_count == 1)
-	{
-		bvh->leaf = true;
-		bvh->aabb = spheres[0]->aabb;
-		bvh->sphere = spheres[0];
-	// If theres exactly two spheres left, they become leaves
-	} else if (sphere_count == 2) {
-		bvh->leaf = false;
-		bvh->l = build_bvh(spheres + 0, 1);
-		bvh->r = build_bvh(spheres + 1, 1);
-		bvh->aabb = aabb_combine(bvh->l->aabb, bvh->r->aabb);
-	} else {
-		// Otherwise divide the list in half, create BVH trees for both sides
-		const u32 half = (sphere_count / 2);
-
-		bvh->leaf = false;
-		bvh->l = build_bvh(spheres + 0,    half);
-		bvh->r = build_bvh(spheres + half, sphere_count - half);
-		bvh->aabb = aabb_combine(bvh->l->aabb, bvh->r->aabb);
-	}
-	return bvh;
-};
-void world_build_bvh(world_t *world)
-{
-	// Allocate a new sphere list for the BVH building routine to modify
-	sphere_t **spheres = malloc(world->sphere_count*sizeof(sphere_t*));
-	assert(spheres != NULL);
-	// Add all the spheres to it
-	for (u32 i = 0; i < world->sphere_count; i++)
-		spheres[i] = (world->spheres + i);
-	// Build the world BVH
-	world->bvh = build_bvh(spheres, world->sphere_count);
-	// Free the temp sphere list
-	free(spheres);
+	return false;
+};
+void object_add_sphere(object_t *object, const sphere_t *sphere)
+{
+	// Grow the sphere array when it's full
+	if (object->sphere_count == object->sphere_capacity)
+	{
+		object->sphere_capacity = max(object->sphere_capacity*2, 16);
+		object->spheres = realloc(object->spheres, object->sphere_capacity*sizeof(sphere_t));
+		assert(object->spheres != NULL);
+	}
+	object->spheres[object->sphere_count++] = *sphere;
+};
+void world_add_instance(world_t *world, u32 object, m44 transform)
+{
+	assert(object < world->object_count);
+	// Grow the instance array when it's full
+	if (world->instance_count == world->instance_capacity)
+	{
+		world->instance_capacity = max(world->instance_capacity*2, 64);
+		world->instances = realloc(world->instances, world->instance_capacity*sizeof(instance_t));
+		assert(world->instances != NULL);
+	}
+	instance_t *instance = world->instances + world->instance_count++;
+	instance->transform = transform;
+	instance->inverse = m44_inverse_affine(transform);
+	instance->object = object;
 };
 
-#if USE_BVH
 #define MAX_QUERY_LIST_SIZE	256
+// Number of spheres hit tested at once when a list of spheres doesn't fit in a query list
+#define SPHERE_BATCH_SIZE	(MAX_QUERY_LIST_SIZE - 8)
 
 typedef struct
 {
 	// Cold data
 	u32 count;
-	sphere_t *sphere[MAX_QUERY_LIST_SIZE];
+	const sphere_t *sphere[MAX_QUERY_LIST_SIZE];
 	// Hot data
 	f32 t_hit[MAX_QUERY_LIST_SIZE] align_16;
 	f32 radius[MAX_QUERY_LIST_SIZE] align_16;
@@ -198,9 +454,10 @@ static bool sphere_list_hit(sphere_list_t *list, ray_t ray,
 	};
 
 	// Get the smallest t value in the list
+	// NOTE: The padding at the end of the list isn't a real sphere, so it's skipped
 	i32 smallest_idx = -1;
 	f32 smallest_t = hit->t;
-	for (u32 i = 0; i < count; i++)
+	for (u32 i = 0; i < list->count; i++)
 	{
 		const f32 t = list->t_hit[i];
 		if ((t > t_min) &&
@@ -229,74 +486,1033 @@ static bool sphere_list_hit(sphere_list_t *list, ray_t ray,
 	}
 	return false;
 };
-static void bvh_query(const bvh_t *bvh, ray_t ray, 
-	f32 t_min, f32 t_max, sphere_list_t *list)
+// Push the spheres of a leaf to the end of the list
+static inline void sphere_list_push(sphere_list_t *list, const sphere_t *spheres, const u32 *indices, u32 count)
 {
-	// If the ray intersects with this BVH node
-	if (aabb_hit(bvh->aabb, ray, t_min, t_max))
+	assert((list->count + count) < MAX_QUERY_LIST_SIZE);
+	for (u32 i = 0; i < count; i++)
 	{
-		// If this is a leaf
-		if (bvh->leaf)
+		const sphere_t *sphere = spheres + indices[i];
+		const u32 slot = list->count++;
+
+		list->t_hit[slot] = INFINITY;
+		list->sphere[slot] = sphere;
+		list->radius[slot] = sphere->radius;
+		list->center_x[slot] = sphere->center.x;
+		list->center_y[slot] = sphere->center.y;
+		list->center_z[slot] = sphere->center.z;
+	}
+};
+// Push a range of spheres to the end of the list
+static inline void sphere_list_push_range(sphere_list_t *list, const sphere_t *spheres, u32 count)
+{
+	assert((list->count + count) < MAX_QUERY_LIST_SIZE);
+	for (u32 i = 0; i < count; i++)
+	{
+		const sphere_t *sphere = spheres + i;
+		const u32 slot = list->count++;
+
+		list->t_hit[slot] = INFINITY;
+		list->sphere[slot] = sphere;
+		list->radius[slot] = sphere->radius;
+		list->center_x[slot] = sphere->center.x;
+		list->center_y[slot] = sphere->center.y;
+		list->center_z[slot] = sphere->center.z;
+	}
+};
+// Maximum depth of the BVH traversal stack
+#define MAX_TRAVERSAL_DEPTH	128
+
+// Closest hit traversal of a node array, the tree nodes or the nodes of a subtree
+static bool bvh_hit_nodes(const bvh_t *bvh, const bvh_node_t *nodes, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	// Stack of nodes still to be visited
+	u32 stack[MAX_TRAVERSAL_DEPTH];
+	u32 stack_count = 0;
+	// Start at the root
+	u32 index = 0;
+	for (;;)
+	{
+		const bvh_node_t *node = nodes + index;
+		// If the ray intersects with this BVH node before the closest hit so far
+		if (aabb_hit(node->aabb, ray, t_min, min(t_max, hit->t)))
+		{
+			// If this is a branch
+			if (node->count == 0)
+			{
+				assert(stack_count < MAX_TRAVERSAL_DEPTH);
+				// Visit the left child next, and the right child later
+				stack[stack_count++] = (index + node->offset);
+				index = (index + 1);
+				continue;
+			}
+			if (node->count == BVH_DEFERRED)
+			{
+				// Traverse the subtree below a deferred node, building it if this is the first ray to get here
+				result |= bvh_hit_nodes(bvh, bvh_subtree(bvh, node->offset), spheres, list, ray, t_min, t_max, hit);
+			} else {
+				// Push the leaf sphere data to the list
+				list->count = 0;
+				sphere_list_push(list, spheres, bvh->indices + node->offset, node->count);
+				// Hit test the leaf spheres
+				// NOTE: Only hits closer than the current closest one are accepted
+				result |= sphere_list_hit(list, ray, t_min, t_max, hit);
+			}
+		}
+		// Nothing left to visit
+		if (stack_count == 0)
+			break;
+		index = stack[--stack_count];
+	};
+	return result;
+};
+static bool bvh_hit(const bvh_t *bvh, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	if (bvh->node_count == 0)
+		return false;
+	return bvh_hit_nodes(bvh, bvh->nodes, spheres, list, ray, t_min, t_max, hit);
+};
+// Closest hit traversal without a stack, following the skip links
+// NOTE: Children are always visited left first, the only traversal state is the current node
+static bool bvh_hit_stackless(const bvh_t *bvh, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	u32 index = 0;
+	while (index < bvh->node_count)
+	{
+		const bvh_node_t *node = bvh->nodes + index;
+		// If the ray misses this node, skip the whole subtree
+		if (!aabb_hit(node->aabb, ray, t_min, min(t_max, hit->t)))
+		{
+			index = bvh->skips[index];
+			continue;
+		}
+		// Branches continue with their left child
+		if (node->count == 0)
+		{
+			index++;
+			continue;
+		}
+		// Hit test the leaf spheres, then move past the leaf
+		list->count = 0;
+		sphere_list_push(list, spheres, bvh->indices + node->offset, node->count);
+		result |= sphere_list_hit(list, ray, t_min, t_max, hit);
+		index = bvh->skips[index];
+	};
+	return result;
+};
+// Check if a ray hits anything at all between t_min and t_max, stopping at the first hit
+static bool bvh_any_hit_nodes(const bvh_t *bvh, const bvh_node_t *nodes, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	hit_t hit;
+	hit.t = t_max;
+
+	u32 stack[MAX_TRAVERSAL_DEPTH];
+	u32 stack_count = 0;
+	u32 index = 0;
+	for (;;)
+	{
+		const bvh_node_t *node = nodes + index;
+		if (aabb_hit(node->aabb, ray, t_min, t_max))
+		{
+			if (node->count == 0)
+			{
+				assert(stack_count < MAX_TRAVERSAL_DEPTH);
+				stack[stack_count++] = (index + node->offset);
+				index = (index + 1);
+				continue;
+			}
+			// Any hit at all ends the traversal
+			if (node->count == BVH_DEFERRED)
+			{
+				if (bvh_any_hit_nodes(bvh, bvh_subtree(bvh, node->offset), spheres, list, ray, t_min, t_max))
+					return true;
+			} else {
+				list->count = 0;
+				sphere_list_push(list, spheres, bvh->indices + node->offset, node->count);
+				if (sphere_list_hit(list, ray, t_min, t_max, &hit))
+					return true;
+			}
+		}
+		if (stack_count == 0)
+			break;
+		index = stack[--stack_count];
+	};
+	return false;
+};
+static bool bvh_any_hit(const bvh_t *bvh, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	if (bvh->node_count == 0)
+		return false;
+	return bvh_any_hit_nodes(bvh, bvh->nodes, spheres, list, ray, t_min, t_max);
+};
+static bool bvh_any_hit_stackless(const bvh_t *bvh, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	hit_t hit;
+	hit.t = t_max;
+
+	u32 index = 0;
+	while (index < bvh->node_count)
+	{
+		const bvh_node_t *node = bvh->nodes + index;
+		if (!aabb_hit(node->aabb, ray, t_min, t_max))
+		{
+			index = bvh->skips[index];
+			continue;
+		}
+		if (node->count == 0)
+		{
+			index++;
+			continue;
+		}
+		list->count = 0;
+		sphere_list_push(list, spheres, bvh->indices + node->offset, node->count);
+		if (sphere_list_hit(list, ray, t_min, t_max, &hit))
+			return true;
+		index = bvh->skips[index];
+	};
+	return false;
+};
+// Stack entry for compressed BVH traversal
+typedef struct
+{
+	u32 index;
+	// Distance the ray enters the node at
+	f32 t;
+} qbvh_stack_entry_t;
+
+static bool qbvh_hit(const qbvh_t *qbvh, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	if (qbvh->node_count == 0)
+		return false;
+
+	// Pre-load the ray vectors
+	const __m128 origin_x = _mm_set_ps1(ray.origin.x);
+	const __m128 origin_y = _mm_set_ps1(ray.origin.y);
+	const __m128 origin_z = _mm_set_ps1(ray.origin.z);
+	const __m128 inv_dir_x = _mm_set_ps1(1.f / ray.direction.x);
+	const __m128 inv_dir_y = _mm_set_ps1(1.f / ray.direction.y);
+	const __m128 inv_dir_z = _mm_set_ps1(1.f / ray.direction.z);
+	const __m128i zero = _mm_setzero_si128();
+
+	// Stack of nodes still to be visited
+	qbvh_stack_entry_t stack[MAX_TRAVERSAL_DEPTH*QBVH_WIDTH];
+	u32 stack_count = 0;
+	// Start at the root
+	stack[stack_count].index = 0;
+	stack[stack_count].t = t_min;
+	stack_count++;
+	while (stack_count > 0)
+	{
+		const qbvh_stack_entry_t entry = stack[--stack_count];
+		// Skip nodes that start behind the closest hit found since they were pushed
+		if (entry.t >= hit->t)
+			continue;
+
+		const qbvh_node_t *node = qbvh->nodes + entry.index;
+		// Decode the child bounds for all children at once
+		// NOTE: Unpacking to 32-bit lanes only needs SSE2
+		#define QBVH_DECODE(q, origin, scale) _mm_add_ps(_mm_set_ps1(origin), _mm_mul_ps(_mm_set_ps1(scale), \
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const i32*) (q)), zero), zero))))
+		const v3 scale = qbvh_node_scale(node);
+		const __m128 min_x = QBVH_DECODE(node->min_x, node->origin.x, scale.x);
+		const __m128 min_y = QBVH_DECODE(node->min_y, node->origin.y, scale.y);
+		const __m128 min_z = QBVH_DECODE(node->min_z, node->origin.z, scale.z);
+		const __m128 max_x = QBVH_DECODE(node->max_x, node->origin.x, scale.x);
+		const __m128 max_y = QBVH_DECODE(node->max_y, node->origin.y, scale.y);
+		const __m128 max_z = QBVH_DECODE(node->max_z, node->origin.z, scale.z);
+		#undef QBVH_DECODE
+		// Slab test every child
+		const __m128 t0_x = _mm_mul_ps(_mm_sub_ps(min_x, origin_x), inv_dir_x);
+		const __m128 t1_x = _mm_mul_ps(_mm_sub_ps(max_x, origin_x), inv_dir_x);
+		const __m128 t0_y = _mm_mul_ps(_mm_sub_ps(min_y, origin_y), inv_dir_y);
+		const __m128 t1_y = _mm_mul_ps(_mm_sub_ps(max_y, origin_y), inv_dir_y);
+		const __m128 t0_z = _mm_mul_ps(_mm_sub_ps(min_z, origin_z), inv_dir_z);
+		const __m128 t1_z = _mm_mul_ps(_mm_sub_ps(max_z, origin_z), inv_dir_z);
+		__m128 t_near = _mm_max_ps(_mm_set_ps1(t_min), _mm_min_ps(t0_x, t1_x));
+		__m128 t_far = _mm_min_ps(_mm_set_ps1(min(t_max, hit->t)), _mm_max_ps(t0_x, t1_x));
+		t_near = _mm_max_ps(t_near, _mm_max_ps(_mm_min_ps(t0_y, t1_y), _mm_min_ps(t0_z, t1_z)));
+		t_far = _mm_min_ps(t_far, _mm_min_ps(_mm_max_ps(t0_y, t1_y), _mm_max_ps(t0_z, t1_z)));
+		const u32 mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & ((1 << node->child_count) - 1);
+
+		f32 t_child[QBVH_WIDTH] align_16;
+		_mm_store_ps(t_child, t_near);
+		// Gather the spheres of every leaf that was hit, and push the branches that were hit
+		list->count = 0;
+		const u32 first_push = stack_count;
+		for (u32 i = 0; i < node->child_count; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			if (node->count[i] == 0)
+			{
+				assert(stack_count < static_len(stack));
+				// Insert sorted, so that the nearest child is on top of the stack
+				u32 j = stack_count++;
+				while ((j > first_push) && (stack[j - 1].t < t_child[i]))
+				{
+					stack[j] = stack[j - 1];
+					j--;
+				}
+				stack[j].index = node->child[i];
+				stack[j].t = t_child[i];
+				continue;
+			}
+			sphere_list_push(list, spheres, qbvh->indices + node->child[i], node->count[i]);
+		}
+		// Hit test all the leaf spheres at once
+		if (list->count > 0)
+			result |= sphere_list_hit(list, ray, t_min, t_max, hit);
+	};
+	return result;
+};
+// Push the spheres of a grid cell to the list, hit testing whenever the list fills up
+static bool grid_cell_hit(const grid_t *grid, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	u32 first, u32 count, f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+	// NOTE: Cells can hold more spheres than a query list, so they're tested in batches
+	for (u32 i = 0; i < count; i += SPHERE_BATCH_SIZE)
+	{
+		list->count = 0;
+		sphere_list_push(list, spheres, grid->indices + first + i, min(count - i, SPHERE_BATCH_SIZE));
+		result |= sphere_list_hit(list, ray, t_min, t_max, hit);
+	}
+	return result;
+};
+// 3D-DDA grid walk state
+typedef struct
+{
+	// Current cell
+	i32 cell[3];
+	// Direction the ray steps in on each axis, and the cell past the grid on that side
+	i32 step[3];
+	i32 end[3];
+	// Distance to the next cell boundary on each axis, and between boundaries
+	f32 t_next[3];
+	f32 t_delta[3];
+	// Distance the ray leaves the current cell at
+	f32 t_exit;
+} grid_walk_t;
+
+// Find the first cell a ray enters, returns false if it misses the grid
+static bool grid_walk_begin(const grid_t *grid, grid_walk_t *walk, ray_t ray, f32 t_min, f32 t_max)
+{
+	// Clip the ray to the grid bounds
+	f32 t_enter = t_min;
+	f32 t_leave = t_max;
+	for (u32 i = 0; i < 3; i++)
+	{
+		const f32 inv_dir = 1.f / ray.direction.v[i];
+		f32 t_0 = (grid->bounds.min.v[i] - ray.origin.v[i])*inv_dir;
+		f32 t_1 = (grid->bounds.max.v[i] - ray.origin.v[i])*inv_dir;
+		if (inv_dir < 0.f)
+			swap(f32, t_0, t_1);
+		t_enter = max(t_enter, t_0);
+		t_leave = min(t_leave, t_1);
+	}
+	if (!(t_enter <= t_leave))
+		return false;
+	// Set up the walk from the cell the ray enters
+	const v3 start = ray_point(ray, t_enter);
+	for (u32 i = 0; i < 3; i++)
+	{
+		const f32 offset = (start.v[i] - grid->bounds.min.v[i]);
+		const i32 cell = clamp((i32) (offset*grid->inv_cell_size.v[i]), 0, (i32) grid->res[i] - 1);
+		const f32 direction = ray.direction.v[i];
+		walk->cell[i] = cell;
+		if (direction > 0.f)
 		{
-			assert((list->count + 1) < MAX_QUERY_LIST_SIZE);
-			// Get the Sphere pointer
-			sphere_t *sphere = bvh->sphere;
-			// Push the sphere data to the list
-			const u32 index = list->count++;
-
-			list->t_hit[index] = INFINITY;
-			list->sphere[index] = sphere;
-			list->radius[index] = sphere->radius;
-			list->center_x[index] = sphere->center.x;
-			list->center_y[index] = sphere->center.y;
-			list->center_z[index] = sphere->center.z;
+			walk->step[i] = 1;
+			walk->end[i] = (i32) grid->res[i];
+			walk->t_delta[i] = (grid->cell_size.v[i] / direction);
+			walk->t_next[i] = t_enter + ((f32) (cell + 1)*grid->cell_size.v[i] - offset) / direction;
+		} else if (direction < 0.f) {
+			walk->step[i] = -1;
+			walk->end[i] = -1;
+			walk->t_delta[i] = -(grid->cell_size.v[i] / direction);
+			walk->t_next[i] = t_enter + ((f32) cell*grid->cell_size.v[i] - offset) / direction;
 		} else {
-			// Test both children
-			bvh_query(bvh->l, ray, t_min, t_max, list);
-			bvh_query(bvh->r, ray, t_min, t_max, list);
+			// NOTE: The ray never crosses a boundary on this axis
+			walk->step[i] = 0;
+			walk->end[i] = -1;
+			walk->t_delta[i] = INFINITY;
+			walk->t_next[i] = INFINITY;
+		}
+	}
+	walk->t_exit = min(t_leave, min(walk->t_next[0], min(walk->t_next[1], walk->t_next[2])));
+	return true;
+};
+// Step to the next cell along the ray, returns false once the ray leaves the grid
+static inline bool grid_walk_step(grid_walk_t *walk, f32 t_max)
+{
+	// Cross the nearest cell boundary
+	u32 axis = (walk->t_next[0] < walk->t_next[1]) ? 0 : 1;
+	if (walk->t_next[2] < walk->t_next[axis])
+		axis = 2;
+	if (walk->t_next[axis] > t_max)
+		return false;
+	walk->cell[axis] += walk->step[axis];
+	if (walk->cell[axis] == walk->end[axis])
+		return false;
+	walk->t_next[axis] += walk->t_delta[axis];
+	walk->t_exit = min(t_max, min(walk->t_next[0], min(walk->t_next[1], walk->t_next[2])));
+	return true;
+};
+// Closest hit traversal of a grid, walking the cells front to back
+// NOTE: A sphere spanning several cells is tested once per cell, the walk stops once the closest hit is inside the current cell
+static bool grid_hit(const grid_t *grid, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	grid_walk_t walk;
+	if ((grid->index_count == 0) || !grid_walk_begin(grid, &walk, ray, t_min, t_max))
+		return false;
+	do
+	{
+		u32 first, count;
+		if (grid_cell(grid, walk.cell[0], walk.cell[1], walk.cell[2], &first, &count))
+			result |= grid_cell_hit(grid, spheres, list, ray, first, count, t_min, t_max, hit);
+		// Nothing behind this cell can be closer
+		if (hit->t <= walk.t_exit)
+			break;
+	} while (grid_walk_step(&walk, t_max));
+	return result;
+};
+static bool grid_any_hit(const grid_t *grid, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	hit_t hit;
+	hit.t = t_max;
+
+	grid_walk_t walk;
+	if ((grid->index_count == 0) || !grid_walk_begin(grid, &walk, ray, t_min, t_max))
+		return false;
+	do
+	{
+		// Any hit at all ends the walk
+		u32 first, count;
+		if (grid_cell(grid, walk.cell[0], walk.cell[1], walk.cell[2], &first, &count) &&
+			grid_cell_hit(grid, spheres, list, ray, first, count, t_min, t_max, &hit))
+			return true;
+	} while (grid_walk_step(&walk, t_max));
+	return false;
+};
+static bool instance_hit(const world_t *world, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	const bvh_t *bvh = &world->instance_bvh;
+	if (bvh->node_count == 0)
+		return false;
+
+	// Stack of top level nodes still to be visited
+	u32 stack[MAX_TRAVERSAL_DEPTH];
+	u32 stack_count = 0;
+	// Start at the root
+	u32 index = 0;
+	for (;;)
+	{
+		const bvh_node_t *node = bvh->nodes + index;
+		// If the ray intersects with this BVH node before the closest hit so far
+		if (aabb_hit(node->aabb, ray, t_min, min(t_max, hit->t)))
+		{
+			// If this is a branch
+			if (node->count == 0)
+			{
+				assert(stack_count < MAX_TRAVERSAL_DEPTH);
+				// Visit the left child next, and the right child later
+				stack[stack_count++] = (index + node->offset);
+				index = (index + 1);
+				continue;
+			}
+			// Hit test the object of every instance in the leaf
+			for (u32 i = 0; i < node->count; i++)
+			{
+				const instance_t *instance = world->instances + bvh->indices[node->offset + i];
+				const object_t *object = world->objects + instance->object;
+				// Move the ray into object space
+				// NOTE: The direction isn't normalized, so hit distances are the same in both spaces
+				ray_t object_ray = ray;
+				object_ray.origin = m44_transform_point(instance->inverse, ray.origin);
+				object_ray.direction = m44_transform_vector(instance->inverse, ray.direction);
+				if (bvh_hit(&object->bvh, object->spheres, list, object_ray, t_min, t_max, hit))
+				{
+					// Move the hit back into world space
+					hit->position = ray_point(ray, hit->t);
+					hit->normal = v3_norm(m44_transform_normal(instance->inverse, hit->normal));
+					result = true;
+				}
+			}
 		}
+		// Nothing left to visit
+		if (stack_count == 0)
+			break;
+		index = stack[--stack_count];
 	};
+	return result;
 };
-#endif
 
 bool world_hit(lin_alloc_t *temp_alloc, 
 	const world_t *world, ray_t ray,
 	f32 t_min, f32 t_max, hit_t *hit)
 {
-	bool result = false;
+	assert(world->accel != NULL);
 
 	// By default, non-hits have an infinite distance
 	hit->t = INFINITY;
-	#if USE_BVH
+	// Hit test the spheres through the world accelerator
+	bool result = world->accel->hit(temp_alloc, world, ray, t_min, t_max, hit);
+	// Traverse the instances, only hits closer than the ones already found are kept
+	if (world->instance_count > 0)
+	{
 		// Allocate a 16-byte aligned query list
-		const size_t align = 16;
-		const size_t size = sizeof(sphere_list_t);
-		sphere_list_t *list = lin_alloc_push(temp_alloc, size, align);
+		sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
 		assert(list != NULL);
+		result |= instance_hit(world, list, ray, t_min, t_max, hit);
+		lin_alloc_reset(temp_alloc);
+	}
+	return result;
+};
+
+void spheres_reorder(sphere_t *spheres, bvh_t *bvh, qbvh_t *qbvh, u32 *order)
+{
+	const u32 count = bvh->index_count;
+	// Gather the spheres, and their order, in leaf order
+	sphere_t *sorted = malloc(count*sizeof(sphere_t));
+	u32 *sorted_order = malloc(count*sizeof(u32));
+	assert(((sorted != NULL) && (sorted_order != NULL)) || (count == 0));
+	for (u32 i = 0; i < count; i++)
+	{
+		sorted[i] = spheres[bvh->indices[i]];
+		sorted_order[i] = order ? order[bvh->indices[i]] : 0;
+	}
+	memcpy(spheres, sorted, count*sizeof(sphere_t));
+	if (order)
+		memcpy(order, sorted_order, count*sizeof(u32));
+	// Leaves now reference the spheres directly
+	for (u32 i = 0; i < count; i++)
+		bvh->indices[i] = i;
+	// NOTE: The compressed tree shares the index order of the tree it was built from
+	if (qbvh)
+	{
+		assert((qbvh->node_count == 0) || (qbvh->index_count == count));
+		for (u32 i = 0; i < qbvh->index_count; i++)
+			qbvh->indices[i] = i;
+	}
+	free(sorted_order);
+	free(sorted);
+};
+bool world_any_hit(lin_alloc_t *temp_alloc,
+	const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	assert(world->accel != NULL);
+
+	// Any sphere hit is enough
+	if (world->accel->any_hit(temp_alloc, world, ray, t_min, t_max))
+		return true;
+	// Otherwise look for the closest instance hit, limited to the same range
+	bool result = false;
+	if (world->instance_count > 0)
+	{
+		sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+		assert(list != NULL);
+		hit_t hit;
+		hit.t = t_max;
+		result = instance_hit(world, list, ray, t_min, t_max, &hit);
+		lin_alloc_reset(temp_alloc);
+	}
+	return result;
+};
+bool spheres_hit(lin_alloc_t *temp_alloc,
+	const bvh_t *bvh, const qbvh_t *qbvh, const sphere_t *spheres,
+	ray_t ray, f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	hit->t = INFINITY;
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	if (qbvh)
+		result = qbvh_hit(qbvh, spheres, list, ray, t_min, t_max, hit);
+	else if (bvh->skips)
+		result = bvh_hit_stackless(bvh, spheres, list, ray, t_min, t_max, hit);
+	else
+		result = bvh_hit(bvh, spheres, list, ray, t_min, t_max, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+bool spheres_hit_grid(lin_alloc_t *temp_alloc,
+	const grid_t *grid, const sphere_t *spheres,
+	ray_t ray, f32 t_min, f32 t_max, hit_t *hit)
+{
+	bool result = false;
+
+	hit->t = INFINITY;
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	result = grid_hit(grid, spheres, list, ray, t_min, t_max, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+bool spheres_any_hit(lin_alloc_t *temp_alloc,
+	const bvh_t *bvh, const sphere_t *spheres,
+	ray_t ray, f32 t_min, f32 t_max)
+{
+	bool result = false;
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	if (bvh->skips)
+		result = bvh_any_hit_stackless(bvh, spheres, list, ray, t_min, t_max);
+	else
+		result = bvh_any_hit(bvh, spheres, list, ray, t_min, t_max);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+
+// Free every acceleration structure over the sphere list
+static void world_free_accel(world_t *world)
+{
+	world_free_replicas(world);
+	bvh_free(&world->bvh);
+	qbvh_free(&world->qbvh);
+	grid_free(&world->grid);
+	page_free(&world->pager);
+	lod_free(&world->lod);
+};
+
+// Brute force accelerator, tests every sphere
+static void brute_build(world_t *world, const accel_params_t *params)
+{
+	world_free_accel(world);
+};
+static void brute_refit(world_t *world)
+{
+	// Nothing to update
+};
+static bool brute_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	// Hit test the spheres in batches that fit in a query list
+	bool result = false;
+	for (u32 i = 0; i < world->sphere_count; i += SPHERE_BATCH_SIZE)
+	{
+		list->count = 0;
+		sphere_list_push_range(list, world->spheres + i, min(world->sphere_count - i, SPHERE_BATCH_SIZE));
+		result |= sphere_list_hit(list, ray, t_min, t_max, hit);
+	}
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static bool brute_any_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	hit_t hit;
+	hit.t = t_max;
+
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	bool result = false;
+	for (u32 i = 0; (i < world->sphere_count) && !result; i += SPHERE_BATCH_SIZE)
+	{
+		list->count = 0;
+		sphere_list_push_range(list, world->spheres + i, min(world->sphere_count - i, SPHERE_BATCH_SIZE));
+		result = sphere_list_hit(list, ray, t_min, t_max, &hit);
+	}
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static void brute_stats(const world_t *world, accel_stats_t *stats)
+{
+	memset(stats, 0, sizeof(accel_stats_t));
+	stats->build_time = world->accel_build_time;
+	stats->index_count = world->sphere_count;
+};
+const accel_t accel_brute =
+{
+	"brute", "Test every sphere, no structure",
+	brute_build, brute_refit, brute_hit, brute_any_hit, brute_stats,
+};
+
+// Binary BVH accelerator
+static void bvh_accel_build(world_t *world, const accel_params_t *params)
+{
+	world_free_accel(world);
+	bvh_params_t bvh_params = params->bvh;
+	bvh_params.compress = false;
+	world_build_bvh(world, &bvh_params, params->cache_file);
+};
+static bool bvh_accel_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	// NOTE: The skip links are used if the tree has them
+	bool result;
+	if (world->bvh.skips)
+		result = bvh_hit_stackless(&world->bvh, world->spheres, list, ray, t_min, t_max, hit);
+	else
+		result = bvh_hit(&world->bvh, world->spheres, list, ray, t_min, t_max, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static bool bvh_accel_any_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	return spheres_any_hit(temp_alloc, &world->bvh, world->spheres, ray, t_min, t_max);
+};
+static void bvh_accel_stats(const world_t *world, accel_stats_t *stats)
+{
+	const bvh_t *bvh = &world->bvh;
+	memset(stats, 0, sizeof(accel_stats_t));
+	stats->build_time = world->accel_build_time;
+	stats->memory = bvh->node_count*sizeof(bvh_node_t) + bvh->index_count*sizeof(u32);
+	if (bvh->skips)
+		stats->memory += bvh->node_count*sizeof(u32);
+	stats->node_count = bvh->node_count;
+	stats->index_count = bvh->index_count;
+	stats->cost = bvh_cost(bvh);
+	// Lazy trees grow as subtrees are built
+	if (bvh->lazy)
+	{
+		bvh_lazy_stats_t lazy_stats;
+		bvh_lazy_stats(bvh, &lazy_stats);
+		stats->memory += (lazy_stats.node_count - bvh->node_count)*sizeof(bvh_node_t);
+		stats->node_count = lazy_stats.node_count;
+	}
+};
+const accel_t accel_bvh =
+{
+	"bvh", "Binary BVH, built with the scene builder",
+	bvh_accel_build, world_refit_bvh, bvh_accel_hit, bvh_accel_any_hit, bvh_accel_stats,
+};
+
+// Compressed 4-wide BVH accelerator
+// NOTE: The binary tree is kept, it's refit and recompressed when the spheres move, and used for any hit queries
+static void qbvh_accel_build(world_t *world, const accel_params_t *params)
+{
+	world_free_accel(world);
+	bvh_params_t bvh_params = params->bvh;
+	bvh_params.compress = true;
+	bvh_params.lazy = false;
+	world_build_bvh(world, &bvh_params, params->cache_file);
+};
+static bool qbvh_accel_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	const bool result = qbvh_hit(&world->qbvh, world->spheres, list, ray, t_min, t_max, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static void qbvh_accel_stats(const world_t *world, accel_stats_t *stats)
+{
+	bvh_accel_stats(world, stats);
+	const qbvh_t *qbvh = &world->qbvh;
+	stats->memory += qbvh->node_count*sizeof(qbvh_node_t) + qbvh->index_count*sizeof(u32);
+	stats->node_count = qbvh->node_count;
+};
+const accel_t accel_qbvh =
+{
+	"qbvh", "Compressed 4-wide BVH with quantized bounds",
+	qbvh_accel_build, world_refit_bvh, qbvh_accel_hit, bvh_accel_any_hit, qbvh_accel_stats,
+};
+
+// Uniform grid accelerator, dense unless the parameters ask for a hashed grid
+static void grid_accel_build(world_t *world, const accel_params_t *params)
+{
+	world_free_accel(world);
+	grid_params_t grid_params = params->grid;
+	if (grid_params.mode == GRID_NONE)
+		grid_params.mode = GRID_DENSE;
+	world_build_grid(world, &grid_params);
+};
+static bool grid_accel_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	const bool result = grid_hit(&world->grid, world->spheres, list, ray, t_min, t_max, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static bool grid_accel_any_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	const bool result = grid_any_hit(&world->grid, world->spheres, list, ray, t_min, t_max);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static void grid_accel_stats(const world_t *world, accel_stats_t *stats)
+{
+	const grid_t *grid = &world->grid;
+	memset(stats, 0, sizeof(accel_stats_t));
+	stats->build_time = world->accel_build_time;
+	stats->memory = grid_size(grid);
+	stats->node_count = grid->slot_count;
+	stats->index_count = grid->index_count;
+};
+// NOTE: Grids can't be refit, so they're rebuilt whenever the spheres move
+const accel_t accel_grid =
+{
+	"grid", "Uniform grid, dense or hashed",
+	grid_accel_build, NULL, grid_accel_hit, grid_accel_any_hit, grid_accel_stats,
+};
+
+// Out-of-core accelerator, the spheres are paged in from disk in chunks as rays reach them
+// Traverse the top level tree over the chunks, and the tree of every chunk the ray reaches
+static bool paged_hit_chunks(const pager_t *pager, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, bool any, hit_t *hit)
+{
+	const bvh_t *top = &pager->top;
+	if (top->node_count == 0)
+		return false;
+
+	bool result = false;
+	// Stack of top level nodes still to be visited
+	u32 stack[MAX_TRAVERSAL_DEPTH];
+	u32 stack_count = 0;
+	// Start at the root
+	u32 index = 0;
+	for (;;)
+	{
+		const bvh_node_t *node = top->nodes + index;
+		if (aabb_hit(node->aabb, ray, t_min, min(t_max, hit->t)))
 		{
-			// Reset the list count
-			list->count = 0;
-			// Query the BVH and build a list of spheres to test
-			bvh_query(world->bvh, ray, t_min, t_max, list);
-			// Hit test the sphere list
-			result = sphere_list_hit(list, ray, t_min, t_max, hit);
+			// If this is a branch
+			if (node->count == 0)
+			{
+				assert(stack_count < MAX_TRAVERSAL_DEPTH);
+				stack[stack_count++] = (index + node->offset);
+				index = (index + 1);
+				continue;
+			}
+			// Hit test every chunk in the leaf, keeping each one resident while it's used
+			for (u32 i = 0; i < node->count; i++)
+			{
+				const u32 chunk_index = top->indices[node->offset + i];
+				const page_chunk_t *chunk = page_acquire(pager, chunk_index);
+				if (any)
+					result = bvh_any_hit_nodes(&chunk->bvh, chunk->bvh.nodes, chunk->spheres, list, ray, t_min, t_max);
+				else
+					result |= bvh_hit_nodes(&chunk->bvh, chunk->bvh.nodes, chunk->spheres, list, ray, t_min, t_max, hit);
+				page_release(pager, chunk_index);
+				if (any && result)
+					return true;
+			}
 		}
-		lin_alloc_reset(temp_alloc);
-	#else
-		// Test against every sphere in the list
-		for (u32 i = 0; i < world->sphere_count; i++)
+		// Nothing left to visit
+		if (stack_count == 0)
+			break;
+		index = stack[--stack_count];
+	};
+	return result;
+};
+static void paged_accel_build(world_t *world, const accel_params_t *params)
+{
+	world_free_accel(world);
+	world_build_paged(world, &params->page, &params->bvh);
+};
+static bool paged_accel_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	const bool result = paged_hit_chunks(&world->pager, list, ray, t_min, t_max, false, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static bool paged_accel_any_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max)
+{
+	hit_t hit;
+	hit.t = t_max;
+
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	const bool result = paged_hit_chunks(&world->pager, list, ray, t_min, t_max, true, &hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static void paged_accel_stats(const world_t *world, accel_stats_t *stats)
+{
+	const pager_t *pager = &world->pager;
+	memset(stats, 0, sizeof(accel_stats_t));
+	stats->build_time = world->accel_build_time;
+	// Only the top level tree, the chunk list and the resident chunks take up memory
+	page_stats_t page;
+	page_stats(pager, &page);
+	stats->memory = pager->top.node_count*sizeof(bvh_node_t) + pager->top.index_count*sizeof(u32) +
+		pager->chunk_count*sizeof(page_chunk_t) + page.resident_bytes;
+	stats->node_count = pager->top.node_count;
+	for (u32 i = 0; i < pager->chunk_count; i++)
+	{
+		stats->node_count += pager->chunks[i].bvh.node_count;
+		stats->index_count += pager->chunks[i].sphere_count;
+	}
+};
+// NOTE: Page files can't be refit, so they're written again whenever the spheres move
+const accel_t accel_paged =
+{
+	"paged", "Out-of-core chunks paged in from disk, with a memory budget",
+	paged_accel_build, NULL, paged_accel_hit, paged_accel_any_hit, paged_accel_stats,
+};
+
+// Level of detail accelerator, rays stop at nodes that are small inside their cone and hit the node proxy instead
+// Hit test a proxy as a sphere that only stops part of the rays through it, with the averaged material
+// NOTE: Kept out of line, inlined into the traversal loop it doubles the cost of every ray that never reaches a proxy
+static no_inline bool lod_proxy_hit(const lod_proxy_t *proxy, const ray_t *ray, f32 t_min, f32 t_max, hit_t *hit)
+{
+	const v3 oc = v3_sub(ray->origin, proxy->center);
+	const f32 a = v3_dot(ray->direction, ray->direction);
+	const f32 b = v3_dot(ray->direction, oc);
+	const f32 c = v3_dot(oc, oc) - proxy->radius*proxy->radius;
+	const f32 det = b*b - a*c;
+	if (det < 0.f)
+		return false;
+	const f32 t = (-b - f32_sqrt(det)) / a;
+	if ((t <= t_min) || (t >= min(t_max, hit->t)))
+		return false;
+	// The rest of the rays pass between the primitives, and miss the whole node
+	if (f32_rand() >= lod_coverage(proxy))
+		return false;
+
+	const v3 position = ray_point(*ray, t);
+	memset(&hit->material, 0, sizeof(material_t));
+	hit->t = t;
+	hit->position = position;
+	hit->normal = v3_scale(v3_sub(position, proxy->center), 1.f / proxy->radius);
+	hit->material.type = MATERIAL_LAMBERTIAN;
+	hit->material.albedo = lod_albedo(proxy);
+	hit->material.emittance = proxy->emittance;
+	return true;
+};
+// Get the proxy of a node if it's small enough for the ray to stop at, NULL otherwise
+// NOTE: Rays starting inside a proxy always descend, so they can't hit the proxy of the primitive they left
+// Out of line like the proxy hit, only nodes that already fit in the cone get here
+static no_inline const lod_proxy_t* lod_cut(const lod_t *lod, u32 index, const ray_t *ray, f32 width)
+{
+	const lod_proxy_t *proxy = lod->proxies + index;
+	if ((2.f*proxy->radius) >= width)
+		return NULL;
+	if (v3_len2(v3_sub(ray->origin, proxy->center)) <= (proxy->radius*proxy->radius))
+		return NULL;
+	return proxy;
+};
+// Closest hit traversal of the world BVH, stopping at branches smaller than the threshold inside the ray cone
+// NOTE: Leaves are always hit tested exactly, and so are branches the ray starts inside of
+static bool lod_hit_nodes(const bvh_t *bvh, const lod_t *lod, const sphere_t *spheres, sphere_list_t *list, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	if (bvh->node_count == 0)
+		return false;
+
+	bool result = false;
+	// The cone width along the ray as a linear function of position, the threshold included
+	const v3 cone_slope = v3_scale(ray.direction, lod->threshold*ray.spread / v3_len2(ray.direction));
+	const f32 cone_width = lod->threshold*ray.width - v3_dot(ray.origin, cone_slope);
+
+	u32 stack[MAX_TRAVERSAL_DEPTH];
+	u32 stack_count = 0;
+	u32 index = 0;
+	for (;;)
+	{
+		const bvh_node_t *node = bvh->nodes + index;
+		if (lod->touched)
+			lod->touched[index] = 1;
+		if (aabb_hit(node->aabb, ray, t_min, min(t_max, hit->t)))
 		{
-			hit_t tmp_hit;
-			if (sphere_hit(world->spheres + i, ray, t_min, t_max, &tmp_hit))
+			if (node->count == 0)
 			{
-				result = true;
-				if (tmp_hit.t < hit->t)
-					*hit = tmp_hit;
+				// Compare the node size against the cone width at it's center
+				// NOTE: A bounding sphere is never smaller than the longest box side, so most nodes are kept without touching their proxy
+				const v3 extent = v3_sub(node->aabb.max, node->aabb.min);
+				const v3 center = aabb_center(node->aabb);
+				const f32 width = cone_width + v3_dot(center, cone_slope);
+				const lod_proxy_t *proxy = NULL;
+				if (max(extent.x, max(extent.y, extent.z)) < width)
+					proxy = lod_cut(lod, index, &ray, width);
+				if (!proxy)
+				{
+					assert(stack_count < MAX_TRAVERSAL_DEPTH);
+					// Visit the left child next, and the right child later
+					stack[stack_count++] = (index + node->offset);
+					index = (index + 1);
+					continue;
+				}
+				// Small enough, the proxy stands in for the whole subtree
+				result |= lod_proxy_hit(proxy, &ray, t_min, t_max, hit);
+			} else {
+				list->count = 0;
+				sphere_list_push(list, spheres, bvh->indices + node->offset, node->count);
+				result |= sphere_list_hit(list, ray, t_min, t_max, hit);
 			}
-		};
-	#endif
+		}
+		// Nothing left to visit
+		if (stack_count == 0)
+			break;
+		index = stack[--stack_count];
+	};
 	return result;
 };
+static void lod_accel_build(world_t *world, const accel_params_t *params)
+{
+	world_free_accel(world);
+	// Proxies need the whole binary tree, and traversal uses the stack
+	bvh_params_t bvh_params = params->bvh;
+	bvh_params.compress = false;
+	bvh_params.stackless = false;
+	bvh_params.lazy = false;
+	world_build_bvh(world, &bvh_params, params->cache_file);
+	world_build_lod(world, &params->lod);
+};
+static void lod_accel_refit(world_t *world)
+{
+	world_refit_bvh(world);
+	// NOTE: Proxies are cheap to build, one pass over the nodes, so they're just built again
+	const lod_params_t params = { world->lod.threshold };
+	world_build_lod(world, &params);
+};
+static bool lod_accel_hit(lin_alloc_t *temp_alloc, const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max, hit_t *hit)
+{
+	sphere_list_t *list = lin_alloc_push(temp_alloc, sizeof(sphere_list_t), 16);
+	assert(list != NULL);
+	const bool result = lod_hit_nodes(&world->bvh, &world->lod, world->spheres, list, ray, t_min, t_max, hit);
+	lin_alloc_reset(temp_alloc);
+	return result;
+};
+static void lod_accel_stats(const world_t *world, accel_stats_t *stats)
+{
+	bvh_accel_stats(world, stats);
+	stats->memory += world->lod.proxy_count*sizeof(lod_proxy_t);
+};
+// NOTE: Any hit queries always traverse the full tree
+const accel_t accel_lod =
+{
+	"lod", "Binary BVH with level of detail proxies, for sub-pixel spheres",
+	lod_accel_build, lod_accel_refit, lod_accel_hit, bvh_accel_any_hit, lod_accel_stats,
+};
 
 camera_t look_at(
 	v3 position, v3 at, v3 up, 
@@ -340,5 +1556,7 @@ ray_t camera_ray(const camera_t *camera, f32 u, f32 v)
 	ray_t ray;
 	ray.origin = v3_add(camera->position, offset);
 	ray.direction = v3_sub(v3_add(camera->f, v3_add(v3_scale(camera->h, u), v3_scale(camera->v, v))), offset);
+	ray.width = 0.f;
+	ray.spread = 0.f;
 	return ray;
 }
\ No newline at end of file
@@ -5,8 +5,18 @@
 #include "util.h"
 #include "geom.h"
 
-// Maximum number of spheres a world can contain
+#include "bvh.h"
+#include "qbvh.h"
+#include "grid.h"
+#include "page.h"
+#include "lod.h"
+#include "job.h"
+
+// Maximum number of spheres listed one by one in a scene, only these can be animated with keyframes
+// NOTE: The world sphere array grows as needed, generated spheres aren't limited by this
 #define MAX_SPHERES	256
+// Maximum number of objects a world can contain
+#define MAX_OBJECTS	64
 
 // Material data structure
 typedef enum
@@ -46,38 +56,116 @@ typedef struct
 // Get the AABB for a sphere
 aabb_t sphere_aabb(v3 center, f32 radius);
 
-// BVH tree data structure
-decl_struct(bvh_t);
-struct bvh_t
+// Object data structure, geometry that can be instanced many times but is only stored once
+typedef struct
 {
-	// Leaf marker, true for leaves, false for branches
-	bool leaf;
-	// Bounding box
-	aabb_t aabb;
-	
-	union
-	{
-		// Branch data, left and right child pointers
-		struct { bvh_t *l, *r; };
-		// Leaf data, shape pointer
-		sphere_t *sphere;
-	};
-};
+	// Name instances refer to the object by
+	char name[64];
+	// Object space BVH containing all the object shapes
+	bvh_t bvh;
+	// Object space sphere array
+	u32 sphere_count;
+	u32 sphere_capacity;
+	sphere_t *spheres;
+} object_t;
 
-// World data structure
+// Instance data structure, a placed copy of an object
 typedef struct
 {
+	// Object to world space transformation, and it's inverse
+	m44 transform;
+	m44 inverse;
+	// Index of the object in the world object list
+	u32 object;
+} instance_t;
+
+// World data structure
+typedef struct world_s
+{
+	// Accelerator used for raycasts against the sphere list, see accel.h
+	const struct accel_s *accel;
+	// Time the last accelerator build took, in seconds
+	f64 accel_build_time;
 	// World BVH containing all shapes
-	bvh_t *bvh;
+	bvh_t bvh;
+	// Compressed copy of the world BVH, empty if compression is off
+	qbvh_t qbvh;
+	// Uniform grid over the spheres, empty unless the grid accelerator is used
+	grid_t grid;
+	// Out-of-core chunks of the spheres, empty unless the paged accelerator is used
+	pager_t pager;
+	// Level of detail proxies for the nodes of the world BVH, empty unless the LOD accelerator is used
+	lod_t lod;
 	// Background color, used when rays hit no shapes
 	v3 background;
 	// Sphere array
+	// NOTE: NULL once the spheres have been paged out, unless they were kept
 	u32 sphere_count;
-	sphere_t spheres[MAX_SPHERES];
+	u32 sphere_capacity;
+	sphere_t *spheres;
+	// Scene index of every sphere, NULL while the spheres are still in scene order
+	u32 *sphere_order;
+	// Object array
+	u32 object_count;
+	object_t objects[MAX_OBJECTS];
+	// Instance array, and the top level BVH over all instances
+	u32 instance_count;
+	u32 instance_capacity;
+	instance_t *instances;
+	bvh_t instance_bvh;
+	// Copies of the sphere array and the accelerator on every NUMA node, empty unless the world was replicated
+	// NOTE: Replicas share everything else with the world, and are dropped whenever the accelerator is
+	u32 replica_count;
+	struct world_s *replicas;
 } world_t;
 
-// Build the BVH for a world from it's sphere list
-void world_build_bvh(world_t *world);
+// Add a sphere to a world
+void world_add_sphere(world_t *world, const sphere_t *sphere);
+// Make room for at least a number of spheres in total, so that adding them doesn't grow the array again
+// NOTE: Growing copies the whole array, reserving up front avoids holding two copies of a big array at once
+void world_reserve_spheres(world_t *world, u32 capacity);
+// Add a number of uninitialized spheres to the end of a world's sphere array, returns the first one
+// NOTE: Used to fill in many spheres at once, the pointer is only valid until the array grows again
+sphere_t* world_add_spheres(world_t *world, u32 count);
+// Add an empty object to a world, returns it's index
+u32 world_add_object(world_t *world, const char *name);
+// Find an object by name, returns false if there is no object with that name
+bool world_find_object(const world_t *world, const char *name, u32 *index);
+// Add a sphere to an object, in object space
+void object_add_sphere(object_t *object, const sphere_t *sphere);
+// Add an instance of an object to a world
+void world_add_instance(world_t *world, u32 object, m44 transform);
+
+// Build the BVH for a world from it's sphere list, replacing the current one
+// NOTE: If a cache file is given, a matching tree is loaded from it instead, otherwise the new tree is written to it
+void world_build_bvh(world_t *world, const bvh_params_t *params, const char *cache_file);
+// Build a uniform grid over the sphere list, replacing the current one
+// NOTE: Grids can't be refit, so they have to be rebuilt whenever the spheres move
+void world_build_grid(world_t *world, const grid_params_t *params);
+// Write the spheres to a page file in chunks with their own BVHs, replacing the current one, returns false if it couldn't be written
+// NOTE: The sphere array is freed afterwards unless the parameters keep it, the spheres are only read from the page file.
+// A reused page file is mapped as it is, and gives the world its sphere count
+bool world_build_paged(world_t *world, const page_params_t *params, const bvh_params_t *bvh_params);
+// Build level of detail proxies for every node of the world BVH, replacing the current ones
+// NOTE: The BVH has to be fully built first, proxies are rebuilt rather than refit when the spheres move
+void world_build_lod(world_t *world, const lod_params_t *params);
+// Build the BVH for every object, and the top level BVH over the instances
+void world_build_instances(world_t *world, const bvh_params_t *params);
+// Move every sphere to a new center, the BVH has to be refit or rebuilt afterwards
+void world_move_spheres(world_t *world, const v3 *centers);
+// Refit the BVH to the current sphere positions, without changing the tree structure
+void world_refit_bvh(world_t *world);
+// Free the data owned by a world
+void world_free(world_t *world);
+// Copy the spheres and the accelerator to every NUMA node the job threads are on, first touched by a thread on that node
+// NOTE: Only for accelerators that keep all their data in the BVH, the compressed BVH or the LOD proxies,
+// returns false if the world can't be replicated or there is only one node
+bool world_replicate(world_t *world);
+// Get the copy of the world on the calling thread's node, or the world itself if it wasn't replicated
+static inline const world_t* world_local(const world_t *world)
+{
+	return (world->replica_count > 0) ? (world->replicas + min(job_node(job_thread_index()), world->replica_count - 1)) : world;
+};
 
 // Data structure for a hit record
 typedef struct
@@ -89,6 +177,7 @@ typedef struct
 } hit_t;
 
 // Raycast into the world, returns if a shape was hit
+// NOTE: An accelerator has to be built for the world first
 bool world_hit(
 	// Temporary memory allocator, used for fast transient allocations
 	lin_alloc_t *temp_alloc,
@@ -99,6 +188,35 @@ bool world_hit(
 	// Output hit data structure
 	hit_t *hit);
 
+// Reorder a sphere array to the leaf order of the BVH over it, so leaves reference sequential memory
+// NOTE: The index lists of the trees become the identity, and the optional order list is permuted along with the spheres
+void spheres_reorder(sphere_t *spheres, bvh_t *bvh, qbvh_t *qbvh, u32 *order);
+// Raycast against a sphere array, through a BVH over it
+// NOTE: Uses the compressed tree if one is given, or the skip links if the tree has them
+// Mostly useful for testing trees outside of a world
+bool spheres_hit(
+	lin_alloc_t *temp_alloc,
+	const bvh_t *bvh, const qbvh_t *qbvh, const sphere_t *spheres,
+	ray_t ray, f32 t_min, f32 t_max,
+	hit_t *hit);
+// Raycast against a sphere array, through a grid over it
+bool spheres_hit_grid(
+	lin_alloc_t *temp_alloc,
+	const grid_t *grid, const sphere_t *spheres,
+	ray_t ray, f32 t_min, f32 t_max,
+	hit_t *hit);
+// Check if a ray hits any sphere in an array between t_min and t_max, through a BVH over it
+bool spheres_any_hit(
+	lin_alloc_t *temp_alloc,
+	const bvh_t *bvh, const sphere_t *spheres,
+	ray_t ray, f32 t_min, f32 t_max);
+
+// Check if a ray hits anything in the world between t_min and t_max, cheaper than finding the closest hit
+bool world_any_hit(
+	lin_alloc_t *temp_alloc,
+	const world_t *world, ray_t ray,
+	f32 t_min, f32 t_max);
+
 // Camera data structure
 typedef struct
 {
@@ -122,6 +240,7 @@ camera_t look_at(
 	f32 fov, f32 aperture, f32 aspect_ratio);
 // Get the outgoing ray from a camera, towards the lens space position
 // NOTE: Will be randomly offset by a random amount based on the aperture for depth of field effects
+// The ray cone is left empty, it depends on the image size which the camera doesn't know
 ray_t camera_ray(const camera_t *camera, f32 u, f32 v);
 
 #endif
\ No newline at end of file